@@ -0,0 +1,156 @@
+
+//Asynchronous readback of the displayed frame for recording
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "AsyncReadback.h"
+
+#define		READBACK_WAIT_NS	1000000000	//upper bound for a blocking wait on a fence (1 s)
+
+// ============================================================================
+//public functions
+AsyncReadback::AsyncReadback(int slots, int numChannels, ReadbackCallback cb, void* userData)
+{
+	numSlots = slots;
+	channels = numChannels;
+	head = 0;
+	pending = 0;
+	skipped = 0;
+	callback = cb;
+	callbackData = userData;
+
+	ring = new READBACK_SLOT[numSlots];
+	for (int i = 0; i < numSlots; i++)
+	{
+		glGenBuffers(1, &ring[i].pbo);
+		ring[i].fence = 0;
+		ring[i].frameNum = 0;
+		ring[i].w = ring[i].h = 0;
+		ring[i].size = 0;
+		ring[i].held = false;
+		ring[i].released = 0;
+	}
+}
+// ----------------------------------------------------------------------------
+
+AsyncReadback::~AsyncReadback()
+{
+	poll(true);
+	for (int i = 0; i < numSlots; i++)
+	{
+		//writers only hold a frame while writing it out
+		while (!reclaim(&ring[i]))
+			Sleep(1);
+		glDeleteBuffers(1, &ring[i].pbo);
+	}
+	delete[] ring;
+}
+// ----------------------------------------------------------------------------
+
+bool AsyncReadback::queue(unsigned int frameNum, int w, int h)
+{
+	//the next slot is the one delivered longest ago; the GPU and the disk both being behind drops the frame
+	poll(false);
+	READBACK_SLOT* slot = &ring[(head + pending) % numSlots];
+	if (pending == numSlots || !reclaim(slot))
+	{
+		skipped++;
+		return false;
+	}
+
+	//rows are padded to GL_PACK_ALIGNMENT (4)
+	int size = ((channels * w + 3) & ~3) * h;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	if (slot->size != size)
+	{
+		//only happens on the first use of a slot or when the window was resized
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		slot->size = size;
+	}
+	//with a pack buffer bound the pointer is an offset into it and the call returns immediately
+	glReadPixels(0, 0, w, h, (channels == 1) ? GL_RED : GL_BGR_EXT, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot->frameNum = frameNum;
+	slot->w = w;
+	slot->h = h;
+	pending++;
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+void AsyncReadback::poll(bool wait)
+{
+	for (int i = 0; i < numSlots; i++)
+		reclaim(&ring[i]);
+	while (pending > 0)
+	{
+		if (!deliver(&ring[head], wait))
+			return;
+		head = (head + 1) % numSlots;
+		pending--;
+	}
+}
+// ----------------------------------------------------------------------------
+
+int AsyncReadback::getPending()
+{
+	return pending;
+}
+
+unsigned int AsyncReadback::getSkipped()
+{
+	return skipped;
+}
+
+// ============================================================================
+//private functions
+
+//hands the slot's pixels to the callback if its fence has signalled; returns false if not ready yet.
+//A fence that fails, or still has not signalled after a blocking wait, loses the frame: mapping the
+//buffer then would stall until the GPU catches up
+bool AsyncReadback::deliver(READBACK_SLOT* slot, bool wait)
+{
+	GLenum result = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? READBACK_WAIT_NS : 0);
+	if (result == GL_TIMEOUT_EXPIRED && !wait)
+		return false;
+	glDeleteSync(slot->fence);
+	slot->fence = 0;
+	if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+	{
+		printf("Readback of frame %u %s\n", slot->frameNum, (result == GL_TIMEOUT_EXPIRED) ? "timed out" : "failed");
+		skipped++;
+		return true;
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	const unsigned char* pixels = (const unsigned char*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (pixels != 0)
+	{
+		slot->released = 0;
+		slot->held = callback(slot->frameNum, pixels, slot->w, slot->h, &slot->released, callbackData);
+		if (!slot->held)
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+//unmaps a slot its writer has let go of; returns false while the writer still reads it
+bool AsyncReadback::reclaim(READBACK_SLOT* slot)
+{
+	if (!slot->held)
+		return true;
+	if (slot->released == 0)
+		return false;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	slot->held = false;
+	return true;
+}
@@ -0,0 +1,76 @@
+#ifndef ASYNC_READBACK
+#define ASYNC_READBACK
+// ============================================================================
+
+//Asynchronous readback of the displayed frame for recording
+//glReadPixels goes into one of a ring of pixel pack buffers and a fence is
+//inserted behind it; the buffer is mapped once the fence has signalled (usually
+//a frame or two later), so the render thread never waits for the pipeline to drain.
+//The mapped buffer itself goes to the writer, which reads it on its own thread; the slot
+//is unmapped and reused once the writer lets go of it. A frame that finds no free slot is
+//skipped rather than waited for
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+#include "GLExt.h"
+
+#define		READBACK_SLOTS_DEF	7	//frames that can be in flight on the GPU or held by writers
+
+//receives a completed readback: bottom-up BGR (or grey) rows padded to 4 bytes. Returns true if it keeps
+//the pixels, and then sets *release to 1 once it no longer reads them; false if they are not needed
+typedef bool (*ReadbackCallback)(unsigned int frameNum, const unsigned char* pixels, int w, int h,
+	volatile LONG* release, void* userData);
+
+// ============================================================================
+
+class AsyncReadback
+{
+public:
+	//channels is 3 to read back BGR, 1 to read back the red channel of a grey picture
+	AsyncReadback(int slots, int channels, ReadbackCallback, void* userData);
+	~AsyncReadback();
+
+	//starts reading back the current read buffer (w x h from the origin) for frame frameNum.
+	//Returns false, and skips the frame, if every slot is in flight or held by a writer
+	bool queue(unsigned int frameNum, int w, int h);
+	//delivers completed readbacks in frame order and reclaims the slots writers have let go of;
+	//with wait, blocks until all are delivered
+	void poll(bool wait);
+
+	//returns number of readbacks queued but not yet delivered
+	int getPending();
+	//returns number of frames skipped because no slot was free, or lost to a failed fence
+	unsigned int getSkipped();
+
+private:
+	struct READBACK_SLOT
+	{
+		GLuint pbo;
+		GLsync fence;
+		unsigned int frameNum;
+		int w, h;
+		int size;			//allocated size of pbo
+		bool held;			//mapped and handed to a writer
+		volatile LONG released;	//set by the writer when it is done with the mapped pixels
+	};
+
+	//data
+	READBACK_SLOT* ring;
+	int numSlots;
+	int head;				//oldest pending slot; the slots before it are held or free
+	int pending;
+	unsigned int skipped;
+	int channels;
+
+	ReadbackCallback callback;
+	void* callbackData;
+
+	//private prototypes
+	bool deliver(READBACK_SLOT*, bool wait);
+	bool reclaim(READBACK_SLOT*);
+};
+
+// ============================================================================
+#endif
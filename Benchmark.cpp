@@ -0,0 +1,888 @@
+
+//Offline benchmarks of the per-frame image processing
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "Benchmark.h"
+#include "SimCamera.h"
+#include "ImageKernels.h"
+#include "PixelPipeline.h"
+#include "PerfTimer.h"
+#include "FL3Camera.h"
+#include "Compositor.h"
+#include "TaskPool.h"
+#include "Disparity.h"
+#include "ShaderDemosaic.h"
+#include "GLCompositor.h"
+#include "Denoise.h"
+#include "Zoom.h"
+#include "Preroll.h"
+#include <math.h>
+
+#define		BENCH_PROFILE		"720p60"	//profile of the thread scaling and SDK timing unless given with -profile
+#define		BENCH_WIDTH			1280	//size of BENCH_PROFILE
+#define		BENCH_HEIGHT		720
+#define		BENCH_EYE_FPS		60		//target rate per eye
+#define		BENCH_CAMERAS		2		//both cameras share the bus
+#define		BENCH_WINDOW_WIDTH	1280	//side-by-side window used for the compositor timing
+#define		BENCH_WINDOW_HEIGHT	480
+#define		BENCH_DEPTH_SHIFT	40		//pixels the right test image is shifted by
+#define		BENCH_DEPTH_FPS		30		//rate the disparity maps should keep up with
+#define		BENCH_DENOISE_SIGMA	4		//noise added to the denoise test frames, grey levels
+#define		BENCH_DENOISE_MS	2.0		//budget for denoising one eye
+#define		BENCH_DENOISE_NOISY	4		//distinct noisy frames cycled through by the timing
+#define		BENCH_DENOISE_SETTLE	30		//frames the filter gets on a still scene before it is checked
+#define		BENCH_DENOISE_SHIFT	8		//pixels the moving scene pans by per frame
+#define		BENCH_DENOISE_GAIN	6.0		//dB the still scene must improve by
+#define		BENCH_DENOISE_LOSS	1.0		//dB moving scenes may lose against the unfiltered frames
+#define		BENCH_ZOOM_MS		5.0		//budget for zooming both eyes, under a third of a 60 fps frame
+#define		BENCH_ZOOM_ERROR	1.0		//grey levels a zoomed linear ramp may be off by
+#define		BENCH_PREROLL_SECONDS	2.0	//ring of the pre-roll copy timing; larger than any cache, like the real one
+
+//pool size and capture profile of the run, from -threads and -profile
+static int benchThreads = 0;
+static const CAPTURE_PROFILE* benchProfile = 0;
+
+// ============================================================================
+//helpers
+
+//prints one benchmark line: stage times in ms per frame and whether an eye keeps up on one core
+static void printResult(const char* name, unsigned int rawBytes, const char** stages, const double* ms, int numStages)
+{
+	double total = 0;
+	printf("%-6s %8u bytes/frame  bus %6.1f MB/s |", name, rawBytes,
+		(double)rawBytes * BENCH_EYE_FPS * BENCH_CAMERAS / (1024 * 1024));
+	for (int i = 0; i < numStages; i++)
+	{
+		printf(" %s %.3f ms", stages[i], ms[i]);
+		total += ms[i];
+	}
+	printf(" | total %.3f ms (%s %d fps per eye)\n", total,
+		(total <= 1000.0 / BENCH_EYE_FPS) ? "meets" : "misses", BENCH_EYE_FPS);
+}
+
+// ============================================================================
+
+//compares the RAW8 SDK conversion with the RAW12/RAW16 unpack, demosaic and tone mapping path
+static void benchmarkBitDepth(unsigned int frames)
+{
+	printf("\n*** BIT DEPTH: %ux%u, %u frames ***\n", BENCH_WIDTH, BENCH_HEIGHT, frames);
+
+	unsigned short* raw16 = new unsigned short[BENCH_WIDTH * BENCH_HEIGHT];
+	unsigned short* rgb16 = new unsigned short[3 * BENCH_WIDTH * BENCH_HEIGHT];
+	unsigned char* rgb8 = new unsigned char[3 * BENCH_WIDTH * BENCH_HEIGHT];
+
+	//RAW8 through the FlyCapture2 SDK, as grabFrame does
+	{
+		SimCamera sim("bench", BENCH_WIDTH, BENCH_HEIGHT, 0, PIXEL_FORMAT_RAW8);
+		Image raw, converted;
+		sim.RetrieveBuffer(&raw);
+
+		LONGLONG start = perfCounter();
+		for (unsigned int i = 0; i < frames; i++)
+			raw.Convert(PIXEL_FORMAT_RGB, &converted);
+		double ms[1] = { perfMs(perfCounter() - start) / frames };
+
+		const char* stages[1] = { "convert" };
+		printResult("RAW8", raw.GetDataSize(), stages, ms, 1);
+	}
+
+	//RAW12 and RAW16 through the kernels
+	PixelFormat formats[2] = { PIXEL_FORMAT_RAW12, PIXEL_FORMAT_RAW16 };
+	const char* names[2] = { "RAW12", "RAW16" };
+	for (int f = 0; f < 2; f++)
+	{
+		SimCamera sim("bench", BENCH_WIDTH, BENCH_HEIGHT, 0, formats[f]);
+		Image raw;
+		sim.RetrieveBuffer(&raw);
+		const unsigned char* data = raw.GetData();
+		unsigned int rowBytes = raw.GetStride();
+
+		TONE_CURVE curve;
+		toneCurveInit(&curve, rawBitDepth(formats[f]));
+		LONGLONG unpackTicks = 0, demosaicTicks = 0, toneTicks = 0;
+
+		for (unsigned int i = 0; i < frames; i++)
+		{
+			LONGLONG t0 = perfCounter();
+			const unsigned short* mosaic = raw16;
+			if (formats[f] == PIXEL_FORMAT_RAW12)
+			{
+				for (unsigned int y = 0; y < BENCH_HEIGHT; y++)
+					unpackRaw12(data + y * rowBytes, raw16 + y * BENCH_WIDTH, BENCH_WIDTH);
+			}
+			else
+			{
+				mosaic = (const unsigned short*)data;
+			}
+			LONGLONG t1 = perfCounter();
+			toneCurveUpdate(&curve, mosaic, BENCH_WIDTH * BENCH_HEIGHT);
+			demosaicBilinear16(mosaic, BENCH_WIDTH, BENCH_HEIGHT, RGGB, rgb16, 0, BENCH_HEIGHT);
+			LONGLONG t2 = perfCounter();
+			toneMap16(rgb16, rgb8, 3 * BENCH_WIDTH * BENCH_HEIGHT, &curve);
+			LONGLONG t3 = perfCounter();
+
+			unpackTicks += t1 - t0;
+			demosaicTicks += t2 - t1;
+			toneTicks += t3 - t2;
+		}
+
+		double ms[3] = { perfMs(unpackTicks) / frames, perfMs(demosaicTicks) / frames, perfMs(toneTicks) / frames };
+		const char* stages[3] = { "unpack", "demosaic", "tonemap" };
+		printResult(names[f], raw.GetDataSize(), stages, ms, 3);
+	}
+
+	delete[] raw16;
+	delete[] rgb16;
+	delete[] rgb8;
+}
+// ----------------------------------------------------------------------------
+
+//compares the RGB path with the luma path of -mono, single threaded: conversion from the mosaic, then
+//composition of both eyes, with the bytes each hands on per frame
+static void benchmarkMono(unsigned int frames)
+{
+	printf("\n*** MONOCHROME: %ux%u, %u frames ***\n", BENCH_WIDTH, BENCH_HEIGHT, frames);
+
+	SimCamera sim("bench", BENCH_WIDTH, BENCH_HEIGHT, 0, PIXEL_FORMAT_RAW8);
+	Image raw;
+	sim.RetrieveBuffer(&raw);
+	unsigned char* pixels = new unsigned char[3 * BENCH_WIDTH * BENCH_HEIGHT];
+
+	for (int channels = 3; channels >= 1; channels -= 2)
+	{
+		LONGLONG start = perfCounter();
+		for (unsigned int i = 0; i < frames; i++)
+		{
+			if (channels == 3)
+				demosaicBilinear8(raw.GetData(), raw.GetStride(), BENCH_WIDTH, BENCH_HEIGHT, RGGB, pixels, 0, BENCH_HEIGHT);
+			else
+				lumaBayer8(raw.GetData(), raw.GetStride(), BENCH_WIDTH, BENCH_HEIGHT, pixels, 0, BENCH_HEIGHT);
+		}
+		double convertMs = perfMs(perfCounter() - start) / frames;
+
+		CpuCompositor compositor(BENCH_WINDOW_WIDTH, BENCH_WINDOW_HEIGHT, channels);
+		start = perfCounter();
+		for (unsigned int i = 0; i < frames; i++)
+		{
+			compositor.clear();
+			compositor.drawQuad(0, BENCH_WINDOW_WIDTH / 2, pixels, BENCH_WIDTH, BENCH_HEIGHT);
+			compositor.drawQuad(BENCH_WINDOW_WIDTH / 2, BENCH_WINDOW_WIDTH, pixels, BENCH_WIDTH, BENCH_HEIGHT);
+		}
+		double drawMs = perfMs(perfCounter() - start) / frames;
+
+		printf("%-5s convert %7.3f ms  compose %7.3f ms | %8u bytes per eye to upload, %8u bytes to record\n",
+			(channels == 3) ? "RGB" : "luma", convertMs, drawMs, channels * BENCH_WIDTH * BENCH_HEIGHT,
+			((channels * BENCH_WINDOW_WIDTH + 3) & ~3) * BENCH_WINDOW_HEIGHT);
+	}
+
+	delete[] pixels;
+}
+// ----------------------------------------------------------------------------
+
+//one eye of the thread scaling benchmark: converts the same raw frame repeatedly like grabFrame does
+struct BENCH_EYE
+{
+	FL3Camera* camera;
+	Image raw;
+	unsigned int frames;
+};
+
+static DWORD WINAPI benchEyeThread(LPVOID param)
+{
+	BENCH_EYE* eye = (BENCH_EYE*)param;
+	for (unsigned int i = 0; i < eye->frames; i++)
+	{
+		eye->camera->convertFrame(&eye->raw);
+		eye->camera->publishFrame();
+	}
+	return 0;
+}
+
+//times both eyes converting at once, each from its own thread as the camera callbacks do,
+//followed by the compositor, for 1 thread up to one per core (or the -threads count)
+static void benchmarkThreads(unsigned int frames, PixelFormat format, const char* name)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int cores = (benchThreads > 0) ? benchThreads : info.dwNumberOfProcessors;
+	unsigned int width = benchProfile->width, height = benchProfile->height;
+	printf("\n*** THREAD SCALING: %s %s %ux%u, two eyes at once, %d cores ***\n", name, benchProfile->name, width, height, cores);
+
+	FL3Camera left(CAMERA_NAME_LEFT, 0, 0);
+	FL3Camera right(CAMERA_NAME_RIGHT, 0, 0);
+	left.setPixelFormat(format);
+	right.setPixelFormat(format);
+	left.connectSimulated(new SimCamera(CAMERA_NAME_LEFT, width, height, 0, format));
+	right.connectSimulated(new SimCamera(CAMERA_NAME_RIGHT, width, height, 0, format));
+	left.configure(benchProfile);
+	right.configure(benchProfile);
+
+	BENCH_EYE eyes[2];
+	eyes[0].camera = &left;
+	eyes[1].camera = &right;
+	for (int e = 0; e < 2; e++)
+	{
+		//the retrieved image points into the SimCamera, so it is copied
+		SimCamera sim("bench", width, height, 0, format);
+		Image frame;
+		sim.RetrieveBuffer(&frame);
+		eyes[e].raw.DeepCopy(&frame);
+		eyes[e].frames = frames;
+	}
+
+	CpuCompositor compositor(BENCH_WINDOW_WIDTH, BENCH_WINDOW_HEIGHT, 3);
+	double baseConvert = 0, baseDraw = 0;
+
+	//powers of two, then all cores
+	for (int threads = 1; ; threads *= 2)
+	{
+		if (threads > cores)
+			threads = cores;
+		initTaskPool(threads);
+
+		LONGLONG start = perfCounter();
+		HANDLE handles[2];
+		for (int e = 0; e < 2; e++)
+			handles[e] = CreateThread(NULL, 0, benchEyeThread, &eyes[e], 0, NULL);
+		WaitForMultipleObjects(2, handles, TRUE, INFINITE);
+		for (int e = 0; e < 2; e++)
+			CloseHandle(handles[e]);
+		double convertMs = perfMs(perfCounter() - start) / frames;
+		left.acquireFrame();
+		right.acquireFrame();
+
+		start = perfCounter();
+		for (unsigned int i = 0; i < frames; i++)
+		{
+			compositor.clear();
+			compositor.drawQuad(0, BENCH_WINDOW_WIDTH / 2, left.getBuffer(), left.getCols(), left.getRows());
+			compositor.drawQuad(BENCH_WINDOW_WIDTH / 2, BENCH_WINDOW_WIDTH, right.getBuffer(), right.getCols(), right.getRows());
+		}
+		double drawMs = perfMs(perfCounter() - start) / frames;
+
+		if (threads == 1)
+		{
+			baseConvert = convertMs;
+			baseDraw = drawMs;
+		}
+		printf("%2d thread(s): convert pair %7.3f ms (x%.2f)  compose %7.3f ms (x%.2f)  %s %d fps\n",
+			threads, convertMs, baseConvert / convertMs, drawMs, baseDraw / drawMs,
+			(convertMs + drawMs <= 1000.0 / BENCH_EYE_FPS) ? "meets" : "misses", BENCH_EYE_FPS);
+
+		if (threads == cores)
+			break;
+	}
+	closeTaskPool();
+}
+// ----------------------------------------------------------------------------
+
+//times the SDK's edge sensing conversion of one eye as the full quality level runs it: one whole frame call,
+//written into the display buffer. Checks that this gives the bytes of a separate conversion into an image the
+//SDK allocates itself
+static bool benchmarkSdkConvert(unsigned int frames)
+{
+	unsigned int width = benchProfile->width, height = benchProfile->height;
+	printf("\n*** SDK CONVERSION: RAW8 %s %ux%u, edge sensing, %u frames ***\n", benchProfile->name, width, height, frames);
+
+	FL3Camera camera(CAMERA_NAME_LEFT, 0, 0);
+	camera.setPixelFormat(PIXEL_FORMAT_RAW8);
+	camera.connectSimulated(new SimCamera(CAMERA_NAME_LEFT, width, height, 0, PIXEL_FORMAT_RAW8));
+	camera.configure(benchProfile);
+	SimCamera sim("bench", width, height, 0, PIXEL_FORMAT_RAW8);
+	Image frame, raw;
+	sim.RetrieveBuffer(&frame);
+	raw.DeepCopy(&frame);
+
+	LONGLONG start = perfCounter();
+	for (unsigned int i = 0; i < frames; i++)
+		camera.convertFrame(&raw);
+	double ms = perfMs(perfCounter() - start) / frames;
+	camera.publishFrame();
+	camera.acquireFrame();
+
+	Image reference;
+	raw.SetColorProcessing(EDGE_SENSING);
+	raw.Convert(PIXEL_FORMAT_RGB, &reference);
+	bool pass = camera.getCols() == reference.GetCols() && camera.getRows() == reference.GetRows();
+	for (unsigned int y = 0; pass && y < height; y++)
+		pass = memcmp(camera.getBuffer() + y * 3 * width, reference.GetData() + y * reference.GetStride(), 3 * width) == 0;
+	printf("whole frame %7.3f ms per eye (%s %d fps) | into the display buffer: %s\n", ms,
+		(ms <= 1000.0 / BENCH_EYE_FPS) ? "meets" : "misses", BENCH_EYE_FPS, pass ? "PASS" : "FAIL");
+	return pass;
+}
+// ----------------------------------------------------------------------------
+
+//prints the capture profile table for each format and checks the automatic choice against stand-in
+//cameras that enforce the bus limit; also checks that they refuse a profile the model rules out
+static void benchmarkProfiles()
+{
+	PixelFormat formats[3] = { PIXEL_FORMAT_RAW8, PIXEL_FORMAT_RAW12, PIXEL_FORMAT_RAW16 };
+	for (int f = 0; f < 3; f++)
+	{
+		printCaptureProfiles(formats[f]);
+
+		FL3Camera left(CAMERA_NAME_LEFT, 0, 0);
+		FL3Camera right(CAMERA_NAME_RIGHT, 0, 0);
+		left.setPixelFormat(formats[f]);
+		right.setPixelFormat(formats[f]);
+		left.connectSimulated(new SimCamera(CAMERA_NAME_LEFT, BENCH_WIDTH, BENCH_HEIGHT, 0, formats[f]));
+		right.connectSimulated(new SimCamera(CAMERA_NAME_RIGHT, BENCH_WIDTH, BENCH_HEIGHT, 0, formats[f]));
+
+		const CAPTURE_PROFILE* chosen = configureCameras(&left, &right, CAPTURE_PROFILE_AUTO);
+		printf("auto: %s\n", (chosen != 0) ? chosen->name : "none");
+
+		//first profile the model rejects, forced onto the cameras without the model
+		for (int i = 0; i < getNumCaptureProfiles(); i++)
+		{
+			const CAPTURE_PROFILE* profile = getCaptureProfile(i);
+			const char* reason;
+			if (profileFitsBus(profile, formats[f], 2, &reason) || profile->fps > profileMaxFps(profile))
+				continue;
+			bool accepted = left.configure(profile) == 0 && right.configure(profile) == 0;
+			printf("forcing %s: %s\n", profile->name, accepted ? "ACCEPTED, bus model and cameras disagree" : "refused by the cameras as expected");
+			break;
+		}
+	}
+}
+// ----------------------------------------------------------------------------
+
+//times disparity maps of a synthetic pair whose right image is the left one shifted by BENCH_DEPTH_SHIFT,
+//and checks how many pixels come out at that disparity
+static void benchmarkDisparity(unsigned int frames)
+{
+	printf("\n*** DISPARITY: %ux%u pair, %u maps ***\n", BENCH_WIDTH, BENCH_HEIGHT, frames);
+
+	SimCamera sim("bench", BENCH_WIDTH, BENCH_HEIGHT, 0, PIXEL_FORMAT_RAW8);
+	Image raw;
+	sim.RetrieveBuffer(&raw);
+	unsigned char* leftRGB = new unsigned char[3 * BENCH_WIDTH * BENCH_HEIGHT];
+	unsigned char* rightRGB = new unsigned char[3 * BENCH_WIDTH * BENCH_HEIGHT];
+	demosaicBilinear8(raw.GetData(), raw.GetStride(), BENCH_WIDTH, BENCH_HEIGHT, RGGB, leftRGB, 0, BENCH_HEIGHT);
+
+	//right pixel x sees what left pixel x + shift sees; the last columns repeat the edge
+	for (unsigned int y = 0; y < BENCH_HEIGHT; y++)
+	{
+		for (unsigned int x = 0; x < BENCH_WIDTH; x++)
+		{
+			unsigned int source = (x + BENCH_DEPTH_SHIFT < BENCH_WIDTH) ? x + BENCH_DEPTH_SHIFT : BENCH_WIDTH - 1;
+			memcpy(rightRGB + 3 * (y * BENCH_WIDTH + x), leftRGB + 3 * (y * BENCH_WIDTH + source), 3);
+		}
+	}
+
+	initTaskPool(benchThreads);
+	DisparityEstimator estimator("bench", 0);
+	LONGLONG start = perfCounter();
+	for (unsigned int i = 0; i < frames; i++)
+	{
+		estimator.submit(i, leftRGB, rightRGB, BENCH_WIDTH, BENCH_HEIGHT, 3, 0, false, 0, 0);
+		estimator.wait();
+	}
+	double ms = perfMs(perfCounter() - start) / frames;
+	closeTaskPool();
+
+	unsigned int w = estimator.getWidth();
+	unsigned int h = estimator.getHeight();
+	unsigned short* map = new unsigned short[w * h];
+	estimator.getDisparity(map);
+	int expected = BENCH_DEPTH_SHIFT * w * DISPARITY_SUBPIXEL / BENCH_WIDTH;
+	unsigned int valid = 0, correct = 0;
+	for (unsigned int i = 0; i < w * h; i++)
+	{
+		if (map[i] == DISPARITY_INVALID)
+			continue;
+		valid++;
+		if (abs((int)map[i] - expected) <= DISPARITY_SUBPIXEL)
+			correct++;
+	}
+
+	printf("%ux%u map: %.3f ms per pair (%s %d fps); %.1f%% of pixels matched, %.1f%% of those within a pixel of %d\n",
+		w, h, ms, (ms <= 1000.0 / BENCH_DEPTH_FPS) ? "meets" : "misses", BENCH_DEPTH_FPS,
+		100.0 * valid / (w * h), 100.0 * correct / (valid > 0 ? valid : 1), expected / DISPARITY_SUBPIXEL);
+
+	delete[] map;
+	delete[] leftRGB;
+	delete[] rightRGB;
+}
+// ----------------------------------------------------------------------------
+
+//fixed pseudo random sequence, so the denoise checks see the same noise on every run
+static unsigned int benchRandom(unsigned int* seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return *seed >> 8;
+}
+
+//adds roughly gaussian noise (sum of four uniform values) of the given sigma
+static void addNoise(const unsigned char* clean, unsigned char* noisy, unsigned int count, double sigma, unsigned int* seed)
+{
+	//four uniform values in [-0.5, 0.5) have a sigma of 1 / sqrt(3)
+	double scale = sigma * sqrt(3.0) / (1 << 24);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		int sum = 0;
+		for (int k = 0; k < 4; k++)
+			sum += (int)benchRandom(seed) - (1 << 23);
+		int v = clean[i] + (int)floor(sum * scale + 0.5);
+		noisy[i] = (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+	}
+}
+
+//peak signal to noise ratio of an 8-bit image against a reference, in dB
+static double psnr(const unsigned char* image, const unsigned char* reference, unsigned int count)
+{
+	double sum = 0;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		int d = image[i] - reference[i];
+		sum += d * d;
+	}
+	return (sum > 0) ? 10 * log10(255.0 * 255.0 * count / sum) : 99.0;
+}
+
+//the scene panned left by shift pixels, wrapping around
+static void panScene(const unsigned char* scene, unsigned char* panned, unsigned int cols, unsigned int rows, unsigned int shift)
+{
+	shift %= cols;
+	for (unsigned int y = 0; y < rows; y++)
+	{
+		const unsigned char* src = scene + 3 * y * cols;
+		unsigned char* dst = panned + 3 * y * cols;
+		memcpy(dst, src + 3 * shift, 3 * (cols - shift));
+		memcpy(dst + 3 * (cols - shift), src, 3 * shift);
+	}
+}
+
+//times the temporal denoiser on a 720p RGB eye, then checks its output on fixed noisy sequences:
+//a still scene must come out cleaner, and a panning scene and a scene cut must not come out worse
+//than the unfiltered frames (no trails). Returns false if any check fails
+static bool benchmarkDenoise(unsigned int frames)
+{
+	printf("\n*** TEMPORAL DENOISE: %ux%u RGB, sigma %d, %u frames ***\n", BENCH_WIDTH, BENCH_HEIGHT, BENCH_DENOISE_SIGMA, frames);
+
+	unsigned int count = 3 * BENCH_WIDTH * BENCH_HEIGHT;
+	SimCamera sim("bench", BENCH_WIDTH, BENCH_HEIGHT, 0, PIXEL_FORMAT_RAW8);
+	Image raw;
+	sim.RetrieveBuffer(&raw);
+	unsigned char* scene = new unsigned char[count];
+	demosaicBilinear8(raw.GetData(), raw.GetStride(), BENCH_WIDTH, BENCH_HEIGHT, RGGB, scene, 0, BENCH_HEIGHT);
+
+	unsigned char* noisy = new unsigned char[BENCH_DENOISE_NOISY * count];
+	unsigned char* clean = new unsigned char[count];
+	unsigned char* work = new unsigned char[count];
+	unsigned int seed = 1;
+	for (int i = 0; i < BENCH_DENOISE_NOISY; i++)
+		addNoise(scene, noisy + i * count, count, BENCH_DENOISE_SIGMA, &seed);
+
+	//timing, without and with the task pool
+	for (int pooled = 0; pooled < 2; pooled++)
+	{
+		if (pooled)
+			initTaskPool(benchThreads);
+		TemporalDenoiser denoiser(count, BENCH_DENOISE_SIGMA);
+		LONGLONG ticks = 0;
+		for (unsigned int i = 0; i <= frames; i++)
+		{
+			memcpy(work, noisy + (i % BENCH_DENOISE_NOISY) * count, count);
+			LONGLONG start = perfCounter();
+			denoiser.process(work, 3 * BENCH_WIDTH, BENCH_HEIGHT);
+			//the first frame only fills the state
+			if (i > 0)
+				ticks += perfCounter() - start;
+		}
+		double ms = perfMs(ticks) / frames;
+		printf("%-11s %7.3f ms per eye (%s the %.0f ms budget)\n", pooled ? "task pool" : "one thread", ms,
+			(ms <= BENCH_DENOISE_MS) ? "meets" : "misses", BENCH_DENOISE_MS);
+		if (pooled)
+			closeTaskPool();
+	}
+
+	TemporalDenoiser denoiser(count, BENCH_DENOISE_SIGMA);
+	bool pass, allPass = true;
+
+	//still scene: the noise should average out
+	seed = 2;
+	for (int i = 0; i < BENCH_DENOISE_SETTLE; i++)
+	{
+		addNoise(scene, work, count, BENCH_DENOISE_SIGMA, &seed);
+		denoiser.process(work, 3 * BENCH_WIDTH, BENCH_HEIGHT);
+	}
+	addNoise(scene, noisy, count, BENCH_DENOISE_SIGMA, &seed);
+	memcpy(work, noisy, count);
+	denoiser.process(work, 3 * BENCH_WIDTH, BENCH_HEIGHT);
+	double before = psnr(noisy, scene, count);
+	double after = psnr(work, scene, count);
+	pass = after - before >= BENCH_DENOISE_GAIN;
+	printf("still scene: %5.2f dB -> %5.2f dB (%s, at least +%.0f dB)\n", before, after, pass ? "PASS" : "FAIL", BENCH_DENOISE_GAIN);
+	allPass = allPass && pass;
+
+	//scene cut to the negative: the first frame after it must not keep any of the old scene
+	for (unsigned int i = 0; i < count; i++)
+		clean[i] = (unsigned char)(255 - scene[i]);
+	addNoise(clean, noisy, count, BENCH_DENOISE_SIGMA, &seed);
+	memcpy(work, noisy, count);
+	denoiser.process(work, 3 * BENCH_WIDTH, BENCH_HEIGHT);
+	before = psnr(noisy, clean, count);
+	after = psnr(work, clean, count);
+	pass = after >= before - BENCH_DENOISE_LOSS;
+	printf("scene cut:   %5.2f dB -> %5.2f dB (%s, at most -%.0f dB)\n", before, after, pass ? "PASS" : "FAIL", BENCH_DENOISE_LOSS);
+	allPass = allPass && pass;
+
+	//panning scene: moving detail must not smear
+	denoiser.reset();
+	double beforeSum = 0, afterSum = 0;
+	for (int i = 0; i < BENCH_DENOISE_SETTLE; i++)
+	{
+		panScene(scene, clean, BENCH_WIDTH, BENCH_HEIGHT, i * BENCH_DENOISE_SHIFT);
+		addNoise(clean, noisy, count, BENCH_DENOISE_SIGMA, &seed);
+		memcpy(work, noisy, count);
+		denoiser.process(work, 3 * BENCH_WIDTH, BENCH_HEIGHT);
+		if (i > 0)
+		{
+			beforeSum += psnr(noisy, clean, count);
+			afterSum += psnr(work, clean, count);
+		}
+	}
+	before = beforeSum / (BENCH_DENOISE_SETTLE - 1);
+	after = afterSum / (BENCH_DENOISE_SETTLE - 1);
+	pass = after >= before - BENCH_DENOISE_LOSS;
+	printf("panning %dpx: %5.2f dB -> %5.2f dB (%s, at most -%.0f dB)\n", BENCH_DENOISE_SHIFT, before, after, pass ? "PASS" : "FAIL", BENCH_DENOISE_LOSS);
+	allPass = allPass && pass;
+
+	delete[] scene;
+	delete[] noisy;
+	delete[] clean;
+	delete[] work;
+	return allPass;
+}
+// ----------------------------------------------------------------------------
+
+//the multi-pass conversion the fused kernels replace: unpack, demosaic (or bin, or luma) at sensor depth, then tone map
+//out is laid out as PIXEL_LAYOUT_RGB, or luma
+static void referencePass(const Image* raw, BayerTileFormat bayer, bool luma, bool binned, const TONE_CURVE* curve,
+	unsigned short* raw16, unsigned short* work16, unsigned char* out)
+{
+	unsigned int cols = raw->GetCols(), rows = raw->GetRows(), stride = raw->GetStride();
+	const unsigned char* data = raw->GetData();
+	unsigned int outCount = (binned ? cols * rows / 4 : cols * rows) * (luma ? 1 : 3);
+
+	if (raw->GetPixelFormat() == PIXEL_FORMAT_RAW8)
+	{
+		if (luma && binned)
+			lumaBin8(data, stride, cols, out, 0, rows / 2);
+		else if (luma)
+			lumaBayer8(data, stride, cols, rows, out, 0, rows);
+		else if (binned)
+			binBayer8(data, stride, cols, bayer, out, 0, rows / 2);
+		else
+			demosaicBilinear8(data, stride, cols, rows, bayer, out, 0, rows);
+		return;
+	}
+
+	for (unsigned int y = 0; y < rows; y++)
+	{
+		if (raw->GetPixelFormat() == PIXEL_FORMAT_RAW12)
+			unpackRaw12(data + y * stride, raw16 + y * cols, cols);
+		else
+			memcpy(raw16 + y * cols, data + y * stride, 2 * cols);
+	}
+	if (luma && binned)
+		lumaBin16(raw16, cols, work16, 0, rows / 2);
+	else if (luma)
+		lumaBayer16(raw16, cols, rows, work16, 0, rows);
+	else if (binned)
+		binBayer16(raw16, cols, bayer, work16, 0, rows / 2);
+	else
+		demosaicBilinear16(raw16, cols, rows, bayer, work16, 0, rows);
+	toneMap16(work16, out, outCount, curve);
+}
+
+//times the fused kernels against the passes they replace, single threaded, and checks they match them byte for
+//byte for every Bayer pattern and layout, and that the tone curve adapts to the same exposure. Returns false if any
+//check fails
+static bool benchmarkPixelKernels(unsigned int frames)
+{
+	static const PixelFormat formats[] = { PIXEL_FORMAT_RAW8, PIXEL_FORMAT_RAW12, PIXEL_FORMAT_RAW16 };
+	static const char* formatNames[] = { "RAW8", "RAW12", "RAW16" };
+	static const BayerTileFormat patterns[] = { RGGB, GRBG, GBRG, BGGR };
+	static const char* modeNames[] = { "bilinear", "binned", "luma", "luma bin" };
+	printf("\n*** FUSED PIXEL KERNELS: %ux%u, %u frames ***\n", BENCH_WIDTH, BENCH_HEIGHT, frames);
+
+	unsigned int count = BENCH_WIDTH * BENCH_HEIGHT;
+	unsigned short* raw16 = new unsigned short[count];
+	unsigned short* work16 = new unsigned short[3 * count];
+	unsigned char* expected = new unsigned char[3 * count];
+	unsigned char* actual = new unsigned char[3 * count];
+	unsigned char* toneTable = new unsigned char[1 << 16];
+	bool allPass = true;
+
+	for (int f = 0; f < 3; f++)
+	{
+		SimCamera sim("bench", BENCH_WIDTH, BENCH_HEIGHT, 0, formats[f]);
+		Image raw;
+		sim.RetrieveBuffer(&raw);
+		PIXEL_JOB job;
+		job.raw = raw.GetData();
+		job.rawStride = raw.GetStride();
+		job.cols = BENCH_WIDTH;
+		job.rows = BENCH_HEIGHT;
+		job.toneTable = toneTable;
+
+		//the exposure from the sampled mosaic must be the one toneCurveUpdate finds in the unpacked one
+		TONE_CURVE curve;
+		bool highBitDepth = isHighBitDepth(formats[f]);
+		if (highBitDepth)
+		{
+			TONE_CURVE reference;
+			toneCurveInit(&curve, rawBitDepth(formats[f]));
+			toneCurveInit(&reference, rawBitDepth(formats[f]));
+			//leaves the unpacked mosaic in raw16
+			referencePass(&raw, RGGB, true, true, &reference, raw16, work16, expected);
+			toneCurveUpdate(&reference, raw16, count);
+			toneCurveAdapt(&curve, pixelSampleMean(formats[f], &job));
+			printf("%-5s exposure: %s\n", formatNames[f], (curve.scale == reference.scale) ? "PASS" : "FAIL");
+			allPass = allPass && curve.scale == reference.scale;
+			buildToneTable(&curve, toneTable);
+		}
+
+		for (int mode = 0; mode < 4; mode++)
+		{
+			bool luma = mode >= 2, binned = (mode & 1) != 0;
+			unsigned int outRows = binned ? BENCH_HEIGHT / 2 : BENCH_HEIGHT;
+			unsigned int outCount = (binned ? count / 4 : count) * (luma ? 1 : 3);
+			PIXEL_KERNELS kernels;
+			job.out = actual;
+
+			//every pattern, and BGR against the reference with red and blue swapped
+			bool pass = true;
+			for (int p = 0; p < 4; p++)
+			{
+				referencePass(&raw, patterns[p], luma, binned, &curve, raw16, work16, expected);
+				for (int layout = luma ? PIXEL_LAYOUT_LUMA : PIXEL_LAYOUT_RGB; layout <= (luma ? PIXEL_LAYOUT_LUMA : PIXEL_LAYOUT_BGR); layout++)
+				{
+					if (layout == PIXEL_LAYOUT_BGR)
+					{
+						for (unsigned int i = 0; i < outCount; i += 3)
+						{
+							unsigned char red = expected[i];
+							expected[i] = expected[i + 2];
+							expected[i + 2] = red;
+						}
+					}
+					selectPixelKernels(formats[f], patterns[p], (PixelLayout)layout, BENCH_WIDTH, &kernels);
+					(binned ? kernels.binned : kernels.full)(&job, 0, outRows);
+					pass = pass && memcmp(actual, expected, outCount) == 0;
+				}
+			}
+
+			//timing, RGB of the sensor's pattern
+			LONGLONG start = perfCounter();
+			for (unsigned int i = 0; i < frames; i++)
+				referencePass(&raw, RGGB, luma, binned, &curve, raw16, work16, expected);
+			double passesMs = perfMs(perfCounter() - start) / frames;
+
+			selectPixelKernels(formats[f], RGGB, luma ? PIXEL_LAYOUT_LUMA : PIXEL_LAYOUT_RGB, BENCH_WIDTH, &kernels);
+			PixelKernel kernel = binned ? kernels.binned : kernels.full;
+			start = perfCounter();
+			for (unsigned int i = 0; i < frames; i++)
+			{
+				if (highBitDepth)
+					buildToneTable(&curve, toneTable);
+				kernel(&job, 0, outRows);
+			}
+			double fusedMs = perfMs(perfCounter() - start) / frames;
+
+			printf("%-5s %-8s passes %7.3f ms  fused %7.3f ms | %s\n", formatNames[f], modeNames[mode], passesMs, fusedMs,
+				pass ? "PASS" : "FAIL");
+			allPass = allPass && pass;
+		}
+	}
+
+	delete[] raw16;
+	delete[] work16;
+	delete[] expected;
+	delete[] actual;
+	delete[] toneTable;
+	return allPass;
+}
+// ----------------------------------------------------------------------------
+
+//times the digital zoom of a 720p and a 1080p RGB pair at a few magnifications, then checks that both
+//eyes come out identical for identical frames and that a linear ramp comes out where the filter puts it.
+//On the task pool each setting has to meet the budget with the bicubic filter or, as the governor falls
+//back to it, the bilinear one
+static bool benchmarkZoom(unsigned int frames)
+{
+	static const unsigned int sizes[][2] = { { 1280, 720 }, { 1920, 1080 } };
+	static const double zooms[] = { 1.5, 2, 4 };
+	printf("\n*** DIGITAL ZOOM: RGB pairs, %u frames ***\n", frames);
+	bool allPass = true;
+
+	for (int s = 0; s < 2; s++)
+	{
+		unsigned int cols = sizes[s][0], rows = sizes[s][1];
+		unsigned int count = 3 * cols * rows;
+		SimCamera sim("bench", cols, rows, 0, PIXEL_FORMAT_RAW8);
+		Image raw;
+		sim.RetrieveBuffer(&raw);
+		unsigned char* scene = new unsigned char[count];
+		demosaicBilinear8(raw.GetData(), raw.GetStride(), cols, rows, RGGB, scene, 0, rows);
+		bool meets[sizeof(zooms) / sizeof(zooms[0])] = { false, false, false };
+
+		//timing, without and with the task pool, and bilinear on the pool
+		for (int run = 0; run < 3; run++)
+		{
+			bool pooled = (run > 0);
+			unsigned int taps = (run == 2) ? ZOOM_FAST_TAPS : ZOOM_TAPS;
+			if (run == 1)
+				initTaskPool(benchThreads);
+			ZoomResampler zoom(cols, rows, 3);
+			zoom.setTaps(taps);
+			for (unsigned int level = 0; level < sizeof(zooms) / sizeof(zooms[0]); level++)
+			{
+				//off centre, so the taps are not symmetric; the first pass builds the tables
+				zoom.setZoom(zooms[level], 0.4, 0.6);
+				zoom.resample(scene, scene, cols, rows);
+				LONGLONG start = perfCounter();
+				for (unsigned int i = 0; i < frames; i++)
+					zoom.resample(scene, scene, cols, rows);
+				double ms = perfMs(perfCounter() - start) / frames;
+				printf("%4up x%.1f %-8s %-11s %7.3f ms per pair (%s the %.0f ms budget)\n", rows, zooms[level],
+					(taps == ZOOM_TAPS) ? "bicubic" : "bilinear", pooled ? "task pool" : "one thread",
+					ms, (ms <= BENCH_ZOOM_MS) ? "meets" : "misses", BENCH_ZOOM_MS);
+				if (pooled)
+					meets[level] = meets[level] || (ms <= BENCH_ZOOM_MS);
+			}
+			if (run == 2)
+				closeTaskPool();
+		}
+		bool pass = true;
+		for (unsigned int level = 0; level < sizeof(zooms) / sizeof(zooms[0]); level++)
+			pass = pass && meets[level];
+		printf("%4up budget: %s\n", rows, pass ? "PASS" : "FAIL");
+		allPass = allPass && pass;
+
+		ZoomResampler zoom(cols, rows, 3);
+
+		//the same frame in both eyes must come out the same, with taps past the edges too
+		zoom.setZoom(3, 0, 1);
+		zoom.resample(scene, scene, cols, rows);
+		pass = memcmp(zoom.getOutput(0), zoom.getOutput(1), count) == 0;
+		printf("%4up lockstep: %s\n", rows, pass ? "PASS" : "FAIL");
+		allPass = allPass && pass;
+
+		//both filters reproduce a linear ramp, so each output pixel should have the ramp's value at its source position
+		double slope = 255.0 / (cols + rows);
+		for (unsigned int y = 0; y < rows; y++)
+		{
+			for (unsigned int x = 0; x < cols; x++)
+				memset(scene + 3 * (y * cols + x), (int)((x + y) * slope + 0.5), 3);
+		}
+		double z = 2.5, centreX = 0.45, centreY = 0.55;
+		zoom.setZoom(z, centreX, centreY);
+		for (unsigned int taps = ZOOM_TAPS; taps >= ZOOM_FAST_TAPS; taps -= 2)
+		{
+			zoom.setTaps(taps);
+			zoom.resample(scene, scene, cols, rows);
+			double worst = 0;
+			for (unsigned int y = 0; y < rows; y++)
+			{
+				double sourceY = centreY * rows - 0.5 * rows / z + (y + 0.5) / z - 0.5;
+				for (unsigned int x = 0; x < cols; x++)
+				{
+					double sourceX = centreX * cols - 0.5 * cols / z + (x + 0.5) / z - 0.5;
+					double error = fabs(zoom.getOutput(0)[3 * (y * cols + x) + 1] - (sourceX + sourceY) * slope);
+					if (error > worst)
+						worst = error;
+				}
+			}
+			pass = worst <= BENCH_ZOOM_ERROR;
+			printf("%4up %s ramp: max error %.2f (%s, at most %.0f)\n", rows, (taps == ZOOM_TAPS) ? "bicubic" : "bilinear",
+				worst, pass ? "PASS" : "FAIL", BENCH_ZOOM_ERROR);
+			allPass = allPass && pass;
+		}
+
+		delete[] scene;
+	}
+	return allPass;
+}
+// ----------------------------------------------------------------------------
+
+//times the copy of each raw frame into the pre-roll ring, which the capture threads pay on every frame,
+//for the run's profile at 8 and 16 bits, against the profile's frame time
+static void benchmarkPreroll(unsigned int frames)
+{
+	static const PixelFormat formats[] = { PIXEL_FORMAT_RAW8, PIXEL_FORMAT_RAW16 };
+	static const char* names[] = { "RAW8", "RAW16" };
+	unsigned int width = benchProfile->width, height = benchProfile->height;
+	printf("\n*** PRE-ROLL COPY: %s %ux%u at %.0f fps, %u frames per eye ***\n", benchProfile->name, width, height, benchProfile->fps, frames);
+
+	for (int f = 0; f < 2; f++)
+	{
+		SimCamera sim("bench", width, height, 0, formats[f]);
+		Image raw;
+		sim.RetrieveBuffer(&raw);
+		unsigned int bytes = raw.GetStride() * raw.GetRows();
+		if (!prerollOpen("bench", bytes, benchProfile->fps, BENCH_PREROLL_SECONDS, 0))
+			continue;
+
+		LONGLONG start = perfCounter();
+		for (unsigned int i = 0; i < frames; i++)
+		{
+			prerollPush(0, &raw, i, 0, 0);
+			prerollPush(1, &raw, i, 0, 0);
+		}
+		double ms = perfMs(perfCounter() - start) / (2 * frames);
+		prerollClose();
+
+		printf("%-6s %8u bytes/frame %7.3f ms per frame, %6.2f GB/s, %4.1f%% of the %.1f ms frame time\n", names[f], bytes, ms,
+			bytes / (ms * 1e6), 100 * ms * benchProfile->fps / 1000, 1000 / benchProfile->fps);
+	}
+}
+// ----------------------------------------------------------------------------
+
+int runBenchmark(unsigned int frames, int threads, const char* profileName)
+{
+	if (frames == 0)
+		frames = 1;
+	benchThreads = threads;
+	benchProfile = findCaptureProfile(profileName);
+	if (benchProfile == 0)
+		benchProfile = findCaptureProfile(BENCH_PROFILE);
+	benchmarkProfiles();
+	benchmarkBitDepth(frames);
+	benchmarkMono(frames);
+	bool kernelsMatch = benchmarkPixelKernels(frames);
+	bool sdkMatches = benchmarkSdkConvert(frames);
+	benchmarkThreads(frames, PIXEL_FORMAT_RAW8, "RAW8");
+	benchmarkThreads(frames, PIXEL_FORMAT_RAW12, "RAW12");
+	benchmarkDisparity(frames);
+	bool denoisePasses = benchmarkDenoise(frames);
+	bool zoomPasses = benchmarkZoom(frames);
+	benchmarkPreroll(frames);
+
+	bool pass = kernelsMatch && sdkMatches && denoisePasses && zoomPasses;
+	printf("\n%s\n", pass ? "All checks passed" : "CHECKS FAILED");
+	return pass ? 0 : 1;
+}
+// ----------------------------------------------------------------------------
+
+int runShaderVerify(int argc, char** argv)
+{
+	glutInit(&argc, argv);
+	glutInitDisplayMode(GLUT_DOUBLE);
+	glutInitWindowSize(BENCH_WINDOW_WIDTH, BENCH_WINDOW_HEIGHT);
+	glutCreateWindow("Raven Stereoscopic 3D - shader verification");
+	glViewport(0, 0, BENCH_WINDOW_WIDTH, BENCH_WINDOW_HEIGHT);
+	//the comparison is done on the back buffer before anything is presented
+	glReadBuffer(GL_BACK);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	loadGLExtensions();
+	bool demosaicMatches = verifyShaderDemosaic(BENCH_WINDOW_WIDTH, BENCH_WINDOW_HEIGHT);
+	bool compositorMatches = verifyGLCompositor(BENCH_WINDOW_WIDTH, BENCH_WINDOW_HEIGHT);
+	return (demosaicMatches && compositorMatches) ? 0 : 1;
+}
+
@@ -0,0 +1,23 @@
+#ifndef BENCHMARK
+#define BENCHMARK
+// ============================================================================
+
+//Offline benchmarks of the per-frame image processing, run on synthetic frames
+//from SimCamera so no cameras are needed (Raven_Stereoscopic.exe -bench)
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#define		BENCH_FRAMES_DEF	200		//frames per measurement unless given on the command line
+
+//runs all benchmarks and prints the results; returns 0, or 1 if any of the checks among them (fused kernels,
+//SDK conversion, denoise quality, zoom) failed, so scripted runs catch regressions. threads sizes the task
+//pool (0 for one per core); the thread scaling and SDK timing run at the named capture profile ("auto" for 720p60)
+int runBenchmark(unsigned int frames, int threads, const char* profileName);
+//opens a window and compares the shader demosaic with the CPU path, and the single draw compositor with the
+//immediate mode quads (Raven_Stereoscopic.exe -verify); works on any OpenGL 2.0 driver, including Mesa's
+//llvmpipe opengl32.dll. Returns 0 if they all match
+int runShaderVerify(int argc, char** argv);
+
+// ============================================================================
+#endif
@@ -0,0 +1,171 @@
+
+//Named capture configurations and the shared USB3 bandwidth model
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "CaptureProfile.h"
+#include "FL3Camera.h"
+#include <string.h>
+
+//ROI offsets in pixels of the mode: both eyes are centred on the sensor and spread STEREO_SEPARATION sensor
+//pixels apart, or as far apart as the horizontal room allows when that is less (1080p60, bin720p60)
+#define		ROI_ROOM(width, bin)		(SENSOR_COLS / (bin) - (width))
+#define		ROI_SPACING(width, bin)		((STEREO_SEPARATION / (bin) < ROI_ROOM(width, bin)) ? STEREO_SEPARATION / (bin) : ROI_ROOM(width, bin))
+#define		ROI_LEFT(width, bin)		((ROI_ROOM(width, bin) + ROI_SPACING(width, bin)) / 2)
+#define		ROI_RIGHT(width, bin)		((ROI_ROOM(width, bin) - ROI_SPACING(width, bin)) / 2)
+#define		ROI_VERTICAL(height, bin)	((SENSOR_ROWS / (bin) - (height)) / 2)
+#define		PROFILE(name, mode, bin, width, height, fps) \
+	{ name, mode, bin, width, height, fps, ROI_LEFT(width, bin), ROI_RIGHT(width, bin), ROI_VERTICAL(height, bin) }
+
+//ordered by decreasing pixel rate
+static const CAPTURE_PROFILE profiles[] =
+{
+	//		name			mode	bin	width	height	fps
+	PROFILE("1080p60",		MODE_8,	1,	1920,	1080,	60),
+	PROFILE("720p120",		MODE_8,	1,	1280,	720,	120),
+	PROFILE("720p60",		MODE_8,	1,	1280,	720,	60),
+	PROFILE("bin720p60",	MODE_1,	2,	960,	720,	60),
+	PROFILE("480p120",		MODE_8,	1,	640,	480,	120),
+	PROFILE("bin480p90",	MODE_1,	2,	640,	480,	90),
+};
+
+// ============================================================================
+
+int getNumCaptureProfiles()
+{
+	return sizeof(profiles) / sizeof(profiles[0]);
+}
+// ----------------------------------------------------------------------------
+
+const CAPTURE_PROFILE* getCaptureProfile(int index)
+{
+	if (index < 0 || index >= getNumCaptureProfiles())
+		return 0;
+	return &profiles[index];
+}
+// ----------------------------------------------------------------------------
+
+const CAPTURE_PROFILE* findCaptureProfile(const char* name)
+{
+	for (int i = 0; i < getNumCaptureProfiles(); i++)
+	{
+		if (strcmp(profiles[i].name, name) == 0)
+			return &profiles[i];
+	}
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+unsigned int busBitsPerPixel(PixelFormat format)
+{
+	if (format == PIXEL_FORMAT_RAW12)
+		return 12;
+	if (format == PIXEL_FORMAT_RAW16)
+		return 16;
+	return 8;
+}
+// ----------------------------------------------------------------------------
+
+double profileBytesPerSecond(const CAPTURE_PROFILE* profile, PixelFormat format)
+{
+	return (double)profile->width * profile->height * busBitsPerPixel(format) / 8 * profile->fps;
+}
+// ----------------------------------------------------------------------------
+
+double profileMaxFps(const CAPTURE_PROFILE* profile)
+{
+	double fps = SENSOR_FULL_FPS * SENSOR_ROWS / (profile->height * profile->binning);
+	return (fps < SENSOR_MAX_FPS) ? fps : SENSOR_MAX_FPS;
+}
+// ----------------------------------------------------------------------------
+
+unsigned int profileSeparation(const CAPTURE_PROFILE* profile)
+{
+	return (profile->offsetLeft - profile->offsetRight) * profile->binning;
+}
+// ----------------------------------------------------------------------------
+
+bool profileFitsBus(const CAPTURE_PROFILE* profile, PixelFormat format, int numCameras, const char** reason)
+{
+	if (profile->fps > profileMaxFps(profile))
+	{
+		*reason = "sensor readout too slow";
+		return false;
+	}
+	if (profileBytesPerSecond(profile, format) * numCameras > USB3_BUS_BYTES_PER_SEC)
+	{
+		*reason = "exceeds shared USB3 bandwidth";
+		return false;
+	}
+	*reason = "";
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+unsigned int profilePacketSize(const CAPTURE_PROFILE* profile, PixelFormat format, const Format7PacketInfo* packetInfo)
+{
+	double bytes = profileBytesPerSecond(profile, format) / USB3_PACKETS_PER_SEC;
+	unsigned int unit = (packetInfo->unitBytesPerPacket > 0) ? packetInfo->unitBytesPerPacket : 1;
+	unsigned int packetSize = ((unsigned int)(bytes + 0.999) + unit - 1) / unit * unit;
+	if (packetSize > packetInfo->maxBytesPerPacket)
+		return 0;
+	return packetSize;
+}
+// ----------------------------------------------------------------------------
+
+void printCaptureProfiles(PixelFormat format)
+{
+	printf("\n*** CAPTURE PROFILES (%u bits per pixel, 2 cameras, bus %.0f MB/s) ***\n",
+		busBitsPerPixel(format), USB3_BUS_BYTES_PER_SEC / (1000 * 1000));
+	for (int i = 0; i < getNumCaptureProfiles(); i++)
+	{
+		const CAPTURE_PROFILE* profile = &profiles[i];
+		const char* reason;
+		bool fits = profileFitsBus(profile, format, 2, &reason);
+		printf("%-10s %4ux%-4u %s %5.1f fps (sensor max %5.1f)  bus %6.1f MB/s  eyes %3u apart  %s %s\n",
+			profile->name, profile->width, profile->height, (profile->binning > 1) ? "binned" : "      ",
+			profile->fps, profileMaxFps(profile), 2 * profileBytesPerSecond(profile, format) / (1000 * 1000),
+			profileSeparation(profile), fits ? "fits" : "does not fit:", reason);
+	}
+}
+// ----------------------------------------------------------------------------
+
+const CAPTURE_PROFILE* configureCameras(FL3Camera* left, FL3Camera* right, const char* name)
+{
+	const CAPTURE_PROFILE* requested = 0;
+	if (strcmp(name, CAPTURE_PROFILE_AUTO) != 0)
+	{
+		requested = findCaptureProfile(name);
+		if (requested == 0)
+			printf("Unknown capture profile %s, choosing one automatically\n", name);
+	}
+
+	//the requested profile first, then all of them from the highest pixel rate down
+	for (int i = -1; i < getNumCaptureProfiles(); i++)
+	{
+		const CAPTURE_PROFILE* profile = (i < 0) ? requested : &profiles[i];
+		if (profile == 0 || (i >= 0 && profile == requested))
+			continue;
+
+		//the spacing of the eyes only changes when asked for by name
+		unsigned int separation = profileSeparation(profile);
+		if (i >= 0 && separation < STEREO_SEPARATION)
+		{
+			printf("Capture profile %s skipped: eyes %u sensor pixels apart instead of %u\n", profile->name, separation, STEREO_SEPARATION);
+			continue;
+		}
+
+		const char* reason;
+		if (!profileFitsBus(profile, left->getPixelFormat(), 2, &reason))
+		{
+			printf("Capture profile %s skipped: %s\n", profile->name, reason);
+			continue;
+		}
+		if (left->configure(profile) == 0 && right->configure(profile) == 0)
+			return profile;
+		printf("Capture profile %s rejected by the cameras\n", profile->name);
+	}
+	return 0;
+}
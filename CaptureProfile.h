@@ -0,0 +1,76 @@
+#ifndef CAPTURE_PROFILE_H
+#define CAPTURE_PROFILE_H
+// ============================================================================
+
+//Named capture configurations (resolution, frame rate, binning, ROI offsets) and a model
+//of the USB3 bandwidth both cameras share, used to pick a configuration that fits
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "FlyCapture2.h"
+
+//both cameras sit on one USB3 host controller; this is what it sustains in practice
+#define		USB3_BUS_BYTES_PER_SEC		(400.0 * 1000 * 1000)
+//the camera sends one packet per 125 us bus interval, so packet size sets its bandwidth
+#define		USB3_PACKETS_PER_SEC		8000
+//sensor readout model for the FL3-U3-32S2C: all 1552 rows at 60 fps, faster for fewer rows
+#define		SENSOR_COLS					2080
+#define		SENSOR_ROWS					1552
+#define		SENSOR_FULL_FPS				60.0
+#define		SENSOR_MAX_FPS				150.0
+
+//horizontal distance between the two eyes' ROIs in sensor pixels, the same for every profile
+#define		STEREO_SEPARATION			224
+
+#define		CAPTURE_PROFILE_AUTO		"auto"	//profile name that picks the best one that fits
+#define		CAPTURE_PROFILE_DEF			CAPTURE_PROFILE_AUTO
+
+using namespace FlyCapture2;
+
+class FL3Camera;
+
+struct CAPTURE_PROFILE
+{
+	const char* name;
+	Mode mode;					//Format7 mode: MODE_8 for a full resolution ROI, MODE_1 for 2x2 binning
+	unsigned int binning;		//sensor rows read per output row
+	unsigned int width, height;	//output size in pixels of the mode
+	double fps;
+	unsigned int offsetLeft;	//ROI offsets in pixels of the mode; horizontal offsets set the stereo spacing
+	unsigned int offsetRight;
+	unsigned int offsetVertical;
+};
+
+// ============================================================================
+
+//returns the number of profiles; they are ordered by decreasing pixel rate, which is the order "auto" tries them in
+int getNumCaptureProfiles();
+const CAPTURE_PROFILE* getCaptureProfile(int index);
+//returns the profile with this name, or null
+const CAPTURE_PROFILE* findCaptureProfile(const char* name);
+
+//bits each pixel takes on the bus
+unsigned int busBitsPerPixel(PixelFormat);
+//bytes per second one camera sends with this profile and format
+double profileBytesPerSecond(const CAPTURE_PROFILE*, PixelFormat);
+//highest frame rate the sensor reads the profile's rows at
+double profileMaxFps(const CAPTURE_PROFILE*);
+//distance between the eyes' ROIs in sensor pixels; less than STEREO_SEPARATION when the sensor leaves no room for it
+unsigned int profileSeparation(const CAPTURE_PROFILE*);
+//checks the profile against the sensor readout and the bus shared by numCameras; reason is set when it does not fit
+bool profileFitsBus(const CAPTURE_PROFILE*, PixelFormat, int numCameras, const char** reason);
+//packet size in bytes that carries the profile's frame rate, in the camera's packet units; 0 if it needs more than the maximum
+unsigned int profilePacketSize(const CAPTURE_PROFILE*, PixelFormat, const Format7PacketInfo*);
+
+//prints the profile table with the bus load of two cameras in this format
+void printCaptureProfiles(PixelFormat);
+
+//configures both connected cameras with the named profile, falling back to (or, for "auto", choosing)
+//the highest pixel rate profile that fits the bus model and that both cameras accept; null if none does.
+//"auto" and the fallback only choose profiles with the full STEREO_SEPARATION; a profile requested by name
+//that has less is used, and the caller logs the change of spacing
+const CAPTURE_PROFILE* configureCameras(FL3Camera* left, FL3Camera* right, const char* name);
+
+// ============================================================================
+#endif
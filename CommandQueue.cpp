@@ -0,0 +1,267 @@
+
+//Operator commands as messages, applied by the display thread between frames
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "CommandQueue.h"
+#include "Metrics.h"
+#include "PerfTimer.h"
+#include "Trace.h"
+#include <string.h>
+
+#define		SCRIPT_POLL_MS		1		//script wait between looks at the frame count
+
+//a command, and whose turn the cell is: free for the producer at position p when sequence is p,
+//holds the command at p for the consumer when it is p + 1
+struct COMMAND_CELL
+{
+	volatile LONG sequence;
+	COMMAND command;
+};
+
+static COMMAND_CELL cells[COMMAND_QUEUE_SIZE];
+static volatile LONG tail = 0;				//position of the next command posted
+static LONG head = 0;						//position of the next command applied; display thread only
+static volatile LONG applied = 0;
+static const volatile unsigned int* frames = 0;
+static FILE* commandLog = 0;
+
+static const char* names[CMD_COUNT] = { "offset+", "offset-", "record", "fullscreen", "quit", "trace", "preroll", "zoom" };
+static const char* sources[] = { "key", "script" };
+
+//zoom arguments in scripts, and the keys they stand for
+static const char* zoomArgs[] = { "+", "-", "0", "left", "right", "up", "down" };
+static const DWORD zoomKeys[] = { VK_ADD, VK_SUBTRACT, VK_NUMPAD5, VK_NUMPAD4, VK_NUMPAD6, VK_NUMPAD8, VK_NUMPAD2 };
+#define		ZOOM_ARGS		(sizeof(zoomArgs) / sizeof(zoomArgs[0]))
+
+//one line of a script
+struct SCRIPT_ENTRY
+{
+	unsigned int frame;
+	int type;
+	LONG arg;
+};
+
+static SCRIPT_ENTRY* script = 0;
+static int scriptLength = 0;
+static HANDLE scriptThread = 0;
+static HANDLE scriptStop = 0;
+
+//prints a line and adds it to the log
+static void commandPrint(const char* buffer)
+{
+	printf(buffer);
+	if (commandLog != 0)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), commandLog);
+	}
+}
+
+// ============================================================================
+//queue
+
+void commandsOpen(const volatile unsigned int* frameCounter, FILE* logFile)
+{
+	commandsClose();
+	for (LONG i = 0; i < COMMAND_QUEUE_SIZE; i++)
+		cells[i].sequence = i;
+	tail = 0;
+	head = 0;
+	applied = 0;
+	frames = frameCounter;
+	commandLog = logFile;
+}
+// ----------------------------------------------------------------------------
+
+LONG postCommand(int type, LONG arg, int source)
+{
+	LONG position = tail;
+	COMMAND_CELL* cell;
+	for (;;)
+	{
+		cell = &cells[position & (COMMAND_QUEUE_SIZE - 1)];
+		LONG difference = cell->sequence - position;
+		if (difference == 0)
+		{
+			//claim the cell; another producer may have got there first
+			LONG seen = InterlockedCompareExchange(&tail, position + 1, position);
+			if (seen == position)
+				break;
+			position = seen;
+		}
+		else if (difference < 0)
+		{
+			//the display thread is a whole queue behind
+			metricAdd(METRIC_COMMANDS_DROPPED, 1);
+			return 0;
+		}
+		else
+		{
+			position = tail;
+		}
+	}
+
+	cell->command.id = position + 1;
+	cell->command.type = type;
+	cell->command.arg = arg;
+	cell->command.source = source;
+	cell->command.postTime = perfCounter();
+	cell->command.postFrame = (frames != 0) ? *frames : 0;
+	//hands the cell to the consumer after everything above is written
+	InterlockedExchange(&cell->sequence, position + 1);
+	return position + 1;
+}
+// ----------------------------------------------------------------------------
+
+bool nextCommand(COMMAND* command)
+{
+	COMMAND_CELL* cell = &cells[head & (COMMAND_QUEUE_SIZE - 1)];
+	if (cell->sequence != head + 1)
+		return false;
+	*command = cell->command;
+	//free for the producer one lap later
+	InterlockedExchange(&cell->sequence, head + COMMAND_QUEUE_SIZE);
+	head++;
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+void acknowledgeCommand(const COMMAND* command, unsigned int frameNum)
+{
+	char buffer[200];
+	LONGLONG now = perfCounter();
+	double ms = perfMs(now - command->postTime);
+	traceSpan(commandName(command->type), command->postTime, now, command->id);
+	metricObserve(METRIC_COMMAND_LATENCY_US, (LONGLONG)(ms * 1000));
+	metricAdd(METRIC_COMMANDS_APPLIED, 1);
+	InterlockedExchange(&applied, command->id);
+
+	sprintf(buffer, "Command %ld %s (%s) posted at frame %u, applied at frame %u after %.1f ms\n", command->id,
+		commandName(command->type), sources[command->source], command->postFrame, frameNum, ms);
+	commandPrint(buffer);
+}
+// ----------------------------------------------------------------------------
+
+LONG getAppliedCommand()
+{
+	return applied;
+}
+// ----------------------------------------------------------------------------
+
+const char* commandName(int type)
+{
+	return (type >= 0 && type < CMD_COUNT) ? names[type] : "unknown";
+}
+
+// ============================================================================
+//script
+
+//posts each line once its frame is reached; a full queue is retried rather than dropping a scripted command
+static DWORD WINAPI scriptRunner(LPVOID)
+{
+	traceThreadName("script");
+	for (int i = 0; i < scriptLength; i++)
+	{
+		while (*frames < script[i].frame || postCommand(script[i].type, script[i].arg, CMD_SOURCE_SCRIPT) == 0)
+		{
+			if (WaitForSingleObject(scriptStop, SCRIPT_POLL_MS) == WAIT_OBJECT_0)
+			{
+				traceThreadExit();
+				return 0;
+			}
+		}
+	}
+	traceThreadExit();
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+bool startCommandScript(const char* path)
+{
+	char buffer[300];
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+	{
+		sprintf(buffer, "Could not open script %s\n", path);
+		commandPrint(buffer);
+		return false;
+	}
+
+	script = new SCRIPT_ENTRY[COMMAND_SCRIPT_MAX];
+	scriptLength = 0;
+	int errors = 0;
+	char line[200];
+	for (int lineNum = 1; fgets(line, sizeof(line), file) != NULL; lineNum++)
+	{
+		char* comment = strchr(line, '#');
+		if (comment != 0)
+			*comment = 0;
+		unsigned int frame;
+		char name[32], arg[32];
+		int fields = sscanf(line, "%u %31s %31s", &frame, name, arg);
+		if (fields <= 0)
+			continue;
+
+		int type = CMD_COUNT;
+		for (int t = 0; t < CMD_COUNT; t++)
+		{
+			if (fields >= 2 && strcmp(name, names[t]) == 0)
+				type = t;
+		}
+		LONG value = 0;
+		if (type == CMD_ZOOM)
+		{
+			type = CMD_COUNT;
+			for (unsigned int z = 0; z < ZOOM_ARGS && fields == 3; z++)
+			{
+				if (strcmp(arg, zoomArgs[z]) == 0)
+				{
+					type = CMD_ZOOM;
+					value = zoomKeys[z];
+				}
+			}
+		}
+		if (type == CMD_COUNT || scriptLength == COMMAND_SCRIPT_MAX)
+		{
+			sprintf(buffer, "%s line %d: not a command: %s\n", path, lineNum, line);
+			commandPrint(buffer);
+			errors++;
+			continue;
+		}
+		script[scriptLength].frame = frame;
+		script[scriptLength].type = type;
+		script[scriptLength].arg = value;
+		scriptLength++;
+	}
+	fclose(file);
+	if (errors > 0)
+	{
+		delete[] script;
+		script = 0;
+		return false;
+	}
+
+	sprintf(buffer, "Script %s: %d commands\n", path, scriptLength);
+	commandPrint(buffer);
+	scriptStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	scriptThread = CreateThread(NULL, 0, scriptRunner, 0, 0, NULL);
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+void commandsClose()
+{
+	if (scriptThread != 0)
+	{
+		SetEvent(scriptStop);
+		WaitForSingleObject(scriptThread, INFINITE);
+		CloseHandle(scriptThread);
+		CloseHandle(scriptStop);
+		scriptThread = scriptStop = 0;
+	}
+	delete[] script;
+	script = 0;
+	scriptLength = 0;
+}
@@ -0,0 +1,81 @@
+#ifndef COMMAND_QUEUE
+#define COMMAND_QUEUE
+// ============================================================================
+
+//Operator commands as messages, applied by the display thread between frames
+//The keyboard hook and the -script reader post typed commands onto a bounded lock-free
+//ring; neither ever waits, and a command that finds the ring full is dropped and counted.
+//Each cell carries a sequence number that says whether it is free for the next producer or
+//holds a command for the consumer, so any number of threads can post while the display
+//thread takes them off in order. The display thread applies everything queued at the start
+//of a frame, to both eyes at once, and acknowledges each command with the frame it took
+//effect at; a spacing change takes effect when frames of both eyes are at the new spacing
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+#include <stdio.h>
+
+#define		COMMAND_QUEUE_SIZE		64		//commands waiting to be applied; a power of 2
+#define		COMMAND_SCRIPT_MAX		1024	//lines of a -script file
+
+enum CommandType
+{
+	CMD_OFFSET_UP,			//increase the stereo spacing (up arrow)
+	CMD_OFFSET_DOWN,		//decrease the stereo spacing (down arrow)
+	CMD_RECORD,				//toggle recording ('R')
+	CMD_FULLSCREEN,			//toggle fullscreen ('F')
+	CMD_QUIT,				//leave the main loop (Esc)
+	CMD_TRACE,				//write the timeline of the last seconds ('T')
+	CMD_PREROLL,			//save the pre-roll ('P')
+	CMD_ZOOM,				//zoom or pan; arg is the key (+, -, number pad)
+
+	CMD_COUNT
+};
+
+//where a command came from
+enum CommandSource
+{
+	CMD_SOURCE_KEY,
+	CMD_SOURCE_SCRIPT
+};
+
+struct COMMAND
+{
+	LONG id;				//1, 2, ... in the order posted
+	LONG type;				//CommandType
+	LONG arg;
+	LONG source;			//CommandSource
+	LONGLONG postTime;		//perfCounter() when posted
+	unsigned int postFrame;	//frame being displayed when posted
+};
+
+// ============================================================================
+
+//sets where acknowledgements and script errors are logged, and the count of displayed frames that
+//commands and script lines refer to
+void commandsOpen(const volatile unsigned int* frameCounter, FILE* logFile);
+//stops the script, if one runs
+void commandsClose();
+
+//queues a command from any thread without waiting; returns its id, or 0 if the queue is full
+LONG postCommand(int type, LONG arg, int source);
+//takes the oldest command off the queue; display thread only
+bool nextCommand(COMMAND* command);
+//logs that a command took effect at frame frameNum and publishes its latency
+void acknowledgeCommand(const COMMAND* command, unsigned int frameNum);
+//id of the latest command applied
+LONG getAppliedCommand();
+
+//name of a command type, as in scripts
+const char* commandName(int type);
+
+//posts the commands of a script file, each once the display reaches its frame. Lines are
+//"<frame> <command> [arg]", with # comments; commands are offset+, offset-, record, fullscreen,
+//quit, trace, preroll, and zoom with +, -, 0 (reset), left, right, up or down.
+//Returns false if the file cannot be read or has errors
+bool startCommandScript(const char* path);
+
+// ============================================================================
+#endif
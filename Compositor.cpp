@@ -0,0 +1,205 @@
+
+//Pure-CPU presentation target used in headless mode
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "Compositor.h"
+#include "TaskPool.h"
+#include <string.h>
+
+// ============================================================================
+//public functions
+CpuCompositor::CpuCompositor(int w, int h, int numChannels)
+{
+	channels = numChannels;
+	pixels = 0;
+	current = 0;
+	for (int i = 0; i < COMPOSITOR_BUFFERS; i++)
+	{
+		buffers[i] = 0;
+		held[i] = false;
+		released[i] = 0;
+	}
+	quadRgb = 0;
+	quadX0 = quadX1 = 0;
+	quadCols = quadRows = 0;
+	colIndex = colWeight = rowIndex = rowWeight = 0;
+	width = height = rowStride = 0;
+	resize(w, h);
+}
+// ----------------------------------------------------------------------------
+
+CpuCompositor::~CpuCompositor()
+{
+	for (int i = 0; i < COMPOSITOR_BUFFERS; i++)
+	{
+		//readers only take a frame to write it out
+		while (held[i] && released[i] == 0)
+			Sleep(1);
+		delete[] buffers[i];
+	}
+	delete[] colIndex;
+	delete[] colWeight;
+	delete[] rowIndex;
+	delete[] rowWeight;
+}
+// ----------------------------------------------------------------------------
+
+void CpuCompositor::resize(int w, int h)
+{
+	if (w == width && h == height)
+		return;
+
+	//only called before the first frame, when no framebuffer is held
+	for (int i = 0; i < COMPOSITOR_BUFFERS; i++)
+		delete[] buffers[i];
+	delete[] colIndex;
+	delete[] colWeight;
+	delete[] rowIndex;
+	delete[] rowWeight;
+
+	width = w;
+	height = h;
+	rowStride = (channels * width + 3) & ~3;
+	for (int i = 0; i < COMPOSITOR_BUFFERS; i++)
+		buffers[i] = new unsigned char[rowStride * height];
+	pixels = buffers[current];
+	colIndex = new int[width];
+	colWeight = new int[width];
+	rowIndex = new int[height];
+	rowWeight = new int[height];
+}
+// ----------------------------------------------------------------------------
+
+void CpuCompositor::clear()
+{
+	memset(pixels, 0, rowStride * height);
+}
+// ----------------------------------------------------------------------------
+
+void CpuCompositor::drawQuad(int x0, int x1, const unsigned char* rgb, unsigned int cols, unsigned int rows)
+{
+	if (x1 > width)
+		x1 = width;
+	if (x0 >= x1 || cols == 0 || rows == 0)
+		return;
+
+	buildTable(x1 - x0, cols, colIndex, colWeight);
+	buildTable(height, rows, rowIndex, rowWeight);
+
+	quadX0 = x0;
+	quadX1 = x1;
+	quadRgb = rgb;
+	quadCols = cols;
+	quadRows = rows;
+	parallelRows(drawRowsTask, this, height);
+}
+// ----------------------------------------------------------------------------
+
+unsigned char* CpuCompositor::getPixels()
+{
+	return pixels;
+}
+// ----------------------------------------------------------------------------
+
+volatile LONG* CpuCompositor::hold()
+{
+	//the next framebuffer no reader holds any more
+	int next = -1;
+	for (int i = 1; i < COMPOSITOR_BUFFERS && next < 0; i++)
+	{
+		int candidate = (current + i) % COMPOSITOR_BUFFERS;
+		if (!held[candidate] || released[candidate] != 0)
+			next = candidate;
+	}
+	if (next < 0)
+		return 0;
+
+	held[current] = true;
+	released[current] = 0;
+	volatile LONG* flag = &released[current];
+	held[next] = false;
+	current = next;
+	pixels = buffers[current];
+	return flag;
+}
+
+int CpuCompositor::getWidth()
+{
+	return width;
+}
+
+int CpuCompositor::getHeight()
+{
+	return height;
+}
+
+// ============================================================================
+//private functions
+
+void CpuCompositor::drawRowsTask(void* context, unsigned int begin, unsigned int end)
+{
+	((CpuCompositor*)context)->drawRows(begin, end);
+}
+// ----------------------------------------------------------------------------
+
+//samples screen rows [begin, end) of the current quad
+void CpuCompositor::drawRows(unsigned int begin, unsigned int end)
+{
+	int x0 = quadX0;
+	int x1 = quadX1;
+	const unsigned char* rgb = quadRgb;
+	unsigned int cols = quadCols;
+	unsigned int rows = quadRows;
+
+	int n = channels;
+	unsigned int srcStride = n * cols;
+	for (int y = begin; y < (int)end; y++)
+	{
+		//texture row 0 is at the top of the screen; framebuffer rows are bottom-up
+		unsigned char* dst = pixels + (height - 1 - y) * rowStride + n * x0;
+		int ty = rowIndex[y];
+		int wy = rowWeight[y];
+		const unsigned char* src0 = rgb + ty * srcStride;
+		const unsigned char* src1 = (ty + 1 < (int)rows) ? src0 + srcStride : src0;
+
+		for (int x = 0; x < x1 - x0; x++)
+		{
+			int tx = colIndex[x];
+			int wx = colWeight[x];
+			int nx = (tx + 1 < (int)cols) ? n : 0;
+			const unsigned char* a = src0 + n * tx;
+			const unsigned char* b = src1 + n * tx;
+
+			//RGB source to BGR framebuffer (luma to grey)
+			for (int c = 0; c < n; c++)
+			{
+				int top = a[c] * (256 - wx) + a[c + nx] * wx;
+				int bottom = b[c] * (256 - wx) + b[c + nx] * wx;
+				int value = (top * (256 - wy) + bottom * wy + (1 << 15)) >> 16;
+				dst[n * x + n - 1 - c] = (unsigned char)value;
+			}
+		}
+	}
+}
+// ----------------------------------------------------------------------------
+
+//maps output pixel centres onto texel coordinates like GL_LINEAR with clamped edges
+void CpuCompositor::buildTable(int outSize, unsigned int inSize, int* index, int* weight)
+{
+	for (int i = 0; i < outSize; i++)
+	{
+		double t = ((double)i + 0.5) * inSize / outSize - 0.5;
+		if (t < 0)
+			t = 0;
+		int t0 = (int)t;
+		if (t0 > (int)inSize - 1)
+			t0 = inSize - 1;
+		index[i] = t0;
+		weight[i] = (int)((t - t0) * 256 + 0.5);
+		if (weight[i] > 256)
+			weight[i] = 256;
+	}
+}
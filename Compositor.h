@@ -0,0 +1,70 @@
+#ifndef CPU_COMPOSITOR
+#define CPU_COMPOSITOR
+// ============================================================================
+
+//Pure-CPU presentation target used in headless mode
+//draws each eye's RGB (or luma) frame into a side-by-side framebuffer the same way the
+//textured quads in display() do (GL_LINEAR sampling, top-left origin), and keeps
+//the result in the layout glReadPixels(GL_BGR_EXT or GL_RED) returns so it can be recorded.
+//A recorded framebuffer is held by the writer while the next frames are drawn into the others
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+
+#define		COMPOSITOR_BUFFERS	4	//framebuffers: the one being drawn and the ones writers still hold
+
+class CpuCompositor
+{
+public:
+	//channels is 3 for RGB frames and a BGR framebuffer, 1 for luma frames and a grey framebuffer
+	CpuCompositor(int w, int h, int channels);
+	~CpuCompositor();
+
+	//changes the framebuffer size; contents are undefined afterwards
+	void resize(int w, int h);
+	//equivalent of glClear(GL_COLOR_BUFFER_BIT) with a black clear colour
+	void clear();
+	//draws an RGB (or luma) image stretched over the screen columns [x0, x1) and all rows
+	//rows are drawn in bands on the shared task pool if there is one
+	void drawQuad(int x0, int x1, const unsigned char* rgb, unsigned int cols, unsigned int rows);
+
+	//returns framebuffer: bottom-up rows of BGR (or grey) pixels, padded to 4 bytes like glReadPixels does
+	unsigned char* getPixels();
+	//hands the framebuffer to a reader, who sets the returned flag to 1 when done with it; later frames are
+	//drawn into another framebuffer. Returns 0 if every other framebuffer is still held
+	volatile LONG* hold();
+	int getWidth();
+	int getHeight();
+
+private:
+	//data
+	unsigned char* pixels;		//framebuffer being drawn, one of buffers
+	unsigned char* buffers[COMPOSITOR_BUFFERS];
+	bool held[COMPOSITOR_BUFFERS];
+	volatile LONG released[COMPOSITOR_BUFFERS];
+	int current;				//index of pixels in buffers
+	int width, height;
+	int channels;		//bytes per pixel of the frames and the framebuffer
+	int rowStride;		//bytes per framebuffer row
+
+	//sampling tables for the current quad (fixed point, 8 fractional bits)
+	int* colIndex;
+	int* colWeight;
+	int* rowIndex;
+	int* rowWeight;
+
+	//quad being drawn, read by drawRows
+	int quadX0, quadX1;
+	const unsigned char* quadRgb;
+	unsigned int quadCols, quadRows;
+
+	//private prototypes
+	void buildTable(int outSize, unsigned int inSize, int* index, int* weight);
+	void drawRows(unsigned int begin, unsigned int end);
+	static void drawRowsTask(void* context, unsigned int begin, unsigned int end);
+};
+
+// ============================================================================
+#endif
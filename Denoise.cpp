@@ -0,0 +1,164 @@
+
+//Motion adaptive temporal denoising
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "Denoise.h"
+#include "TaskPool.h"
+#include <emmintrin.h>
+
+#define		DENOISE_STATE_SHIFT		6		//state is in 1/64 grey levels, so differences fit 16 bits
+#define		DENOISE_WEIGHT_ONE		32767	//weight of a sample passed through unfiltered
+
+// ============================================================================
+//kernel
+
+//one sample: new state = state + (sample - state) * weight, weight from |sample - previous output|;
+//the same integer steps as the SIMD version, for the samples left over at the end of a band
+static inline void denoiseSample(unsigned char* pixel, unsigned short* state, short low, short range, short slope, short weightMin)
+{
+	int previous = (*state + (1 << (DENOISE_STATE_SHIFT - 1))) >> DENOISE_STATE_SHIFT;
+	int difference = abs((int)*pixel - previous);
+	int over = difference - low;
+	if (over < 0)
+		over = 0;
+	if (over > range)
+		over = range;
+	int weight = weightMin + over * slope;
+
+	int delta = ((int)*pixel << DENOISE_STATE_SHIFT) - *state;
+	//a high multiply, as _mm_mulhi_epi16 does it
+	int s = *state + ((2 * delta * weight) >> 16);
+	*state = (unsigned short)s;
+	*pixel = (unsigned char)((s + (1 << (DENOISE_STATE_SHIFT - 1))) >> DENOISE_STATE_SHIFT);
+}
+
+//filters count samples in place against their state, 16 per SSE2 iteration
+static void temporalDenoise8(unsigned char* pixels, unsigned short* state, unsigned int count, short low, short range,
+	short slope, short weightMin)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(1 << (DENOISE_STATE_SHIFT - 1));
+	const __m128i lowV = _mm_set1_epi16(low);
+	const __m128i rangeV = _mm_set1_epi16(range);
+	const __m128i slopeV = _mm_set1_epi16(slope);
+	const __m128i weightMinV = _mm_set1_epi16(weightMin);
+
+	unsigned int i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i*)(pixels + i));
+		__m128i s[2] = { _mm_loadu_si128((const __m128i*)(state + i)), _mm_loadu_si128((const __m128i*)(state + i + 8)) };
+
+		//previous output and the absolute difference to it, as bytes
+		__m128i previous = _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(s[0], half), DENOISE_STATE_SHIFT),
+			_mm_srli_epi16(_mm_add_epi16(s[1], half), DENOISE_STATE_SHIFT));
+		__m128i difference = _mm_or_si128(_mm_subs_epu8(in, previous), _mm_subs_epu8(previous, in));
+
+		__m128i out[2];
+		for (int h = 0; h < 2; h++)
+		{
+			__m128i d = h == 0 ? _mm_unpacklo_epi8(difference, zero) : _mm_unpackhi_epi8(difference, zero);
+			__m128i x = h == 0 ? _mm_unpacklo_epi8(in, zero) : _mm_unpackhi_epi8(in, zero);
+
+			//weight ramps from weightMin at low to about 1 at low + range
+			__m128i over = _mm_min_epi16(_mm_subs_epu16(d, lowV), rangeV);
+			__m128i weight = _mm_add_epi16(weightMinV, _mm_mullo_epi16(over, slopeV));
+
+			//|delta| <= 255 * 64, so twice it still fits a signed 16-bit lane
+			__m128i delta = _mm_sub_epi16(_mm_slli_epi16(x, DENOISE_STATE_SHIFT), s[h]);
+			s[h] = _mm_add_epi16(s[h], _mm_mulhi_epi16(_mm_add_epi16(delta, delta), weight));
+			out[h] = _mm_srli_epi16(_mm_add_epi16(s[h], half), DENOISE_STATE_SHIFT);
+		}
+
+		_mm_storeu_si128((__m128i*)(state + i), s[0]);
+		_mm_storeu_si128((__m128i*)(state + i + 8), s[1]);
+		_mm_storeu_si128((__m128i*)(pixels + i), _mm_packus_epi16(out[0], out[1]));
+	}
+
+	for (; i < count; i++)
+		denoiseSample(pixels + i, state + i, low, range, slope, weightMin);
+}
+
+// ============================================================================
+//public functions
+
+TemporalDenoiser::TemporalDenoiser(unsigned int maxBytes, int noiseSigma)
+{
+	capacity = maxBytes;
+	state = new unsigned short[capacity];
+	rowBytes = rows = 0;
+	current = 0;
+	restart = true;
+
+	if (noiseSigma < 1)
+		noiseSigma = 1;
+	if (noiseSigma > DENOISE_SIGMA_MAX)
+		noiseSigma = DENOISE_SIGMA_MAX;
+	sigma = noiseSigma;
+	low = (short)(DENOISE_MOTION_LOW * sigma);
+	range = (short)((DENOISE_MOTION_HIGH - DENOISE_MOTION_LOW) * sigma);
+	weightMin = (short)(DENOISE_WEIGHT_MIN * 32768);
+	//weightMin + range * slope stays within DENOISE_WEIGHT_ONE
+	slope = (short)((DENOISE_WEIGHT_ONE - weightMin) / range);
+}
+// ----------------------------------------------------------------------------
+
+TemporalDenoiser::~TemporalDenoiser()
+{
+	delete[] state;
+}
+// ----------------------------------------------------------------------------
+
+void TemporalDenoiser::process(unsigned char* pixels, unsigned int frameRowBytes, unsigned int frameRows)
+{
+	if ((LONGLONG)frameRowBytes * frameRows > capacity)
+	{
+		rowBytes = rows = 0;
+		return;
+	}
+
+	restart = frameRowBytes != rowBytes || frameRows != rows;
+	rowBytes = frameRowBytes;
+	rows = frameRows;
+	current = pixels;
+	parallelRows(denoiseTask, this, rows);
+	current = 0;
+}
+// ----------------------------------------------------------------------------
+
+void TemporalDenoiser::reset()
+{
+	rowBytes = rows = 0;
+}
+// ----------------------------------------------------------------------------
+
+int TemporalDenoiser::getSigma()
+{
+	return sigma;
+}
+
+// ============================================================================
+//private functions
+
+//task pool kernel; context is the TemporalDenoiser filtering the frame
+void TemporalDenoiser::denoiseTask(void* context, unsigned int begin, unsigned int end)
+{
+	TemporalDenoiser* denoiser = (TemporalDenoiser*)context;
+	unsigned int offset = begin * denoiser->rowBytes;
+	unsigned int count = (end - begin) * denoiser->rowBytes;
+	unsigned char* pixels = denoiser->current + offset;
+	unsigned short* state = denoiser->state + offset;
+
+	if (denoiser->restart)
+	{
+		for (unsigned int i = 0; i < count; i++)
+			state[i] = (unsigned short)(pixels[i] << DENOISE_STATE_SHIFT);
+	}
+	else
+	{
+		temporalDenoise8(pixels, state, count, denoiser->low, denoiser->range, denoiser->slope, denoiser->weightMin);
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef TEMPORAL_DENOISE
+#define TEMPORAL_DENOISE
+// ============================================================================
+
+//Motion adaptive temporal denoising of the converted frames of one eye
+//A recursive filter: each output sample moves from the previous output towards the new
+//frame by a weight that depends on how far apart they are. Differences within the sensor
+//noise are averaged over several frames; larger ones are taken as motion and passed
+//through, so moving instruments do not leave trails. The filter state is kept at 1/64
+//of a grey level so slow changes are not lost to rounding. 16 samples per SSE2 iteration,
+//row bands spread over the shared task pool. Works on any 8-bit buffer: RGB, luma or a
+//RAW8 mosaic, since it only compares each sample with itself over time
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+
+#define		DENOISE_SIGMA_DEF		4		//sensor noise (grey levels) assumed unless given with -denoise
+#define		DENOISE_SIGMA_MAX		32
+#define		DENOISE_MOTION_LOW		2		//differences below this many sigma are filtered fully
+#define		DENOISE_MOTION_HIGH		5		//differences above this many sigma are motion and passed through
+#define		DENOISE_WEIGHT_MIN		0.2		//weight of the new frame where there is no motion
+
+// ============================================================================
+
+class TemporalDenoiser
+{
+public:
+	//allocates the filter state for frames of up to maxBytes; sigma is the noise level to remove
+	TemporalDenoiser(unsigned int maxBytes, int sigma);
+	~TemporalDenoiser();
+
+	//filters a frame in place. The state starts again from this frame if its size differs from the last
+	//one's, after reset, or if the frame does not fit
+	void process(unsigned char* pixels, unsigned int rowBytes, unsigned int rows);
+	//forgets the previous frames, e.g. after a gap in processing
+	void reset();
+
+	int getSigma();
+
+private:
+	//data
+	unsigned short* state;		//filtered frame in 1/64 grey levels
+	unsigned int capacity;		//bytes the state can hold
+	unsigned int rowBytes, rows;	//size of the frame in the state; 0 when there is none
+	int sigma;
+	short low, range, slope;	//motion ramp: weight = min + (difference - low, at most range) * slope
+	short weightMin;			//weights are in 1/32768
+
+	//frame being filtered, for the task pool kernels
+	unsigned char* current;
+	bool restart;
+
+	//private prototypes
+	static void denoiseTask(void*, unsigned int, unsigned int);
+};
+
+// ============================================================================
+#endif
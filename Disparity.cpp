@@ -0,0 +1,623 @@
+
+//Dense disparity from the stereo pair by semi-global matching at reduced resolution
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "Disparity.h"
+#include "TaskPool.h"
+#include "Metrics.h"
+#include "PerfTimer.h"
+#include "Trace.h"
+#include <emmintrin.h>
+#include <string.h>
+
+#define		CENSUS_BITS		24			//5x5 window without the centre
+#define		PATH_BORDER		0x3FFF		//path cost outside the search range
+#define		PATH_STRIDE		(DISPARITY_MAX + 2)
+
+// ============================================================================
+//helpers
+
+static inline int popcount(unsigned int v)
+{
+	v = v - ((v >> 1) & 0x55555555);
+	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+	return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+static inline int clampIndex(int i, int size)
+{
+	return (i < 0) ? 0 : ((i >= size) ? size - 1 : i);
+}
+
+//smallest of 8 non-negative 16-bit lanes
+static inline int horizontalMin(__m128i v)
+{
+	v = _mm_min_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_min_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	v = _mm_min_epi16(v, _mm_srli_epi32(v, 16));
+	return _mm_cvtsi128_si32(v) & 0xFFFF;
+}
+
+//one step along an SGM path, for all D disparities of a pixel, 8 at a time:
+//cur[d] = cost[d] + min(prev[d], prev[d -+ 1] + P1, min(prev) + P2) - min(prev)
+//prev and cur have a PATH_BORDER entry before and after them; adds cur to sum (or sets it for the first path)
+//returns min(cur)
+static inline int pathStep(const short* cost, const short* prev, int prevMin, short* cur, short* sum, int D, bool first)
+{
+	const __m128i p1 = _mm_set1_epi16(DISPARITY_P1);
+	const __m128i jump = _mm_set1_epi16((short)(prevMin + DISPARITY_P2));
+	const __m128i base = _mm_set1_epi16((short)prevMin);
+	__m128i lowest = _mm_set1_epi16(0x7FFF);
+
+	for (int d = 0; d < D; d += 8)
+	{
+		__m128i same = _mm_loadu_si128((const __m128i*)(prev + d));
+		__m128i down = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(prev + d - 1)), p1);
+		__m128i up = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(prev + d + 1)), p1);
+		__m128i best = _mm_min_epi16(_mm_min_epi16(same, jump), _mm_min_epi16(down, up));
+		__m128i value = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(cost + d)), _mm_sub_epi16(best, base));
+		_mm_storeu_si128((__m128i*)(cur + d), value);
+		lowest = _mm_min_epi16(lowest, value);
+
+		if (!first)
+			value = _mm_add_epi16(value, _mm_loadu_si128((const __m128i*)(sum + d)));
+		_mm_storeu_si128((__m128i*)(sum + d), value);
+	}
+	return horizontalMin(lowest);
+}
+
+//path buffers start at zero cost, so the first step of a path is the matching cost itself
+static inline void resetPath(short* buffer, int D)
+{
+	buffer[-1] = PATH_BORDER;
+	memset(buffer, 0, D * sizeof(short));
+	buffer[D] = PATH_BORDER;
+}
+
+// ============================================================================
+//public functions
+DisparityEstimator::DisparityEstimator(const char* base, FILE* log)
+{
+	width = height = 0;
+	scale = 1;
+	shift = 0;
+	frameNum = 0;
+	record = false;
+	baseFilename = _strdup(base);
+	logFile = log;
+
+	grey[0] = grey[1] = 0;
+	census[0] = census[1] = 0;
+	cost = sum = pathScratch = 0;
+	pathMin = 0;
+	result = output = 0;
+	outputFrame = -1;
+	input[0] = input[1] = 0;
+	inputRelease[0] = inputRelease[1] = 0;
+	inputCols = inputChannels = 0;
+
+	dMin = 0;
+	numDisparities = DISPARITY_MAX;
+	framesSinceFull = DISPARITY_FULL_INTERVAL;
+
+	InitializeCriticalSection(&outputLock);
+	busy = 0;
+	stopping = false;
+	work = CreateEvent(NULL, FALSE, FALSE, NULL);
+	done = CreateEvent(NULL, TRUE, TRUE, NULL);
+	thread = CreateThread(NULL, 0, workerThread, this, 0, NULL);
+}
+// ----------------------------------------------------------------------------
+
+DisparityEstimator::~DisparityEstimator()
+{
+	stopping = true;
+	SetEvent(work);
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	CloseHandle(work);
+	CloseHandle(done);
+	DeleteCriticalSection(&outputLock);
+	release();
+	free(baseFilename);
+}
+// ----------------------------------------------------------------------------
+
+bool DisparityEstimator::submit(unsigned int frame, const unsigned char* leftRGB, const unsigned char* rightRGB,
+	unsigned int cols, unsigned int rows, unsigned int channels, int roiShift, bool recordFrame,
+	volatile LONG* releaseLeft, volatile LONG* releaseRight)
+{
+	//still matching the previous pair
+	if (InterlockedCompareExchange(&busy, 1, 0) != 0)
+		return false;
+
+	unsigned int s = cols / DISPARITY_WIDTH;
+	if (s < 1)
+		s = 1;
+	unsigned int w = cols / s;
+	unsigned int h = rows / s;
+	if (w != width || h != height || s != scale)
+	{
+		//new capture size: start over with a full search
+		EnterCriticalSection(&outputLock);
+		release();
+		allocate(w, h);
+		outputFrame = -1;
+		LeaveCriticalSection(&outputLock);
+		scale = s;
+		framesSinceFull = DISPARITY_FULL_INTERVAL;
+	}
+
+	frameNum = frame;
+	shift = roiShift / (int)scale;
+	record = recordFrame;
+	input[0] = leftRGB;
+	input[1] = rightRGB;
+	inputRelease[0] = releaseLeft;
+	inputRelease[1] = releaseRight;
+	inputCols = cols;
+	inputChannels = channels;
+
+	ResetEvent(done);
+	SetEvent(work);
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+int DisparityEstimator::getDisparity(unsigned short* dst)
+{
+	EnterCriticalSection(&outputLock);
+	int frame = outputFrame;
+	if (dst != 0 && frame >= 0)
+		memcpy(dst, output, width * height * sizeof(unsigned short));
+	LeaveCriticalSection(&outputLock);
+	return frame;
+}
+// ----------------------------------------------------------------------------
+
+unsigned int DisparityEstimator::getWidth()
+{
+	return width;
+}
+
+unsigned int DisparityEstimator::getHeight()
+{
+	return height;
+}
+// ----------------------------------------------------------------------------
+
+void DisparityEstimator::wait()
+{
+	while (busy != 0)
+		WaitForSingleObject(done, INFINITE);
+}
+
+// ============================================================================
+//private functions
+
+void DisparityEstimator::allocate(unsigned int w, unsigned int h)
+{
+	width = w;
+	height = h;
+	for (int i = 0; i < 2; i++)
+	{
+		grey[i] = new unsigned char[w * h];
+		census[i] = new unsigned int[w * h];
+	}
+	cost = new short[w * h * DISPARITY_MAX];
+	sum = new short[w * h * DISPARITY_MAX];
+	pathScratch = new short[2 * w * PATH_STRIDE];
+	pathMin = new int[w];
+	result = new unsigned short[w * h];
+	output = new unsigned short[w * h];
+}
+// ----------------------------------------------------------------------------
+
+void DisparityEstimator::release()
+{
+	for (int i = 0; i < 2; i++)
+	{
+		delete[] grey[i];
+		delete[] census[i];
+		grey[i] = 0;
+		census[i] = 0;
+	}
+	delete[] cost;
+	delete[] sum;
+	delete[] pathScratch;
+	delete[] pathMin;
+	delete[] result;
+	delete[] output;
+	cost = sum = pathScratch = 0;
+	pathMin = 0;
+	result = output = 0;
+}
+// ----------------------------------------------------------------------------
+
+//grey level of each scale x scale block, from the 2x2 pixels at its centre
+void DisparityEstimator::reduce(const unsigned char* pixels, unsigned char* dst, unsigned int cols, unsigned int channels)
+{
+	unsigned int centre = (scale - 1) / 2;
+	unsigned int next = (scale > 1) ? channels : 0;
+	unsigned int nextRow = (scale > 1) ? channels * cols : 0;
+	//RGB is weighted (R + 2G + B) / 4, luma is used as it is
+	unsigned int g = (channels == 3) ? 1 : 0;
+	unsigned int b = (channels == 3) ? 2 : 0;
+
+	for (unsigned int y = 0; y < height; y++)
+	{
+		const unsigned char* row = pixels + channels * ((y * scale + centre) * cols + centre);
+		for (unsigned int x = 0; x < width; x++, row += channels * scale)
+		{
+			const unsigned char* p[4] = { row, row + next, row + nextRow, row + nextRow + next };
+			unsigned int total = 0;
+			for (int i = 0; i < 4; i++)
+				total += p[i][0] + 2 * p[i][g] + p[i][b];
+			dst[y * width + x] = (unsigned char)(total >> 4);
+		}
+	}
+}
+// ----------------------------------------------------------------------------
+
+void DisparityEstimator::match()
+{
+	LONGLONG start = perfCounter();
+
+	//the submitter gets its frames back as soon as they are reduced
+	for (int i = 0; i < 2; i++)
+	{
+		reduce(input[i], grey[i], inputCols, inputChannels);
+		if (inputRelease[i] != 0)
+			InterlockedExchange(inputRelease[i], 1);
+		input[i] = 0;
+		inputRelease[i] = 0;
+	}
+	traceSpan("reduce", start, perfCounter(), frameNum);
+
+	if (framesSinceFull >= DISPARITY_FULL_INTERVAL)
+	{
+		dMin = 0;
+		numDisparities = DISPARITY_MAX;
+		framesSinceFull = 0;
+	}
+
+	//census and costs of a row only read rows already transformed, so each pass is a barrier
+	parallelRows(censusTask, this, height);
+	parallelRows(costTask, this, height);		//plus the left and right paths
+	parallelRows(verticalTask, this, width);	//top and bottom paths, in bands of columns
+	parallelRows(selectTask, this, height);
+
+	updateRange();
+	framesSinceFull++;
+
+	EnterCriticalSection(&outputLock);
+	unsigned short* finished = result;
+	result = output;
+	output = finished;
+	outputFrame = frameNum;
+	LeaveCriticalSection(&outputLock);
+
+	LONGLONG end = perfCounter();
+	traceSpan("disparity", start, end, frameNum);
+	metricAdd(METRIC_DEPTH_FRAMES, 1);
+	metricObserve(METRIC_DEPTH_US, (LONGLONG)(perfMs(end - start) * 1000));
+	metricSet(METRIC_DEPTH_RANGE, numDisparities);
+
+	if (record)
+		saveMap();
+}
+// ----------------------------------------------------------------------------
+
+//5x5 census: one bit per neighbour, set if it is darker than the centre
+void DisparityEstimator::censusTask(void* context, unsigned int begin, unsigned int end)
+{
+	DisparityEstimator* est = (DisparityEstimator*)context;
+	int w = est->width;
+	int h = est->height;
+
+	for (int i = 0; i < 2; i++)
+	{
+		const unsigned char* g = est->grey[i];
+		for (int y = begin; y < (int)end; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				unsigned char centre = g[y * w + x];
+				unsigned int bits = 0;
+				for (int dy = -2; dy <= 2; dy++)
+				{
+					const unsigned char* row = g + clampIndex(y + dy, h) * w;
+					for (int dx = -2; dx <= 2; dx++)
+					{
+						if (dx == 0 && dy == 0)
+							continue;
+						bits = (bits << 1) | (row[clampIndex(x + dx, w)] < centre ? 1 : 0);
+					}
+				}
+				est->census[i][y * w + x] = bits;
+			}
+		}
+	}
+}
+// ----------------------------------------------------------------------------
+
+void DisparityEstimator::costTask(void* context, unsigned int begin, unsigned int end)
+{
+	((DisparityEstimator*)context)->costRows(begin, end);
+}
+
+//matching costs of rows [begin, end), then the paths along them in both directions
+void DisparityEstimator::costRows(unsigned int begin, unsigned int end)
+{
+	int D = numDisparities;
+	short pathA[PATH_STRIDE], pathB[PATH_STRIDE];
+
+	for (unsigned int y = begin; y < end; y++)
+	{
+		const unsigned int* leftCensus = census[0] + y * width;
+		const unsigned int* rightCensus = census[1] + y * width;
+		short* rowCost = cost + y * width * D;
+		short* rowSum = sum + y * width * D;
+
+		//the left pixel x is matched with the right pixel x + shift - disparity
+		for (unsigned int x = 0; x < width; x++)
+		{
+			short* c = rowCost + x * D;
+			int xr = (int)x + shift - dMin;
+			for (int d = 0; d < D; d++, xr--)
+				c[d] = (short)((xr >= 0 && xr < (int)width) ? popcount(leftCensus[x] ^ rightCensus[xr]) : CENSUS_BITS);
+		}
+
+		for (int direction = 0; direction < 2; direction++)
+		{
+			short* prev = pathA + 1;
+			short* cur = pathB + 1;
+			resetPath(prev, D);
+			resetPath(cur, D);
+			int prevMin = 0;
+			for (unsigned int i = 0; i < width; i++)
+			{
+				unsigned int x = (direction == 0) ? i : width - 1 - i;
+				prevMin = pathStep(rowCost + x * D, prev, prevMin, cur, rowSum + x * D, D, direction == 0);
+				short* swap = prev;
+				prev = cur;
+				cur = swap;
+			}
+		}
+	}
+}
+// ----------------------------------------------------------------------------
+
+void DisparityEstimator::verticalTask(void* context, unsigned int begin, unsigned int end)
+{
+	((DisparityEstimator*)context)->verticalPaths(begin, end);
+}
+
+//paths down and up the columns [begin, end); each column has its own pair of path buffers and path minimum
+void DisparityEstimator::verticalPaths(unsigned int begin, unsigned int end)
+{
+	int D = numDisparities;
+	int* prevMin = pathMin + begin;
+
+	for (int direction = 0; direction < 2; direction++)
+	{
+		for (unsigned int x = begin; x < end; x++)
+		{
+			short* buffers = pathScratch + 2 * x * PATH_STRIDE;
+			resetPath(buffers + 1, D);
+			resetPath(buffers + PATH_STRIDE + 1, D);
+			prevMin[x - begin] = 0;
+		}
+
+		for (unsigned int i = 0; i < height; i++)
+		{
+			unsigned int y = (direction == 0) ? i : height - 1 - i;
+			unsigned int index = y * width + begin;
+			for (unsigned int x = begin; x < end; x++, index++)
+			{
+				short* buffers = pathScratch + 2 * x * PATH_STRIDE;
+				short* prev = buffers + (i & 1) * PATH_STRIDE + 1;
+				short* cur = buffers + ((i + 1) & 1) * PATH_STRIDE + 1;
+				prevMin[x - begin] = pathStep(cost + index * D, prev, prevMin[x - begin], cur, sum + index * D, D, false);
+			}
+		}
+	}
+}
+// ----------------------------------------------------------------------------
+
+void DisparityEstimator::selectTask(void* context, unsigned int begin, unsigned int end)
+{
+	((DisparityEstimator*)context)->selectRows(begin, end);
+}
+
+//lowest aggregated cost per pixel, with a uniqueness check and parabolic sub-pixel refinement
+void DisparityEstimator::selectRows(unsigned int begin, unsigned int end)
+{
+	int D = numDisparities;
+
+	for (unsigned int y = begin; y < end; y++)
+	{
+		for (unsigned int x = 0; x < width; x++)
+		{
+			unsigned int index = y * width + x;
+			const short* s = sum + index * D;
+
+			int best = s[0];
+			int bestD = 0;
+			for (int d = 1; d < D; d++)
+			{
+				if (s[d] < best)
+				{
+					best = s[d];
+					bestD = d;
+				}
+			}
+
+			//the best match must be clearly better than any match more than a pixel away from it
+			int second = 0x7FFF;
+			for (int d = 0; d < D; d++)
+			{
+				if ((d < bestD - 1 || d > bestD + 1) && s[d] < second)
+					second = s[d];
+			}
+
+			int disparity = dMin + bestD;
+			int xr = (int)x + shift - disparity;
+			if (second * 100 <= best * (100 + DISPARITY_UNIQUENESS) || xr < 0 || xr >= (int)width)
+			{
+				result[index] = DISPARITY_INVALID;
+				continue;
+			}
+
+			int value = disparity * DISPARITY_SUBPIXEL;
+			if (bestD > 0 && bestD < D - 1)
+			{
+				int l = s[bestD - 1];
+				int r = s[bestD + 1];
+				int curvature = l - 2 * best + r;
+				if (curvature > 0)
+					value += (l - r) * DISPARITY_SUBPIXEL / (2 * curvature);
+			}
+			result[index] = (unsigned short)((value > 0) ? value : 0);
+		}
+	}
+}
+// ----------------------------------------------------------------------------
+
+//narrows the next search to the disparities found now, or goes back to a full search when they run
+//off the edge of the range or too few pixels matched
+void DisparityEstimator::updateRange()
+{
+	unsigned int histogram[DISPARITY_MAX] = { 0 };
+	unsigned int valid = 0;
+	for (unsigned int i = 0; i < width * height; i++)
+	{
+		if (result[i] == DISPARITY_INVALID)
+			continue;
+		unsigned int d = (result[i] + DISPARITY_SUBPIXEL / 2) / DISPARITY_SUBPIXEL;
+		histogram[(d < DISPARITY_MAX) ? d : DISPARITY_MAX - 1]++;
+		valid++;
+	}
+
+	if (valid < width * height / 2)
+	{
+		framesSinceFull = DISPARITY_FULL_INTERVAL;
+		return;
+	}
+
+	//2nd and 98th percentiles
+	int lo = -1, hi = DISPARITY_MAX - 1;
+	unsigned int count = 0;
+	for (int d = 0; d < DISPARITY_MAX; d++)
+	{
+		count += histogram[d];
+		if (lo < 0 && count * 50 > valid)
+			lo = d;
+		if (count * 50 >= valid * 49)
+		{
+			hi = d;
+			break;
+		}
+	}
+
+	//only an edge with more of the full range beyond it can have been run off; with converged cameras most
+	//of the scene sits at the bottom edge of a range starting at 0
+	bool offBottom = lo <= dMin && dMin > 0;
+	bool offTop = hi >= dMin + numDisparities - 1 && dMin + numDisparities < DISPARITY_MAX;
+	bool full = (numDisparities == DISPARITY_MAX);
+	if (!full && (offBottom || offTop))
+	{
+		framesSinceFull = DISPARITY_FULL_INTERVAL;
+		return;
+	}
+
+	int newMin = lo - DISPARITY_RANGE_MARGIN;
+	int range = hi + DISPARITY_RANGE_MARGIN + 1 - newMin;
+	if (range < DISPARITY_MIN_RANGE)
+		range = DISPARITY_MIN_RANGE;
+	range = (range + 7) & ~7;
+	if (range > DISPARITY_MAX)
+		range = DISPARITY_MAX;
+	if (newMin < 0)
+		newMin = 0;
+	if (newMin + range > DISPARITY_MAX)
+		newMin = DISPARITY_MAX - range;
+
+	dMin = newMin;
+	numDisparities = range;
+}
+// ----------------------------------------------------------------------------
+
+//8-bit grey bmp of the map, nearer is brighter; unknown pixels are black
+void DisparityEstimator::saveMap()
+{
+	char path[200];
+	sprintf(path, "%s\\%s-%u_disparity.bmp", baseFilename, baseFilename, frameNum);
+	FILE* pFile = fopen(path, "wb");
+	if (pFile == NULL)
+		return;
+
+	int rowBytes = (width + 3) & ~3;
+	BITMAPINFOHEADER BMIH;
+	memset(&BMIH, 0, sizeof(BMIH));
+	BMIH.biSize = sizeof(BITMAPINFOHEADER);
+	BMIH.biWidth = width;
+	BMIH.biHeight = height;
+	BMIH.biPlanes = 1;
+	BMIH.biBitCount = 8;
+	BMIH.biCompression = BI_RGB;
+	BMIH.biSizeImage = rowBytes * height;
+	BMIH.biClrUsed = 256;
+
+	BITMAPFILEHEADER bmfh;
+	bmfh.bfType = 'B' + ('M' << 8);
+	bmfh.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + 256 * 4;
+	bmfh.bfSize = bmfh.bfOffBits + BMIH.biSizeImage;
+	bmfh.bfReserved1 = bmfh.bfReserved2 = 0;
+
+	fwrite(&bmfh, 1, sizeof(BITMAPFILEHEADER), pFile);
+	fwrite(&BMIH, 1, sizeof(BITMAPINFOHEADER), pFile);
+
+	unsigned char palette[256 * 4];
+	for (int i = 0; i < 256; i++)
+	{
+		palette[4 * i] = palette[4 * i + 1] = palette[4 * i + 2] = (unsigned char)i;
+		palette[4 * i + 3] = 0;
+	}
+	fwrite(palette, 1, sizeof(palette), pFile);
+
+	//bottom-up rows; output is only swapped by this thread, so it can be read without the lock
+	unsigned char* row = new unsigned char[rowBytes];
+	memset(row, 0, rowBytes);
+	for (int y = height - 1; y >= 0; y--)
+	{
+		for (unsigned int x = 0; x < width; x++)
+		{
+			unsigned short d = output[y * width + x];
+			row[x] = (d == DISPARITY_INVALID) ? 0 : (unsigned char)(1 + d * 254 / (DISPARITY_MAX * DISPARITY_SUBPIXEL));
+		}
+		fwrite(row, 1, rowBytes, pFile);
+	}
+	delete[] row;
+	fclose(pFile);
+}
+// ----------------------------------------------------------------------------
+
+DWORD WINAPI DisparityEstimator::workerThread(LPVOID lpThreadParameter)
+{
+	DisparityEstimator* est = (DisparityEstimator*)lpThreadParameter;
+	traceThreadName("disparity");
+	while (true)
+	{
+		WaitForSingleObject(est->work, INFINITE);
+		if (est->stopping)
+			break;
+		est->match();
+		InterlockedExchange(&est->busy, 0);
+		SetEvent(est->done);
+	}
+	return 0;
+}
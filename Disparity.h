@@ -0,0 +1,114 @@
+#ifndef DISPARITY
+#define DISPARITY
+// ============================================================================
+
+//Dense disparity from the stereo pair by semi-global matching at reduced resolution
+//Runs on its own thread next to the display: display() offers each pair, which is
+//taken only when the previous one is finished, and reduced to grey on this thread,
+//so the display never waits for it. Census matching costs are aggregated along four paths with SSE2,
+//rows and columns spread over the shared task pool. The search range follows the
+//disparities found in the previous frames, with a full search every so often.
+//Only disparities 0 to DISPARITY_MAX - 1 are searched, after the ROI shift is taken out: points behind the
+//convergence plane (negative disparity) find no match, or the nearest one at 0
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+#include <stdio.h>
+
+#define		DISPARITY_WIDTH				320		//width of the reduced images that are matched
+#define		DISPARITY_MAX				64		//full search range in reduced pixels, a multiple of 8
+#define		DISPARITY_MIN_RANGE			24		//narrowest search range reused from the previous frame
+#define		DISPARITY_RANGE_MARGIN		4		//added on both sides of the range seen in the previous frame
+#define		DISPARITY_FULL_INTERVAL		30		//frames between full range searches
+#define		DISPARITY_P1				2		//SGM penalty for a disparity change of 1
+#define		DISPARITY_P2				12		//SGM penalty for larger changes
+#define		DISPARITY_UNIQUENESS		10		//percent the best cost must beat the next best by
+#define		DISPARITY_SUBPIXEL			16		//output units per pixel
+#define		DISPARITY_INVALID			0xFFFF	//output where no disparity was found
+
+// ============================================================================
+
+class DisparityEstimator
+{
+public:
+	//maps of recorded frames are saved as <base>\<base>-<frame>_disparity.bmp
+	DisparityEstimator(const char* baseFilename, FILE* log);
+	~DisparityEstimator();
+
+	//offers a stereo pair of RGB (channels 3) or luma (channels 1) images; shift is the left ROI offset minus
+	//the right one, in image pixels. The images are read on the matching thread: they must stay untouched until
+	//it sets *releaseLeft and *releaseRight to 1, or, where those are null, until wait returns.
+	//Returns false (and ignores the pair, leaving the flags alone) while the previous pair is still being matched
+	bool submit(unsigned int frameNum, const unsigned char* leftRGB, const unsigned char* rightRGB,
+		unsigned int cols, unsigned int rows, unsigned int channels, int shift, bool record,
+		volatile LONG* releaseLeft, volatile LONG* releaseRight);
+
+	//copies the newest disparity map (reduced pixels in 1/DISPARITY_SUBPIXEL units, DISPARITY_INVALID where unknown)
+	//into dst if it is given; returns its frame number, or -1 before the first map
+	int getDisparity(unsigned short* dst);
+	//size of the maps returned by getDisparity
+	unsigned int getWidth();
+	unsigned int getHeight();
+
+	//blocks until no pair is being matched
+	void wait();
+
+private:
+	//data
+	unsigned int width, height;		//reduced size
+	unsigned int scale;				//reduction factor
+	int shift;						//ROI offset difference in reduced pixels
+	unsigned int frameNum;
+	bool record;
+	char* baseFilename;
+	FILE* logFile;
+
+	//the pair being matched, until it is reduced
+	const unsigned char* input[2];
+	volatile LONG* inputRelease[2];
+	unsigned int inputCols, inputChannels;
+
+	unsigned char* grey[2];			//reduced left and right images
+	unsigned int* census[2];		//5x5 census transforms
+	short* cost;					//matching cost per pixel and disparity of the current range
+	short* sum;						//costs aggregated over all paths
+	short* pathScratch;				//previous and current path costs, two per column
+	int* pathMin;					//lowest previous path cost, one per column
+	unsigned short* result;			//disparity map being computed
+	unsigned short* output;			//newest finished map
+	int outputFrame;
+
+	//search range of the current frame
+	int dMin;
+	int numDisparities;				//multiple of 8
+	unsigned int framesSinceFull;
+
+	//worker thread
+	HANDLE thread;
+	HANDLE work;					//signalled by submit
+	HANDLE done;					//set while no pair is being matched
+	volatile LONG busy;
+	volatile bool stopping;
+	CRITICAL_SECTION outputLock;
+
+	//private prototypes
+	void allocate(unsigned int w, unsigned int h);
+	void release();
+	void reduce(const unsigned char* pixels, unsigned char* dst, unsigned int cols, unsigned int channels);
+	void match();
+	void costRows(unsigned int begin, unsigned int end);
+	void verticalPaths(unsigned int begin, unsigned int end);
+	void selectRows(unsigned int begin, unsigned int end);
+	void updateRange();
+	void saveMap();
+	static void censusTask(void*, unsigned int, unsigned int);
+	static void costTask(void*, unsigned int, unsigned int);
+	static void verticalTask(void*, unsigned int, unsigned int);
+	static void selectTask(void*, unsigned int, unsigned int);
+	static DWORD WINAPI workerThread(LPVOID);
+};
+
+// ============================================================================
+#endif
@@ -7,15 +7,17 @@
 
 #include "stdafx.h"
 #include "FL3Camera.h"
+#include "SimCamera.h"
+#include "Metrics.h"
+#include "PerfTimer.h"
+#include "TaskPool.h"
+#include "QualityGovernor.h"
+#include "FrameBus.h"
+#include "Trace.h"
+#include "Denoise.h"
+#include "Preroll.h"
 
-//defines for image capture, etc
-#define		IMAGE_WIDTH		1280 //default width to capture
-#define		IMAGE_HEIGHT	720  //default height to capture
-//ROI offset: based off prior calculation of ~18.6% between the cameras and width of 1280
-//400 is from FlyCap, centering the ROI
-#define		OFFSET_RIGHT_DEF	288	 //400 - 238/2 but divisible by 4
-#define		OFFSET_LEFT_DEF		512  //400 + 238/2 but divisible by 4
-#define		OFFSET_VERTICAL		416	 //from FlyCap
+//capture size, frame rate and ROI offsets come from the CAPTURE_PROFILE passed to configure
 
 
 // ============================================================================
@@ -23,7 +25,16 @@
 FL3Camera::FL3Camera()
 {
 	cameraName = "default";
+	eye = 0;
 	bufferInitialized = false;
+	for (int i = 0; i < FRAME_BUFFERS; i++)
+		buffers[i] = 0;
+	image_buffer = 0;
+	bufferBytes = 0;
+	memset(&published, 0, sizeof(published));
+	memset(&current, 0, sizeof(current));
+	heldPixels = 0;
+	heldReleased = 1;
 	frameNum = 0;
 	startTime = 0;
 	prevTime= 0;
@@ -32,12 +43,45 @@ FL3Camera::FL3Camera()
 	acqInProgress = false;
 	newFrame = false;
 	logFile = 0;
+	cam = 0;
+	sim = 0;
+	captureFormat = PIXEL_FORMAT_RAW8;
+	channels = 3;
+	rawOutput = false;
+	packetSize = 0;
+	frameRate = 0;
+	lastFrameTime = 0;
+	InitializeCriticalSection(&controlLock);
+	InitializeCriticalSection(&frameLock);
+	offset = 0;
+	toneTable = 0;
+	currentRaw = 0;
+	rawCols = rawRows = 0;
+	currentBayer = RGGB;
+	kernelsSelected = false;
+	kernelBayer = RGGB;
+	pixelKernel = 0;
+	denoiseSigma = 0;
+	denoiser = 0;
+	captureThread = 0;
+	captureTicks = 0;
+	offsetGeneration = frameGeneration = 0;
+	frameOffset = 0;
 }
 
 FL3Camera::FL3Camera(std::string name, DWORD start, FILE* log)
 {
 	cameraName = name;
+	eye = (name.compare(CAMERA_NAME_LEFT) == 0) ? 0 : 1;
 	bufferInitialized = false;
+	for (int i = 0; i < FRAME_BUFFERS; i++)
+		buffers[i] = 0;
+	image_buffer = 0;
+	bufferBytes = 0;
+	memset(&published, 0, sizeof(published));
+	memset(&current, 0, sizeof(current));
+	heldPixels = 0;
+	heldReleased = 1;
 	frameNum = 0;
 	startTime = start;
 	prevTime = 0;
@@ -46,61 +90,108 @@ FL3Camera::FL3Camera(std::string name, DWORD start, FILE* log)
 	acqInProgress = false;
 	newFrame = false; 
 	logFile = log;
+	cam = 0;
+	sim = 0;
+	captureFormat = PIXEL_FORMAT_RAW8;
+	channels = 3;
+	rawOutput = false;
+	packetSize = 0;
+	frameRate = 0;
+	lastFrameTime = 0;
+	InitializeCriticalSection(&controlLock);
+	InitializeCriticalSection(&frameLock);
+	offset = 0;
+	toneTable = 0;
+	currentRaw = 0;
+	rawCols = rawRows = 0;
+	currentBayer = RGGB;
+	kernelsSelected = false;
+	kernelBayer = RGGB;
+	pixelKernel = 0;
+	denoiseSigma = 0;
+	denoiser = 0;
+	captureThread = 0;
+	captureTicks = 0;
+	offsetGeneration = frameGeneration = 0;
+	frameOffset = 0;
 }
 // ----------------------------------------------------------------------------
 
 
 FL3Camera::~FL3Camera()
 {
+	freeBuffers();
+	DeleteCriticalSection(&controlLock);
+	DeleteCriticalSection(&frameLock);
 	delete cam;
-	delete image_buffer;
+	delete sim;
+	delete[] toneTable;
+	delete denoiser;
 }
 // ----------------------------------------------------------------------------
 
 void FL3Camera::increaseOffset()
 {
-	if (cameraName.compare(CAMERA_NAME_LEFT) == 0)
-	{
-		//shift left image to the right
-		offset = offset + 4;
-	}
-	else
-	{
-		//shift right image to the left
-		offset = offset - 4;
-	}
-	
-	fmt7ImageSettings.offsetX = offset;
-
-	cam->StopCapture();
-	cam->SetFormat7Configuration(
-		&fmt7ImageSettings,
-		fmt7PacketInfo.recommendedBytesPerPacket);
-	cam->StartCapture(callGrabFrame, this);
-
+	moveOffset(1);
 }
 // ----------------------------------------------------------------------------
 
 void FL3Camera::decreaseOffset()
+{
+	moveOffset(-1);
+}
+// ----------------------------------------------------------------------------
+
+LONG FL3Camera::moveOffset(int steps)
 {
 	if (cameraName.compare(CAMERA_NAME_LEFT) == 0)
 	{
-		//shift left image to the left
-		offset = offset - 4;
+		//increasing shifts left image to the right
+		offset = offset + 4 * steps;
 	}
 	else
 	{
-		//shift right image to the right
-		offset = offset + 4;
+		//increasing shifts right image to the left
+		offset = offset - 4 * steps;
 	}
-	fmt7ImageSettings.offsetX = offset;
+	applyOffset();
+	return offsetGeneration;
+}
+// ----------------------------------------------------------------------------
 
-	cam->StopCapture();
-	cam->SetFormat7Configuration(
-		&fmt7ImageSettings,
-		fmt7PacketInfo.recommendedBytesPerPacket);
-	cam->StartCapture(callGrabFrame, this);
+void FL3Camera::setPixelFormat(PixelFormat format)
+{
+	captureFormat = format;
+}
 
+PixelFormat FL3Camera::getPixelFormat()
+{
+	return captureFormat;
+}
+
+void FL3Camera::setMonochrome(bool mono)
+{
+	channels = mono ? 1 : 3;
+}
+
+unsigned int FL3Camera::getChannels()
+{
+	return channels;
+}
+
+void FL3Camera::setRawOutput(bool raw)
+{
+	rawOutput = raw;
+}
+
+BayerTileFormat FL3Camera::getBayerFormat()
+{
+	return currentBayer;
+}
+
+void FL3Camera::setDenoise(int sigma)
+{
+	denoiseSigma = sigma;
 }
 // ----------------------------------------------------------------------------
 
@@ -121,40 +212,158 @@ void FL3Camera::connect(PGRGuid guid)
 		fwrite(buffer, sizeof(char), strlen(buffer), logFile);
 	}
 
-	//initialize
+}
+// ----------------------------------------------------------------------------
+
+void FL3Camera::connectSimulated(SimCamera* source)
+{
+	sim = source;
+
+	char buffer[50];
+	sprintf(buffer,"Connected simulated %s camera\n", cameraName.c_str());
+	printf(buffer);
+	if (logFile != 0)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+	}
+}
+// ----------------------------------------------------------------------------
+
+//sets ROI, pixel format, packet size and frame rate; returns -1 if the camera rejects the profile
+int FL3Camera::configure(const CAPTURE_PROFILE* profile)
+{
+	char buffer[200];
 	Error error;
+	PixelFormat k_fmt7PixFmt = captureFormat;
 
-	//grab a single frame to check how much memory is needed for buffer
-	cam->StartCapture();
-	Image rawImage;
-	error = cam->RetrieveBuffer(&rawImage);
-	cam->StopCapture();
+	if (sim == 0)
+	{
+		// Query for available Format 7 modes
+		Format7Info fmt7Info;
+		bool supported;
+		fmt7Info.mode = profile->mode;
+		error = cam->GetFormat7Info(&fmt7Info, &supported);
+		if (error != PGRERROR_OK)
+		{
+			error.PrintErrorTrace();
+			return -1;
+		}
+		if (!supported)
+			return -1;
 
-	if (error != PGRERROR_OK)
-		error.PrintErrorTrace();
-	// Convert the raw image to RGB format
-	error = rawImage.Convert(PIXEL_FORMAT_RGB, &convertedImage);
-	if (error != PGRERROR_OK)
-		error.PrintErrorTrace();
+		PrintFormat7Capabilities(fmt7Info);
 
-	//initialize buffer
-	if (!bufferInitialized) 
+		//pixel formats are bit flags in pixelFormatBitField
+		if ((fmt7Info.pixelFormatBitField & k_fmt7PixFmt) == 0)
+		{
+			sprintf(buffer,"Pixel format not supported, using RAW8\n");
+			printf(buffer);
+			if (logFile != 0)
+			{
+				fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+			}
+			k_fmt7PixFmt = PIXEL_FORMAT_RAW8;
+			captureFormat = k_fmt7PixFmt;
+		}
+	}
+
+	//the left and right ROIs are offset horizontally for the stereo effect
+	offset = (eye == 0) ? profile->offsetLeft : profile->offsetRight;
+	fmt7ImageSettings.mode = profile->mode;
+	fmt7ImageSettings.offsetX = offset;
+	fmt7ImageSettings.offsetY = profile->offsetVertical;
+	fmt7ImageSettings.width = profile->width;
+	fmt7ImageSettings.height = profile->height;
+	fmt7ImageSettings.pixelFormat = k_fmt7PixFmt;
+
+	// Validate the settings to make sure that they are valid
+	bool valid;
+	if (sim != 0)
+		sim->ValidateFormat7Settings(&fmt7ImageSettings, &valid, &fmt7PacketInfo);
+	else
 	{
-		sprintf(buffer,"Initializing buffer\n");
+		error = cam->ValidateFormat7Settings(&fmt7ImageSettings, &valid, &fmt7PacketInfo);
+		if (error != PGRERROR_OK)
+		{
+			error.PrintErrorTrace();
+			return -1;
+		}
+	}
+	if (!valid)
+	{
+		sprintf(buffer,"%s: Format7 settings of %s are not valid\n", cameraName.c_str(), profile->name);
 		printf(buffer);
 		if (logFile != 0)
 		{
 			fwrite(buffer, sizeof(char), strlen(buffer), logFile);
 		}
-		image_buffer = new unsigned char[convertedImage.GetDataSize()];
-		bufferInitialized = true;
+		return -1;
+	}
+
+	//only as much of the bus as the frame rate needs, leaving the rest to the other camera
+	packetSize = profilePacketSize(profile, k_fmt7PixFmt, &fmt7PacketInfo);
+	if (packetSize == 0)
+	{
+		sprintf(buffer,"%s: %s needs packets larger than %u bytes\n", cameraName.c_str(), profile->name, fmt7PacketInfo.maxBytesPerPacket);
+		printf(buffer);
+		if (logFile != 0)
+		{
+			fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+		}
+		return -1;
 	}
+
+	// Set the settings to the camera
+	frameRate = profile->fps;
+	if (applySettings() != 0)
+		return -1;
+
+	sprintf(buffer,"%s camera: %s, %ux%u at %.0f fps, offset %u, %u byte packets\n", cameraName.c_str(), profile->name,
+		profile->width, profile->height, profile->fps, offset, packetSize);
+	printf(buffer);
+	if (logFile != 0)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+	}
+
+	//grab a single frame to check how much memory is needed for buffer
+	Image rawImage;
+	if (sim != 0)
+	{
+		sim->RetrieveBuffer(&rawImage);
+	}
+	else
+	{
+		cam->StartCapture();
+		error = cam->RetrieveBuffer(&rawImage);
+		cam->StopCapture();
+		if (error != PGRERROR_OK)
+		{
+			error.PrintErrorTrace();
+			return -1;
+		}
+	}
+
+	//the previous profile's buffers may be the wrong size
+	freeBuffers();
+	delete[] toneTable;
+	delete denoiser;
+	toneTable = 0;
+	denoiser = 0;
+	bufferInitialized = false;
+	initBuffer(&rawImage);
+	return 0;
 }
 // ----------------------------------------------------------------------------
 void FL3Camera::start()
 {
 	char buffer[50];
-	cam->StartCapture(callGrabFrame, this);
+	//the watchdog counts the first frame's delay from here
+	lastFrameTime = timeGetTime();
+	if (sim != 0)
+		sim->StartCapture(callGrabFrame, this);
+	else
+		cam->StartCapture(callGrabFrame, this);
 
 	sprintf(buffer,"Started  %s camera\n", cameraName.c_str());
 	printf(buffer);
@@ -169,8 +378,16 @@ int FL3Camera::disconnectCamera()
 	char buffer[50];
 	Error error;
 
+	if (sim != 0)
+	{
+		sim->StopCapture();
+		releaseCaptureThread();
+		return 0;
+	}
+
 	// Stop capturing images
 	error = cam->StopCapture();
+	releaseCaptureThread();
 	if (error != PGRERROR_OK)
 	{
 		error.PrintErrorTrace();
@@ -196,6 +413,60 @@ int FL3Camera::disconnectCamera()
 }
 // ----------------------------------------------------------------------------
 
+//stops capture and brings the camera back with the settings of the last configure, reconnecting real cameras
+//first; the display buffers are kept as they are. Returns -1 if the camera cannot be brought back
+int FL3Camera::restart()
+{
+	char buffer[100];
+	int result = 0;
+	EnterCriticalSection(&controlLock);
+
+	if (sim != 0)
+	{
+		sim->StopCapture();
+		releaseCaptureThread();
+		result = sim->StartCapture(callGrabFrame, this);
+	}
+	else
+	{
+		//either may fail on a camera that has dropped off the bus
+		cam->StopCapture();
+		releaseCaptureThread();
+		cam->Disconnect();
+
+		if (connectCamera(cam_id, cam) != 0 || applySettings() != 0)
+		{
+			result = -1;
+		}
+		else
+		{
+			Error error = cam->StartCapture(callGrabFrame, this);
+			if (error != PGRERROR_OK)
+			{
+				error.PrintErrorTrace();
+				result = -1;
+			}
+		}
+	}
+
+	LeaveCriticalSection(&controlLock);
+
+	sprintf(buffer, (result == 0) ? "Restarted %s camera\n" : "Could not restart %s camera\n", cameraName.c_str());
+	printf(buffer);
+	if (logFile != 0)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+	}
+	return result;
+}
+// ----------------------------------------------------------------------------
+
+DWORD FL3Camera::getLastFrameTime()
+{
+	return lastFrameTime;
+}
+// ----------------------------------------------------------------------------
+
 //grabFrame is called by the callback function indirectly: the Image* is new data, the other array is various data
 void FL3Camera::grabFrame(Image* pImage)
 {
@@ -203,22 +474,42 @@ void FL3Camera::grabFrame(Image* pImage)
 	//set acquisition flag to true
 	//can be used to prevent image being displayed mid-frame
 	acqInProgress = true;
+	traceThreadName(cameraName.c_str());
+	captureThread = GetCurrentThreadId();
+	//capture is stopped while the offset changes, so every frame belongs to one setting
+	frameGeneration = offsetGeneration;
+	frameOffset = fmt7ImageSettings.offsetX;
+	LONGLONG grabStart = perfCounter();
+	captureTicks = grabStart;
 
 	Error error;
 	if (startTime == 0)
 		startTime = timeGetTime();
 	currentTime = timeGetTime();
 
-	// Convert the raw image to RGB format
-	error = pImage->Convert(PIXEL_FORMAT_RGB, &convertedImage);
-	if (error != PGRERROR_OK)
-	{
-		error.PrintErrorTrace();
-	}
+	//previous frame was never picked up by the display
+	if (newFrame)
+		metricAdd(METRIC_CAPTURE_DROPS + eye, 1);
 
-	//get the necessary dimensions
-	PixelFormat pixFormat;
-	convertedImage.GetDimensions(&rows, &cols, &stride, &pixFormat);
+	//keep the raw frame for a pre-roll save, if the pre-roll is open
+	prerollPush(eye, pImage, frameNum, currentTime, frameImageOffset());
+
+	//with the frame bus open the frame is converted straight into the eye's next slot, which other processes and
+	//the display then read in place; the frames the display is showing or has lent out are not written over
+	EnterCriticalSection(&frameLock);
+	unsigned char* slot = frameBusAcquire(eye, bufferBytes, current.pixels, (heldReleased == 0) ? heldPixels : 0);
+	LeaveCriticalSection(&frameLock);
+	if (slot != 0)
+		image_buffer = slot;
+
+	// Convert the raw image to RGB format in image_buffer
+	convertFrame(pImage);
+
+	//hand it to other processes too, if the frame bus is open
+	FrameBusFormat busFormat = rawOutput ? FRAMEBUS_BAYER8 : ((channels == 1) ? FRAMEBUS_LUMA8 : FRAMEBUS_RGB8);
+	LONGLONG busStart = perfCounter();
+	frameBusSeal(eye, cols, rows, stride, busFormat, currentBayer, frameNum, currentTime, frameImageOffset());
+	traceSpan("framebus", busStart, perfCounter(), frameNum);
 
 	//"current" FPS value for just this frame - put in low pass filter
 	double fps = 1 / ((double)(currentTime - prevTime) / 1000);
@@ -237,19 +528,105 @@ void FL3Camera::grabFrame(Image* pImage)
 	prev_fps = fps;
 	prevTime = currentTime;
 
-	//copy image to buffer
-	memcpy(image_buffer, convertedImage.GetData(), convertedImage.GetDataSize());
+	metricAdd(METRIC_CAPTURE_FRAMES + eye, 1);
+	metricSet(METRIC_CAPTURE_FPS + eye, (LONGLONG)(net_fps * 1000));
 
 	//frame is fully acquired
+	lastFrameTime = currentTime;
 	acqInProgress = false;
-	//flag indicating a new frame is available to be displayed
-	newFrame = true;
-
+	//the frame becomes the newest one and the newFrame flag is set
+	publishFrame();
 
+	traceSpan("grab", grabStart, perfCounter(), frameNum);
 	frameNum++;
 }
 // ----------------------------------------------------------------------------
 
+//converts a raw frame to 8-bit RGB (or luma when monochrome, or the RAW8 mosaic itself for raw output) in image_buffer, using the shared task pool if there is one
+//the quality governor picks the demosaic, and half resolution output when the host is overloaded
+void FL3Camera::convertFrame(Image* pImage)
+{
+	LONGLONG convertStart = perfCounter();
+	int quality = getQualityLevel();
+
+	if (isHighBitDepth(pImage->GetPixelFormat()))
+	{
+		//12/16-bit data is tone mapped straight into the display buffer
+		convertHighBitDepth(pImage, quality);
+	}
+	else if (rawOutput)
+	{
+		//the mosaic is demosaiced on the GPU; only the row padding is dropped
+		setRawFrame(pImage);
+		cols = rawCols;
+		rows = rawRows;
+		stride = cols;
+		LONGLONG copyStart = perfCounter();
+		unsigned int rawStride = pImage->GetStride();
+		for (unsigned int y = 0; y < rows; y++)
+			memcpy(image_buffer + y * cols, pImage->GetData() + y * rawStride, cols);
+		LONGLONG copyEnd = perfCounter();
+		traceSpan("copy", copyStart, copyEnd, frameNum);
+		metricObserve(METRIC_COPY_US + eye, (LONGLONG)(perfMs(copyEnd - copyStart) * 1000));
+	}
+	else if (channels == 1)
+	{
+		//luma straight from the mosaic, no demosaic
+		setRawFrame(pImage);
+		bool binned = quality >= QUALITY_BINNED;
+		cols = binned ? rawCols / 2 : rawCols;
+		rows = binned ? rawRows / 2 : rawRows;
+		stride = cols;
+		runKernel(binned ? kernels.binned : kernels.full, rows);
+	}
+	else if (quality >= QUALITY_BINNED)
+	{
+		setRawFrame(pImage);
+		cols = rawCols / 2;
+		rows = rawRows / 2;
+		stride = 3 * cols;
+		runKernel(kernels.binned, rows);
+	}
+	else if (quality == QUALITY_BILINEAR)
+	{
+		setRawFrame(pImage);
+		cols = rawCols;
+		rows = rawRows;
+		stride = 3 * cols;
+		runKernel(kernels.full, rows);
+	}
+	else
+	{
+		//one whole frame conversion by the SDK, written straight into the display buffer. The SDK does not
+		//say its converter may work on parts of one frame from several threads, so it is not split into bands
+		convertSDK(pImage);
+	}
+
+	LONGLONG convertEnd = perfCounter();
+	traceSpan("convert", convertStart, convertEnd, frameNum);
+
+	//denoising is optional: left out at the lowest quality, and started afresh when it comes back
+	if (denoiser != 0 && quality < QUALITY_ESSENTIAL)
+	{
+		denoiser->process(image_buffer, stride, rows);
+		LONGLONG denoiseEnd = perfCounter();
+		traceSpan("denoise", convertEnd, denoiseEnd, frameNum);
+		metricObserve(METRIC_DENOISE_US + eye, (LONGLONG)(perfMs(denoiseEnd - convertEnd) * 1000));
+		convertEnd = denoiseEnd;
+	}
+	else if (denoiser != 0)
+	{
+		denoiser->reset();
+	}
+
+	double convertMs = perfMs(convertEnd - convertStart);
+	metricObserve(METRIC_CONVERT_US + eye, (LONGLONG)(convertMs * 1000));
+	QualityGovernor* governor = getQualityGovernor();
+	if (governor != 0)
+		governor->observe(eye, convertMs);
+}
+// ----------------------------------------------------------------------------
+
 //callGrabFrame is called by the callback function; pCallbackData is a pointer to the FL3Camera object whose grabFrame function should be called
 static void callGrabFrame(Image* pImage, const void* pCallbackData)
 {
@@ -258,25 +635,86 @@ static void callGrabFrame(Image* pImage, const void* pCallbackData)
 }
 // ----------------------------------------------------------------------------
 
+//the buffer, its size and the capture data change together, under frameLock, so the display never pairs one
+//frame's pixels with another's size. The next frame goes into a buffer that is neither the newest, nor shown, nor held
+void FL3Camera::publishFrame()
+{
+	EnterCriticalSection(&frameLock);
+	published.pixels = image_buffer;
+	published.cols = cols;
+	published.rows = rows;
+	published.timestamp = currentTime - startTime;
+	published.captureTicks = captureTicks;
+	published.offset = frameImageOffset();
+	published.generation = frameGeneration;
+	for (int i = 0; i < FRAME_BUFFERS; i++)
+	{
+		if (buffers[i] != published.pixels && buffers[i] != current.pixels && (heldReleased != 0 || buffers[i] != heldPixels))
+		{
+			image_buffer = buffers[i];
+			break;
+		}
+	}
+	//flag indicating a new frame is available to be displayed
+	newFrame = true;
+	LeaveCriticalSection(&frameLock);
+}
+
+void FL3Camera::acquireFrame()
+{
+	EnterCriticalSection(&frameLock);
+	current = published;
+	LeaveCriticalSection(&frameLock);
+}
+
+volatile LONG* FL3Camera::holdFrame()
+{
+	EnterCriticalSection(&frameLock);
+	volatile LONG* release = 0;
+	if (heldReleased != 0)
+	{
+		heldPixels = current.pixels;
+		heldReleased = 0;
+		release = &heldReleased;
+	}
+	LeaveCriticalSection(&frameLock);
+	return release;
+}
+
 //returns pointer to buffer of current image data that should be displayed
 unsigned char* FL3Camera::getBuffer()
 {
 
-	return image_buffer;
+	return current.pixels;
 }
 
 unsigned int FL3Camera::getCols()
 {
-	return cols;
+	return current.cols;
 }
 unsigned int FL3Camera::getRows()
 {
-	return rows;
+	return current.rows;
 }
 
 unsigned long FL3Camera::getTimestamp()
 {
-	return currentTime - startTime;
+	return current.timestamp;
+}
+
+LONGLONG FL3Camera::getCaptureTicks()
+{
+	return current.captureTicks;
+}
+
+unsigned int FL3Camera::getImageOffset()
+{
+	return current.offset;
+}
+
+LONG FL3Camera::getOffsetGeneration()
+{
+	return published.generation;
 }
 
 bool FL3Camera::checkNewFrame()
@@ -292,114 +730,289 @@ void FL3Camera::clearNewFrame()
 // ============================================================================
 //private functions
 
-int FL3Camera::connectCamera(PGRGuid guid, Camera* cam)
+//horizontal ROI offset in pixels of the frame in image_buffer (halved when binned)
+unsigned int FL3Camera::frameImageOffset()
 {
-	char buffer[50];
-	//adapted from CustomImageEx example --> setting resolution and ROI
-	const Mode k_fmt7Mode = MODE_8;
-	const PixelFormat k_fmt7PixFmt = PIXEL_FORMAT_RAW8;
+	return (rawCols > 0) ? frameOffset * cols / rawCols : frameOffset;
+}
+// ----------------------------------------------------------------------------
 
+void FL3Camera::freeBuffers()
+{
+	EnterCriticalSection(&frameLock);
+	for (int i = 0; i < FRAME_BUFFERS; i++)
+	{
+		delete[] buffers[i];
+		buffers[i] = 0;
+	}
+	image_buffer = 0;
+	bufferBytes = 0;
+	memset(&published, 0, sizeof(published));
+	memset(&current, 0, sizeof(current));
+	LeaveCriticalSection(&frameLock);
+}
+// ----------------------------------------------------------------------------
+
+//converts a first frame to find out how much memory the display buffer needs
+void FL3Camera::initBuffer(Image* rawImage)
+{
+	char buffer[50];
 	Error error;
+	unsigned int bufferSize;
 
-	// Connect to a camera
-	error = cam->Connect(&guid);
-	if (error != PGRERROR_OK)
+	if (isHighBitDepth(rawImage->GetPixelFormat()) || channels == 1)
 	{
-		error.PrintErrorTrace();
-		return -1;
+		//8-bit RGB output of the tone mapper, or 8-bit luma
+		bufferSize = channels * rawImage->GetCols() * rawImage->GetRows();
+	}
+	else
+	{
+		// Convert the raw image to RGB format
+		error = rawImage->Convert(PIXEL_FORMAT_RGB, &convertedImage);
+		if (error != PGRERROR_OK)
+			error.PrintErrorTrace();
+		bufferSize = convertedImage.GetDataSize();
 	}
 
-	// Get the camera information
-	CameraInfo camInfo;
-	error = cam->GetCameraInfo(&camInfo);
-	if (error != PGRERROR_OK)
+	//initialize buffer
+	if (!bufferInitialized) 
 	{
-		error.PrintErrorTrace();
-		return -1;
+		sprintf(buffer,"Initializing buffer\n");
+		printf(buffer);
+		if (logFile != 0)
+		{
+			fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+		}
+		//black frames the size of the raw frame are shown until the first one is converted
+		for (int i = 0; i < FRAME_BUFFERS; i++)
+			buffers[i] = new unsigned char[bufferSize]();
+		image_buffer = buffers[0];
+		bufferBytes = bufferSize;
+		EnterCriticalSection(&frameLock);
+		memset(&published, 0, sizeof(published));
+		published.pixels = buffers[FRAME_BUFFERS - 1];
+		published.cols = rawImage->GetCols();
+		published.rows = rawImage->GetRows();
+		current = published;
+		LeaveCriticalSection(&frameLock);
+
+		//the high bit depth kernels tone map through a table, rebuilt when auto exposure moves the curve
+		if (isHighBitDepth(rawImage->GetPixelFormat()))
+		{
+			toneCurveInit(&toneCurve, rawBitDepth(rawImage->GetPixelFormat()));
+			toneTable = new unsigned char[1 << toneCurve.bitDepth];
+			buildToneTable(&toneCurve, toneTable);
+		}
+		//its state is the size of the largest frame, so no quality level needs more
+		if (denoiseSigma > 0)
+			denoiser = new TemporalDenoiser(bufferSize, denoiseSigma);
+		bufferInitialized = true;
 	}
+	//the kernels for this session's format and layout are picked once, here
+	selectKernels(rawImage);
+}
+// ----------------------------------------------------------------------------
 
-	PrintCameraInfo(&camInfo);
+//demosaics (or bins, or takes the luma of) a RAW12/RAW16 frame and tone maps it into image_buffer in one pass
+void FL3Camera::convertHighBitDepth(Image* pImage, int quality)
+{
+	setRawFrame(pImage);
 
-	// Query for available Format 8 modes
-	Format7Info fmt7Info;
-	bool supported;
-	fmt7Info.mode = k_fmt7Mode;
-	error = cam->GetFormat7Info(&fmt7Info, &supported);
-	if (error != PGRERROR_OK)
+	//auto exposure is optional: the curve keeps the last exposure
+	if (quality < QUALITY_ESSENTIAL)
 	{
-		error.PrintErrorTrace();
-		return -1;
+		toneCurveAdapt(&toneCurve, pixelSampleMean(pImage->GetPixelFormat(), &pixelJob));
+		buildToneTable(&toneCurve, toneTable);
 	}
 
-	PrintFormat7Capabilities(fmt7Info);
+	bool binned = quality >= QUALITY_BINNED;
+	cols = binned ? rawCols / 2 : rawCols;
+	rows = binned ? rawRows / 2 : rawRows;
+	stride = channels * cols;
+	runKernel(binned ? kernels.binned : kernels.full, rows);
+}
+// ----------------------------------------------------------------------------
 
-	fmt7ImageSettings.mode = k_fmt7Mode;
-	//if this is the left camera, do the left offset
-	if (cameraName.compare(CAMERA_NAME_LEFT) == 0)
+//records the raw frame the task pool kernels work on
+void FL3Camera::setRawFrame(Image* pImage)
+{
+	currentRaw = pImage;
+	rawCols = pImage->GetCols();
+	rawRows = pImage->GetRows();
+	currentBayer = pImage->GetBayerTileFormat();
+	//a pattern the session did not start with (a changed ROI offset, say) needs other kernels
+	if (currentBayer != kernelBayer)
+		selectKernels(pImage);
+
+	pixelJob.raw = pImage->GetData();
+	pixelJob.rawStride = pImage->GetStride();
+	pixelJob.cols = rawCols;
+	pixelJob.rows = rawRows;
+	pixelJob.out = image_buffer;
+	pixelJob.toneTable = toneTable;
+}
+// ----------------------------------------------------------------------------
+
+//picks the fused kernels from the raw format to the display layout
+void FL3Camera::selectKernels(Image* rawImage)
+{
+	char buffer[100];
+	kernelBayer = rawImage->GetBayerTileFormat();
+	PixelLayout layout = (channels == 1) ? PIXEL_LAYOUT_LUMA : PIXEL_LAYOUT_RGB;
+	kernelsSelected = selectPixelKernels(rawImage->GetPixelFormat(), kernelBayer, layout, rawImage->GetCols(), &kernels);
+	if (!kernelsSelected)
 	{
-		offset = OFFSET_LEFT_DEF;
-		fmt7ImageSettings.offsetX = offset;
-		sprintf(buffer,"Left camera offset \n");
+		sprintf(buffer, "%s camera: no pixel kernels for this format\n", cameraName.c_str());
 		printf(buffer);
 		if (logFile != 0)
 		{
 			fwrite(buffer, sizeof(char), strlen(buffer), logFile);
 		}
 	}
-	//otherwise assume right camera
+}
+// ----------------------------------------------------------------------------
+
+//runs a kernel over outRows rows of image_buffer on the task pool
+void FL3Camera::runKernel(PixelKernel kernel, unsigned int outRows)
+{
+	if (!kernelsSelected)
+		return;
+	pixelKernel = kernel;
+	parallelRows(pixelTask, this, outRows);
+}
+// ----------------------------------------------------------------------------
+
+//task pool kernel; context is the FL3Camera converting the frame
+void FL3Camera::pixelTask(void* context, unsigned int begin, unsigned int end)
+{
+	FL3Camera* camera = (FL3Camera*)context;
+	camera->pixelKernel(&camera->pixelJob, begin, end);
+}
+
+//edge sensing conversion of a RAW8 frame by the SDK into image_buffer. The destination image wraps the
+//display buffer, so the SDK writes the pixels there itself; a copy is only made if it allocated its own
+void FL3Camera::convertSDK(Image* pImage)
+{
+	rows = pImage->GetRows();
+	cols = pImage->GetCols();
+	stride = 3 * cols;
+	Image display(rows, cols, stride, image_buffer, stride * rows, PIXEL_FORMAT_RGB);
+
+	pImage->SetColorProcessing(EDGE_SENSING);
+	Error error = pImage->Convert(PIXEL_FORMAT_RGB, &display);
+	if (error != PGRERROR_OK)
+	{
+		error.PrintErrorTrace();
+		return;
+	}
+
+	if (display.GetData() != image_buffer)
+	{
+		LONGLONG copyStart = perfCounter();
+		for (unsigned int y = 0; y < rows; y++)
+			memcpy(image_buffer + y * stride, display.GetData() + y * display.GetStride(), stride);
+		LONGLONG copyEnd = perfCounter();
+		traceSpan("copy", copyStart, copyEnd, frameNum);
+		metricObserve(METRIC_COPY_US + eye, (LONGLONG)(perfMs(copyEnd - copyStart) * 1000));
+	}
+}
+// ----------------------------------------------------------------------------
+
+//restarts capture with the current ROI offset
+void FL3Camera::applyOffset()
+{
+	//the watchdog may be restarting the camera
+	EnterCriticalSection(&controlLock);
+
+	if (sim != 0)
+	{
+		sim->StopCapture();
+		releaseCaptureThread();
+		fmt7ImageSettings.offsetX = offset;
+		InterlockedIncrement(&offsetGeneration);
+		sim->setOffset(offset);
+		sim->StartCapture(callGrabFrame, this);
+	}
 	else
 	{
-		offset = OFFSET_RIGHT_DEF;
+		cam->StopCapture();
+		releaseCaptureThread();
 		fmt7ImageSettings.offsetX = offset;
-		sprintf(buffer,"Right camera offset \n");
-		printf(buffer);
-		if (logFile != 0)
-		{
-			fwrite(buffer, sizeof(char), strlen(buffer), logFile);
-		}
+		InterlockedIncrement(&offsetGeneration);
+		cam->SetFormat7Configuration(&fmt7ImageSettings, packetSize);
+		cam->StartCapture(callGrabFrame, this);
 	}
-		
-	fmt7ImageSettings.offsetY = OFFSET_VERTICAL;
-	fmt7ImageSettings.width = IMAGE_WIDTH;
-	fmt7ImageSettings.height = IMAGE_HEIGHT;//
-	fmt7ImageSettings.pixelFormat = k_fmt7PixFmt;
+	LeaveCriticalSection(&controlLock);
+}
+// ----------------------------------------------------------------------------
 
-	bool valid;
+//once capture has stopped no more frames arrive on the callback thread, so its task queue and trace buffer can be reused
+void FL3Camera::releaseCaptureThread()
+{
+	if (captureThread != 0)
+	{
+		releaseTaskQueue(captureThread);
+		traceReleaseThread(captureThread);
+		captureThread = 0;
+	}
+}
+// ----------------------------------------------------------------------------
 
-	// Validate the settings to make sure that they are valid
-	error = cam->ValidateFormat7Settings(
-		&fmt7ImageSettings,
-		&valid,
-		&fmt7PacketInfo);
+//sends the Format7 settings, packet size and frame rate to the camera; returns -1 if it rejects them
+int FL3Camera::applySettings()
+{
+	if (sim != 0)
+	{
+		if (sim->SetFormat7Configuration(&fmt7ImageSettings, packetSize) != 0)
+			return -1;
+		sim->SetFrameRate(frameRate);
+		return 0;
+	}
+
+	Error error = cam->SetFormat7Configuration(&fmt7ImageSettings, packetSize);
 	if (error != PGRERROR_OK)
 	{
 		error.PrintErrorTrace();
 		return -1;
 	}
 
-	if (!valid)
+	Property frameRateProperty(FRAME_RATE);
+	frameRateProperty.absControl = true;
+	frameRateProperty.onOff = true;
+	frameRateProperty.autoManualMode = false;
+	frameRateProperty.absValue = (float)frameRate;
+	error = cam->SetProperty(&frameRateProperty);
+	if (error != PGRERROR_OK)
+		error.PrintErrorTrace();
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+int FL3Camera::connectCamera(PGRGuid guid, Camera* cam)
+{
+	//adapted from CustomImageEx example
+	Error error;
+
+	// Connect to a camera
+	error = cam->Connect(&guid);
+	if (error != PGRERROR_OK)
 	{
-		// Settings are not valid
-		sprintf(buffer,"Format7 settings are not valid\n");
-		printf(buffer);
-		if (logFile != 0)
-		{
-			fwrite(buffer, sizeof(char), strlen(buffer), logFile);
-		}
+		error.PrintErrorTrace();
 		return -1;
 	}
 
-	// Set the settings to the camera
-	error = cam->SetFormat7Configuration(
-		&fmt7ImageSettings,
-		fmt7PacketInfo.recommendedBytesPerPacket);
+	// Get the camera information
+	CameraInfo camInfo;
+	error = cam->GetCameraInfo(&camInfo);
 	if (error != PGRERROR_OK)
 	{
 		error.PrintErrorTrace();
 		return -1;
 	}
 
+	PrintCameraInfo(&camInfo);
 
+	//Format7 mode, ROI and frame rate are set by configure
 	return 0;
 }
 // ----------------------------------------------------------------------------
@@ -11,6 +11,8 @@
 //#pragma once
 
 #include "FlyCapture2.h"
+#include "PixelPipeline.h"
+#include "CaptureProfile.h"
 #include <GL/freeglut.h>
 #include <ctime>  
 #include <string>
@@ -18,9 +20,25 @@
 
 #define		CAMERA_NAME_LEFT	"Left"  //string for name of left camera
 #define		CAMERA_NAME_RIGHT	"Right" //string for name of left camera
+#define		FRAME_BUFFERS		4		//display buffers: the one being converted into, the newest frame, the one shown, one held
 
 using namespace FlyCapture2;
 
+class SimCamera;
+class TemporalDenoiser;
+
+//a converted frame and what was captured with it, published as one so the display never sees a buffer
+//with the size or offset of another frame
+struct FRAME_VIEW
+{
+	unsigned char* pixels;
+	unsigned int cols, rows;
+	unsigned long timestamp;	//ms since start of execution
+	LONGLONG captureTicks;		//perfCounter() when the frame arrived
+	unsigned int offset;		//horizontal ROI offset in pixels of the frame
+	LONG generation;			//offset changes applied before the frame was captured
+};
+
 // ============================================================================
 
 class FL3Camera
@@ -30,10 +48,33 @@ public:
 	FL3Camera(std::string, DWORD, FILE*);
 	~FL3Camera();
 	
+	//selects the raw format to capture (RAW8, RAW12 or RAW16); call before connect
+	void setPixelFormat(PixelFormat);
+	//returns the raw format; RAW8 after configure if the camera does not support the requested one
+	PixelFormat getPixelFormat();
+	//selects 1-byte luma output instead of RGB; call before configure
+	void setMonochrome(bool);
+	//returns bytes per pixel of the display buffer: 1 when monochrome, otherwise 3
+	unsigned int getChannels();
+	//passes RAW8 frames through undemosaiced (1 byte per pixel, for the shader demosaic); call before configure
+	void setRawOutput(bool);
+	//returns the Bayer pattern of the current raw frame
+	BayerTileFormat getBayerFormat();
+	//filters out sensor noise of about sigma grey levels over time (0 turns it off); call before configure
+	void setDenoise(int sigma);
+
 	void connect(PGRGuid);
+	//uses a stand-in camera instead of hardware; FL3Camera takes ownership of it
+	void connectSimulated(SimCamera*);
+	//applies a capture profile after connecting and sizes the buffers for it; returns -1 if the camera rejects it
+	int configure(const CAPTURE_PROFILE*);
 	void start();
 
 	int disconnectCamera();
+	//stops capture and brings the camera back with the current settings, keeping the buffers; for the watchdog
+	int restart();
+	//returns timeGetTime() when the last frame was converted, or when capture started if none has been
+	DWORD getLastFrameTime();
 
 	//returns value of newFrame flag
 	bool checkNewFrame(); 
@@ -42,6 +83,17 @@ public:
 
 	//grabFrame is called indirectly by the callback function: the Image* is new data
 	void grabFrame(Image*);
+	//converts a raw frame into the display buffer being filled; the conversion step of grabFrame
+	void convertFrame(Image*);
+	//makes the frame convertFrame just wrote the newest one and sets the newFrame flag; the next frame
+	//is converted into another buffer. grabFrame calls it after the conversion
+	void publishFrame();
+	//makes the newest published frame the current one, which the getters below describe until the next
+	//call; the display calls it once per pair, so everything it reads belongs to the same frame
+	void acquireFrame();
+	//keeps the current frame's buffer out of the conversions until *release is set to 1, so another thread can
+	//read it after the display has moved on; returns null while an earlier hold is not released
+	volatile LONG* holdFrame();
 
 	//returns buffer of current image data that should be displayed
 	unsigned char* getBuffer();
@@ -51,38 +103,90 @@ public:
 	unsigned int getRows();
 	//returns timestamp in ms (since start of execution) of current frame
 	unsigned long getTimestamp();
+	//returns perfCounter() when the current frame arrived, for sub-millisecond comparisons
+	LONGLONG getCaptureTicks();
+	//returns horizontal ROI offset in pixels of current frame (halved when binned)
+	unsigned int getImageOffset();
+	//returns the number of offset changes applied before the newest published frame was captured, which
+	//the display checks before acquiring it; the frames of two cameras given the same changes have the
+	//same spacing when this matches
+	LONG getOffsetGeneration();
 
 	//increases offset between images
 	void increaseOffset();
 	//decreases offset between images
 	void decreaseOffset();
+	//moves the offset by steps increases (negative for decreases) with one capture restart, which blocks
+	//until the camera streams again; called off the display thread. Returns the offset generation the
+	//camera's frames have from then on
+	LONG moveOffset(int steps);
 
 private:
 	//data
 	Camera* cam;
-	unsigned char* image_buffer;
-	unsigned int cols, rows, stride;
+	SimCamera* sim;		//stand-in source; used instead of cam when not null
+	unsigned char* buffers[FRAME_BUFFERS];
+	unsigned int bufferBytes;		//size of each of buffers
+	unsigned char* image_buffer;	//the buffer being converted into, one of buffers or a frame bus slot; never the
+									//published or the current one
+	unsigned int cols, rows, stride;	//of the frame in image_buffer
+	FRAME_VIEW published;		//newest converted frame
+	FRAME_VIEW current;			//frame the display acquired
+	unsigned char* heldPixels;	//buffer of holdFrame, until heldReleased is set
+	volatile LONG heldReleased;
+	CRITICAL_SECTION frameLock;	//guards published, current and the hold
+	unsigned int channels;	//bytes per pixel of image_buffer
+	bool rawOutput;			//image_buffer holds the RAW8 mosaic instead of a conversion
 	PGRGuid cam_id;
 	std::string cameraName;
+	int eye;				//0 for the left camera, 1 for the right; indexes per-eye metrics
 	bool bufferInitialized;
 	int frameNum;
 
 	//for adjusting stereoscopic effect
 	unsigned int offset;
+	volatile LONG offsetGeneration;	//offset changes applied to the camera
+	LONG frameGeneration;		//offsetGeneration when the current frame was captured
+	unsigned int frameOffset;	//offset the current frame was captured at
 	Format7ImageSettings fmt7ImageSettings;
 	Format7PacketInfo fmt7PacketInfo;
+	unsigned int packetSize;	//bytes per packet; sets this camera's share of the bus
+	double frameRate;			//frame rate of the capture profile
+	CRITICAL_SECTION controlLock;	//serializes capture restarts (offset changes, watchdog recovery)
 
 	//for calculating framerate
 	DWORD startTime;			//time first frame was captured
 	DWORD prevTime;			//time previous frame was captured - for FPS calculation
 	double net_fps, prev_fps;	//variables for calculating FPS through low pass filter
 	DWORD currentTime;		//timestamp for current frame
+	LONGLONG captureTicks;	//perfCounter() when the current frame arrived
+	volatile DWORD lastFrameTime;	//currentTime once the frame is converted; read by the watchdog
+	DWORD captureThread;		//thread the frames are delivered on; each StartCapture starts a new one
 
 	FILE* logFile;		//pointer to file for saving print statements
 
 
 	//to hold the newly converted image each timestep
 	Image convertedImage;
+
+	//high bit depth path (RAW12/RAW16)
+	PixelFormat captureFormat;	//format requested from the camera
+	TONE_CURVE toneCurve;
+	unsigned char* toneTable;	//display value of each sensor value under toneCurve
+
+	//temporal denoise of the converted frames
+	int denoiseSigma;			//0 when off
+	TemporalDenoiser* denoiser;	//sized by initBuffer
+
+	//state of the conversion in progress, read by the task pool kernels
+	Image* currentRaw;
+	unsigned int rawCols, rawRows;	//size of currentRaw; cols and rows are the output size
+	BayerTileFormat currentBayer;
+	PIXEL_KERNELS kernels;			//selected for the capture format, kernelBayer and channels
+	bool kernelsSelected;
+	BayerTileFormat kernelBayer;
+	PIXEL_JOB pixelJob;				//the frame for pixelKernel
+	PixelKernel pixelKernel;
 	//flag for image being aquired
 	bool acqInProgress;
 	//flag for new image to display
@@ -90,6 +194,18 @@ private:
 
 	//private prototypes
 	int connectCamera(FlyCapture2::PGRGuid, FlyCapture2::Camera*);
+	void initBuffer(Image*);
+	void freeBuffers();
+	unsigned int frameImageOffset();
+	void convertHighBitDepth(Image*, int quality);
+	void setRawFrame(Image*);
+	void convertSDK(Image*);
+	void selectKernels(Image*);
+	void runKernel(PixelKernel, unsigned int outRows);
+	static void pixelTask(void*, unsigned int, unsigned int);
+	void applyOffset();
+	void releaseCaptureThread();
+	int applySettings();
 	void PrintCameraInfo(FlyCapture2::CameraInfo*);
 	void PrintFormat7Capabilities(Format7Info);
 
@@ -0,0 +1,309 @@
+
+//Shared memory frame bus
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "FrameBus.h"
+#include "Metrics.h"
+#include "PerfTimer.h"
+#include <mmsystem.h>
+#include <conio.h>
+
+#define		READER_INTERVAL		1000	//ms between reader reports
+#define		READER_POLL_MS		2		//reader sleep between looks for new frames
+
+static HANDLE busMapping = 0;
+static FRAMEBUS_SEGMENT* bus = 0;
+static int writing[2] = { -1, -1 };	//slot each eye is converting into, -1 when none
+static int lastSlot[2];				//slot of each eye's last frameBusAcquire
+
+//pixels of slot i of an eye
+static unsigned char* slotPixels(const FRAMEBUS_SEGMENT* segment, int eye, int i)
+{
+	return (unsigned char*)segment + segment->dataOffset + (size_t)(eye * segment->slotsPerEye + i) * segment->slotBytes;
+}
+
+// ============================================================================
+//writer
+
+bool frameBusOpen(unsigned int slotBytes)
+{
+	frameBusClose();
+
+	slotBytes = (slotBytes + FRAMEBUS_PAGE - 1) & ~(FRAMEBUS_PAGE - 1);
+	DWORD dataOffset = (sizeof(FRAMEBUS_SEGMENT) + FRAMEBUS_PAGE - 1) & ~(FRAMEBUS_PAGE - 1);
+	DWORD size = dataOffset + 2 * FRAMEBUS_SLOTS * slotBytes;
+
+	busMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, FRAMEBUS_SEGMENT_NAME);
+	if (busMapping != 0)
+		bus = (FRAMEBUS_SEGMENT*)MapViewOfFile(busMapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (bus == 0)
+	{
+		printf("Could not create the shared frame bus (%lu bytes)\n", size);
+		if (busMapping != 0)
+			CloseHandle(busMapping);
+		busMapping = 0;
+		return false;
+	}
+
+	//publish the layout last so a reader never sees a valid magic with a partial header
+	memset(bus, 0, sizeof(FRAMEBUS_SEGMENT));
+	bus->slotsPerEye = FRAMEBUS_SLOTS;
+	bus->slotSize = sizeof(FRAMEBUS_SLOT);
+	bus->slotBytes = slotBytes;
+	bus->dataOffset = dataOffset;
+	bus->processId = GetCurrentProcessId();
+	bus->version = FRAMEBUS_VERSION;
+	for (int eye = 0; eye < 2; eye++)
+	{
+		writing[eye] = -1;
+		lastSlot[eye] = FRAMEBUS_SLOTS - 1;
+	}
+	MemoryBarrier();
+	bus->magic = FRAMEBUS_MAGIC;
+
+	printf("Frame bus %s: %d slots of %u bytes per eye\n", FRAMEBUS_SEGMENT_NAME, FRAMEBUS_SLOTS, slotBytes);
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+void frameBusClose()
+{
+	if (bus != 0)
+	{
+		bus->magic = 0;
+		UnmapViewOfFile(bus);
+		CloseHandle(busMapping);
+	}
+	bus = 0;
+	busMapping = 0;
+}
+// ----------------------------------------------------------------------------
+
+unsigned char* frameBusAcquire(int eye, unsigned int bytes, const unsigned char* keep0, const unsigned char* keep1)
+{
+	if (bus == 0 || bytes > (unsigned int)bus->slotBytes)
+		return 0;
+
+	//the oldest slot not in use; only this eye's capture thread writes them
+	for (int n = 1; n <= FRAMEBUS_SLOTS; n++)
+	{
+		int i = (lastSlot[eye] + n) % FRAMEBUS_SLOTS;
+		unsigned char* pixels = slotPixels(bus, eye, i);
+		if ((bus->published[eye] > 0 && i == bus->latest[eye]) || pixels == keep0 || pixels == keep1)
+			continue;
+
+		//odd: readers of the frame that was here will see it change
+		InterlockedIncrement(&bus->slots[eye][i].sequence);
+		lastSlot[eye] = i;
+		writing[eye] = i;
+		return pixels;
+	}
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+void frameBusSeal(int eye, unsigned int cols, unsigned int rows, unsigned int stride,
+	FrameBusFormat format, int bayer, unsigned int frameNum, DWORD captureTime, unsigned int offset)
+{
+	if (bus == 0 || writing[eye] < 0)
+		return;
+	LONGLONG start = perfCounter();
+
+	int i = writing[eye];
+	FRAMEBUS_SLOT* slot = &bus->slots[eye][i];
+	writing[eye] = -1;
+	slot->eye = eye;
+	slot->frameNum = frameNum;
+	slot->captureTime = captureTime;
+	slot->cols = cols;
+	slot->rows = rows;
+	slot->stride = stride;
+	slot->format = format;
+	slot->bayer = bayer;
+	slot->offset = offset;
+	//even again, then make it the latest
+	InterlockedIncrement(&slot->sequence);
+	InterlockedExchange(&bus->latest[eye], i);
+	InterlockedIncrement(&bus->published[eye]);
+
+	metricAdd(METRIC_FRAMEBUS_FRAMES + eye, 1);
+	metricObserve(METRIC_FRAMEBUS_US, (LONGLONG)(perfMs(perfCounter() - start) * 1000));
+}
+
+// ============================================================================
+//reader
+
+FrameBusReader::FrameBusReader()
+{
+	mapping = 0;
+	segment = 0;
+}
+// ----------------------------------------------------------------------------
+
+FrameBusReader::~FrameBusReader()
+{
+	close();
+}
+// ----------------------------------------------------------------------------
+
+bool FrameBusReader::open()
+{
+	close();
+	mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, FRAMEBUS_SEGMENT_NAME);
+	if (mapping == 0)
+		return false;
+
+	//the whole segment; its size is only known from the header
+	segment = (const FRAMEBUS_SEGMENT*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (segment == 0 || segment->magic != FRAMEBUS_MAGIC || segment->version != FRAMEBUS_VERSION
+		|| segment->slotSize != sizeof(FRAMEBUS_SLOT) || segment->slotsPerEye != FRAMEBUS_SLOTS)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+void FrameBusReader::close()
+{
+	if (segment != 0)
+		UnmapViewOfFile(segment);
+	if (mapping != 0)
+		CloseHandle(mapping);
+	segment = 0;
+	mapping = 0;
+}
+// ----------------------------------------------------------------------------
+
+bool FrameBusReader::isLive()
+{
+	return segment != 0 && segment->magic == FRAMEBUS_MAGIC;
+}
+// ----------------------------------------------------------------------------
+
+const FRAMEBUS_SLOT* FrameBusReader::latest(int eye, const unsigned char** pixels, LONG* sequence)
+{
+	if (segment == 0)
+		return 0;
+
+	//a slot being written is one the writer has lapped us to; the one it just published is newer
+	for (int attempt = 0; attempt < FRAMEBUS_SLOTS; attempt++)
+	{
+		if (segment->published[eye] == 0)
+			return 0;
+		int i = segment->latest[eye];
+		if (i < 0 || i >= FRAMEBUS_SLOTS)
+			return 0;
+		const FRAMEBUS_SLOT* slot = &segment->slots[eye][i];
+		LONG seq = slot->sequence;
+		//the header and pixels are read after the sequence
+		MemoryBarrier();
+		if ((seq & 1) == 0)
+		{
+			*sequence = seq;
+			*pixels = slotPixels(segment, eye, i);
+			return slot;
+		}
+	}
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+bool FrameBusReader::check(const FRAMEBUS_SLOT* slot, LONG sequence)
+{
+	//everything read from the slot is read before the sequence is looked at again
+	MemoryBarrier();
+	return slot->sequence == sequence;
+}
+// ----------------------------------------------------------------------------
+
+bool FrameBusReader::fits(LONG rows, LONG stride)
+{
+	return rows > 0 && stride > 0 && (LONGLONG)rows * stride <= segment->slotBytes;
+}
+
+// ============================================================================
+//reader mode
+
+int runFrameBusReader()
+{
+	FrameBusReader reader;
+	if (!reader.open())
+	{
+		printf("No running instance is publishing frames (%s)\n", FRAMEBUS_SEGMENT_NAME);
+		return -1;
+	}
+
+	LONG lastFrame[2] = { -1, -1 };
+	unsigned int frames[2] = { 0, 0 }, torn[2] = { 0, 0 };
+	double latency[2] = { 0, 0 };
+	unsigned int checksum = 0;
+	DWORD reportTime = timeGetTime();
+
+	printf("Reading frames; press any key to stop\n");
+	while (!_kbhit())
+	{
+		if (!reader.isLive())
+		{
+			printf("Instance exited\n");
+			break;
+		}
+
+		for (int eye = 0; eye < 2; eye++)
+		{
+			const unsigned char* pixels;
+			LONG sequence;
+			const FRAMEBUS_SLOT* slot = reader.latest(eye, &pixels, &sequence);
+			if (slot == 0 || slot->frameNum == lastFrame[eye])
+				continue;
+
+			//the header is copied once and its size checked before it is used: a slot being rewritten may hold anything
+			const volatile FRAMEBUS_SLOT* header = slot;
+			LONG frameNum = header->frameNum;
+			DWORD captureTime = header->captureTime;
+			LONG rows = header->rows, stride = header->stride;
+			if (!reader.fits(rows, stride))
+			{
+				torn[eye]++;
+				continue;
+			}
+
+			//stands in for a consumer: touches every row of the frame where it lies
+			for (LONG y = 0; y < rows; y++)
+				checksum += pixels[y * stride] + pixels[y * stride + stride - 1];
+
+			if (!reader.check(slot, sequence))
+			{
+				torn[eye]++;
+				continue;
+			}
+			lastFrame[eye] = frameNum;
+			frames[eye]++;
+			latency[eye] += timeGetTime() - captureTime;
+		}
+
+		DWORD now = timeGetTime();
+		if (now - reportTime >= READER_INTERVAL)
+		{
+			double seconds = (double)(now - reportTime) / 1000;
+			for (int eye = 0; eye < 2; eye++)
+			{
+				printf("%-5s %6.1f frames/s  latency %5.1f ms  %u torn  last frame %ld\n", (eye == 0) ? "left" : "right",
+					frames[eye] / seconds, (frames[eye] > 0) ? latency[eye] / frames[eye] : 0.0, torn[eye], lastFrame[eye]);
+				frames[eye] = torn[eye] = 0;
+				latency[eye] = 0;
+			}
+			reportTime = now;
+		}
+		Sleep(READER_POLL_MS);
+	}
+
+	//keeps the reads from being optimized away
+	if (checksum == 1)
+		printf("\n");
+	return 0;
+}
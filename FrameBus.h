@@ -0,0 +1,113 @@
+#ifndef FRAME_BUS
+#define FRAME_BUS
+// ============================================================================
+
+//Shared memory frame bus for other processes on the workstation (tracking, annotation)
+//Each eye has a ring of fixed size slots in a named segment. The capture thread converts
+//each frame straight into the eye's next free slot and publishes it with a seqlock: the
+//slot's sequence number is odd while it is written and advances by 2 per frame. The
+//display shows the frames from the slots too, so publishing copies nothing; slots it is
+//still showing, or has lent to the depth thread, are passed over. Readers use the pixels
+//in place and check the sequence afterwards, so any number of them can read without
+//copies or locks, and the capture path never waits for one. A reader has FRAMEBUS_SLOTS - 3
+//frame intervals to finish with a frame before it is overwritten
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+
+#define		FRAMEBUS_SEGMENT_NAME	"Local\\RavenStereoFrames"
+#define		FRAMEBUS_MAGIC			0x42465652	//"RVFB"
+#define		FRAMEBUS_VERSION		2			//bump when the segment layout changes
+#define		FRAMEBUS_SLOTS			6			//frames per eye in the ring
+#define		FRAMEBUS_PAGE			4096		//pixel data of every slot starts on a page
+
+//contents of a slot's pixels
+enum FrameBusFormat
+{
+	FRAMEBUS_RGB8,		//3 bytes per pixel
+	FRAMEBUS_LUMA8,		//1 byte of grey per pixel (-mono)
+	FRAMEBUS_BAYER8		//1 byte RAW8 mosaic per pixel (-shader), pattern in bayer
+};
+
+//one frame as laid out in the shared segment
+struct FRAMEBUS_SLOT
+{
+	volatile LONG sequence;		//odd while the writer fills the slot
+	LONG eye;					//0 left, 1 right
+	LONG frameNum;				//the camera's frame count
+	DWORD captureTime;			//timeGetTime() when the frame arrived; the clock is shared by all processes
+	LONG cols, rows, stride;	//stride in bytes
+	LONG format;				//FrameBusFormat
+	LONG bayer;					//FlyCapture2 BayerTileFormat of FRAMEBUS_BAYER8 frames
+	LONG offset;				//horizontal ROI offset on the sensor, for the stereo geometry
+	LONG pad[6];
+};
+
+struct FRAMEBUS_SEGMENT
+{
+	LONG magic;
+	LONG version;
+	LONG slotsPerEye;
+	LONG slotSize;						//sizeof(FRAMEBUS_SLOT), so readers can check the layout
+	LONG slotBytes;						//pixel bytes reserved for each slot
+	LONG dataOffset;					//bytes from the segment start to the pixels of the first slot
+	DWORD processId;					//writer process
+	volatile LONG published[2];			//frames published per eye
+	volatile LONG latest[2];			//slot of each eye's newest frame, once published is not 0
+	FRAMEBUS_SLOT slots[2][FRAMEBUS_SLOTS];
+};
+
+// ============================================================================
+//writer
+
+//creates the shared segment with room for frames of up to slotBytes; returns false if that fails
+bool frameBusOpen(unsigned int slotBytes);
+//withdraws and releases the segment
+void frameBusClose();
+//returns the pixels of the eye's next slot for a frame of up to bytes to be converted into, and marks the slot
+//as being written; the newest frame and the slots keep0 and keep1 (frames still in use, or null) are passed over.
+//Returns null if the bus is not open or the frame does not fit. Called by each camera's capture thread, one
+//writer per eye
+unsigned char* frameBusAcquire(int eye, unsigned int bytes, const unsigned char* keep0, const unsigned char* keep1);
+//publishes the frame written into the slot of the last frameBusAcquire; does nothing if that returned null
+void frameBusSeal(int eye, unsigned int cols, unsigned int rows, unsigned int stride,
+	FrameBusFormat format, int bayer, unsigned int frameNum, DWORD captureTime, unsigned int offset);
+
+// ============================================================================
+//reader
+
+class FrameBusReader
+{
+public:
+	FrameBusReader();
+	~FrameBusReader();
+
+	//maps the segment of a running instance; returns false if there is none or its layout is unknown
+	bool open();
+	void close();
+	//true while the writer has the segment published
+	bool isLive();
+
+	//returns the newest complete frame of an eye and its pixels, or null if there is none yet. Pass
+	//the sequence to check() when done with the frame; the slot may be rewritten at any time
+	const FRAMEBUS_SLOT* latest(int eye, const unsigned char** pixels, LONG* sequence);
+	//true if the frame was not overwritten while it was read, so what was read is consistent
+	bool check(const FRAMEBUS_SLOT* slot, LONG sequence);
+	//true if rows of stride bytes lie inside a slot. The header of a slot being rewritten can hold another
+	//frame's size or garbage, so sizes read from it are checked with this before any pixel is touched
+	bool fits(LONG rows, LONG stride);
+
+private:
+	//data
+	HANDLE mapping;
+	const FRAMEBUS_SEGMENT* segment;
+};
+
+//reads the frames of a running instance and prints per-eye rates, latency and torn reads once a second
+//until a key is pressed (Raven_Stereoscopic.exe -busread)
+int runFrameBusReader();
+
+// ============================================================================
+#endif
@@ -0,0 +1,511 @@
+
+//Draws both eyes side by side in one draw call
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "GLCompositor.h"
+#include "Metrics.h"
+#include "PerfTimer.h"
+#include <stdlib.h>
+
+#define		VERIFY_TIMING_FRAMES	60		//frames drawn by each path for the timing
+#define		VERIFY_ISSUE_TOLERANCE	0.05	//fraction the single draw's issue time may exceed the immediate path's by, for timer noise
+
+//attribute locations, bound before linking
+#define		ATTRIB_POSITION			0
+#define		ATTRIB_TEXCOORD			1
+#define		ATTRIB_EYE				2
+#define		VERTEX_FLOATS			5		//x, y, s, t, eye
+
+static const char* vertexSource =
+	"#version 120\n"
+	"attribute vec2 position;\n"		//normalized device coordinates
+	"attribute vec2 texCoord;\n"
+	"attribute float eye;\n"			//0 on the quad showing the left eye, 1 on the right eye's
+	"varying vec2 uv;\n"
+	"varying float rightEye;\n"
+	"void main()\n"
+	"{\n"
+	"	uv = texCoord;\n"
+	"	rightEye = eye;\n"
+	"	gl_Position = vec4(position, 0.0, 1.0);\n"
+	"}\n";
+
+//luma textures sample as (l, l, l, 1), as the fixed function pipeline shows them
+static const char* fragmentSource =
+	"#version 120\n"
+	"uniform sampler2D leftImage;\n"
+	"uniform sampler2D rightImage;\n"
+	"varying vec2 uv;\n"
+	"varying float rightEye;\n"
+	"void main()\n"
+	"{\n"
+	"	gl_FragColor = (rightEye > 0.5) ? texture2D(rightImage, uv) : texture2D(leftImage, uv);\n"
+	"}\n";
+
+//two quads as triangles, top left origin for the images: the right eye on the left half, the left eye on the right half
+static const GLfloat vertices[12 * VERTEX_FLOATS] = {
+	-1.0f,  1.0f, 0.0f, 0.0f, 1.0f,
+	-1.0f, -1.0f, 0.0f, 1.0f, 1.0f,
+	 0.0f, -1.0f, 1.0f, 1.0f, 1.0f,
+	-1.0f,  1.0f, 0.0f, 0.0f, 1.0f,
+	 0.0f, -1.0f, 1.0f, 1.0f, 1.0f,
+	 0.0f,  1.0f, 1.0f, 0.0f, 1.0f,
+
+	 0.0f,  1.0f, 0.0f, 0.0f, 0.0f,
+	 0.0f, -1.0f, 0.0f, 1.0f, 0.0f,
+	 1.0f, -1.0f, 1.0f, 1.0f, 0.0f,
+	 0.0f,  1.0f, 0.0f, 0.0f, 0.0f,
+	 1.0f, -1.0f, 1.0f, 1.0f, 0.0f,
+	 1.0f,  1.0f, 1.0f, 0.0f, 0.0f };
+
+// ============================================================================
+//public functions
+GLCompositor::GLCompositor()
+{
+	program = 0;
+	vertexBuffer = 0;
+	textures[0] = textures[1] = 0;
+	texCols[0] = texCols[1] = 0;
+	texRows[0] = texRows[1] = 0;
+	format = GL_RGB;
+}
+// ----------------------------------------------------------------------------
+
+GLCompositor::~GLCompositor()
+{
+	if (program != 0)
+	{
+		unbind();
+		glDeleteProgram(program);
+	}
+	if (vertexBuffer != 0)
+		glDeleteBuffers(1, &vertexBuffer);
+	if (textures[0] != 0)
+		glDeleteTextures(2, textures);
+}
+// ----------------------------------------------------------------------------
+
+bool GLCompositor::init(int channels)
+{
+	if (!glCompositorSupported())
+	{
+		printf("Single draw compositor needs OpenGL 2.0\n");
+		return false;
+	}
+	format = (channels == 1) ? GL_LUMINANCE : GL_RGB;
+
+	GLuint vertex = compile(GL_VERTEX_SHADER, vertexSource);
+	GLuint fragment = compile(GL_FRAGMENT_SHADER, fragmentSource);
+	if (vertex == 0 || fragment == 0)
+		return false;
+
+	program = glCreateProgram();
+	glAttachShader(program, vertex);
+	glAttachShader(program, fragment);
+	glBindAttribLocation(program, ATTRIB_POSITION, "position");
+	glBindAttribLocation(program, ATTRIB_TEXCOORD, "texCoord");
+	glBindAttribLocation(program, ATTRIB_EYE, "eye");
+	glLinkProgram(program);
+	//the program keeps them
+	glDeleteShader(vertex);
+	glDeleteShader(fragment);
+
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		char log[1000];
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		printf("Single draw compositor failed to link:\n%s\n", log);
+		glDeleteProgram(program);
+		program = 0;
+		return false;
+	}
+
+	//the samplers never change unit, so they are set once
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "leftImage"), 0);
+	glUniform1i(glGetUniformLocation(program, "rightImage"), 1);
+
+	glGenBuffers(1, &vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+	//linear filtering, clamped at the edges like CpuCompositor
+	glGenTextures(2, textures);
+	for (int i = 0; i < 2; i++)
+	{
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	bind();
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+void GLCompositor::bind()
+{
+	glUseProgram(program);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glVertexAttribPointer(ATTRIB_POSITION, 2, GL_FLOAT, GL_FALSE, VERTEX_FLOATS * sizeof(GLfloat), (const void*)0);
+	glVertexAttribPointer(ATTRIB_TEXCOORD, 2, GL_FLOAT, GL_FALSE, VERTEX_FLOATS * sizeof(GLfloat), (const void*)(2 * sizeof(GLfloat)));
+	glVertexAttribPointer(ATTRIB_EYE, 1, GL_FLOAT, GL_FALSE, VERTEX_FLOATS * sizeof(GLfloat), (const void*)(4 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(ATTRIB_POSITION);
+	glEnableVertexAttribArray(ATTRIB_TEXCOORD);
+	glEnableVertexAttribArray(ATTRIB_EYE);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, textures[1]);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, textures[0]);
+	//camera rows are not padded
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+}
+// ----------------------------------------------------------------------------
+
+void GLCompositor::unbind()
+{
+	glDisableVertexAttribArray(ATTRIB_POSITION);
+	glDisableVertexAttribArray(ATTRIB_TEXCOORD);
+	glDisableVertexAttribArray(ATTRIB_EYE);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glUseProgram(0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+}
+// ----------------------------------------------------------------------------
+
+void GLCompositor::upload(int eye, const unsigned char* pixels, unsigned int cols, unsigned int rows)
+{
+	//each texture stays bound to its own unit, so only the unit is selected
+	glActiveTexture(GL_TEXTURE0 + eye);
+
+	//the texture is only reallocated when the frame size changes
+	if (cols != texCols[eye] || rows != texRows[eye])
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, (format == GL_LUMINANCE) ? GL_LUMINANCE8 : GL_RGB8, cols, rows, 0,
+			format, GL_UNSIGNED_BYTE, pixels);
+		texCols[eye] = cols;
+		texRows[eye] = rows;
+	}
+	else
+	{
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cols, rows, format, GL_UNSIGNED_BYTE, pixels);
+	}
+}
+// ----------------------------------------------------------------------------
+
+void GLCompositor::draw()
+{
+	if (texCols[0] == 0 || texCols[1] == 0)
+		return;
+	glDrawArrays(GL_TRIANGLES, 0, 12);
+}
+
+// ============================================================================
+//private functions
+
+//returns the compiled shader, or 0 after printing the compiler's log
+GLuint GLCompositor::compile(GLenum type, const char* source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	GLint compiled = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (!compiled)
+	{
+		char log[1000];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		printf("Single draw compositor failed to compile:\n%s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+// ============================================================================
+//GPU timer
+GLTimer::GLTimer()
+{
+	first = pending = 0;
+	timing = false;
+	measured = 0;
+	totalMs = 0;
+	queries[0] = 0;
+}
+// ----------------------------------------------------------------------------
+
+GLTimer::~GLTimer()
+{
+	if (queries[0] != 0)
+		glDeleteQueries(GL_TIMER_QUERIES, queries);
+}
+// ----------------------------------------------------------------------------
+
+bool GLTimer::init()
+{
+	if (!glTimerSupported())
+		return false;
+	glGenQueries(GL_TIMER_QUERIES, queries);
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+void GLTimer::begin()
+{
+	poll();
+	//all queries are still waiting for the GPU; skip this frame rather than wait
+	if (pending == GL_TIMER_QUERIES)
+		return;
+	glBeginQuery(GL_TIME_ELAPSED, queries[(first + pending) % GL_TIMER_QUERIES]);
+	timing = true;
+}
+// ----------------------------------------------------------------------------
+
+void GLTimer::end()
+{
+	if (!timing)
+		return;
+	glEndQuery(GL_TIME_ELAPSED);
+	timing = false;
+	pending++;
+}
+// ----------------------------------------------------------------------------
+
+void GLTimer::poll()
+{
+	while (pending > 0)
+	{
+		GLint available = 0;
+		glGetQueryObjectiv(queries[first], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			return;
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(queries[first], GL_QUERY_RESULT, &ns);
+		metricObserve(METRIC_RENDER_GPU_US, (LONGLONG)(ns / 1000));
+		totalMs += ns / 1e6;
+		measured++;
+		first = (first + 1) % GL_TIMER_QUERIES;
+		pending--;
+	}
+}
+// ----------------------------------------------------------------------------
+
+int GLTimer::getMeasured()
+{
+	return measured;
+}
+// ----------------------------------------------------------------------------
+
+double GLTimer::getAverageMs()
+{
+	return (measured > 0) ? totalMs / measured : 0;
+}
+
+// ============================================================================
+//verification against the immediate mode path
+
+//the original display path: a texture re-specified for each eye and a quad drawn with it, the
+//upload ahead of its quad. Pixels are in window coordinates, top left origin
+static void drawImmediate(GLuint texture, GLenum format, const unsigned char* leftPixels, const unsigned char* rightPixels,
+	unsigned int cols, unsigned int rows, int viewWidth, int viewHeight)
+{
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho(0.0, viewWidth, viewHeight, 0.0, -1.0, 1.0);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+
+	glTexImage2D(GL_TEXTURE_2D, 0, format, cols, rows, 0, format, GL_UNSIGNED_BYTE, rightPixels);
+	glBegin(GL_QUADS);
+	glTexCoord2i(0, 0); glVertex2i(0, 0);
+	glTexCoord2i(0, 1); glVertex2i(0, viewHeight);
+	glTexCoord2i(1, 1); glVertex2i(viewWidth / 2, viewHeight);
+	glTexCoord2i(1, 0); glVertex2i(viewWidth / 2, 0);
+	glEnd();
+
+	glTexImage2D(GL_TEXTURE_2D, 0, format, cols, rows, 0, format, GL_UNSIGNED_BYTE, leftPixels);
+	glBegin(GL_QUADS);
+	glTexCoord2i(0, 0); glVertex2i(viewWidth / 2, 0);
+	glTexCoord2i(0, 1); glVertex2i(viewWidth / 2, viewHeight);
+	glTexCoord2i(1, 1); glVertex2i(viewWidth, viewHeight);
+	glTexCoord2i(1, 0); glVertex2i(viewWidth, 0);
+	glEnd();
+
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+}
+// ----------------------------------------------------------------------------
+
+bool verifyGLCompositor(int viewWidth, int viewHeight)
+{
+	GLTimer singleTimer, immediateTimer;
+	bool timed = singleTimer.init() && immediateTimer.init();
+	GLCompositor compositor;
+	//RGB first; a luma compositor is made for the luma frames
+	if (!compositor.init(3))
+		return false;
+	printf("Verifying single draw compositor on %s\n", glGetString(GL_RENDERER));
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	//down scaled, up scaled, and odd sizes whose rows are not a multiple of 4 bytes
+	const unsigned int sizes[3][2] = { { 1280, 720 }, { 320, 240 }, { 641, 359 } };
+	unsigned char* leftPixels = new unsigned char[3 * 1280 * 720];
+	unsigned char* rightPixels = new unsigned char[3 * 1280 * 720];
+	int size = ((3 * viewWidth + 3) & ~3) * viewHeight;
+	unsigned char* expected = new unsigned char[size];
+	unsigned char* pixels = new unsigned char[size];
+	bool passed = true;
+
+	srand(1);
+	for (int i = 0; i < 3 * 1280 * 720; i++)
+	{
+		leftPixels[i] = (unsigned char)(rand() >> 4);
+		rightPixels[i] = (unsigned char)(rand() >> 4);
+	}
+
+	GLCompositor luma;
+	for (int channels = 3; channels >= 1; channels -= 2)
+	{
+		GLCompositor* single = &compositor;
+		if (channels == 1)
+		{
+			compositor.unbind();
+			if (!luma.init(1))
+			{
+				passed = false;
+				break;
+			}
+			single = &luma;
+		}
+		GLenum format = (channels == 1) ? GL_LUMINANCE : GL_RGB;
+		GLenum readFormat = (channels == 1) ? GL_RED : GL_BGR_EXT;
+		int readSize = ((channels * viewWidth + 3) & ~3) * viewHeight;
+
+		for (int s = 0; s < 3; s++)
+		{
+			unsigned int cols = sizes[s][0], rows = sizes[s][1];
+
+			single->unbind();
+			glEnable(GL_TEXTURE_2D);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glClear(GL_COLOR_BUFFER_BIT);
+			drawImmediate(texture, format, leftPixels, rightPixels, cols, rows, viewWidth, viewHeight);
+			glFinish();
+			glPixelStorei(GL_PACK_ALIGNMENT, 4);
+			glReadPixels(0, 0, viewWidth, viewHeight, readFormat, GL_UNSIGNED_BYTE, expected);
+
+			single->bind();
+			glClear(GL_COLOR_BUFFER_BIT);
+			single->upload(1, rightPixels, cols, rows);
+			single->upload(0, leftPixels, cols, rows);
+			single->draw();
+			glFinish();
+			glReadPixels(0, 0, viewWidth, viewHeight, readFormat, GL_UNSIGNED_BYTE, pixels);
+
+			int differing = 0, maxDiff = 0;
+			for (int i = 0; i < readSize; i++)
+			{
+				int diff = abs((int)pixels[i] - (int)expected[i]);
+				if (diff > 0)
+					differing++;
+				if (diff > maxDiff)
+					maxDiff = diff;
+			}
+			printf("%s %4ux%3u: %s (%d bytes differ, max difference %d)\n", (channels == 1) ? "luma" : "RGB ",
+				cols, rows, (differing == 0) ? "match" : "MISMATCH", differing, maxDiff);
+			if (differing > 0)
+				passed = false;
+		}
+		single->unbind();
+	}
+
+	//per frame cost of 720p pairs: the CPU time to issue the frame, and the time until the GPU has drawn it.
+	//Each frame starts at a different pixel, so nothing can be skipped because it was uploaded before
+	double issueMs[2] = { 0, 0 }, frameMs[2] = { 0, 0 };
+	for (int path = 0; path < 2; path++)
+	{
+		GLTimer* timer = (path == 0) ? &immediateTimer : &singleTimer;
+		if (path == 0)
+			glEnable(GL_TEXTURE_2D);
+		else
+			compositor.bind();
+		for (int i = 0; i < VERIFY_TIMING_FRAMES; i++)
+		{
+			const unsigned char* left = leftPixels + (i % 16) * 3;
+			const unsigned char* right = rightPixels + (i % 16) * 3;
+			LONGLONG t0 = perfCounter();
+			if (timed)
+				timer->begin();
+			glClear(GL_COLOR_BUFFER_BIT);
+			if (path == 0)
+			{
+				drawImmediate(texture, GL_RGB, left, right, 1280 - 16, 720, viewWidth, viewHeight);
+			}
+			else
+			{
+				compositor.upload(1, right, 1280 - 16, 720);
+				compositor.upload(0, left, 1280 - 16, 720);
+				compositor.draw();
+			}
+			if (timed)
+				timer->end();
+			LONGLONG t1 = perfCounter();
+			glFinish();
+			LONGLONG t2 = perfCounter();
+			if (timed)
+				timer->poll();
+			issueMs[path] += perfMs(t1 - t0);
+			frameMs[path] += perfMs(t2 - t0);
+		}
+		if (path == 1)
+			compositor.unbind();
+	}
+	const char* names[2] = { "immediate", "single   " };
+	const int draws[2] = { 2, 1 };
+	GLTimer* timers[2] = { &immediateTimer, &singleTimer };
+	for (int path = 0; path < 2; path++)
+	{
+		printf("%s: %d draws, %.2f ms to issue, %.2f ms per frame", names[path], draws[path],
+			issueMs[path] / VERIFY_TIMING_FRAMES, frameMs[path] / VERIFY_TIMING_FRAMES);
+		if (timed)
+			printf(", %.2f ms GPU", timers[path]->getAverageMs());
+		printf("\n");
+	}
+
+	printf("Single draw compositor %s the immediate mode path\n", passed ? "matches" : "DOES NOT match");
+
+	//the point of the single draw is less CPU time per frame
+	bool faster = issueMs[1] <= issueMs[0] * (1 + VERIFY_ISSUE_TOLERANCE);
+	printf("Single draw issue time %.2f ms vs %.2f ms immediate: %s (at most %.0f%% above)\n", issueMs[1] / VERIFY_TIMING_FRAMES,
+		issueMs[0] / VERIFY_TIMING_FRAMES, faster ? "PASS" : "FAIL", VERIFY_ISSUE_TOLERANCE * 100);
+	passed = passed && faster;
+	glDeleteTextures(1, &texture);
+	delete[] leftPixels;
+	delete[] rightPixels;
+	delete[] expected;
+	delete[] pixels;
+	return passed;
+}
@@ -0,0 +1,92 @@
+#ifndef GL_COMPOSITOR
+#define GL_COMPOSITOR
+// ============================================================================
+
+//Draws both eyes side by side in one draw call
+//Each eye has its own texture, allocated once per frame size and refreshed in place with
+//glTexSubImage2D, on its own texture unit. The two quads of the side-by-side layout are
+//in a static vertex buffer, and a shader picks the texture each quad samples, so a frame
+//is two uploads and one glDrawArrays. The program, the buffer and the textures stay bound
+//between frames. Only buffer objects, generic vertex attributes and GLSL are used, none
+//of the fixed function pipeline or immediate mode
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "GLExt.h"
+
+#define		GL_TIMER_QUERIES		4		//frames whose GPU time can be outstanding
+
+// ============================================================================
+
+class GLCompositor
+{
+public:
+	GLCompositor();
+	~GLCompositor();
+
+	//builds the program, the vertex buffer and the textures for frames of channels bytes per pixel (3 for
+	//RGB, 1 for luma); needs a current context with GL 2.0. Returns false if that fails
+	bool init(int channels);
+	//makes the program, the vertex buffer and the textures current; init does it, so this is only needed
+	//after something else has drawn
+	void bind();
+	//undoes bind, for drawing with the fixed function pipeline
+	void unbind();
+
+	//copies eye 0 (left) or 1 (right) into its texture; rows are not padded
+	void upload(int eye, const unsigned char* pixels, unsigned int cols, unsigned int rows);
+	//draws the right eye over the left half of the viewport and the left eye over the right half
+	void draw();
+
+private:
+	//data
+	GLuint program;
+	GLuint vertexBuffer;
+	GLuint textures[2];
+	unsigned int texCols[2], texRows[2];	//size of each texture, 0 before the first upload
+	GLenum format;							//GL_RGB or GL_LUMINANCE
+
+	//private prototypes
+	GLuint compile(GLenum type, const char* source);
+};
+
+// ============================================================================
+
+//GPU time of each frame's commands, from timer queries that are read back frames later, never waited for
+class GLTimer
+{
+public:
+	GLTimer();
+	~GLTimer();
+
+	//needs glTimerSupported(); returns false without it
+	bool init();
+	//brackets the commands of a frame; a frame is not timed while GL_TIMER_QUERIES are outstanding
+	void begin();
+	void end();
+	//publishes the finished measurements as render.gpu.us
+	void poll();
+
+	//frames measured so far, and their average in ms
+	int getMeasured();
+	double getAverageMs();
+
+private:
+	GLuint queries[GL_TIMER_QUERIES];
+	int first;			//oldest outstanding query
+	int pending;		//outstanding queries
+	bool timing;		//between begin and end of a timed frame
+	int measured;
+	double totalMs;
+};
+
+// ============================================================================
+
+//draws random frames of several sizes, RGB and luma, with the immediate mode quads of the original
+//display path and with GLCompositor, compares them byte for byte and times both. Needs a current context
+//drawing to a viewWidth x viewHeight back buffer; returns true if they all match
+bool verifyGLCompositor(int viewWidth, int viewHeight);
+
+// ============================================================================
+#endif
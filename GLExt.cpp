@@ -0,0 +1,140 @@
+
+//Loads OpenGL entry points newer than 1.1
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "GLExt.h"
+#include <string.h>
+
+GLGENBUFFERSPROC glGenBuffers = 0;
+GLDELETEBUFFERSPROC glDeleteBuffers = 0;
+GLBINDBUFFERPROC glBindBuffer = 0;
+GLBUFFERDATAPROC glBufferData = 0;
+GLMAPBUFFERPROC glMapBuffer = 0;
+GLUNMAPBUFFERPROC glUnmapBuffer = 0;
+
+GLCREATESHADERPROC glCreateShader = 0;
+GLDELETESHADERPROC glDeleteShader = 0;
+GLSHADERSOURCEPROC glShaderSource = 0;
+GLCOMPILESHADERPROC glCompileShader = 0;
+GLGETSHADERIVPROC glGetShaderiv = 0;
+GLGETSHADERINFOLOGPROC glGetShaderInfoLog = 0;
+GLCREATEPROGRAMPROC glCreateProgram = 0;
+GLDELETEPROGRAMPROC glDeleteProgram = 0;
+GLATTACHSHADERPROC glAttachShader = 0;
+GLLINKPROGRAMPROC glLinkProgram = 0;
+GLGETPROGRAMIVPROC glGetProgramiv = 0;
+GLGETPROGRAMINFOLOGPROC glGetProgramInfoLog = 0;
+GLUSEPROGRAMPROC glUseProgram = 0;
+GLGETUNIFORMLOCATIONPROC glGetUniformLocation = 0;
+GLUNIFORM1IPROC glUniform1i = 0;
+GLUNIFORM1FPROC glUniform1f = 0;
+GLUNIFORM2FPROC glUniform2f = 0;
+GLUNIFORM4FPROC glUniform4f = 0;
+GLBINDATTRIBLOCATIONPROC glBindAttribLocation = 0;
+GLVERTEXATTRIBPOINTERPROC glVertexAttribPointer = 0;
+GLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray = 0;
+GLDISABLEVERTEXATTRIBARRAYPROC glDisableVertexAttribArray = 0;
+
+GLACTIVETEXTUREPROC glActiveTexture = 0;
+
+GLGENQUERIESPROC glGenQueries = 0;
+GLDELETEQUERIESPROC glDeleteQueries = 0;
+GLBEGINQUERYPROC glBeginQuery = 0;
+GLENDQUERYPROC glEndQuery = 0;
+GLGETQUERYOBJECTIVPROC glGetQueryObjectiv = 0;
+GLGETQUERYOBJECTUI64VPROC glGetQueryObjectui64v = 0;
+
+GLFENCESYNCPROC glFenceSync = 0;
+GLCLIENTWAITSYNCPROC glClientWaitSync = 0;
+GLDELETESYNCPROC glDeleteSync = 0;
+
+// ============================================================================
+
+void loadGLExtensions()
+{
+	glGenBuffers = (GLGENBUFFERSPROC)glutGetProcAddress("glGenBuffers");
+	glDeleteBuffers = (GLDELETEBUFFERSPROC)glutGetProcAddress("glDeleteBuffers");
+	glBindBuffer = (GLBINDBUFFERPROC)glutGetProcAddress("glBindBuffer");
+	glBufferData = (GLBUFFERDATAPROC)glutGetProcAddress("glBufferData");
+	glMapBuffer = (GLMAPBUFFERPROC)glutGetProcAddress("glMapBuffer");
+	glUnmapBuffer = (GLUNMAPBUFFERPROC)glutGetProcAddress("glUnmapBuffer");
+
+	glCreateShader = (GLCREATESHADERPROC)glutGetProcAddress("glCreateShader");
+	glDeleteShader = (GLDELETESHADERPROC)glutGetProcAddress("glDeleteShader");
+	glShaderSource = (GLSHADERSOURCEPROC)glutGetProcAddress("glShaderSource");
+	glCompileShader = (GLCOMPILESHADERPROC)glutGetProcAddress("glCompileShader");
+	glGetShaderiv = (GLGETSHADERIVPROC)glutGetProcAddress("glGetShaderiv");
+	glGetShaderInfoLog = (GLGETSHADERINFOLOGPROC)glutGetProcAddress("glGetShaderInfoLog");
+	glCreateProgram = (GLCREATEPROGRAMPROC)glutGetProcAddress("glCreateProgram");
+	glDeleteProgram = (GLDELETEPROGRAMPROC)glutGetProcAddress("glDeleteProgram");
+	glAttachShader = (GLATTACHSHADERPROC)glutGetProcAddress("glAttachShader");
+	glLinkProgram = (GLLINKPROGRAMPROC)glutGetProcAddress("glLinkProgram");
+	glGetProgramiv = (GLGETPROGRAMIVPROC)glutGetProcAddress("glGetProgramiv");
+	glGetProgramInfoLog = (GLGETPROGRAMINFOLOGPROC)glutGetProcAddress("glGetProgramInfoLog");
+	glUseProgram = (GLUSEPROGRAMPROC)glutGetProcAddress("glUseProgram");
+	glGetUniformLocation = (GLGETUNIFORMLOCATIONPROC)glutGetProcAddress("glGetUniformLocation");
+	glUniform1i = (GLUNIFORM1IPROC)glutGetProcAddress("glUniform1i");
+	glUniform1f = (GLUNIFORM1FPROC)glutGetProcAddress("glUniform1f");
+	glUniform2f = (GLUNIFORM2FPROC)glutGetProcAddress("glUniform2f");
+	glUniform4f = (GLUNIFORM4FPROC)glutGetProcAddress("glUniform4f");
+	glBindAttribLocation = (GLBINDATTRIBLOCATIONPROC)glutGetProcAddress("glBindAttribLocation");
+	glVertexAttribPointer = (GLVERTEXATTRIBPOINTERPROC)glutGetProcAddress("glVertexAttribPointer");
+	glEnableVertexAttribArray = (GLENABLEVERTEXATTRIBARRAYPROC)glutGetProcAddress("glEnableVertexAttribArray");
+	glDisableVertexAttribArray = (GLDISABLEVERTEXATTRIBARRAYPROC)glutGetProcAddress("glDisableVertexAttribArray");
+
+	glActiveTexture = (GLACTIVETEXTUREPROC)glutGetProcAddress("glActiveTexture");
+
+	glGenQueries = (GLGENQUERIESPROC)glutGetProcAddress("glGenQueries");
+	glDeleteQueries = (GLDELETEQUERIESPROC)glutGetProcAddress("glDeleteQueries");
+	glBeginQuery = (GLBEGINQUERYPROC)glutGetProcAddress("glBeginQuery");
+	glEndQuery = (GLENDQUERYPROC)glutGetProcAddress("glEndQuery");
+	glGetQueryObjectiv = (GLGETQUERYOBJECTIVPROC)glutGetProcAddress("glGetQueryObjectiv");
+	glGetQueryObjectui64v = (GLGETQUERYOBJECTUI64VPROC)glutGetProcAddress("glGetQueryObjectui64v");
+
+	glFenceSync = (GLFENCESYNCPROC)glutGetProcAddress("glFenceSync");
+	glClientWaitSync = (GLCLIENTWAITSYNCPROC)glutGetProcAddress("glClientWaitSync");
+	glDeleteSync = (GLDELETESYNCPROC)glutGetProcAddress("glDeleteSync");
+
+	printf("OpenGL %s (%s)\n", glGetString(GL_VERSION), glGetString(GL_RENDERER));
+	printf("Asynchronous readback %s\n", glReadbackSupported() ? "available" : "not available");
+	printf("Shaders %s\n", glShadersSupported() ? "available" : "not available");
+	printf("GPU timer %s\n", glTimerSupported() ? "available" : "not available");
+}
+// ----------------------------------------------------------------------------
+
+bool glReadbackSupported()
+{
+	return glGenBuffers != 0 && glDeleteBuffers != 0 && glBindBuffer != 0 && glBufferData != 0
+		&& glMapBuffer != 0 && glUnmapBuffer != 0
+		&& glFenceSync != 0 && glClientWaitSync != 0 && glDeleteSync != 0;
+}
+
+bool glShadersSupported()
+{
+	return glCreateShader != 0 && glDeleteShader != 0 && glShaderSource != 0 && glCompileShader != 0
+		&& glGetShaderiv != 0 && glGetShaderInfoLog != 0 && glCreateProgram != 0 && glDeleteProgram != 0
+		&& glAttachShader != 0 && glLinkProgram != 0 && glGetProgramiv != 0 && glGetProgramInfoLog != 0
+		&& glUseProgram != 0 && glGetUniformLocation != 0
+		&& glUniform1i != 0 && glUniform1f != 0 && glUniform2f != 0 && glUniform4f != 0;
+}
+
+bool glCompositorSupported()
+{
+	return glShadersSupported() && glGenBuffers != 0 && glDeleteBuffers != 0 && glBindBuffer != 0 && glBufferData != 0
+		&& glBindAttribLocation != 0 && glVertexAttribPointer != 0 && glEnableVertexAttribArray != 0
+		&& glDisableVertexAttribArray != 0 && glActiveTexture != 0;
+}
+
+bool glTimerSupported()
+{
+	//the entry points exist from GL 1.5 on, but GL_TIME_ELAPSED needs 3.3 or the extension
+	const char* version = (const char*)glGetString(GL_VERSION);
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+	bool timeElapsed = (version != 0 && (version[0] > '3' || (version[0] == '3' && version[2] >= '3')))
+		|| (extensions != 0 && strstr(extensions, "GL_ARB_timer_query") != 0);
+	return timeElapsed && glGenQueries != 0 && glDeleteQueries != 0 && glBeginQuery != 0 && glEndQuery != 0
+		&& glGetQueryObjectiv != 0 && glGetQueryObjectui64v != 0;
+}
@@ -0,0 +1,158 @@
+#ifndef GL_EXT_LOADER
+#define GL_EXT_LOADER
+// ============================================================================
+
+//Loads the OpenGL entry points newer than 1.1 that the Windows GL headers do not
+//declare (buffer objects, shaders, sync objects, timer queries) through freeglut's glutGetProcAddress
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <GL/freeglut.h>
+#include <stddef.h>
+
+//types and constants from glext.h
+#ifndef GL_VERSION_1_2
+#define GL_CLAMP_TO_EDGE				0x812F
+#endif
+#ifndef GL_VERSION_1_3
+#define GL_TEXTURE0						0x84C0
+#define GL_TEXTURE1						0x84C1
+#endif
+#ifndef GL_VERSION_1_5
+typedef ptrdiff_t GLsizeiptr;
+typedef ptrdiff_t GLintptr;
+#define GL_STREAM_READ					0x88E1
+#define GL_READ_ONLY					0x88B8
+#define GL_ARRAY_BUFFER					0x8892
+#define GL_STATIC_DRAW					0x88E4
+#define GL_QUERY_RESULT					0x8866
+#define GL_QUERY_RESULT_AVAILABLE		0x8867
+#endif
+#ifndef GL_VERSION_2_0
+typedef char GLchar;
+#define GL_FRAGMENT_SHADER				0x8B30
+#define GL_VERTEX_SHADER				0x8B31
+#define GL_COMPILE_STATUS				0x8B81
+#define GL_LINK_STATUS					0x8B82
+#define GL_INFO_LOG_LENGTH				0x8B84
+#endif
+#ifndef GL_VERSION_2_1
+#define GL_PIXEL_PACK_BUFFER			0x88EB
+#endif
+#ifndef GL_VERSION_3_2
+typedef struct __GLsync* GLsync;
+typedef unsigned __int64 GLuint64;
+#define GL_SYNC_GPU_COMMANDS_COMPLETE	0x9117
+#define GL_SYNC_FLUSH_COMMANDS_BIT		0x00000001
+#define GL_ALREADY_SIGNALED				0x911A
+#define GL_TIMEOUT_EXPIRED				0x911B
+#define GL_CONDITION_SATISFIED			0x911C
+#define GL_WAIT_FAILED					0x911D
+#endif
+#ifndef GL_VERSION_3_3
+#define GL_TIME_ELAPSED					0x88BF
+#endif
+
+typedef void (APIENTRY *GLGENBUFFERSPROC)(GLsizei, GLuint*);
+typedef void (APIENTRY *GLDELETEBUFFERSPROC)(GLsizei, const GLuint*);
+typedef void (APIENTRY *GLBINDBUFFERPROC)(GLenum, GLuint);
+typedef void (APIENTRY *GLBUFFERDATAPROC)(GLenum, GLsizeiptr, const void*, GLenum);
+typedef void* (APIENTRY *GLMAPBUFFERPROC)(GLenum, GLenum);
+typedef GLboolean (APIENTRY *GLUNMAPBUFFERPROC)(GLenum);
+typedef GLsync (APIENTRY *GLFENCESYNCPROC)(GLenum, GLbitfield);
+typedef GLenum (APIENTRY *GLCLIENTWAITSYNCPROC)(GLsync, GLbitfield, GLuint64);
+typedef void (APIENTRY *GLDELETESYNCPROC)(GLsync);
+typedef void (APIENTRY *GLACTIVETEXTUREPROC)(GLenum);
+typedef void (APIENTRY *GLGENQUERIESPROC)(GLsizei, GLuint*);
+typedef void (APIENTRY *GLDELETEQUERIESPROC)(GLsizei, const GLuint*);
+typedef void (APIENTRY *GLBEGINQUERYPROC)(GLenum, GLuint);
+typedef void (APIENTRY *GLENDQUERYPROC)(GLenum);
+typedef void (APIENTRY *GLGETQUERYOBJECTIVPROC)(GLuint, GLenum, GLint*);
+typedef void (APIENTRY *GLGETQUERYOBJECTUI64VPROC)(GLuint, GLenum, GLuint64*);
+
+typedef GLuint (APIENTRY *GLCREATESHADERPROC)(GLenum);
+typedef void (APIENTRY *GLDELETESHADERPROC)(GLuint);
+typedef void (APIENTRY *GLSHADERSOURCEPROC)(GLuint, GLsizei, const GLchar**, const GLint*);
+typedef void (APIENTRY *GLCOMPILESHADERPROC)(GLuint);
+typedef void (APIENTRY *GLGETSHADERIVPROC)(GLuint, GLenum, GLint*);
+typedef void (APIENTRY *GLGETSHADERINFOLOGPROC)(GLuint, GLsizei, GLsizei*, GLchar*);
+typedef GLuint (APIENTRY *GLCREATEPROGRAMPROC)();
+typedef void (APIENTRY *GLDELETEPROGRAMPROC)(GLuint);
+typedef void (APIENTRY *GLATTACHSHADERPROC)(GLuint, GLuint);
+typedef void (APIENTRY *GLLINKPROGRAMPROC)(GLuint);
+typedef void (APIENTRY *GLGETPROGRAMIVPROC)(GLuint, GLenum, GLint*);
+typedef void (APIENTRY *GLGETPROGRAMINFOLOGPROC)(GLuint, GLsizei, GLsizei*, GLchar*);
+typedef void (APIENTRY *GLUSEPROGRAMPROC)(GLuint);
+typedef GLint (APIENTRY *GLGETUNIFORMLOCATIONPROC)(GLuint, const GLchar*);
+typedef void (APIENTRY *GLUNIFORM1IPROC)(GLint, GLint);
+typedef void (APIENTRY *GLUNIFORM1FPROC)(GLint, GLfloat);
+typedef void (APIENTRY *GLUNIFORM2FPROC)(GLint, GLfloat, GLfloat);
+typedef void (APIENTRY *GLUNIFORM4FPROC)(GLint, GLfloat, GLfloat, GLfloat, GLfloat);
+typedef void (APIENTRY *GLBINDATTRIBLOCATIONPROC)(GLuint, GLuint, const GLchar*);
+typedef void (APIENTRY *GLVERTEXATTRIBPOINTERPROC)(GLuint, GLint, GLenum, GLboolean, GLsizei, const void*);
+typedef void (APIENTRY *GLENABLEVERTEXATTRIBARRAYPROC)(GLuint);
+typedef void (APIENTRY *GLDISABLEVERTEXATTRIBARRAYPROC)(GLuint);
+
+//buffer objects (GL 1.5)
+extern GLGENBUFFERSPROC glGenBuffers;
+extern GLDELETEBUFFERSPROC glDeleteBuffers;
+extern GLBINDBUFFERPROC glBindBuffer;
+extern GLBUFFERDATAPROC glBufferData;
+extern GLMAPBUFFERPROC glMapBuffer;
+extern GLUNMAPBUFFERPROC glUnmapBuffer;
+
+//shaders (GL 2.0)
+extern GLCREATESHADERPROC glCreateShader;
+extern GLDELETESHADERPROC glDeleteShader;
+extern GLSHADERSOURCEPROC glShaderSource;
+extern GLCOMPILESHADERPROC glCompileShader;
+extern GLGETSHADERIVPROC glGetShaderiv;
+extern GLGETSHADERINFOLOGPROC glGetShaderInfoLog;
+extern GLCREATEPROGRAMPROC glCreateProgram;
+extern GLDELETEPROGRAMPROC glDeleteProgram;
+extern GLATTACHSHADERPROC glAttachShader;
+extern GLLINKPROGRAMPROC glLinkProgram;
+extern GLGETPROGRAMIVPROC glGetProgramiv;
+extern GLGETPROGRAMINFOLOGPROC glGetProgramInfoLog;
+extern GLUSEPROGRAMPROC glUseProgram;
+extern GLGETUNIFORMLOCATIONPROC glGetUniformLocation;
+extern GLUNIFORM1IPROC glUniform1i;
+extern GLUNIFORM1FPROC glUniform1f;
+extern GLUNIFORM2FPROC glUniform2f;
+extern GLUNIFORM4FPROC glUniform4f;
+extern GLBINDATTRIBLOCATIONPROC glBindAttribLocation;
+extern GLVERTEXATTRIBPOINTERPROC glVertexAttribPointer;
+extern GLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
+extern GLDISABLEVERTEXATTRIBARRAYPROC glDisableVertexAttribArray;
+
+//multitexture (GL 1.3)
+extern GLACTIVETEXTUREPROC glActiveTexture;
+
+//queries (GL 1.5; GL_TIME_ELAPSED and 64-bit results are GL 3.3 / ARB_timer_query)
+extern GLGENQUERIESPROC glGenQueries;
+extern GLDELETEQUERIESPROC glDeleteQueries;
+extern GLBEGINQUERYPROC glBeginQuery;
+extern GLENDQUERYPROC glEndQuery;
+extern GLGETQUERYOBJECTIVPROC glGetQueryObjectiv;
+extern GLGETQUERYOBJECTUI64VPROC glGetQueryObjectui64v;
+
+//sync objects (GL 3.2 / ARB_sync)
+extern GLFENCESYNCPROC glFenceSync;
+extern GLCLIENTWAITSYNCPROC glClientWaitSync;
+extern GLDELETESYNCPROC glDeleteSync;
+
+//must be called with a current context (after glutCreateWindow)
+void loadGLExtensions();
+
+//true if pixel pack buffers and fences were found, i.e. asynchronous readback is possible
+bool glReadbackSupported();
+//true if GLSL programs can be built
+bool glShadersSupported();
+//true if GLSL programs can also be fed from vertex buffers and sample two texture units
+bool glCompositorSupported();
+//true if the GPU time of a range of commands can be measured
+bool glTimerSupported();
+
+// ============================================================================
+#endif
@@ -0,0 +1,405 @@
+
+//Pixel kernels for the capture path
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "ImageKernels.h"
+#include <intrin.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <math.h>
+
+#define		TONE_MID_GREY		0.18f	//tone space level the scene average is mapped to
+#define		TONE_SCALE_MIN		0.25f	//limits of the automatic exposure
+#define		TONE_SCALE_MAX		64.0f
+#define		TONE_ADAPT_RATE		0.1f	//fraction of the new exposure taken each frame
+
+// ============================================================================
+//helpers
+
+//colour (0 red, 1 green, 2 blue) at each position of the 2x2 tile, indexed (y & 1) * 2 + (x & 1)
+static void bayerPattern(BayerTileFormat format, int* pattern)
+{
+	static const int rggb[4] = { 0, 1, 1, 2 };
+	static const int grbg[4] = { 1, 0, 2, 1 };
+	static const int gbrg[4] = { 1, 2, 0, 1 };
+	static const int bggr[4] = { 2, 1, 1, 0 };
+
+	const int* p;
+	switch (format)
+	{
+	case GRBG: p = grbg; break;
+	case GBRG: p = gbrg; break;
+	case BGGR: p = bggr; break;
+	default: p = rggb; break;
+	}
+	for (int i = 0; i < 4; i++)
+		pattern[i] = p[i];
+}
+
+//reflects an out of range index back into [0, size); keeps its parity so Bayer colours match
+static inline unsigned int mirror(int i, unsigned int size)
+{
+	if (i < 0)
+		return -i;
+	if (i >= (int)size)
+		return 2 * (size - 1) - i;
+	return i;
+}
+
+static bool hasSSSE3()
+{
+	static int checked = -1;
+	if (checked < 0)
+	{
+		int info[4];
+		__cpuid(info, 1);
+		checked = (info[2] & (1 << 9)) ? 1 : 0;
+	}
+	return checked == 1;
+}
+
+// ============================================================================
+
+bool isHighBitDepth(PixelFormat format)
+{
+	return format == PIXEL_FORMAT_RAW12 || format == PIXEL_FORMAT_RAW16;
+}
+
+int rawBitDepth(PixelFormat format)
+{
+	switch (format)
+	{
+	case PIXEL_FORMAT_RAW12: return 12;
+	case PIXEL_FORMAT_RAW16: return 16;
+	default: return 8;
+	}
+}
+// ----------------------------------------------------------------------------
+
+//byte 0: pixel 0 bits 11-4; byte 1: pixel 1 bits 3-0 (high nibble), pixel 0 bits 3-0 (low nibble); byte 2: pixel 1 bits 11-4
+void unpackRaw12(const unsigned char* src, unsigned short* dst, unsigned int count)
+{
+	unsigned int i = 0;
+
+	if (hasSSSE3())
+	{
+		//gather each pixel's two bytes into a 16-bit lane as (high byte << 8) | middle byte
+		const __m128i gather = _mm_setr_epi8(1, 0, 1, 2, 4, 3, 4, 5, 7, 6, 7, 8, 10, 9, 10, 11);
+		const __m128i evenMask = _mm_setr_epi16(-1, 0, -1, 0, -1, 0, -1, 0);
+		const __m128i highMask = _mm_set1_epi16(0x0FF0);
+		const __m128i lowMask = _mm_set1_epi16(0x000F);
+
+		//8 pixels (12 bytes) per iteration; the 16-byte load must stay inside the source
+		for (; i + 8 <= count && (i / 2) * 3 + 16 <= (count / 2) * 3; i += 8)
+		{
+			__m128i packed = _mm_loadu_si128((const __m128i*)(src + (i / 2) * 3));
+			__m128i w = _mm_shuffle_epi8(packed, gather);
+
+			//odd pixels: (b2 << 4) | (b1 >> 4) is just w >> 4
+			__m128i odd = _mm_srli_epi16(w, 4);
+			//even pixels: (b0 << 4) | (b1 & 0xF)
+			__m128i even = _mm_or_si128(_mm_and_si128(odd, highMask), _mm_and_si128(w, lowMask));
+
+			__m128i result = _mm_or_si128(_mm_and_si128(evenMask, even), _mm_andnot_si128(evenMask, odd));
+			_mm_storeu_si128((__m128i*)(dst + i), result);
+		}
+	}
+
+	for (; i + 1 < count; i += 2)
+	{
+		const unsigned char* p = src + (i / 2) * 3;
+		dst[i] = (unsigned short)((p[0] << 4) | (p[1] & 0x0F));
+		dst[i + 1] = (unsigned short)((p[2] << 4) | (p[1] >> 4));
+	}
+}
+// ----------------------------------------------------------------------------
+
+//shared by the 8 and 16-bit versions; rawStride is in pixels
+template <typename T>
+static void demosaicBilinear(const T* raw, unsigned int rawStride, unsigned int cols, unsigned int rows, BayerTileFormat format, T* rgb,
+	unsigned int rowBegin, unsigned int rowEnd)
+{
+	int pattern[4];
+	bayerPattern(format, pattern);
+
+	for (unsigned int y = rowBegin; y < rowEnd && y < rows; y++)
+	{
+		const T* up = raw + mirror(y - 1, rows) * rawStride;
+		const T* mid = raw + y * rawStride;
+		const T* down = raw + mirror(y + 1, rows) * rawStride;
+		const int* rowPattern = pattern + (y & 1) * 2;
+		T* out = rgb + 3 * y * cols;
+
+		for (unsigned int x = 0; x < cols; x++, out += 3)
+		{
+			unsigned int xl = mirror(x - 1, cols);
+			unsigned int xr = mirror(x + 1, cols);
+			int c = rowPattern[x & 1];
+
+			if (c == 1)
+			{
+				//green site: the other colour of this row is left/right, the remaining one above/below
+				int rowColour = rowPattern[(x + 1) & 1];
+				out[1] = mid[x];
+				out[rowColour] = (T)((mid[xl] + mid[xr] + 1) >> 1);
+				out[2 - rowColour] = (T)((up[x] + down[x] + 1) >> 1);
+			}
+			else
+			{
+				//red or blue site: green from the 4 neighbours, the opposite colour from the diagonals
+				out[c] = mid[x];
+				out[1] = (T)((up[x] + down[x] + mid[xl] + mid[xr] + 2) >> 2);
+				out[2 - c] = (T)((up[xl] + up[xr] + down[xl] + down[xr] + 2) >> 2);
+			}
+		}
+	}
+}
+
+//each 2x2 Bayer cell becomes one RGB pixel: its red, its blue and the mean of its two greens
+template <typename T>
+static void binBayer(const T* raw, unsigned int rawStride, unsigned int cols, BayerTileFormat format, T* rgb,
+	unsigned int rowBegin, unsigned int rowEnd)
+{
+	int pattern[4];
+	bayerPattern(format, pattern);
+	unsigned int outCols = cols / 2;
+
+	for (unsigned int y = rowBegin; y < rowEnd; y++)
+	{
+		const T* top = raw + 2 * y * rawStride;
+		const T* bottom = top + rawStride;
+		T* out = rgb + 3 * y * outCols;
+
+		for (unsigned int x = 0; x < outCols; x++, out += 3)
+		{
+			unsigned int sum[3] = { 0, 0, 0 };
+			sum[pattern[0]] += top[2 * x];
+			sum[pattern[1]] += top[2 * x + 1];
+			sum[pattern[2]] += bottom[2 * x];
+			sum[pattern[3]] += bottom[2 * x + 1];
+			out[0] = (T)sum[0];
+			out[1] = (T)((sum[1] + 1) >> 1);
+			out[2] = (T)sum[2];
+		}
+	}
+}
+// ----------------------------------------------------------------------------
+
+void demosaicBilinear8(const unsigned char* raw, unsigned int rawStride, unsigned int cols, unsigned int rows, BayerTileFormat format,
+	unsigned char* rgb, unsigned int rowBegin, unsigned int rowEnd)
+{
+	demosaicBilinear(raw, rawStride, cols, rows, format, rgb, rowBegin, rowEnd);
+}
+
+void demosaicBilinear16(const unsigned short* raw, unsigned int cols, unsigned int rows, BayerTileFormat format, unsigned short* rgb,
+	unsigned int rowBegin, unsigned int rowEnd)
+{
+	demosaicBilinear(raw, cols, cols, rows, format, rgb, rowBegin, rowEnd);
+}
+// ----------------------------------------------------------------------------
+
+void binBayer8(const unsigned char* raw, unsigned int rawStride, unsigned int cols, BayerTileFormat format, unsigned char* rgb,
+	unsigned int rowBegin, unsigned int rowEnd)
+{
+	binBayer(raw, rawStride, cols, format, rgb, rowBegin, rowEnd);
+}
+
+void binBayer16(const unsigned short* raw, unsigned int cols, BayerTileFormat format, unsigned short* rgb,
+	unsigned int rowBegin, unsigned int rowEnd)
+{
+	binBayer(raw, cols, cols, format, rgb, rowBegin, rowEnd);
+}
+// ----------------------------------------------------------------------------
+
+//any 2x2 window of a Bayer mosaic holds one red, two greens and one blue, so its mean is the luma
+//(R + 2G + B) / 4 whatever the pattern; the last row and column use the window mirrored back
+//columns before colBegin are left to the SIMD version
+template <typename T>
+static void lumaBayer(const T* raw, unsigned int rawStride, unsigned int cols, unsigned int rows, T* luma,
+	unsigned int rowBegin, unsigned int rowEnd, unsigned int colBegin)
+{
+	for (unsigned int y = rowBegin; y < rowEnd && y < rows; y++)
+	{
+		const T* top = raw + y * rawStride;
+		const T* bottom = raw + mirror(y + 1, rows) * rawStride;
+		T* out = luma + y * cols;
+		for (unsigned int x = colBegin; x < cols; x++)
+		{
+			unsigned int xr = mirror(x + 1, cols);
+			out[x] = (T)((top[x] + top[xr] + bottom[x] + bottom[xr] + 2) >> 2);
+		}
+	}
+}
+
+//mean of each 2x2 Bayer cell: the luma of a binned pixel
+template <typename T>
+static void lumaBin(const T* raw, unsigned int rawStride, unsigned int cols, T* luma,
+	unsigned int rowBegin, unsigned int rowEnd, unsigned int colBegin)
+{
+	unsigned int outCols = cols / 2;
+	for (unsigned int y = rowBegin; y < rowEnd; y++)
+	{
+		const T* top = raw + 2 * y * rawStride;
+		const T* bottom = top + rawStride;
+		T* out = luma + y * outCols;
+		for (unsigned int x = colBegin; x < outCols; x++)
+			out[x] = (T)((top[2 * x] + top[2 * x + 1] + bottom[2 * x] + bottom[2 * x + 1] + 2) >> 2);
+	}
+}
+// ----------------------------------------------------------------------------
+
+//16 pixels per SSE2 iteration; the scalar version finishes the columns whose window runs past the row
+void lumaBayer8(const unsigned char* raw, unsigned int rawStride, unsigned int cols, unsigned int rows, unsigned char* luma,
+	unsigned int rowBegin, unsigned int rowEnd)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(2);
+	unsigned int simdCols = (cols > 16) ? (cols - 1) & ~15u : 0;
+
+	for (unsigned int y = rowBegin; y < rowEnd && y < rows; y++)
+	{
+		const unsigned char* top = raw + y * rawStride;
+		const unsigned char* bottom = raw + mirror(y + 1, rows) * rawStride;
+		unsigned char* out = luma + y * cols;
+		for (unsigned int x = 0; x < simdCols; x += 16)
+		{
+			__m128i t0 = _mm_loadu_si128((const __m128i*)(top + x));
+			__m128i t1 = _mm_loadu_si128((const __m128i*)(top + x + 1));
+			__m128i b0 = _mm_loadu_si128((const __m128i*)(bottom + x));
+			__m128i b1 = _mm_loadu_si128((const __m128i*)(bottom + x + 1));
+			__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(t0, zero), _mm_unpacklo_epi8(t1, zero)),
+				_mm_add_epi16(_mm_unpacklo_epi8(b0, zero), _mm_unpacklo_epi8(b1, zero)));
+			__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(t0, zero), _mm_unpackhi_epi8(t1, zero)),
+				_mm_add_epi16(_mm_unpackhi_epi8(b0, zero), _mm_unpackhi_epi8(b1, zero)));
+			lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 2);
+			hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 2);
+			_mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(lo, hi));
+		}
+	}
+	lumaBayer(raw, rawStride, cols, rows, luma, rowBegin, rowEnd, simdCols);
+}
+
+void lumaBayer16(const unsigned short* raw, unsigned int cols, unsigned int rows, unsigned short* luma,
+	unsigned int rowBegin, unsigned int rowEnd)
+{
+	lumaBayer(raw, cols, cols, rows, luma, rowBegin, rowEnd, 0);
+}
+// ----------------------------------------------------------------------------
+
+//16 output pixels (32 raw columns) per SSE2 iteration: even and odd bytes are split with a mask and a shift
+void lumaBin8(const unsigned char* raw, unsigned int rawStride, unsigned int cols, unsigned char* luma,
+	unsigned int rowBegin, unsigned int rowEnd)
+{
+	const __m128i even = _mm_set1_epi16(0x00FF);
+	const __m128i round = _mm_set1_epi16(2);
+	unsigned int outCols = cols / 2;
+	unsigned int simdCols = outCols & ~15u;
+
+	for (unsigned int y = rowBegin; y < rowEnd; y++)
+	{
+		const unsigned char* top = raw + 2 * y * rawStride;
+		const unsigned char* bottom = top + rawStride;
+		unsigned char* out = luma + y * outCols;
+		for (unsigned int x = 0; x < simdCols; x += 16)
+		{
+			__m128i sum[2];
+			for (int half = 0; half < 2; half++)
+			{
+				__m128i t = _mm_loadu_si128((const __m128i*)(top + 2 * x + 16 * half));
+				__m128i b = _mm_loadu_si128((const __m128i*)(bottom + 2 * x + 16 * half));
+				__m128i s = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(t, even), _mm_srli_epi16(t, 8)),
+					_mm_add_epi16(_mm_and_si128(b, even), _mm_srli_epi16(b, 8)));
+				sum[half] = _mm_srli_epi16(_mm_add_epi16(s, round), 2);
+			}
+			_mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(sum[0], sum[1]));
+		}
+	}
+	lumaBin(raw, rawStride, cols, luma, rowBegin, rowEnd, simdCols);
+}
+
+void lumaBin16(const unsigned short* raw, unsigned int cols, unsigned short* luma,
+	unsigned int rowBegin, unsigned int rowEnd)
+{
+	lumaBin(raw, cols, cols, luma, rowBegin, rowEnd, 0);
+}
+// ----------------------------------------------------------------------------
+
+void toneCurveInit(TONE_CURVE* curve, int bitDepth)
+{
+	curve->bitDepth = bitDepth;
+	curve->scale = 1.0f / (float)((1 << bitDepth) - 1);
+	curve->invWhite2 = 1.0f;
+}
+// ----------------------------------------------------------------------------
+
+void toneCurveUpdate(TONE_CURVE* curve, const unsigned short* raw, unsigned int count)
+{
+	double sum = 0;
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < count; i += TONE_SAMPLE_STEP)
+	{
+		sum += raw[i];
+		n++;
+	}
+	if (n > 0)
+		toneCurveAdapt(curve, sum / n);
+}
+// ----------------------------------------------------------------------------
+
+void toneCurveAdapt(TONE_CURVE* curve, double sampleMean)
+{
+	float maxValue = (float)((1 << curve->bitDepth) - 1);
+
+	//exposure that brings the average to mid grey, smoothed so the image does not pump
+	float mean = (float)sampleMean / maxValue;
+	float exposure = (mean > 0) ? TONE_MID_GREY / mean : TONE_SCALE_MAX;
+	if (exposure < TONE_SCALE_MIN)
+		exposure = TONE_SCALE_MIN;
+	if (exposure > TONE_SCALE_MAX)
+		exposure = TONE_SCALE_MAX;
+
+	float current = curve->scale * maxValue;
+	float next = current + TONE_ADAPT_RATE * (exposure - current);
+	curve->scale = next / maxValue;
+	//the brightest sensor value maps exactly to white
+	curve->invWhite2 = 1.0f / (next * next);
+}
+// ----------------------------------------------------------------------------
+
+void toneMap16(const unsigned short* src, unsigned char* dst, unsigned int count, const TONE_CURVE* curve)
+{
+	const __m128 scale = _mm_set1_ps(curve->scale);
+	const __m128 invWhite2 = _mm_set1_ps(curve->invWhite2);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 full = _mm_set1_ps(255.0f);
+	const __m128i zero = _mm_setzero_si128();
+
+	unsigned int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128 a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), scale);
+		__m128 b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), scale);
+
+		//t = v (1 + v / white^2) / (1 + v), then gamma 1/2
+		a = _mm_div_ps(_mm_mul_ps(a, _mm_add_ps(one, _mm_mul_ps(a, invWhite2))), _mm_add_ps(one, a));
+		b = _mm_div_ps(_mm_mul_ps(b, _mm_add_ps(one, _mm_mul_ps(b, invWhite2))), _mm_add_ps(one, b));
+		a = _mm_mul_ps(_mm_sqrt_ps(_mm_min_ps(a, one)), full);
+		b = _mm_mul_ps(_mm_sqrt_ps(_mm_min_ps(b, one)), full);
+
+		__m128i words = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+		_mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(words, words));
+	}
+
+	for (; i < count; i++)
+	{
+		float v = src[i] * curve->scale;
+		float t = v * (1 + v * curve->invWhite2) / (1 + v);
+		if (t > 1)
+			t = 1;
+		dst[i] = (unsigned char)(sqrtf(t) * 255.0f + 0.5f);
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef IMAGE_KERNELS
+#define IMAGE_KERNELS
+// ============================================================================
+
+//Pixel kernels for the capture path that the FlyCapture2 SDK conversion does not cover:
+//unpacking 12-bit raw data, bilinear demosaicing, binning and luma extraction of Bayer
+//mosaics, and tone mapping high bit depth data down to the 8 bits the display uses
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "FlyCapture2.h"
+
+using namespace FlyCapture2;
+
+#define		TONE_SAMPLE_STEP	31		//auto exposure samples every 31st raw value; odd so all Bayer colours are hit
+
+//global tone curve: extended Reinhard with a square root display gamma
+//scale maps sensor values so that the scene average lands on mid grey
+struct TONE_CURVE
+{
+	float scale;		//multiplier from sensor value to tone space
+	float invWhite2;	//1 / (tone space value that maps to full white)^2
+	int bitDepth;		//significant bits of the sensor values (12 or 16)
+};
+
+//true for the raw formats that go through the kernels below instead of Image::Convert
+bool isHighBitDepth(PixelFormat);
+//significant bits per pixel of a raw format
+int rawBitDepth(PixelFormat);
+
+//unpacks Point Grey 12-bit packed data (two pixels in three bytes) to one 16-bit value (0-4095) per pixel
+//count must be even
+void unpackRaw12(const unsigned char* src, unsigned short* dst, unsigned int count);
+
+//bilinear demosaic of a Bayer mosaic to interleaved RGB of the same depth; edges are mirrored
+//only output rows [rowBegin, rowEnd) are written, so bands can run in parallel
+void demosaicBilinear8(const unsigned char* raw, unsigned int rawStride, unsigned int cols, unsigned int rows, BayerTileFormat,
+	unsigned char* rgb, unsigned int rowBegin, unsigned int rowEnd);
+void demosaicBilinear16(const unsigned short* raw, unsigned int cols, unsigned int rows, BayerTileFormat, unsigned short* rgb,
+	unsigned int rowBegin, unsigned int rowEnd);
+
+//2x2 binning of a Bayer mosaic to half resolution RGB (cols / 2 wide); rows are output rows
+void binBayer8(const unsigned char* raw, unsigned int rawStride, unsigned int cols, BayerTileFormat, unsigned char* rgb,
+	unsigned int rowBegin, unsigned int rowEnd);
+void binBayer16(const unsigned short* raw, unsigned int cols, BayerTileFormat, unsigned short* rgb,
+	unsigned int rowBegin, unsigned int rowEnd);
+
+//luma (R + 2G + B) / 4 straight from a Bayer mosaic, one value per pixel: the mean of the 2x2 window
+//at each pixel, which holds every colour whatever the pattern. The 8-bit version is SSE2
+void lumaBayer8(const unsigned char* raw, unsigned int rawStride, unsigned int cols, unsigned int rows, unsigned char* luma,
+	unsigned int rowBegin, unsigned int rowEnd);
+void lumaBayer16(const unsigned short* raw, unsigned int cols, unsigned int rows, unsigned short* luma,
+	unsigned int rowBegin, unsigned int rowEnd);
+//luma of 2x2 binned pixels (cols / 2 wide); rows are output rows
+void lumaBin8(const unsigned char* raw, unsigned int rawStride, unsigned int cols, unsigned char* luma,
+	unsigned int rowBegin, unsigned int rowEnd);
+void lumaBin16(const unsigned short* raw, unsigned int cols, unsigned short* luma,
+	unsigned int rowBegin, unsigned int rowEnd);
+
+//sets up a tone curve for the given sensor bit depth
+void toneCurveInit(TONE_CURVE*, int bitDepth);
+//adapts the exposure of the curve to the average level of a raw frame (sparsely sampled, smoothed over frames)
+void toneCurveUpdate(TONE_CURVE*, const unsigned short* raw, unsigned int count);
+//the same from the mean of the sampled values, for callers that sample the frame themselves
+void toneCurveAdapt(TONE_CURVE*, double sampleMean);
+//maps 16-bit values to 8-bit through the curve, 8 values per SSE iteration
+void toneMap16(const unsigned short* src, unsigned char* dst, unsigned int count, const TONE_CURVE*);
+
+// ============================================================================
+#endif
@@ -0,0 +1,291 @@
+
+//Live metrics published through a named shared memory segment
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "Metrics.h"
+#include <mmsystem.h>
+#include <conio.h>
+
+#define		MONITOR_INTERVAL	1000	//ms between monitor updates
+
+struct METRIC_INFO
+{
+	const char* name;
+	MetricType type;
+	LONG scale;
+};
+
+//names and types, in MetricId order
+static const METRIC_INFO metricInfo[METRIC_COUNT] =
+{
+	{ "capture.frames.left",	METRIC_TYPE_COUNTER,	1 },
+	{ "capture.frames.right",	METRIC_TYPE_COUNTER,	1 },
+	{ "capture.drops.left",		METRIC_TYPE_COUNTER,	1 },
+	{ "capture.drops.right",	METRIC_TYPE_COUNTER,	1 },
+	{ "capture.fps.left",		METRIC_TYPE_GAUGE,		1000 },
+	{ "capture.fps.right",		METRIC_TYPE_GAUGE,		1000 },
+	{ "convert.us.left",		METRIC_TYPE_HISTOGRAM,	1 },
+	{ "convert.us.right",		METRIC_TYPE_HISTOGRAM,	1 },
+	{ "copy.us.left",			METRIC_TYPE_HISTOGRAM,	1 },
+	{ "copy.us.right",			METRIC_TYPE_HISTOGRAM,	1 },
+
+	{ "display.frames",			METRIC_TYPE_COUNTER,	1 },
+	{ "display.fps",			METRIC_TYPE_GAUGE,		1000 },
+	{ "pair.skew.us",			METRIC_TYPE_HISTOGRAM,	1 },
+	{ "upload.us",				METRIC_TYPE_HISTOGRAM,	1 },
+	{ "draw.us",				METRIC_TYPE_HISTOGRAM,	1 },
+	{ "present.us",				METRIC_TYPE_HISTOGRAM,	1 },
+	{ "record.us",				METRIC_TYPE_HISTOGRAM,	1 },
+	{ "frame.us",				METRIC_TYPE_HISTOGRAM,	1 },
+
+	{ "readback.pending",		METRIC_TYPE_GAUGE,		1 },
+	{ "readback.skipped",		METRIC_TYPE_COUNTER,	1 },
+	{ "save.backlog",			METRIC_TYPE_GAUGE,		1 },
+	{ "save.skipped",			METRIC_TYPE_COUNTER,	1 },
+	{ "save.frames",			METRIC_TYPE_COUNTER,	1 },
+	{ "save.us",				METRIC_TYPE_HISTOGRAM,	1 },
+
+	{ "quality.level",			METRIC_TYPE_GAUGE,		1 },
+	{ "quality.changes",		METRIC_TYPE_COUNTER,	1 },
+
+	{ "depth.frames",			METRIC_TYPE_COUNTER,	1 },
+	{ "depth.skipped",			METRIC_TYPE_COUNTER,	1 },
+	{ "depth.us",				METRIC_TYPE_HISTOGRAM,	1 },
+	{ "depth.range",			METRIC_TYPE_GAUGE,		1 },
+
+	{ "watchdog.stalls.left",	METRIC_TYPE_COUNTER,	1 },
+	{ "watchdog.stalls.right",	METRIC_TYPE_COUNTER,	1 },
+	{ "watchdog.restarts.left",	METRIC_TYPE_COUNTER,	1 },
+	{ "watchdog.restarts.right",	METRIC_TYPE_COUNTER,	1 },
+	{ "watchdog.downtime.ms.left",	METRIC_TYPE_HISTOGRAM,	1 },
+	{ "watchdog.downtime.ms.right",	METRIC_TYPE_HISTOGRAM,	1 },
+
+	{ "framebus.frames.left",	METRIC_TYPE_COUNTER,	1 },
+	{ "framebus.frames.right",	METRIC_TYPE_COUNTER,	1 },
+	{ "framebus.us",			METRIC_TYPE_HISTOGRAM,	1 },
+
+	{ "denoise.us.left",		METRIC_TYPE_HISTOGRAM,	1 },
+	{ "denoise.us.right",		METRIC_TYPE_HISTOGRAM,	1 },
+
+	{ "zoom.us",				METRIC_TYPE_HISTOGRAM,	1 },
+	{ "zoom.level",				METRIC_TYPE_GAUGE,		1000 },
+
+	{ "preroll.triggers",		METRIC_TYPE_COUNTER,	1 },
+	{ "preroll.write.us",		METRIC_TYPE_HISTOGRAM,	1 },
+	{ "preroll.backlog",		METRIC_TYPE_GAUGE,		1 },
+	{ "preroll.lost",			METRIC_TYPE_COUNTER,	1 },
+
+	{ "record.queue",			METRIC_TYPE_GAUGE,		1 },
+	{ "record.bytes",			METRIC_TYPE_COUNTER,	1 },
+	{ "record.write.us",		METRIC_TYPE_HISTOGRAM,	1 },
+	{ "record.stalls",			METRIC_TYPE_COUNTER,	1 },
+	{ "record.sync",			METRIC_TYPE_COUNTER,	1 },
+
+	{ "commands.applied",		METRIC_TYPE_COUNTER,	1 },
+	{ "commands.dropped",		METRIC_TYPE_COUNTER,	1 },
+	{ "command.latency.us",		METRIC_TYPE_HISTOGRAM,	1 },
+
+	{ "render.draws",			METRIC_TYPE_COUNTER,	1 },
+	{ "render.gpu.us",			METRIC_TYPE_HISTOGRAM,	1 },
+};
+
+static HANDLE metricsMapping = 0;
+static METRICS_SEGMENT* segment = 0;
+
+//used before metricsOpen or if the shared segment could not be created, so updates never need a check
+static METRICS_SEGMENT localSegment;
+
+// ============================================================================
+//writer
+
+void metricsOpen()
+{
+	metricsMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(METRICS_SEGMENT), METRICS_SEGMENT_NAME);
+	if (metricsMapping != 0)
+		segment = (METRICS_SEGMENT*)MapViewOfFile(metricsMapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(METRICS_SEGMENT));
+	if (segment == 0)
+	{
+		printf("Could not create shared metrics segment; metrics are local only\n");
+		segment = &localSegment;
+	}
+
+	//publish the layout last so a monitor never sees a valid magic with missing names
+	memset(segment, 0, sizeof(METRICS_SEGMENT));
+	for (int i = 0; i < METRIC_COUNT; i++)
+	{
+		strncpy(segment->slots[i].name, metricInfo[i].name, METRICS_NAME_LENGTH - 1);
+		segment->slots[i].type = metricInfo[i].type;
+		segment->slots[i].scale = metricInfo[i].scale;
+	}
+	segment->numMetrics = METRIC_COUNT;
+	segment->slotSize = sizeof(METRIC_SLOT);
+	segment->processId = GetCurrentProcessId();
+	segment->startTime = timeGetTime();
+	segment->version = METRICS_VERSION;
+	MemoryBarrier();
+	segment->magic = METRICS_MAGIC;
+}
+// ----------------------------------------------------------------------------
+
+void metricsClose()
+{
+	if (segment != 0 && segment != &localSegment)
+	{
+		segment->magic = 0;
+		UnmapViewOfFile(segment);
+		CloseHandle(metricsMapping);
+	}
+	segment = 0;
+	metricsMapping = 0;
+}
+// ----------------------------------------------------------------------------
+
+static METRICS_SEGMENT* writeSegment()
+{
+	return (segment != 0) ? segment : &localSegment;
+}
+
+void metricAdd(int id, LONGLONG delta)
+{
+	InterlockedExchangeAdd64(&writeSegment()->slots[id].value, delta);
+}
+
+void metricSet(int id, LONGLONG value)
+{
+	InterlockedExchange64(&writeSegment()->slots[id].value, value);
+}
+
+void metricObserve(int id, LONGLONG value)
+{
+	METRIC_SLOT* slot = &writeSegment()->slots[id];
+	if (value < 0)
+		value = 0;
+
+	int bucket = 0;
+	while (bucket < METRICS_BUCKETS - 1 && (value >> (bucket + 1)) != 0)
+		bucket++;
+
+	InterlockedIncrement64(&slot->buckets[bucket]);
+	InterlockedExchangeAdd64(&slot->sum, value);
+	InterlockedIncrement64(&slot->value);
+
+	LONGLONG prevMax = slot->max;
+	while (value > prevMax)
+	{
+		LONGLONG seen = InterlockedCompareExchange64(&slot->max, value, prevMax);
+		if (seen == prevMax)
+			break;
+		prevMax = seen;
+	}
+}
+
+void metricsHeartbeat()
+{
+	InterlockedIncrement64(&writeSegment()->heartbeat);
+}
+
+// ============================================================================
+//monitor
+
+//upper bound of the bucket holding the given fraction of the observations
+static LONGLONG percentile(const LONGLONG* buckets, LONGLONG count, double fraction)
+{
+	LONGLONG target = (LONGLONG)(count * fraction);
+	LONGLONG seen = 0;
+	for (int i = 0; i < METRICS_BUCKETS; i++)
+	{
+		seen += buckets[i];
+		if (seen > target)
+			return (LONGLONG)1 << (i + 1);
+	}
+	return (LONGLONG)1 << METRICS_BUCKETS;
+}
+
+int runMetricsMonitor()
+{
+	HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, METRICS_SEGMENT_NAME);
+	if (mapping == 0)
+	{
+		printf("No running instance found (%s)\n", METRICS_SEGMENT_NAME);
+		return -1;
+	}
+	const METRICS_SEGMENT* shared = (const METRICS_SEGMENT*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(METRICS_SEGMENT));
+	if (shared == 0 || shared->magic != METRICS_MAGIC || shared->version != METRICS_VERSION || shared->slotSize != sizeof(METRIC_SLOT))
+	{
+		printf("Metrics segment has an unknown layout\n");
+		if (shared != 0)
+			UnmapViewOfFile(shared);
+		CloseHandle(mapping);
+		return -1;
+	}
+
+	//previous snapshot, for rates and per-interval histograms
+	static METRICS_SEGMENT prev;
+	memcpy(&prev, shared, sizeof(METRICS_SEGMENT));
+	DWORD prevTime = timeGetTime();
+
+	printf("Monitoring process %u; press any key to stop\n", shared->processId);
+	while (!_kbhit())
+	{
+		Sleep(MONITOR_INTERVAL);
+		if (shared->magic != METRICS_MAGIC)
+		{
+			printf("Instance exited\n");
+			break;
+		}
+
+		static METRICS_SEGMENT now;
+		memcpy(&now, shared, sizeof(METRICS_SEGMENT));
+		DWORD currentTime = timeGetTime();
+		double seconds = (double)(currentTime - prevTime) / 1000;
+		if (seconds <= 0)
+			seconds = 1;
+
+		printf("\n--- %.1f s, %lld frames/s heartbeat ---\n", (double)(currentTime - now.startTime) / 1000,
+			(long long)((now.heartbeat - prev.heartbeat) / seconds));
+		for (int i = 0; i < now.numMetrics && i < METRICS_MAX; i++)
+		{
+			const METRIC_SLOT* slot = &now.slots[i];
+			const METRIC_SLOT* old = &prev.slots[i];
+			double scale = (slot->scale > 0) ? slot->scale : 1;
+			switch (slot->type)
+			{
+			case METRIC_TYPE_COUNTER:
+				printf("%-24s %12lld  %10.1f /s\n", slot->name, (long long)slot->value,
+					(slot->value - old->value) / seconds);
+				break;
+			case METRIC_TYPE_GAUGE:
+				printf("%-24s %12.3f\n", slot->name, slot->value / scale);
+				break;
+			case METRIC_TYPE_HISTOGRAM:
+			{
+				LONGLONG buckets[METRICS_BUCKETS];
+				for (int b = 0; b < METRICS_BUCKETS; b++)
+					buckets[b] = slot->buckets[b] - old->buckets[b];
+				LONGLONG count = slot->value - old->value;
+				if (count > 0)
+				{
+					printf("%-24s n=%-6lld avg %9.1f  p50 <%-7lld p99 <%-7lld max %lld\n", slot->name, (long long)count,
+						(double)(slot->sum - old->sum) / count, (long long)percentile(buckets, count, 0.5),
+						(long long)percentile(buckets, count, 0.99), (long long)slot->max);
+				}
+				else
+				{
+					printf("%-24s n=0\n", slot->name);
+				}
+				break;
+			}
+			}
+		}
+
+		memcpy(&prev, &now, sizeof(METRICS_SEGMENT));
+		prevTime = currentTime;
+	}
+
+	UnmapViewOfFile(shared);
+	CloseHandle(mapping);
+	return 0;
+}
@@ -0,0 +1,157 @@
+#ifndef METRICS
+#define METRICS
+// ============================================================================
+
+//Live metrics published through a named shared memory segment
+//Every metric is a fixed slot in the segment and is updated with interlocked
+//operations, so the video threads never take a lock and a monitor in another
+//process (Raven_Stereoscopic.exe -monitor) can read it at any time
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+
+#define		METRICS_SEGMENT_NAME	"Local\\RavenStereoMetrics"
+#define		METRICS_MAGIC			0x544D5652	//"RVMT"
+#define		METRICS_VERSION			1			//bump when the segment layout changes
+#define		METRICS_MAX				64			//metric slots in the segment
+#define		METRICS_NAME_LENGTH		32
+#define		METRICS_BUCKETS			20			//histogram bucket i counts values in [2^i, 2^(i+1)) (bucket 0 also holds 0)
+
+//all metrics; per-eye metrics come in pairs with the left eye first, index with + eye (0 left, 1 right)
+enum MetricId
+{
+	//capture (FL3Camera::grabFrame)
+	METRIC_CAPTURE_FRAMES,				//frames delivered by the camera
+	METRIC_CAPTURE_FRAMES_R,
+	METRIC_CAPTURE_DROPS,				//frames overwritten before they were displayed
+	METRIC_CAPTURE_DROPS_R,
+	METRIC_CAPTURE_FPS,					//low pass filtered capture rate, milli fps
+	METRIC_CAPTURE_FPS_R,
+	METRIC_CONVERT_US,					//histogram: Bayer to RGB conversion
+	METRIC_CONVERT_US_R,
+	METRIC_COPY_US,						//histogram: copy into the display buffer
+	METRIC_COPY_US_R,
+
+	//display
+	METRIC_DISPLAY_FRAMES,				//frames presented
+	METRIC_DISPLAY_FPS,					//low pass filtered display rate, milli fps
+	METRIC_PAIR_SKEW_US,				//histogram: difference between left and right capture times
+	METRIC_UPLOAD_US,					//histogram: texture upload
+	METRIC_DRAW_US,						//histogram: clear and quads
+	METRIC_PRESENT_US,					//histogram: buffer swap
+	METRIC_RECORD_US,					//histogram: readback and hand-off to the save thread
+	METRIC_FRAME_US,					//histogram: whole display frame
+
+	//recording
+	METRIC_READBACK_PENDING,			//readbacks in flight in the pack buffer ring
+	METRIC_READBACK_SKIPPED,			//frames not read back: every slot in flight or held by a writer, or a failed fence
+	METRIC_SAVE_BACKLOG,				//frames handed to save threads but not yet written
+	METRIC_SAVE_SKIPPED,				//frames not recorded because every save thread (or the writer's queue) was busy
+	METRIC_SAVE_FRAMES,					//frames written to disk
+	METRIC_SAVE_US,						//histogram: writing one bmp
+
+	//quality governor
+	METRIC_QUALITY_LEVEL,				//current level of the quality ladder, 0 is full quality
+	METRIC_QUALITY_CHANGES,				//level transitions
+
+	//disparity
+	METRIC_DEPTH_FRAMES,				//disparity maps computed
+	METRIC_DEPTH_SKIPPED,				//pairs offered while the previous one was still being matched
+	METRIC_DEPTH_US,					//histogram: matching one pair
+	METRIC_DEPTH_RANGE,					//disparities searched in the last map
+
+	//capture watchdog
+	METRIC_WATCHDOG_STALLS,				//times the camera stopped delivering frames
+	METRIC_WATCHDOG_STALLS_R,
+	METRIC_WATCHDOG_RESTARTS,			//restarts tried to bring the camera back
+	METRIC_WATCHDOG_RESTARTS_R,
+	METRIC_WATCHDOG_DOWNTIME_MS,		//histogram: last frame before a stall to first frame after it
+	METRIC_WATCHDOG_DOWNTIME_MS_R,
+
+	//frame bus
+	METRIC_FRAMEBUS_FRAMES,				//frames published to other processes
+	METRIC_FRAMEBUS_FRAMES_R,
+	METRIC_FRAMEBUS_US,					//histogram: copying a frame into its slot
+
+	//temporal denoise
+	METRIC_DENOISE_US,					//histogram: filtering one frame
+	METRIC_DENOISE_US_R,
+
+	//digital zoom
+	METRIC_ZOOM_US,						//histogram: resampling both eyes
+	METRIC_ZOOM_LEVEL,					//magnification, 1.000 when off
+
+	//pre-roll
+	METRIC_PREROLL_TRIGGERS,			//saves started
+	METRIC_PREROLL_WRITE_US,			//histogram: writing one frame to disk
+	METRIC_PREROLL_BACKLOG,				//frames captured but not yet saved during a save
+	METRIC_PREROLL_LOST,				//frames missing from saves: overwritten before they were written
+
+	//single file recording (-direct)
+	METRIC_RECORD_QUEUE,				//chunk writes in flight
+	METRIC_RECORD_BYTES,				//bytes written to the recording file
+	METRIC_RECORD_WRITE_US,				//histogram: one chunk write, from submission to completion
+	METRIC_RECORD_STALLS,				//times every chunk was still being written when one was needed
+	METRIC_RECORD_SYNC_WRITES,			//overlapped chunk writes that completed synchronously
+
+	//operator commands
+	METRIC_COMMANDS_APPLIED,			//commands applied by the display thread
+	METRIC_COMMANDS_DROPPED,			//commands lost to a full queue
+	METRIC_COMMAND_LATENCY_US,			//histogram: from posting a command to applying it
+
+	//GL rendering of the display
+	METRIC_RENDER_DRAWS,				//draw calls
+	METRIC_RENDER_GPU_US,				//histogram: GPU time of a frame's uploads and draws
+
+	METRIC_COUNT
+};
+
+enum MetricType
+{
+	METRIC_TYPE_COUNTER,		//monotonically increasing; monitors show the rate
+	METRIC_TYPE_GAUGE,			//current value
+	METRIC_TYPE_HISTOGRAM		//distribution of observed values
+};
+
+//one metric as laid out in the shared segment; 64-bit values are aligned so plain reads are atomic
+struct METRIC_SLOT
+{
+	char name[METRICS_NAME_LENGTH];
+	LONG type;
+	LONG scale;							//divide the value by this for display (e.g. 1000 for milli units)
+	volatile LONGLONG value;			//counter or gauge value; histograms: number of observations
+	volatile LONGLONG sum;				//histograms: sum of observed values
+	volatile LONGLONG max;				//histograms: largest observed value
+	volatile LONGLONG buckets[METRICS_BUCKETS];
+};
+
+struct METRICS_SEGMENT
+{
+	LONG magic;
+	LONG version;
+	LONG numMetrics;
+	LONG slotSize;						//sizeof(METRIC_SLOT), so readers can check the layout
+	DWORD processId;					//writer process
+	DWORD startTime;					//timeGetTime() when the segment was created
+	volatile LONGLONG heartbeat;		//incremented by the writer once per displayed frame
+	METRIC_SLOT slots[METRICS_MAX];
+};
+
+//creates the shared segment (falls back to process memory if that fails); call once at startup
+void metricsOpen();
+//releases the segment
+void metricsClose();
+
+//hot path updates; lock free and safe from any thread
+void metricAdd(int id, LONGLONG delta);
+void metricSet(int id, LONGLONG value);
+void metricObserve(int id, LONGLONG value);
+void metricsHeartbeat();
+
+//reads the segment of a running instance and prints it once a second until a key is pressed
+int runMetricsMonitor();
+
+// ============================================================================
+#endif
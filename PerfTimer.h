@@ -0,0 +1,35 @@
+#ifndef PERF_TIMER
+#define PERF_TIMER
+// ============================================================================
+
+//High resolution timing helpers for measuring pipeline stages
+//timeGetTime only has ms resolution, which is too coarse for per-stage timing
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+
+//returns current value of the performance counter
+inline LONGLONG perfCounter()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+}
+
+//converts a difference between two perfCounter() values to ms
+inline double perfMs(LONGLONG ticks)
+{
+	static LONGLONG freq = 0;
+	if (freq == 0)
+	{
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		freq = f.QuadPart;
+	}
+	return (double)ticks * 1000.0 / (double)freq;
+}
+
+// ============================================================================
+#endif
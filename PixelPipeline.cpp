@@ -0,0 +1,348 @@
+
+//Fused kernels from the camera's raw format straight to the display buffer
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "PixelPipeline.h"
+
+#define		TONE_TABLE_MAX		65536	//sensor values of the deepest format
+
+//how mosaic values are read
+enum PixelSource
+{
+	SOURCE_RAW8,
+	SOURCE_RAW12,		//two pixels in three bytes
+	SOURCE_RAW16,
+
+	SOURCE_COUNT
+};
+
+//colour of a site, and for green which colour shares its row
+enum BayerSite
+{
+	SITE_RED,
+	SITE_BLUE,
+	SITE_GREEN_RED_ROW,
+	SITE_GREEN_BLUE_ROW
+};
+
+// ============================================================================
+//helpers
+
+//reflects an out of range index back into [0, size), as ImageKernels.cpp does
+static inline unsigned int mirror(int i, unsigned int size)
+{
+	if (i < 0)
+		return -i;
+	if (i >= (int)size)
+		return 2 * (size - 1) - i;
+	return i;
+}
+
+//pattern index: red at (Pattern & 1, Pattern >> 1) of the 2x2 tile
+static int patternIndex(BayerTileFormat format)
+{
+	switch (format)
+	{
+	case RGGB: return 0;
+	case GRBG: return 1;
+	case GBRG: return 2;
+	case BGGR: return 3;
+	default: return -1;
+	}
+}
+
+//rows of the mosaic as the kernels read them; RAW8 and RAW16 rows are used in place
+template <int Source>
+struct MosaicRows
+{
+	typedef unsigned char T;
+	const PIXEL_JOB* job;
+
+	MosaicRows(const PIXEL_JOB* pixelJob) : job(pixelJob) {}
+	const T* get(unsigned int y) { return job->raw + y * job->rawStride; }
+};
+
+template <>
+struct MosaicRows<SOURCE_RAW16>
+{
+	typedef unsigned short T;
+	const PIXEL_JOB* job;
+
+	MosaicRows(const PIXEL_JOB* pixelJob) : job(pixelJob) {}
+	const T* get(unsigned int y) { return (const T*)(job->raw + y * job->rawStride); }
+};
+
+//RAW12 rows are unpacked when first asked for; the last 3 are kept, which is all a bilinear row needs
+template <>
+struct MosaicRows<SOURCE_RAW12>
+{
+	typedef unsigned short T;
+	const PIXEL_JOB* job;
+	T rows[3][PIXEL_ROW_MAX];
+	unsigned int held[3];
+
+	MosaicRows(const PIXEL_JOB* pixelJob) : job(pixelJob)
+	{
+		held[0] = held[1] = held[2] = 0xFFFFFFFF;
+	}
+	const T* get(unsigned int y)
+	{
+		unsigned int slot = y % 3;
+		if (held[slot] != y)
+		{
+			unpackRaw12(job->raw + y * job->rawStride, rows[slot], job->cols);
+			held[slot] = y;
+		}
+		return rows[slot];
+	}
+};
+
+//8-bit display value of a mosaic value or an average of them
+template <int Source>
+static inline unsigned char display(unsigned int value, const unsigned char* toneTable)
+{
+	return (Source == SOURCE_RAW8) ? (unsigned char)value : toneTable[value];
+}
+
+// ============================================================================
+//bilinear demosaic, as demosaicBilinear computes it
+
+template <int Site, int Source, int Layout, typename T>
+static inline void bilinearPixel(const T* up, const T* mid, const T* down, unsigned int xl, unsigned int x, unsigned int xr,
+	unsigned char* out, const unsigned char* toneTable)
+{
+	const int red = (Layout == PIXEL_LAYOUT_RGB) ? 0 : 2;
+	if (Site == SITE_RED || Site == SITE_BLUE)
+	{
+		//green from the 4 neighbours, the opposite colour from the diagonals
+		const int own = (Site == SITE_RED) ? red : 2 - red;
+		out[own] = display<Source>(mid[x], toneTable);
+		out[1] = display<Source>((up[x] + down[x] + mid[xl] + mid[xr] + 2) >> 2, toneTable);
+		out[2 - own] = display<Source>((up[xl] + up[xr] + down[xl] + down[xr] + 2) >> 2, toneTable);
+	}
+	else
+	{
+		//the other colour of this row is left and right, the remaining one above and below
+		const int across = (Site == SITE_GREEN_RED_ROW) ? red : 2 - red;
+		out[1] = display<Source>(mid[x], toneTable);
+		out[across] = display<Source>((mid[xl] + mid[xr] + 1) >> 1, toneTable);
+		out[2 - across] = display<Source>((up[x] + down[x] + 1) >> 1, toneTable);
+	}
+}
+
+//one row whose even columns are EvenSite and odd columns OddSite; cols is even. Only the first and
+//last columns mirror their neighbours
+template <int EvenSite, int OddSite, int Source, int Layout, typename T>
+static void bilinearRow(const T* up, const T* mid, const T* down, unsigned int cols, unsigned char* out,
+	const unsigned char* toneTable)
+{
+	bilinearPixel<EvenSite, Source, Layout>(up, mid, down, 1, 0, 1, out, toneTable);
+	unsigned int x = 1;
+	for (; x + 2 < cols; x += 2)
+	{
+		bilinearPixel<OddSite, Source, Layout>(up, mid, down, x - 1, x, x + 1, out + 3 * x, toneTable);
+		bilinearPixel<EvenSite, Source, Layout>(up, mid, down, x, x + 1, x + 2, out + 3 * x + 3, toneTable);
+	}
+	bilinearPixel<OddSite, Source, Layout>(up, mid, down, x - 1, x, x - 1, out + 3 * x, toneTable);
+}
+
+template <int Pattern, int Source, int Layout>
+static void bilinearRows(const PIXEL_JOB* job, unsigned int rowBegin, unsigned int rowEnd)
+{
+	const int redX = Pattern & 1;
+	const int redY = Pattern >> 1;
+	MosaicRows<Source> mosaic(job);
+	unsigned int cols = job->cols, rows = job->rows;
+
+	for (unsigned int y = rowBegin; y < rowEnd && y < rows; y++)
+	{
+		const typename MosaicRows<Source>::T* up = mosaic.get(mirror(y - 1, rows));
+		const typename MosaicRows<Source>::T* mid = mosaic.get(y);
+		const typename MosaicRows<Source>::T* down = mosaic.get(mirror(y + 1, rows));
+		unsigned char* out = job->out + 3 * y * cols;
+
+		if ((int)(y & 1) == redY)
+		{
+			if (redX == 0)
+				bilinearRow<SITE_RED, SITE_GREEN_RED_ROW, Source, Layout>(up, mid, down, cols, out, job->toneTable);
+			else
+				bilinearRow<SITE_GREEN_RED_ROW, SITE_RED, Source, Layout>(up, mid, down, cols, out, job->toneTable);
+		}
+		else
+		{
+			if (redX == 0)
+				bilinearRow<SITE_GREEN_BLUE_ROW, SITE_BLUE, Source, Layout>(up, mid, down, cols, out, job->toneTable);
+			else
+				bilinearRow<SITE_BLUE, SITE_GREEN_BLUE_ROW, Source, Layout>(up, mid, down, cols, out, job->toneTable);
+		}
+	}
+}
+
+// ============================================================================
+//2x2 binning, as binBayer computes it
+
+template <int Pattern, int Source, int Layout>
+static void binnedRows(const PIXEL_JOB* job, unsigned int rowBegin, unsigned int rowEnd)
+{
+	const int redX = Pattern & 1;
+	const int redY = Pattern >> 1;
+	const int red = (Layout == PIXEL_LAYOUT_RGB) ? 0 : 2;
+	MosaicRows<Source> mosaic(job);
+	unsigned int outCols = job->cols / 2;
+
+	for (unsigned int y = rowBegin; y < rowEnd; y++)
+	{
+		const typename MosaicRows<Source>::T* top = mosaic.get(2 * y);
+		const typename MosaicRows<Source>::T* bottom = mosaic.get(2 * y + 1);
+		const typename MosaicRows<Source>::T* redRow = redY ? bottom : top;
+		const typename MosaicRows<Source>::T* blueRow = redY ? top : bottom;
+		unsigned char* out = job->out + 3 * y * outCols;
+
+		for (unsigned int x = 0; x < outCols; x++, out += 3)
+		{
+			unsigned int cell = 2 * x;
+			out[red] = display<Source>(redRow[cell + redX], job->toneTable);
+			out[1] = display<Source>((redRow[cell + 1 - redX] + blueRow[cell + redX] + 1) >> 1, job->toneTable);
+			out[2 - red] = display<Source>(blueRow[cell + 1 - redX], job->toneTable);
+		}
+	}
+}
+
+// ============================================================================
+//luma, as lumaBayer and lumaBin compute it; the same for every pattern
+
+template <int Source>
+static void lumaRows(const PIXEL_JOB* job, unsigned int rowBegin, unsigned int rowEnd)
+{
+	//the SSE2 kernel already reads the mosaic once
+	if (Source == SOURCE_RAW8)
+	{
+		lumaBayer8(job->raw, job->rawStride, job->cols, job->rows, job->out, rowBegin, rowEnd);
+		return;
+	}
+
+	MosaicRows<Source> mosaic(job);
+	unsigned int cols = job->cols, rows = job->rows;
+	for (unsigned int y = rowBegin; y < rowEnd && y < rows; y++)
+	{
+		const typename MosaicRows<Source>::T* top = mosaic.get(y);
+		const typename MosaicRows<Source>::T* bottom = mosaic.get(mirror(y + 1, rows));
+		unsigned char* out = job->out + y * cols;
+		for (unsigned int x = 0; x + 1 < cols; x++)
+			out[x] = display<Source>((top[x] + top[x + 1] + bottom[x] + bottom[x + 1] + 2) >> 2, job->toneTable);
+		unsigned int x = cols - 1;
+		out[x] = display<Source>((top[x] + top[x - 1] + bottom[x] + bottom[x - 1] + 2) >> 2, job->toneTable);
+	}
+}
+
+template <int Source>
+static void lumaBinnedRows(const PIXEL_JOB* job, unsigned int rowBegin, unsigned int rowEnd)
+{
+	if (Source == SOURCE_RAW8)
+	{
+		lumaBin8(job->raw, job->rawStride, job->cols, job->out, rowBegin, rowEnd);
+		return;
+	}
+
+	MosaicRows<Source> mosaic(job);
+	unsigned int outCols = job->cols / 2;
+	for (unsigned int y = rowBegin; y < rowEnd; y++)
+	{
+		const typename MosaicRows<Source>::T* top = mosaic.get(2 * y);
+		const typename MosaicRows<Source>::T* bottom = mosaic.get(2 * y + 1);
+		unsigned char* out = job->out + y * outCols;
+		for (unsigned int x = 0; x < outCols; x++)
+			out[x] = display<Source>((top[2 * x] + top[2 * x + 1] + bottom[2 * x] + bottom[2 * x + 1] + 2) >> 2, job->toneTable);
+	}
+}
+
+// ============================================================================
+//the kernel family, indexed [source][layout][pattern]
+
+#define		PATTERN_KERNELS(kernel, source, layout) \
+	{ kernel<0, source, layout>, kernel<1, source, layout>, kernel<2, source, layout>, kernel<3, source, layout> }
+#define		LAYOUT_KERNELS(kernel, luma, source) \
+	{ PATTERN_KERNELS(kernel, source, PIXEL_LAYOUT_RGB), PATTERN_KERNELS(kernel, source, PIXEL_LAYOUT_BGR), \
+	{ luma<source>, luma<source>, luma<source>, luma<source> } }
+
+static const PixelKernel fullKernels[SOURCE_COUNT][3][4] = {
+	LAYOUT_KERNELS(bilinearRows, lumaRows, SOURCE_RAW8),
+	LAYOUT_KERNELS(bilinearRows, lumaRows, SOURCE_RAW12),
+	LAYOUT_KERNELS(bilinearRows, lumaRows, SOURCE_RAW16) };
+
+static const PixelKernel binnedKernels[SOURCE_COUNT][3][4] = {
+	LAYOUT_KERNELS(binnedRows, lumaBinnedRows, SOURCE_RAW8),
+	LAYOUT_KERNELS(binnedRows, lumaBinnedRows, SOURCE_RAW12),
+	LAYOUT_KERNELS(binnedRows, lumaBinnedRows, SOURCE_RAW16) };
+
+//every sensor value once, for building tone tables
+static unsigned short toneRamp[TONE_TABLE_MAX];
+
+static bool initToneRamp()
+{
+	for (int i = 0; i < TONE_TABLE_MAX; i++)
+		toneRamp[i] = (unsigned short)i;
+	return true;
+}
+static bool toneRampReady = initToneRamp();
+
+// ============================================================================
+
+bool selectPixelKernels(PixelFormat format, BayerTileFormat bayer, PixelLayout layout, unsigned int cols, PIXEL_KERNELS* kernels)
+{
+	int source;
+	switch (format)
+	{
+	case PIXEL_FORMAT_RAW8: source = SOURCE_RAW8; break;
+	case PIXEL_FORMAT_RAW12: source = SOURCE_RAW12; break;
+	case PIXEL_FORMAT_RAW16: source = SOURCE_RAW16; break;
+	default: return false;
+	}
+	int pattern = patternIndex(bayer);
+	if (pattern < 0 || (source == SOURCE_RAW12 && cols > PIXEL_ROW_MAX))
+		return false;
+
+	kernels->full = fullKernels[source][layout][pattern];
+	kernels->binned = binnedKernels[source][layout][pattern];
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+double pixelSampleMean(PixelFormat format, const PIXEL_JOB* job)
+{
+	//the positions toneCurveUpdate samples in the unpacked mosaic, walked row by row
+	double sum = 0;
+	unsigned int n = 0;
+	unsigned int x = 0, y = 0;
+	while (y < job->rows)
+	{
+		const unsigned char* row = job->raw + y * job->rawStride;
+		if (format == PIXEL_FORMAT_RAW12)
+		{
+			const unsigned char* p = row + (x / 2) * 3;
+			sum += (x & 1) ? ((p[2] << 4) | (p[1] >> 4)) : ((p[0] << 4) | (p[1] & 0x0F));
+		}
+		else
+		{
+			sum += ((const unsigned short*)row)[x];
+		}
+		n++;
+
+		x += TONE_SAMPLE_STEP;
+		while (x >= job->cols)
+		{
+			x -= job->cols;
+			y++;
+		}
+	}
+	return (n > 0) ? sum / n : 0;
+}
+// ----------------------------------------------------------------------------
+
+void buildToneTable(const TONE_CURVE* curve, unsigned char* table)
+{
+	toneMap16(toneRamp, table, 1 << curve->bitDepth, curve);
+}
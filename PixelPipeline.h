@@ -0,0 +1,64 @@
+#ifndef PIXEL_PIPELINE
+#define PIXEL_PIPELINE
+// ============================================================================
+
+//Fused kernels from the camera's raw format straight to the display buffer
+//The kernels cover the bilinear and 2x2 binned conversions and luma, at every bit depth; the
+//SDK's edge sensing demosaic of the full quality level is not fused and stays one Convert call.
+//A kernel is generated for every combination of Bayer pattern, raw format (RAW8, packed
+//RAW12, RAW16), channel order and destination layout, so the colour of each site and the
+//way a value is read are constants inside the loops rather than lookups per pixel. High bit
+//depth rows are unpacked as the kernel reaches them and tone mapped through a table as each
+//pixel is written: a frame goes from the camera's buffer to 8-bit display pixels in one
+//pass, with no unpacked mosaic or 16-bit RGB frame in between. The output matches the
+//ImageKernels functions (demosaic, binning, luma, then toneMap16) byte for byte.
+//A camera selects its RGB or luma kernels once, when it knows its format and pattern; the
+//BGR ones write bitmap order for the pre-roll export
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "ImageKernels.h"
+
+#define		PIXEL_ROW_MAX		8192	//widest RAW12 mosaic; the kernels unpack 3 of its rows at a time on the stack
+
+//what the display buffer holds
+enum PixelLayout
+{
+	PIXEL_LAYOUT_RGB,		//3 bytes per pixel, as GL_RGB, the frame bus, the zoom and the disparity search take them
+	PIXEL_LAYOUT_BGR,		//3 bytes per pixel in the order of GL_BGR_EXT and bitmaps
+	PIXEL_LAYOUT_LUMA		//1 byte per pixel
+};
+
+//a frame being converted
+struct PIXEL_JOB
+{
+	const unsigned char* raw;			//mosaic as the camera delivered it
+	unsigned int rawStride;				//bytes per mosaic row
+	unsigned int cols, rows;			//size of the mosaic
+	unsigned char* out;					//output rows, not padded
+	const unsigned char* toneTable;		//display value of each sensor value; high bit depth only
+};
+
+//converts output rows [rowBegin, rowEnd); bands can run in parallel
+typedef void (*PixelKernel)(const PIXEL_JOB* job, unsigned int rowBegin, unsigned int rowEnd);
+
+struct PIXEL_KERNELS
+{
+	PixelKernel full;		//bilinear demosaic, or luma, at the mosaic's size
+	PixelKernel binned;		//2x2 binned, half the size
+};
+
+// ============================================================================
+
+//picks the kernels for a raw format, the Bayer pattern at the mosaic's top left corner and a layout.
+//Returns false if there are none: not a Bayer raw format, or a RAW12 mosaic wider than PIXEL_ROW_MAX
+bool selectPixelKernels(PixelFormat format, BayerTileFormat bayer, PixelLayout layout, unsigned int cols, PIXEL_KERNELS* kernels);
+
+//mean of the sensor values toneCurveUpdate would sample, read from a RAW12 or RAW16 mosaic as delivered
+double pixelSampleMean(PixelFormat format, const PIXEL_JOB* job);
+//fills table (1 << curve->bitDepth entries) with toneMap16 of every sensor value
+void buildToneTable(const TONE_CURVE* curve, unsigned char* table);
+
+// ============================================================================
+#endif
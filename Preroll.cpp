@@ -0,0 +1,438 @@
+
+//Pre-roll ring of raw stereo frames
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "Preroll.h"
+#include "Metrics.h"
+#include "PerfTimer.h"
+#include "Trace.h"
+#include "PixelPipeline.h"
+#include "RecordWriter.h"
+#include <mmsystem.h>
+
+#define		PREROLL_POLL_MS		5		//writer wait for the next frame before it looks again
+
+//who has a slot
+enum SlotState
+{
+	SLOT_EMPTY,			//never filled
+	SLOT_READY,			//holds the frame of its sequence number
+	SLOT_FILLING,		//a capture thread is copying a frame in
+	SLOT_SAVING			//the writer is saving it
+};
+
+struct PREROLL_SLOT
+{
+	volatile LONG state;		//SlotState
+	volatile LONG sequence;		//frame the slot holds, counted over both eyes
+	volatile LONG missed;		//latest frame that could not be put in the slot
+	PREROLL_FRAME frame;
+};
+
+static unsigned char* ringMemory = 0;
+static PREROLL_SLOT* slots = 0;
+static LONG numSlots = 0;
+static unsigned int slotBytes = 0;
+static double ringFps = 0;
+static volatile LONG head = 0;			//frames handed to the ring so far; the next one's sequence
+
+//trigger being saved
+static volatile LONG saving = 0;
+static LONG saveBegin, saveEnd;			//sequences to save, [begin, end)
+static DWORD triggerTime;
+static int fileCount = 0;
+
+static HANDLE writerThread = 0;
+static HANDLE triggerEvent = 0;			//set by prerollTrigger
+static HANDLE frameEvent = 0;			//set by prerollPush while saving
+static HANDLE stopEvent = 0;			//set by prerollClose
+static char* prerollBase = 0;
+static FILE* prerollLog = 0;
+
+//prints a line and adds it to the log
+static void prerollPrint(const char* buffer)
+{
+	printf(buffer);
+	if (prerollLog != 0)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), prerollLog);
+	}
+}
+// ----------------------------------------------------------------------------
+
+static unsigned char* slotData(LONG sequence)
+{
+	return ringMemory + (size_t)(sequence % numSlots) * slotBytes;
+}
+
+// ============================================================================
+//writer
+
+//writes one frame from its slot
+static bool writeFrame(HANDLE file, LONG sequence)
+{
+	PREROLL_SLOT* slot = &slots[sequence % numSlots];
+	LONGLONG start = perfCounter();
+	DWORD written = 0;
+	bool ok = WriteFile(file, &slot->frame, sizeof(PREROLL_FRAME), &written, NULL) && written == sizeof(PREROLL_FRAME);
+	ok = ok && WriteFile(file, slotData(sequence), slot->frame.bytes, &written, NULL) && written == (DWORD)slot->frame.bytes;
+	LONGLONG end = perfCounter();
+	traceSpan("preroll write", start, end, slot->frame.frameNum);
+	metricObserve(METRIC_PREROLL_WRITE_US, (LONGLONG)(perfMs(end - start) * 1000));
+	return ok;
+}
+// ----------------------------------------------------------------------------
+
+//saves the frames of the current trigger to a new file, oldest first
+static void saveTrigger()
+{
+	char buffer[200];
+	char* path = (char*)malloc(strlen(prerollBase) * 2 + 30);
+	sprintf(path, "%s\\%s_preroll-%d.raw", prerollBase, prerollBase, fileCount++);
+	HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		sprintf(buffer, "Could not create pre-roll file %s\n", path);
+		prerollPrint(buffer);
+		free(path);
+		InterlockedExchange(&saving, 0);
+		return;
+	}
+
+	PREROLL_FILE_HEADER header;
+	memset(&header, 0, sizeof(header));
+	header.magic = PREROLL_MAGIC;
+	header.version = PREROLL_VERSION;
+	header.frameSize = sizeof(PREROLL_FRAME);
+	header.triggerTime = triggerTime;
+	DWORD written = 0;
+	bool ok = WriteFile(file, &header, sizeof(header), &written, NULL) != 0;
+
+	bool stopping = false;
+	for (LONG s = saveBegin; s < saveEnd && ok; s++)
+	{
+		PREROLL_SLOT* slot = &slots[s % numSlots];
+		metricSet(METRIC_PREROLL_BACKLOG, head - s);
+		//wait until the frame is in its slot, was dropped, or was overwritten before we got to it
+		for (;;)
+		{
+			if (slot->missed == s)
+			{
+				header.lost++;
+				metricAdd(METRIC_PREROLL_LOST, 1);
+				break;
+			}
+			if (InterlockedCompareExchange(&slot->state, SLOT_SAVING, SLOT_READY) == SLOT_READY)
+			{
+				LONG held = slot->sequence;
+				if (held == s)
+				{
+					ok = writeFrame(file, s);
+					header.frames++;
+				}
+				InterlockedExchange(&slot->state, SLOT_READY);
+				if (held == s)
+					break;
+				if (held > s)
+				{
+					header.lost++;
+					metricAdd(METRIC_PREROLL_LOST, 1);
+					break;
+				}
+			}
+			//no more frames are coming once the cameras have stopped
+			if (stopping && s >= head)
+				break;
+			HANDLE events[2] = { stopEvent, frameEvent };
+			if (WaitForMultipleObjects(2, events, FALSE, PREROLL_POLL_MS) == WAIT_OBJECT_0)
+				stopping = true;
+		}
+		if (stopping && s >= head)
+			break;
+	}
+	metricSet(METRIC_PREROLL_BACKLOG, 0);
+
+	//the frame count goes in last
+	LARGE_INTEGER zero;
+	zero.QuadPart = 0;
+	if (SetFilePointerEx(file, zero, NULL, FILE_BEGIN))
+		ok = WriteFile(file, &header, sizeof(header), &written, NULL) && ok;
+	CloseHandle(file);
+
+	sprintf(buffer, "%s %ld pre-roll frames (%ld lost) to %s\n", ok ? "Saved" : "Failed after", header.frames, header.lost, path);
+	prerollPrint(buffer);
+	free(path);
+	InterlockedExchange(&saving, 0);
+}
+// ----------------------------------------------------------------------------
+
+static DWORD WINAPI prerollWriter(LPVOID)
+{
+	traceThreadName("preroll");
+	HANDLE events[2] = { stopEvent, triggerEvent };
+	while (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+		saveTrigger();
+	traceThreadExit();
+	return 0;
+}
+
+// ============================================================================
+//public functions
+
+bool prerollOpen(const char* baseFilename, unsigned int frameBytes, double fps, double seconds, FILE* logFile)
+{
+	char buffer[200];
+	prerollClose();
+	prerollLog = logFile;
+
+	//both eyes for the whole time, and the slots the writer leaves alone
+	slotBytes = (frameBytes + PREROLL_PAGE - 1) & ~(PREROLL_PAGE - 1);
+	LONG wanted = (LONG)(seconds * fps * 2 + 0.5) + PREROLL_GUARD;
+	LONG fit = (LONG)(((LONGLONG)PREROLL_MEMORY_MAX_MB << 20) / slotBytes);
+	numSlots = (wanted < fit) ? wanted : fit;
+	size_t size = (size_t)numSlots * slotBytes;
+	if (numSlots > PREROLL_GUARD)
+		ringMemory = (unsigned char*)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (ringMemory == 0)
+	{
+		sprintf(buffer, "Could not allocate the pre-roll ring (%ld slots of %u bytes)\n", numSlots, slotBytes);
+		prerollPrint(buffer);
+		numSlots = 0;
+		return false;
+	}
+	//touched once here, so the capture threads never take the page faults
+	memset(ringMemory, 0, size);
+
+	slots = new PREROLL_SLOT[numSlots];
+	for (LONG i = 0; i < numSlots; i++)
+	{
+		slots[i].state = SLOT_EMPTY;
+		slots[i].sequence = -1;
+		slots[i].missed = -1;
+	}
+	ringFps = fps;
+	head = 0;
+	saving = 0;
+	prerollBase = _strdup(baseFilename);
+
+	triggerEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	frameEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	writerThread = CreateThread(NULL, 0, prerollWriter, 0, 0, NULL);
+	//the disk can wait; the display and capture threads cannot
+	SetThreadPriority(writerThread, THREAD_PRIORITY_BELOW_NORMAL);
+
+	sprintf(buffer, "Pre-roll: last %.1f s of both eyes in %ld slots of %u bytes (%u MB)\n",
+		(numSlots - PREROLL_GUARD) / (2 * fps), numSlots, slotBytes, (unsigned int)(size >> 20));
+	prerollPrint(buffer);
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+void prerollClose()
+{
+	if (slots == 0)
+		return;
+
+	//the writer saves what it has of a trigger in progress, then exits
+	SetEvent(stopEvent);
+	WaitForSingleObject(writerThread, INFINITE);
+	CloseHandle(writerThread);
+	CloseHandle(triggerEvent);
+	CloseHandle(frameEvent);
+	CloseHandle(stopEvent);
+	writerThread = triggerEvent = frameEvent = stopEvent = 0;
+
+	VirtualFree(ringMemory, 0, MEM_RELEASE);
+	delete[] slots;
+	free(prerollBase);
+	ringMemory = 0;
+	slots = 0;
+	prerollBase = 0;
+	numSlots = 0;
+}
+// ----------------------------------------------------------------------------
+
+void prerollPush(int eye, FlyCapture2::Image* raw, unsigned int frameNum, DWORD captureTime, unsigned int offset)
+{
+	if (slots == 0)
+		return;
+	LONGLONG start = perfCounter();
+
+	unsigned int bytes = raw->GetStride() * raw->GetRows();
+	LONG sequence = InterlockedIncrement(&head) - 1;
+	PREROLL_SLOT* slot = &slots[sequence % numSlots];
+
+	//the writer is a whole ring behind and still has the slot, or the frame is larger than the profile's:
+	//this frame is left out rather than waited for
+	LONG state = slot->state;
+	if (bytes > slotBytes || state == SLOT_FILLING || state == SLOT_SAVING
+		|| InterlockedCompareExchange(&slot->state, SLOT_FILLING, state) != state)
+	{
+		InterlockedExchange(&slot->missed, sequence);
+		if (saving)
+			SetEvent(frameEvent);
+		return;
+	}
+
+	slot->frame.eye = eye;
+	slot->frame.frameNum = frameNum;
+	slot->frame.captureTime = captureTime;
+	slot->frame.cols = raw->GetCols();
+	slot->frame.rows = raw->GetRows();
+	slot->frame.stride = raw->GetStride();
+	slot->frame.pixelFormat = raw->GetPixelFormat();
+	slot->frame.bayer = raw->GetBayerTileFormat();
+	slot->frame.offset = offset;
+	slot->frame.bytes = bytes;
+	memcpy(slotData(sequence), raw->GetData(), bytes);
+	slot->sequence = sequence;
+	InterlockedExchange(&slot->state, SLOT_READY);
+
+	if (saving)
+		SetEvent(frameEvent);
+	traceSpan("preroll", start, perfCounter(), frameNum);
+}
+// ----------------------------------------------------------------------------
+
+bool prerollTrigger(double afterSeconds)
+{
+	if (slots == 0 || InterlockedCompareExchange(&saving, 1, 0) != 0)
+		return false;
+
+	//from the oldest frame that will not be overwritten before the writer gets to it
+	LONG now = head;
+	saveBegin = now - numSlots + PREROLL_GUARD;
+	if (saveBegin < 0)
+		saveBegin = 0;
+	saveEnd = now + (LONG)(afterSeconds * ringFps * 2 + 0.5);
+	triggerTime = timeGetTime();
+	metricAdd(METRIC_PREROLL_TRIGGERS, 1);
+	SetEvent(triggerEvent);
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+bool prerollIsSaving()
+{
+	return saving != 0;
+}
+
+// ============================================================================
+//export
+
+int runPrerollExport(const char* path)
+{
+	FILE* in = fopen(path, "rb");
+	if (in == NULL)
+	{
+		printf("Could not open %s\n", path);
+		return -1;
+	}
+	PREROLL_FILE_HEADER header;
+	if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != PREROLL_MAGIC || header.version != PREROLL_VERSION
+		|| header.frameSize != sizeof(PREROLL_FRAME))
+	{
+		printf("%s is not a version %d pre-roll file\n", path, PREROLL_VERSION);
+		fclose(in);
+		return -1;
+	}
+
+	//the bitmaps are named after the file
+	static const char* eyeNames[2] = { "left", "right" };
+	size_t stem = strlen(path);
+	if (stem > 4 && strcmp(path + stem - 4, ".raw") == 0)
+		stem -= 4;
+	char* outPath = (char*)malloc(stem + 40);
+
+	TONE_CURVE curves[2];
+	bool curveReady[2] = { false, false };
+	unsigned char* toneTable = new unsigned char[1 << 16];
+	unsigned char* raw = 0;
+	unsigned char* pixels = 0;
+	unsigned char* bitmap = 0;
+	unsigned int rawCapacity = 0, pixelCapacity = 0;
+	LONG exported = 0, skipped = 0;
+	double convertMs = 0;
+	bool ok = true;
+
+	for (LONG i = 0; i < header.frames && ok; i++)
+	{
+		PREROLL_FRAME frame;
+		ok = fread(&frame, sizeof(frame), 1, in) == 1 && frame.bytes >= 0;
+		if (ok && (unsigned int)frame.bytes > rawCapacity)
+		{
+			delete[] raw;
+			rawCapacity = frame.bytes;
+			raw = new unsigned char[rawCapacity];
+		}
+		ok = ok && fread(raw, 1, frame.bytes, in) == (size_t)frame.bytes;
+		if (!ok)
+			break;
+
+		PixelFormat format = (PixelFormat)frame.pixelFormat;
+		PIXEL_KERNELS kernels;
+		if (frame.eye < 0 || frame.eye > 1 || frame.cols < 2 || frame.rows < 2
+			|| !selectPixelKernels(format, (BayerTileFormat)frame.bayer, PIXEL_LAYOUT_BGR, frame.cols, &kernels))
+		{
+			skipped++;
+			continue;
+		}
+
+		//bottom-up rows padded to 4 bytes after the headers, as the recording writes them
+		unsigned int rowBytes = 3 * frame.cols;
+		unsigned int paddedRow = (rowBytes + 3) & ~3;
+		unsigned int headerBytes = bitmapHeaders(0, frame.cols, frame.rows, 3);
+		if (headerBytes + paddedRow * frame.rows > pixelCapacity)
+		{
+			delete[] pixels;
+			delete[] bitmap;
+			pixelCapacity = headerBytes + paddedRow * frame.rows;
+			pixels = new unsigned char[pixelCapacity];
+			bitmap = new unsigned char[pixelCapacity];
+		}
+
+		LONGLONG start = perfCounter();
+		PIXEL_JOB job = { raw, (unsigned int)frame.stride, (unsigned int)frame.cols, (unsigned int)frame.rows, pixels, toneTable };
+		if (isHighBitDepth(format))
+		{
+			if (!curveReady[frame.eye])
+				toneCurveInit(&curves[frame.eye], rawBitDepth(format));
+			curveReady[frame.eye] = true;
+			toneCurveAdapt(&curves[frame.eye], pixelSampleMean(format, &job));
+			buildToneTable(&curves[frame.eye], toneTable);
+		}
+		kernels.full(&job, 0, frame.rows);
+		convertMs += perfMs(perfCounter() - start);
+
+		bitmapHeaders(bitmap, frame.cols, frame.rows, 3);
+		for (LONG y = 0; y < frame.rows; y++)
+		{
+			unsigned char* row = bitmap + headerBytes + (frame.rows - 1 - y) * paddedRow;
+			memcpy(row, pixels + y * rowBytes, rowBytes);
+			memset(row + rowBytes, 0, paddedRow - rowBytes);
+		}
+		sprintf(outPath, "%.*s_%s-%ld.bmp", (int)stem, path, eyeNames[frame.eye], frame.frameNum);
+		FILE* out = fopen(outPath, "wb");
+		ok = out != NULL && fwrite(bitmap, 1, headerBytes + paddedRow * frame.rows, out) == headerBytes + paddedRow * frame.rows;
+		if (out != NULL)
+			fclose(out);
+		if (!ok)
+			printf("Could not write %s\n", outPath);
+		else
+			exported++;
+	}
+	fclose(in);
+
+	printf("Exported %ld of %ld pre-roll frames (%ld not Bayer raw) to %.*s_<eye>-<frame>.bmp, %.3f ms per frame to convert%s\n",
+		exported, header.frames, skipped, (int)stem, path, (exported > 0) ? convertMs / exported : 0.0, ok ? "" : "; FAILED");
+	delete[] raw;
+	delete[] pixels;
+	delete[] bitmap;
+	delete[] toneTable;
+	free(outPath);
+	return ok ? 0 : -1;
+}
@@ -0,0 +1,80 @@
+#ifndef PREROLL
+#define PREROLL
+// ============================================================================
+
+//Always-on pre-roll of the raw stereo frames, for saving the moments before a trigger
+//Both capture threads copy each raw frame, as the camera delivered it, into the next slot
+//of one preallocated ring. That copy is the pre-roll's one cost on the capture threads;
+//-bench times it (about 2% of a 60 fps frame for 1080p RAW8, twice that for RAW16).
+//Handing the ring to the camera as its user buffers would save it, but then the driver,
+//not the writer, would decide when a slot is reused. On a trigger a writer thread saves the ring
+//from its oldest frame onwards, then the live frames that follow, straight from the slots
+//into one file. Slots are handed between the capture threads and the writer with a state
+//word, so capture never waits: a frame that finds its slot still being saved is dropped
+//from the recording, and a frame overwritten before the writer reached it is counted as lost.
+//Memory is fixed when the ring is opened
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+#include <stdio.h>
+#include "FlyCapture2.h"
+
+#define		PREROLL_SECONDS_DEF		10		//seconds kept before a trigger unless given with -preroll
+#define		PREROLL_AFTER_DEF		5		//seconds saved after a trigger unless given with -preroll
+#define		PREROLL_MEMORY_MAX_MB	1024	//the ring is shortened to fit this
+#define		PREROLL_GUARD			8		//oldest slots not saved, as they are about to be overwritten
+#define		PREROLL_PAGE			4096	//every slot starts on a page
+#define		PREROLL_MAGIC			0x52505652	//"RVPR"
+#define		PREROLL_VERSION			1		//bump when the file layout changes
+
+//start of a pre-roll file; PREROLL_FRAME headers, each followed by its raw data, come next
+struct PREROLL_FILE_HEADER
+{
+	LONG magic;
+	LONG version;
+	LONG frames;			//written when the file is complete
+	LONG frameSize;			//sizeof(PREROLL_FRAME), so readers can check the layout
+	DWORD triggerTime;		//timeGetTime() of the trigger
+	LONG lost;				//frames between the first and the last that are missing
+	LONG pad[2];
+};
+
+//one raw frame, in memory and on disk
+struct PREROLL_FRAME
+{
+	LONG eye;				//0 left, 1 right
+	LONG frameNum;			//the camera's frame count
+	DWORD captureTime;		//timeGetTime() when the frame arrived
+	LONG cols, rows, stride;	//stride in bytes
+	LONG pixelFormat;		//FlyCapture2 PixelFormat of the raw data (RAW8, RAW12 or RAW16)
+	LONG bayer;				//FlyCapture2 BayerTileFormat
+	LONG offset;			//horizontal ROI offset on the sensor, for the stereo geometry
+	LONG bytes;				//stride * rows of data after the header
+};
+
+// ============================================================================
+
+//allocates a ring for seconds of both eyes at fps, with frames of up to frameBytes, shortened to fit
+//PREROLL_MEMORY_MAX_MB, and starts the writer. Files are saved as <base>\<base>_preroll-n.raw.
+//Returns false, leaving the pre-roll off, if the memory cannot be had
+bool prerollOpen(const char* baseFilename, unsigned int frameBytes, double fps, double seconds, FILE* logFile);
+//finishes a file being saved, then releases the ring
+void prerollClose();
+//copies a raw frame into the ring; does nothing if the pre-roll is not open. Called by each camera's
+//capture thread
+void prerollPush(int eye, FlyCapture2::Image* raw, unsigned int frameNum, DWORD captureTime, unsigned int offset);
+//saves what the ring holds and the frames of the next afterSeconds; returns false if it is not open or
+//a save is still running
+bool prerollTrigger(double afterSeconds);
+//true while a trigger's frames are being saved
+bool prerollIsSaving();
+
+//converts every frame of a saved pre-roll file to a bitmap next to it, <file>_left-<frame>.bmp or
+//<file>_right-<frame>.bmp, with the bilinear kernels writing bitmap (BGR) order. High bit depth frames
+//are tone mapped with each eye's curve adapting over the frames, as the live view does. Returns 0 on success
+int runPrerollExport(const char* path);
+
+// ============================================================================
+#endif
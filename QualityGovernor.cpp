@@ -0,0 +1,187 @@
+
+//Adaptive quality governor
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "QualityGovernor.h"
+#include "Metrics.h"
+#include <string.h>
+
+static const char* levelNames[QUALITY_LEVELS] = { "full", "bilinear", "binned", "essential" };
+
+static QualityGovernor* sharedGovernor = 0;
+
+// ============================================================================
+//public functions
+QualityGovernor::QualityGovernor(double fps, FILE* log)
+{
+	InitializeCriticalSection(&lock);
+	level = QUALITY_FULL;
+	locked = false;
+	budget = 1000.0 / ((fps > 0) ? fps : 60);
+	for (int s = 0; s < GOVERNOR_SOURCES; s++)
+		average[s] = 0;
+	for (int s = 0; s < GOVERNOR_SOURCES; s++)
+		reported[s] = false;
+	observations = 0;
+	overFrames = underFrames = framesAtLevel = 0;
+	upFrames = GOVERNOR_UP_FRAMES;
+	probing = false;
+	logFile = log;
+	metricSet(METRIC_QUALITY_LEVEL, level);
+}
+// ----------------------------------------------------------------------------
+
+QualityGovernor::~QualityGovernor()
+{
+	DeleteCriticalSection(&lock);
+}
+// ----------------------------------------------------------------------------
+
+void QualityGovernor::observe(int source, double ms)
+{
+	EnterCriticalSection(&lock);
+
+	average[source] = (average[source] <= 0) ? ms : average[source] + GOVERNOR_SMOOTHING * (ms - average[source]);
+	reported[source] = true;
+	if (source != GOVERNOR_DISPLAY)
+		observations++;
+
+	//decide once per two frames of whichever eyes deliver, on the slowest of the sources that reported: a stalled
+	//or restarting camera neither stops the adapting nor holds the level down with its last average. The display
+	//thread runs beside the capture threads, so its work on a pair has the same frame budget as a conversion
+	if (!locked && observations >= 2)
+	{
+		double slowest = 0;
+		for (int s = 0; s < GOVERNOR_SOURCES; s++)
+		{
+			if (reported[s] && average[s] > slowest)
+				slowest = average[s];
+			reported[s] = false;
+		}
+		observations = 0;
+		double load = slowest / budget;
+		framesAtLevel++;
+
+		if (load > GOVERNOR_HIGH_LOAD)
+		{
+			overFrames++;
+			underFrames = 0;
+		}
+		else if (load < GOVERNOR_LOW_LOAD)
+		{
+			underFrames++;
+			overFrames = 0;
+		}
+		else
+		{
+			overFrames = underFrames = 0;
+		}
+
+		if (overFrames >= GOVERNOR_DOWN_FRAMES && level < QUALITY_LEVELS - 1)
+		{
+			//a step up that could not be held: wait longer before trying again
+			if (probing && upFrames < GOVERNOR_UP_FRAMES_MAX)
+				upFrames *= 2;
+			probing = false;
+			change(level + 1, load);
+		}
+		else if (underFrames >= upFrames && level > QUALITY_FULL)
+		{
+			probing = true;
+			change(level - 1, load);
+		}
+		else if (probing && framesAtLevel >= upFrames)
+		{
+			//the higher level held up
+			probing = false;
+			upFrames = GOVERNOR_UP_FRAMES;
+		}
+	}
+
+	LeaveCriticalSection(&lock);
+}
+// ----------------------------------------------------------------------------
+
+int QualityGovernor::getLevel()
+{
+	return level;
+}
+// ----------------------------------------------------------------------------
+
+void QualityGovernor::lockLevel(int newLevel)
+{
+	EnterCriticalSection(&lock);
+	locked = true;
+	if (newLevel != level)
+		change(newLevel, 0);
+	LeaveCriticalSection(&lock);
+}
+
+// ============================================================================
+//private functions
+
+//switches level and restarts the measurements, which were taken at the old level
+void QualityGovernor::change(int newLevel, double load)
+{
+	char buffer[150];
+	sprintf(buffer, "Quality %s -> %s (processing at %.0f%% of the %.1f ms frame budget)\n",
+		levelNames[level], levelNames[newLevel], load * 100, budget);
+	printf("%s", buffer);
+	if (logFile != 0)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+	}
+
+	InterlockedExchange(&level, newLevel);
+	for (int s = 0; s < GOVERNOR_SOURCES; s++)
+		average[s] = 0;
+	overFrames = underFrames = framesAtLevel = 0;
+	metricSet(METRIC_QUALITY_LEVEL, newLevel);
+	metricAdd(METRIC_QUALITY_CHANGES, 1);
+}
+
+// ============================================================================
+//shared governor
+
+void initQualityGovernor(double fps, FILE* log)
+{
+	closeQualityGovernor();
+	sharedGovernor = new QualityGovernor(fps, log);
+}
+
+void closeQualityGovernor()
+{
+	delete sharedGovernor;
+	sharedGovernor = 0;
+}
+
+QualityGovernor* getQualityGovernor()
+{
+	return sharedGovernor;
+}
+
+int getQualityLevel()
+{
+	return (sharedGovernor != 0) ? sharedGovernor->getLevel() : QUALITY_FULL;
+}
+// ----------------------------------------------------------------------------
+
+const char* qualityLevelName(int level)
+{
+	if (level < 0 || level >= QUALITY_LEVELS)
+		return "unknown";
+	return levelNames[level];
+}
+
+int findQualityLevel(const char* name)
+{
+	for (int i = 0; i < QUALITY_LEVELS; i++)
+	{
+		if (strcmp(levelNames[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
@@ -0,0 +1,87 @@
+#ifndef QUALITY_GOVERNOR
+#define QUALITY_GOVERNOR
+// ============================================================================
+
+//Adaptive quality governor
+//Tracks how long each eye takes to process a frame, and the display thread a pair
+//(zoom, depth hand-off and draw), against the frame budget and,
+//when the host cannot keep up, steps the conversion down a quality ladder instead
+//of letting frames be overwritten before they are displayed. Steps back up with
+//hysteresis once there is headroom again; every transition is logged
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+#include <stdio.h>
+
+#define		GOVERNOR_HIGH_LOAD		0.85	//step down when processing takes more than this fraction of the frame budget
+#define		GOVERNOR_LOW_LOAD		0.5		//fraction of the budget below which there is headroom to step up
+#define		GOVERNOR_DOWN_FRAMES	10		//frames over budget before stepping down
+#define		GOVERNOR_UP_FRAMES		120		//frames with headroom before stepping up
+#define		GOVERNOR_UP_FRAMES_MAX	1920	//the wait doubles after each step up that had to be undone, up to this
+#define		GOVERNOR_SMOOTHING		0.1		//weight of a new frame time in the running average
+#define		GOVERNOR_DISPLAY		2		//source of observe() for the display thread; 0 and 1 are the eyes
+#define		GOVERNOR_SOURCES		3
+
+//the quality ladder, best first
+enum QualityLevel
+{
+	QUALITY_FULL,			//SDK edge sensing demosaic, all stages
+	QUALITY_BILINEAR,		//bilinear demosaic
+	QUALITY_BINNED,			//2x2 binned half resolution conversion, bilinear zoom
+	QUALITY_ESSENTIAL,		//binned, and optional stages (e.g. auto exposure, depth) skipped
+	QUALITY_LEVELS
+};
+
+// ============================================================================
+
+class QualityGovernor
+{
+public:
+	//fps sets the frame budget
+	QualityGovernor(double fps, FILE* log);
+	~QualityGovernor();
+
+	//reports how long one eye took to process a frame, or (GOVERNOR_DISPLAY) how long the display thread
+	//took to zoom, hand to the depth thread and draw a pair; safe from any thread
+	void observe(int source, double ms);
+
+	//returns the level the processing stages should run at
+	int getLevel();
+	//holds the given level and stops adapting
+	void lockLevel(int);
+
+private:
+	//data
+	CRITICAL_SECTION lock;
+	volatile LONG level;
+	bool locked;
+	double budget;				//ms per frame
+	double average[GOVERNOR_SOURCES];	//smoothed processing time per source at the current level, 0 until measured
+	bool reported[GOVERNOR_SOURCES];	//sources observed since the last decision
+	int observations;			//frames of either eye observed since the last decision
+	int overFrames;				//consecutive frames over GOVERNOR_HIGH_LOAD
+	int underFrames;			//consecutive frames under GOVERNOR_LOW_LOAD
+	int framesAtLevel;
+	int upFrames;				//current wait before stepping up
+	bool probing;				//stepped up and not yet held the level for upFrames
+	FILE* logFile;
+
+	//private prototypes
+	void change(int newLevel, double load);
+};
+
+//governor shared by both eyes; null (full quality) until initQualityGovernor
+void initQualityGovernor(double fps, FILE* log);
+void closeQualityGovernor();
+QualityGovernor* getQualityGovernor();
+//level for the processing stages; QUALITY_FULL without a governor
+int getQualityLevel();
+
+//name of a level as used by -quality, and the reverse (-1 if unknown)
+const char* qualityLevelName(int);
+int findQualityLevel(const char*);
+
+// ============================================================================
+#endif
@@ -18,6 +18,27 @@ Cliff Bargar, 8/22/2014
 #include "stdafx.h"
 #include <iostream>
 #include "FL3Camera.h"
+#include "SimCamera.h"
+#include "Compositor.h"
+#include "PerfTimer.h"
+#include "AsyncReadback.h"
+#include "Metrics.h"
+#include "Benchmark.h"
+#include "TaskPool.h"
+#include "CaptureProfile.h"
+#include "QualityGovernor.h"
+#include "Disparity.h"
+#include "ShaderDemosaic.h"
+#include "GLCompositor.h"
+#include "Watchdog.h"
+#include "FrameBus.h"
+#include "Trace.h"
+#include "Denoise.h"
+#include "Zoom.h"
+#include "Preroll.h"
+#include "RecordWriter.h"
+#include "Transcode.h"
+#include "CommandQueue.h"
 
 
 //required libraries are freeglut and the FlyCap SDK:
@@ -27,8 +48,9 @@ Cliff Bargar, 8/22/2014
 using namespace FlyCapture2;
 
 //****************DEFINES****************
-#define DEFAULT_WIDTH	1280//1920
-#define DEFAULT_HEIGHT	720//1080
+//initial window size; the capture size is set by the capture profile
+#define DEFAULT_WIDTH	1280
+#define DEFAULT_HEIGHT	720
 
 #define RIGHT_SERIAL	14150448	//current serial number for Right
 #define	LEFT_SERIAL		14150447	//serial for Left
@@ -37,11 +59,21 @@ using namespace FlyCapture2;
 #define PATH_DIR		"image_data\\"
 
 #define LOGGING			true	//turns logging of general print statements on/off
+#define SAVE_THREADS_MAX	4		//bmp saves that may be in flight before recording skips frames
+
+#define HEADLESS_FRAMES_DEF			600	//frames rendered in headless mode unless given on the command line
+#define HEADLESS_REPORT_INTERVAL	120	//frames between throughput reports in headless mode
+#define HEADLESS_STALL_INTERVAL		300	//frames between stalls injected into the right camera by -stall
+#define TRACE_LATE_DEF				50	//ms a frame may take before -trace writes a timeline around it
 
 //****************VARIABLES****************
 int width = DEFAULT_WIDTH;
 int height = DEFAULT_HEIGHT;
 
+//current window size, updated by reshape
+int windowWidth = DEFAULT_WIDTH;
+int windowHeight = DEFAULT_HEIGHT;
+
 Camera* leftCam;
 Camera* rightCam;
 
@@ -54,6 +86,41 @@ FILE* dataFile;
 FILE* logFile;
 
 bool saving_on = false; //flag for turning saving on/off
+bool headless_on = false; //render offscreen on the CPU with simulated cameras - set by -headless
+PixelFormat capturePixelFormat = PIXEL_FORMAT_RAW8; //raw format requested from the cameras - set by -raw12/-raw16
+const char* captureProfileName = CAPTURE_PROFILE_DEF; //capture profile name or "auto" - set by -profile
+int fixedQuality = -1; //quality level to hold instead of adapting, -1 to adapt - set by -quality
+bool depth_on = false; //compute disparity maps from the stereo pair - set by -depth
+int displayChannels = 3; //bytes per pixel from conversion to recording: 3 for RGB, 1 for luma - set by -mono
+DisparityEstimator* disparity; //null unless depth_on
+bool shader_on = false; //upload the raw mosaics and demosaic them on the GPU - set by -shader
+ShaderDemosaic* shaderDemosaic; //null unless shader_on and the driver has shaders
+bool immediate_on = false; //draw with immediate mode quads and one shared texture instead of the single draw compositor - set by -render
+GLCompositor* glCompositor; //both eyes in one draw; null in shader mode, with -render immediate, or without GL 2.0
+GLTimer* glTimer; //GPU time of each displayed frame; null without timer queries
+CaptureWatchdog* watchdog; //restarts a camera that stops delivering frames
+bool stall_on = false; //inject stalls into the right simulated camera in headless mode - set by -stall
+DWORD stallMs = SIM_STALL_HANG; //length of each injected stall - set by -stall
+bool framebus_on = false; //publish frames to other processes through shared memory - set by -framebus
+bool trace_on = false; //write a timeline around late frames (and at the end of a headless run) - set by -trace
+double traceLateMs = TRACE_LATE_DEF; //frame time that counts as late - set by -trace
+int denoiseSigma = 0; //noise level the temporal denoiser removes, 0 for off - set by -denoise
+double zoomInitial = 1; //magnification to start with - set by -zoom
+ZoomResampler* zoom; //digital zoom and pan of both eyes; null in shader mode
+bool preroll_on = false; //keep the last seconds of raw frames for 'P' to save - set by -preroll
+double prerollSeconds = PREROLL_SECONDS_DEF; //seconds kept before a save - set by -preroll
+double prerollAfter = PREROLL_AFTER_DEF; //seconds saved after the key press - set by -preroll
+bool direct_on = false; //record into one file with unbuffered overlapped writes instead of a bmp per frame - set by -direct
+RecordWriter* recordWriter; //created with the first recorded frame when direct_on
+const char* scriptPath = 0; //file of operator commands to post as the frames go by - set by -script
+bool quit_requested = false; //set by the quit command; ends a headless run early
+volatile unsigned int displayFrameNum = 0; //number of the next frame displayed, as in the data file
+CpuCompositor* compositor; //offscreen framebuffer used in headless mode
+volatile LONG offsetSteps = 0; //stereo spacing steps posted and not yet applied to the cameras
+HANDLE offsetThread = 0; //applies posted spacing steps; 0 when none is running
+volatile LONG offsetRequests = 0; //spacing commands handed to offsetWorker
+volatile LONG offsetCovered = 0; //of those, the ones offsetWorker has applied
+volatile LONG offsetTarget[2] = { 0, 0 }; //offset generation of each camera once they are applied
 
 //buffer for image - don't want to waste time reinitializing
 unsigned char *image_buffer_l;
@@ -63,16 +130,44 @@ unsigned char *image_buffer_r;
 unsigned int rows_r, cols_r, stride_r;
 
 GLuint texid;
+AsyncReadback* readback; //pixel pack buffer ring for recording; null if not supported
 unsigned int numCameras;
 
 //timing
 DWORD startTime;
 
+//per-stage timing of the render path, summed over frames (ms)
+struct STAGE_TIMES
+{
+	double zoom;		//digital zoom of both eyes
+	double upload;		//texture upload
+	double draw;		//clear and quads (or CPU composition)
+	double present;		//buffer swap
+	double record;		//readback and hand-off to the save thread
+	double maxFrame;	//worst whole frame
+	unsigned int frames;
+};
+STAGE_TIMES stageTimes;
+
+//spacing command waiting for both eyes to deliver at its spacing before it is acknowledged
+struct PENDING_OFFSET
+{
+	COMMAND command;
+	LONG request;		//offsetRequests when it was handed over
+};
+PENDING_OFFSET pendingOffsets[COMMAND_QUEUE_SIZE];
+int numPendingOffsets = 0;
+
 //****************PROTOTYPES****************
 void PrintBuildInfo();
 void PrintError(Error);
 
 void display();//redraws images
+void applyCommands();
+void acknowledgeOffsets(LONG leftGeneration, LONG rightGeneration);
+bool saveFrame(unsigned int frameNum, const unsigned char* pixels, int w, int h, volatile LONG* release, void* userData);
+void runHeadless(unsigned int frames, double fps);
+void submitDisparity(unsigned int frameNum);
 
 //callback for keyboard "listener"
 LRESULT CALLBACK LowLevelKeyboardProc(_In_  int nCode, _In_  WPARAM wParam, _In_  LPARAM lParam);
@@ -81,61 +176,330 @@ DWORD WINAPI SaveImageFile(LPVOID lpThreadParameter);
 //allows data to be passed via lpThreadParameter
 struct IMAGE_DATA
 {
-	char* szPathName;
-	void* lpBits;
+	char szPathName[MAX_PATH];
+	const void* lpBits;		//owned by whoever handed the frame over, until release is set
 	int w;
 	int h;
+	int channels;	//3 for BGR pixels, 1 for grey
+	volatile LONG* release;
+	HANDLE thread;			//the save thread using this entry, 0 if free
 };
 
 
+/* Adds the time of one stage to the headless report and the live metrics */
+void addStageTime(double* total, int metric, LONGLONG ticks)
+{
+	double ms = perfMs(ticks);
+	*total += ms;
+	metricObserve(metric, (LONGLONG)(ms * 1000));
+}
+
+/* Draws both eyes side by side with OpenGL: right image on the left half, left image on the right half.
+The pixels are the cameras' buffers or their zoomed copies, the size of the camera frames. This is the
+immediate mode path (-render immediate): one texture is re-specified for each eye just before its quad */
+void drawFrameGL(const unsigned char* leftPixels, const unsigned char* rightPixels)
+{
+	GLenum format = (displayChannels == 1) ? GL_LUMINANCE : GL_RGB;
+	LONGLONG t0 = perfCounter();
+	if (glTimer != 0)
+		glTimer->begin();
+	// Clear color and depth buffers
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glMatrixMode(GL_MODELVIEW);     // Operate on model-view matrix
+
+	//void glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const GLvoid *data);
+	//from https://www.khronos.org/opengles/sdk/1.1/docs/man/glTexImage2D.xml internalFormat must match format
+	//the texture is specified before the quad that uses it, so each quad shows its own eye of this frame
+	glTexImage2D(GL_TEXTURE_2D, 0, format, right->getCols(), right->getRows(), 0, format, GL_UNSIGNED_BYTE, rightPixels); /* Texture specification */
+	LONGLONG t1 = perfCounter();
+
+	//displaying right image
+	/* Draw a quad */
+	glBegin(GL_QUADS);
+	glTexCoord2i(0, 0); glVertex2i(0, 0);
+	glTexCoord2i(0, 1); glVertex2i(0, height);
+	glTexCoord2i(1, 1); glVertex2i(width / 2, height);
+	glTexCoord2i(1, 0); glVertex2i(width / 2, 0);
+	glEnd();
+	LONGLONG t2 = perfCounter();
+
+	glTexImage2D(GL_TEXTURE_2D, 0, format, left->getCols(), left->getRows(), 0, format, GL_UNSIGNED_BYTE, leftPixels);
+	LONGLONG t3 = perfCounter();
+
+	//displaying left image
+	/* Draw a quad */
+	glBegin(GL_QUADS);
+	glTexCoord2i(0, 0); glVertex2i(width / 2, 0);
+	glTexCoord2i(0, 1); glVertex2i(width / 2, height);
+	glTexCoord2i(1, 1); glVertex2i(width, height);
+	glTexCoord2i(1, 0); glVertex2i(width, 0);
+	glEnd();
+	if (glTimer != 0)
+		glTimer->end();
+	LONGLONG t4 = perfCounter();
+
+	traceSpan("upload", t0, t1);
+	traceSpan("draw", t1, t2);
+	traceSpan("upload", t2, t3);
+	traceSpan("draw", t3, t4);
+	addStageTime(&stageTimes.upload, METRIC_UPLOAD_US, (t1 - t0) + (t3 - t2));
+	addStageTime(&stageTimes.draw, METRIC_DRAW_US, (t2 - t1) + (t4 - t3));
+	metricAdd(METRIC_RENDER_DRAWS, 2);
+}
+
+/* drawFrameGL with the single draw compositor: each eye is copied into its own texture, then both are drawn at once */
+void drawFrameSingle(const unsigned char* leftPixels, const unsigned char* rightPixels)
+{
+	LONGLONG t0 = perfCounter();
+	if (glTimer != 0)
+		glTimer->begin();
+	glCompositor->upload(1, rightPixels, right->getCols(), right->getRows());
+	glCompositor->upload(0, leftPixels, left->getCols(), left->getRows());
+	LONGLONG t1 = perfCounter();
+
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glCompositor->draw();
+	if (glTimer != 0)
+		glTimer->end();
+	LONGLONG t2 = perfCounter();
+
+	traceSpan("upload", t0, t1);
+	traceSpan("draw", t1, t2);
+	addStageTime(&stageTimes.upload, METRIC_UPLOAD_US, t1 - t0);
+	addStageTime(&stageTimes.draw, METRIC_DRAW_US, t2 - t1);
+	metricAdd(METRIC_RENDER_DRAWS, 1);
+}
+
+/* drawFrameGL for raw frames: uploads each eye's 1-byte mosaic and demosaics it in a fragment shader */
+void drawFrameShader()
+{
+	LONGLONG t0 = perfCounter();
+	if (glTimer != 0)
+		glTimer->begin();
+	shaderDemosaic->upload(0, left->getBuffer(), left->getCols(), left->getCols(), left->getRows());
+	shaderDemosaic->upload(1, right->getBuffer(), right->getCols(), right->getCols(), right->getRows());
+	LONGLONG t1 = perfCounter();
+
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	//the stereo offset is already applied by the camera ROI, so the whole mosaic is shown
+	shaderDemosaic->draw(1, right->getBayerFormat(), 0, 0, right->getCols(), right->getRows(), 0, windowWidth / 2, windowWidth, windowHeight);
+	shaderDemosaic->draw(0, left->getBayerFormat(), 0, 0, left->getCols(), left->getRows(), windowWidth / 2, windowWidth, windowWidth, windowHeight);
+	if (glTimer != 0)
+		glTimer->end();
+	LONGLONG t2 = perfCounter();
+
+	traceSpan("upload", t0, t1);
+	traceSpan("draw", t1, t2);
+	addStageTime(&stageTimes.upload, METRIC_UPLOAD_US, t1 - t0);
+	addStageTime(&stageTimes.draw, METRIC_DRAW_US, t2 - t1);
+	metricAdd(METRIC_RENDER_DRAWS, 2);
+}
+
+/* Headless equivalent of drawFrameGL: same layout, rendered into the CPU compositor */
+void drawFrameCPU(const unsigned char* leftPixels, const unsigned char* rightPixels)
+{
+	LONGLONG t0 = perfCounter();
+	compositor->clear();
+	//the compositor samples straight from the frames, so upload and draw are one step
+	compositor->drawQuad(0, width / 2, rightPixels, right->getCols(), right->getRows());
+	compositor->drawQuad(width / 2, width, leftPixels, left->getCols(), left->getRows());
+	LONGLONG t1 = perfCounter();
+	traceSpan("draw", t0, t1);
+	addStageTime(&stageTimes.draw, METRIC_DRAW_US, t1 - t0);
+}
+
+/* Hands a frame of pixels (bottom-up BGR or grey, rows padded to 4 bytes) to a save thread, which writes it
+as a bmp and then sets *release to 1; the pixels are not copied, so they must stay untouched until then.
+Returns false if every save thread is still busy: the frame is skipped rather than waited for.
+Also used as the completion callback of the asynchronous readback */
+bool saveFrame(unsigned int frameNum, const unsigned char* pixels, int w, int h, volatile LONG* release, void* userData)
+{
+	//the writer copies the frame into its chunks on its own thread
+	if (direct_on)
+	{
+		if (recordWriter == 0)
+			recordWriter = new RecordWriter(baseFilename, logFile);
+		if (recordWriter->post(frameNum, pixels, w, h, displayChannels, release))
+			return true;
+		metricAdd(METRIC_SAVE_SKIPPED, 1);
+		return false;
+	}
+
+	//a few saves may be in flight; take an entry whose thread has finished
+	static IMAGE_DATA saves[SAVE_THREADS_MAX];
+	IMAGE_DATA* save_data = 0;
+	for (int i = 0; i < SAVE_THREADS_MAX && save_data == 0; i++)
+	{
+		if (saves[i].thread != 0 && WaitForSingleObject(saves[i].thread, 0) == WAIT_OBJECT_0)
+		{
+			CloseHandle(saves[i].thread);
+			saves[i].thread = 0;
+		}
+		if (saves[i].thread == 0)
+			save_data = &saves[i];
+	}
+	if (save_data == 0)
+	{
+		metricAdd(METRIC_SAVE_SKIPPED, 1);
+		return false;
+	}
+
+	//assemble data required for saving bmp
+	save_data->lpBits = pixels;
+	save_data->w = w;
+	save_data->h = h;
+	save_data->channels = displayChannels;
+	save_data->release = release;
+	//create file name based on frame number and time of execution
+	sprintf(save_data->szPathName, "%s\\%s-%i.bmp", baseFilename, baseFilename, frameNum);
+
+	//create a new thread to save the image
+	metricAdd(METRIC_SAVE_BACKLOG, 1);
+	save_data->thread = CreateThread(NULL, 0, SaveImageFile, save_data, 0, NULL);
+	return true;
+}
+
+/* Records the frame that was just drawn, before it is presented. Uses the asynchronous readback if the driver
+supports it, otherwise reads back synchronously. In headless mode the compositor framebuffer itself is handed
+over, and the next frames are drawn into another one. Nothing is copied here, and nothing waits for the disk:
+a frame the writers have no room for is skipped */
+void recordFrame(unsigned int frameNum)
+{
+	if (headless_on)
+	{
+		const unsigned char* pixels = compositor->getPixels();
+		volatile LONG* release = compositor->hold();
+		if (release == 0)
+			metricAdd(METRIC_SAVE_SKIPPED, 1);
+		else if (!saveFrame(frameNum, pixels, compositor->getWidth(), compositor->getHeight(), release, 0))
+			*release = 1;
+	}
+	else if (readback != 0)
+	{
+		//delivered to saveFrame once the GPU has finished, a frame or two from now
+		readback->queue(frameNum, windowWidth, windowHeight);
+	}
+	else
+	{
+		//each buffer is read into, then held by a save thread until it has been written
+		static unsigned char* pbyData[SAVE_THREADS_MAX + 1] = { 0 };
+		static int dataSize[SAVE_THREADS_MAX + 1] = { 0 };
+		static volatile LONG released[SAVE_THREADS_MAX + 1] = { 1, 1, 1, 1, 1 };
+		int free_buffer = -1;
+		for (int i = 0; i <= SAVE_THREADS_MAX && free_buffer < 0; i++)
+		{
+			if (released[i] != 0)
+				free_buffer = i;
+		}
+		if (free_buffer < 0)
+		{
+			metricAdd(METRIC_SAVE_SKIPPED, 1);
+			return;
+		}
+
+		//checking if window size changed; reallocate if necessary
+		int size = ((displayChannels * windowWidth + 3) & ~3) * windowHeight;
+		if (dataSize[free_buffer] != size)
+		{
+			free(pbyData[free_buffer]);
+			pbyData[free_buffer] = (unsigned char*)malloc(size);
+			dataSize[free_buffer] = size;
+		}
+
+		//save current screen into the buffer; a grey picture only needs its red channel
+		glReadPixels(0, 0, windowWidth, windowHeight, (displayChannels == 1) ? GL_RED : GL_BGR_EXT, GL_UNSIGNED_BYTE, pbyData[free_buffer]);
+		released[free_buffer] = 0;
+		if (!saveFrame(frameNum, pbyData[free_buffer], windowWidth, windowHeight, &released[free_buffer], 0))
+			released[free_buffer] = 1;
+	}
+}
+
 /* Handler for window-repaint event. Called back when the window first appears and
-whenever the window needs to be re-painted. */
+whenever the window needs to be re-painted. In headless mode it is called from runHeadless instead. */
 void display()
 {
 	char buffer[50];
-	//make sure that a new frame has been grabbed by each camera since the last frame was displayed
-	if (left->checkNewFrame() && right->checkNewFrame())
+	//operator input takes effect between frames, never in the middle of one
+	applyCommands();
+
+	//make sure that a new frame has been grabbed by each camera since the last frame was displayed;
+	//while one camera is stalled the other keeps the display going, next to the stalled eye's last frame
+	bool leftStalled = watchdog != 0 && watchdog->isStalled(0);
+	bool rightStalled = watchdog != 0 && watchdog->isStalled(1);
+	bool leftReady = left->checkNewFrame();
+	bool rightReady = right->checkNewFrame();
+	//after a spacing change one camera streams again before the other: the last pair stays on screen,
+	//and the earlier spacing's frames are dropped, until both eyes deliver at the new spacing
+	LONG leftGeneration = left->getOffsetGeneration();
+	LONG rightGeneration = right->getOffsetGeneration();
+	acknowledgeOffsets(leftGeneration, rightGeneration);
+	if (leftGeneration != rightGeneration && !leftStalled && !rightStalled)
 	{
-		//clear new frame flag
+		if (leftGeneration < rightGeneration)
+		{
+			left->clearNewFrame();
+			leftReady = false;
+		}
+		else
+		{
+			right->clearNewFrame();
+			rightReady = false;
+		}
+	}
+	if ((leftReady || leftStalled) && (rightReady || rightStalled) && (leftReady || rightReady))
+	{
+		LONGLONG frameStart = perfCounter();
+		traceThreadName("display");
+
+		//hand any finished readbacks of earlier frames to the save threads
+		if (readback != 0)
+		{
+			readback->poll(false);
+			traceSpan("readback", frameStart, perfCounter());
+		}
+
+		//clear new frame flag and take the newest frames; everything below reads these, whatever
+		//the capture threads convert in the meantime
 		left->clearNewFrame();
 		right->clearNewFrame();
+		left->acquireFrame();
+		right->acquireFrame();
+
+		//magnified: both eyes are resampled from one zoom setting, so the views always match
+		LONGLONG workStart = perfCounter();
+		const unsigned char* leftPixels = left->getBuffer();
+		const unsigned char* rightPixels = right->getBuffer();
+		if (zoom != 0 && zoom->isActive() && left->getCols() == right->getCols() && left->getRows() == right->getRows())
+		{
+			//from the binned level down the governor is short of time, and the zoom drops to bilinear too
+			zoom->setTaps((getQualityLevel() >= QUALITY_BINNED) ? ZOOM_FAST_TAPS : ZOOM_TAPS);
+			LONGLONG zoomStart = perfCounter();
+			if (zoom->resample(leftPixels, rightPixels, left->getCols(), left->getRows()))
+			{
+				leftPixels = zoom->getOutput(0);
+				rightPixels = zoom->getOutput(1);
+			}
+			LONGLONG zoomEnd = perfCounter();
+			traceSpan("zoom", zoomStart, zoomEnd);
+			addStageTime(&stageTimes.zoom, METRIC_ZOOM_US, zoomEnd - zoomStart);
+		}
 
-		// Clear color and depth buffers
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		glMatrixMode(GL_MODELVIEW);     // Operate on model-view matrix
-
-		//displaying right image
-		/* Draw a quad */
-		glBegin(GL_QUADS);
-		glTexCoord2i(0, 0); glVertex2i(0, 0);
-		glTexCoord2i(0, 1); glVertex2i(0, height);
-		glTexCoord2i(1, 1); glVertex2i(width / 2, height);
-		glTexCoord2i(1, 0); glVertex2i(width / 2, 0);
-		glEnd();
-		//void glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const GLvoid *data);
-		//conceivably renders the image data as a texture
-		//from https://www.khronos.org/opengles/sdk/1.1/docs/man/glTexImage2D.xml internalFormat must match format
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, right->getCols(), right->getRows(), 0, GL_RGB, GL_UNSIGNED_BYTE, right->getBuffer()); /* Texture specification */
-		//get timestamp for saving in data file
-		unsigned long timestampRight = right->getTimestamp();
+		if (headless_on)
+			drawFrameCPU(leftPixels, rightPixels);
+		else if (shaderDemosaic != 0)
+			drawFrameShader();
+		else if (glCompositor != 0)
+			drawFrameSingle(leftPixels, rightPixels);
+		else
+			drawFrameGL(leftPixels, rightPixels);
+		double workMs = perfMs(perfCounter() - workStart);
 
-		//displaying left image
-		/* Draw a quad */
-		glBegin(GL_QUADS);
-		glTexCoord2i(0, 0); glVertex2i(width / 2, 0);
-		glTexCoord2i(0, 1); glVertex2i(width / 2, height);
-		glTexCoord2i(1, 1); glVertex2i(width, height);
-		glTexCoord2i(1, 0); glVertex2i(width, 0);
-		glEnd();
-		//if there are two cameras display left and right
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, left->getCols(), left->getRows(), 0, GL_RGB, GL_UNSIGNED_BYTE, left->getBuffer());
-		//get timestamp for saving in data file
+		//get timestamps for saving in data file
+		unsigned long timestampRight = right->getTimestamp();
 		unsigned long timestampLeft = left->getTimestamp();
 
-		glutSwapBuffers();
-
 		//variables for evaluating display rate
-		static unsigned int frameNum = 0;
+		unsigned int frameNum = displayFrameNum;
 		static DWORD prevTime = 0;
 		static double net_fps = 0, prev_fps = 0;
 		DWORD currentTime = timeGetTime(); //"retrieves the system time, in milliseconds. The system time is the time elapsed since Windows was started."
@@ -143,39 +507,34 @@ void display()
 		//only saves images if the save toggle variable is turned on - toggled by pressing 'R' (for "record")
 		if (saving_on)
 		{
-			//Save image
-			static int dataSize = 3 * glutGet(GLUT_WINDOW_WIDTH) * glutGet(GLUT_WINDOW_HEIGHT);
-			static char* pbyData = (char*)malloc(dataSize);
+			LONGLONG recordStart = perfCounter();
+			recordFrame(frameNum);
+			LONGLONG recordEnd = perfCounter();
+			traceSpan("record", recordStart, recordEnd, frameNum);
+			addStageTime(&stageTimes.record, METRIC_RECORD_US, recordEnd - recordStart);
+		}
 
-			//checking if window size changed
-			if (dataSize != 3 * glutGet(GLUT_WINDOW_WIDTH) * glutGet(GLUT_WINDOW_HEIGHT))
-			{
-				//reallocate pbyData if necessary
-				dataSize = 3 * glutGet(GLUT_WINDOW_WIDTH) * glutGet(GLUT_WINDOW_HEIGHT);
-				delete pbyData;
-				pbyData = (char*)malloc(dataSize);
-			}
+		//depth is one of the optional stages dropped when the host cannot keep up
+		if (disparity != 0 && getQualityLevel() < QUALITY_ESSENTIAL)
+		{
+			LONGLONG depthStart = perfCounter();
+			submitDisparity(frameNum);
+			workMs += perfMs(perfCounter() - depthStart);
+		}
 
-			//save current screen into buffer pbyData
-			glReadPixels(0, 0, glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT), GL_BGR_EXT, GL_UNSIGNED_BYTE, pbyData);
-
-			//assemble data required for saving bmp
-			static IMAGE_DATA* save_data = (IMAGE_DATA*)malloc(sizeof(IMAGE_DATA*));
-			save_data->lpBits = pbyData;
-			save_data->w = glutGet(GLUT_WINDOW_WIDTH);
-			save_data->h = glutGet(GLUT_WINDOW_HEIGHT);
-			//create file name based on frame number and time of execution
-			save_data->szPathName = (char*)malloc(100 * sizeof(char)); //note: I'm not sure if this is a memory leak
-			sprintf(save_data->szPathName, "%s\\%s-%i.bmp", baseFilename, baseFilename, frameNum);
-
-			static HANDLE prevThreadHandle = 0;
-			//waits for previous image to save before starting to save this one
-			if (prevThreadHandle != 0)
-			{
-				WaitForSingleObject(prevThreadHandle, INFINITE);
-			}
-			//create a new thread to save the image
-			prevThreadHandle = CreateThread(NULL, 0, SaveImageFile, save_data, 0, NULL);
+		//zoom, depth and drawing count against the frame budget like the conversions do
+		QualityGovernor* governor = getQualityGovernor();
+		if (governor != 0)
+			governor->observe(GOVERNOR_DISPLAY, workMs);
+
+		//show the new frame
+		if (!headless_on)
+		{
+			LONGLONG presentStart = perfCounter();
+			glutSwapBuffers();
+			LONGLONG presentEnd = perfCounter();
+			traceSpan("swap", presentStart, presentEnd, frameNum);
+			addStageTime(&stageTimes.present, METRIC_PRESENT_US, presentEnd - presentStart);
 		}
 
 		//calculate display rate
@@ -200,8 +559,396 @@ void display()
 		prev_fps = fps;
 		prevTime = currentTime;
 
-		frameNum++;
+		LONGLONG frameEnd = perfCounter();
+		traceSpan("frame", frameStart, frameEnd, frameNum);
+		displayFrameNum = frameNum + 1;
+
+		double frameMs = perfMs(frameEnd - frameStart);
+		//keep the timeline around a late frame, including what the other threads did after it
+		if (trace_on && frameMs > traceLateMs)
+			traceExport(TRACE_BEFORE_DEF, TRACE_AFTER_DEF, "late frame", true);
+		if (frameMs > stageTimes.maxFrame)
+			stageTimes.maxFrame = frameMs;
+		stageTimes.frames++;
+
+		//publish for the external monitor
+		//the data file's timestamps are whole milliseconds; the skew is taken from the performance counter
+		LONGLONG skew = left->getCaptureTicks() - right->getCaptureTicks();
+		metricObserve(METRIC_PAIR_SKEW_US, (LONGLONG)(perfMs(skew < 0 ? -skew : skew) * 1000));
+		metricObserve(METRIC_FRAME_US, (LONGLONG)(frameMs * 1000));
+		metricSet(METRIC_DISPLAY_FPS, (LONGLONG)(net_fps * 1000));
+		if (zoom != 0)
+			metricSet(METRIC_ZOOM_LEVEL, (LONGLONG)(zoom->getZoom() * 1000));
+		metricAdd(METRIC_DISPLAY_FRAMES, 1);
+		if (readback != 0)
+		{
+			metricSet(METRIC_READBACK_PENDING, readback->getPending());
+			//a running count: the counter gets what was skipped since the last frame
+			static unsigned int skippedPublished = 0;
+			unsigned int skipped = readback->getSkipped();
+			metricAdd(METRIC_READBACK_SKIPPED, skipped - skippedPublished);
+			skippedPublished = skipped;
+		}
+		metricsHeartbeat();
+	}
+}
+
+/* Prints throughput and average per-stage cost of the render path */
+void printStageTimes(DWORD elapsed)
+{
+	char buffer[300];
+	double n = (stageTimes.frames > 0) ? stageTimes.frames : 1;
+	sprintf(buffer, "Rendered %u frames in %.2f s: %.2f fps; per frame zoom %.3f ms, upload %.3f ms, draw %.3f ms, present %.3f ms, record %.3f ms; worst frame %.3f ms\n",
+		stageTimes.frames, (double)elapsed / 1000, stageTimes.frames / ((double)(elapsed > 0 ? elapsed : 1) / 1000),
+		stageTimes.zoom / n, stageTimes.upload / n, stageTimes.draw / n, stageTimes.present / n, stageTimes.record / n, stageTimes.maxFrame);
+	printf(buffer);
+	if (LOGGING)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+	}
+}
+
+/* Offers the current pair to the disparity thread, which drops it if it is still busy. The cameras keep the
+frames out of their conversions until that thread has reduced them, so nothing is copied here */
+void submitDisparity(unsigned int frameNum)
+{
+	if (left->getCols() != right->getCols() || left->getRows() != right->getRows())
+		return;
+	int shift = (int)left->getImageOffset() - (int)right->getImageOffset();
+	volatile LONG* releaseLeft = left->holdFrame();
+	volatile LONG* releaseRight = right->holdFrame();
+	if (releaseLeft == 0 || releaseRight == 0 || !disparity->submit(frameNum, left->getBuffer(), right->getBuffer(),
+		left->getCols(), left->getRows(), displayChannels, shift, saving_on, releaseLeft, releaseRight))
+	{
+		if (releaseLeft != 0)
+			*releaseLeft = 1;
+		if (releaseRight != 0)
+			*releaseRight = 1;
+		metricAdd(METRIC_DEPTH_SKIPPED, 1);
+	}
+}
+
+/* Starts adapting processing quality to a frame budget of 1/fps, or holds the level given by -quality.
+With the shader demosaic the level is held at bilinear, which is what the shader does */
+void startQualityGovernor(double fps)
+{
+	initQualityGovernor(fps, logFile);
+	//the shader demosaic is bilinear whatever the level, and the only one checked against it by -verify
+	if (shaderDemosaic != 0)
+		getQualityGovernor()->lockLevel(QUALITY_BILINEAR);
+	else if (fixedQuality >= 0)
+		getQualityGovernor()->lockLevel(fixedQuality);
+}
+
+/* Sizes the digital zoom for the profile's frames and applies the magnification given by -zoom */
+void startZoom(const CAPTURE_PROFILE* profile)
+{
+	zoom = new ZoomResampler(profile->width, profile->height, displayChannels);
+	zoom->setZoom(zoomInitial, 0.5, 0.5);
+}
+
+/* Keeps the last seconds of raw frames of both eyes in memory for 'P' to save */
+void startPreroll(const CAPTURE_PROFILE* profile, double fps)
+{
+	//raw rows as the cameras send them, with room for row padding
+	unsigned int rowBytes = (profile->width * busBitsPerPixel(left->getPixelFormat()) / 8 + 63) & ~63;
+	prerollOpen(baseFilename, rowBytes * profile->height, fps, prerollSeconds, logFile);
+}
+
+/* Zoom keys: + and - zoom both eyes in and out, the number pad arrows pan, 5 goes back to the whole frame.
+Returns false for any other key */
+bool zoomKey(DWORD vkCode)
+{
+	char buffer[80];
+	switch (vkCode)
+	{
+	case VK_ADD:
+	case VK_OEM_PLUS:
+		zoom->zoomIn();
+		break;
+	case VK_SUBTRACT:
+	case VK_OEM_MINUS:
+		zoom->zoomOut();
+		break;
+	case VK_NUMPAD4:
+		zoom->pan(-1, 0);
+		break;
+	case VK_NUMPAD6:
+		zoom->pan(1, 0);
+		break;
+	case VK_NUMPAD8:
+		zoom->pan(0, -1);
+		break;
+	case VK_NUMPAD2:
+		zoom->pan(0, 1);
+		break;
+	case VK_NUMPAD5:
+		zoom->setZoom(1, 0.5, 0.5);
+		break;
+	default:
+		return false;
+	}
+	sprintf(buffer, "Zoom key --> magnification %.2f\n", zoom->getZoom());
+	printf(buffer);
+	if (LOGGING)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+	}
+	return true;
+}
+
+/* True for the keys zoomKey handles */
+bool isZoomKey(DWORD vkCode)
+{
+	switch (vkCode)
+	{
+	case VK_ADD:
+	case VK_OEM_PLUS:
+	case VK_SUBTRACT:
+	case VK_OEM_MINUS:
+	case VK_NUMPAD4:
+	case VK_NUMPAD6:
+	case VK_NUMPAD8:
+	case VK_NUMPAD2:
+	case VK_NUMPAD5:
+		return true;
+	}
+	return false;
+}
+
+/* Applies the spacing steps posted so far to both cameras, on its own thread: each change restarts
+the cameras' capture, which would freeze the display for as long. Publishes the generation each camera's
+frames will have, then how many spacing commands that covers, for acknowledgeOffsets */
+DWORD WINAPI offsetWorker(LPVOID lpThreadParameter)
+{
+	traceThreadName("offset");
+	LONG steps;
+	do
+	{
+		//every request counted by now has its step in offsetSteps; steps that cancel out restart nothing
+		LONG requests = offsetRequests;
+		steps = InterlockedExchange(&offsetSteps, 0);
+		if (steps != 0)
+		{
+			InterlockedExchange(&offsetTarget[0], left->moveOffset(steps));
+			InterlockedExchange(&offsetTarget[1], right->moveOffset(steps));
+		}
+		InterlockedExchange(&offsetCovered, requests);
+	} while (steps != 0);
+	traceThreadExit();
+	return 0;
+}
+
+/* Acknowledges the spacing commands the worker has applied once frames of both eyes are at their spacing.
+The targets are read after the count, so a change applied in between can only make the wait longer */
+void acknowledgeOffsets(LONG leftGeneration, LONG rightGeneration)
+{
+	LONG covered = offsetCovered;
+	if (leftGeneration < offsetTarget[0] || rightGeneration < offsetTarget[1])
+		return;
+	int done = 0;
+	while (done < numPendingOffsets && pendingOffsets[done].request <= covered)
+	{
+		acknowledgeCommand(&pendingOffsets[done].command, displayFrameNum);
+		done++;
+	}
+	numPendingOffsets -= done;
+	memmove(pendingOffsets, pendingOffsets + done, numPendingOffsets * sizeof(PENDING_OFFSET));
+}
+
+/* Waits for a running spacing change; call before the cameras are disconnected */
+void finishOffsetChange()
+{
+	if (offsetThread != 0)
+	{
+		WaitForSingleObject(offsetThread, INFINITE);
+		CloseHandle(offsetThread);
+		offsetThread = 0;
+	}
+}
+
+/* Applies the operator commands posted since the last call, on the display thread between two frames.
+Spacing steps are handed to offsetWorker; display shows no pair until both eyes have the new spacing, and
+acknowledges the commands then */
+void applyCommands()
+{
+	char buffer[80];
+	COMMAND command;
+	while (nextCommand(&command))
+	{
+		bool pending = false;
+		switch (command.type)
+		{
+		case CMD_OFFSET_UP:
+		case CMD_OFFSET_DOWN:
+			if (command.type == CMD_OFFSET_UP)
+				InterlockedIncrement(&offsetSteps);
+			else
+				InterlockedDecrement(&offsetSteps);
+			//the queue holds no more than this, so only a backlog of restarts fills it; then it is acknowledged now
+			pending = numPendingOffsets < COMMAND_QUEUE_SIZE;
+			if (pending)
+			{
+				pendingOffsets[numPendingOffsets].command = command;
+				pendingOffsets[numPendingOffsets].request = InterlockedIncrement(&offsetRequests);
+				numPendingOffsets++;
+			}
+			break;
+		case CMD_RECORD:
+			saving_on = !saving_on;
+			break;
+		case CMD_FULLSCREEN:
+			if (!headless_on)
+				glutFullScreenToggle();
+			break;
+		case CMD_QUIT:
+			quit_requested = true;
+			if (!headless_on)
+				glutLeaveMainLoop();
+			break;
+		case CMD_TRACE:
+			traceExport(TRACE_BEFORE_DEF, 0, "key");
+			break;
+		case CMD_PREROLL:
+			if (!prerollTrigger(prerollAfter))
+			{
+				sprintf(buffer, "Pre-roll off or still saving\n");
+				printf(buffer);
+				if (LOGGING)
+				{
+					fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+				}
+			}
+			break;
+		case CMD_ZOOM:
+			if (zoom != 0)
+				zoomKey(command.arg);
+			break;
+		}
+		if (!pending)
+			acknowledgeCommand(&command, displayFrameNum);
+	}
+
+	//steps posted while a change runs are picked up by the same worker, or by the next one
+	if (offsetThread != 0 && WaitForSingleObject(offsetThread, 0) == WAIT_OBJECT_0)
+	{
+		CloseHandle(offsetThread);
+		offsetThread = 0;
+	}
+	if (offsetThread == 0 && (offsetSteps != 0 || offsetRequests != offsetCovered))
+		offsetThread = CreateThread(NULL, 0, offsetWorker, NULL, 0, NULL);
+}
+
+/* Runs the render path against simulated cameras and an offscreen CPU framebuffer, without a window or GPU.
+fps of 0 lets the simulated cameras run as fast as possible */
+void runHeadless(unsigned int frames, double fps)
+{
+	compositor = new CpuCompositor(width, height, displayChannels);
+
+	SimCamera* leftSim = new SimCamera(CAMERA_NAME_LEFT, DEFAULT_WIDTH, DEFAULT_HEIGHT, fps, capturePixelFormat);
+	SimCamera* rightSim = new SimCamera(CAMERA_NAME_RIGHT, DEFAULT_WIDTH, DEFAULT_HEIGHT, fps, capturePixelFormat);
+	left = new FL3Camera(CAMERA_NAME_LEFT, startTime, logFile);
+	left->setPixelFormat(capturePixelFormat);
+	left->setMonochrome(displayChannels == 1);
+	left->setDenoise(denoiseSigma);
+	left->connectSimulated(leftSim);
+	right = new FL3Camera(CAMERA_NAME_RIGHT, startTime, logFile);
+	right->setPixelFormat(capturePixelFormat);
+	right->setMonochrome(displayChannels == 1);
+	right->setDenoise(denoiseSigma);
+	right->connectSimulated(rightSim);
+
+	//same profile selection as with real cameras, then the requested rate instead of the profile's
+	const CAPTURE_PROFILE* profile = configureCameras(left, right, captureProfileName);
+	if (profile == 0)
+	{
+		printf("No capture profile fits\n");
+		delete left;
+		delete right;
+		delete compositor;
+		return;
+	}
+	if (profileSeparation(profile) < STEREO_SEPARATION)
+		printf("Capture profile %s puts the eyes %u sensor pixels apart instead of %u\n", profile->name, profileSeparation(profile), STEREO_SEPARATION);
+	leftSim->SetFrameRate(fps);
+	rightSim->SetFrameRate(fps);
+	startQualityGovernor((fps > 0) ? fps : profile->fps);
+	if (framebus_on)
+		frameBusOpen(3 * profile->width * profile->height);
+	if (depth_on)
+		disparity = new DisparityEstimator(baseFilename, logFile);
+	startZoom(profile);
+	if (preroll_on)
+		startPreroll(profile, profile->fps);
+
+	left->start();
+	right->start();
+	watchdog = new CaptureWatchdog(left, right, (fps > 0) ? fps : profile->fps, logFile);
+
+	if (scriptPath != 0)
+		startCommandScript(scriptPath);
+
+	DWORD runStart = timeGetTime();
+	unsigned int reported = 0;
+	unsigned int stalled = 0;
+	while (stageTimes.frames < frames && !quit_requested)
+	{
+		unsigned int before = stageTimes.frames;
+		display();
+		//nothing new from the cameras yet: give the capture threads the core
+		if (stageTimes.frames == before)
+		{
+			Sleep(0);
+			continue;
+		}
+		if (stageTimes.frames - reported >= HEADLESS_REPORT_INTERVAL)
+		{
+			printStageTimes(timeGetTime() - runStart);
+			reported = stageTimes.frames;
+		}
+		//the watchdog has to bring the camera back while the left eye carries on
+		if (stall_on && stageTimes.frames - stalled >= HEADLESS_STALL_INTERVAL)
+		{
+			rightSim->injectStall(stallMs);
+			stalled = stageTimes.frames;
+		}
+		//half way through, as if 'P' had been pressed
+		if (preroll_on && stageTimes.frames == frames / 2)
+			prerollTrigger(prerollAfter);
 	}
+	printStageTimes(timeGetTime() - runStart);
+	delete recordWriter;
+	recordWriter = 0;
+	if (trace_on)
+		traceExport(TRACE_BEFORE_DEF, 0, "end of run");
+	if (stall_on)
+		printf("Right camera recovered from %u of the injected stalls\n", watchdog->getRecoveries(1));
+
+	commandsClose();
+	finishOffsetChange();
+	delete watchdog;
+	watchdog = 0;
+	left->disconnectCamera();
+	right->disconnectCamera();
+	prerollClose();
+	//the depth thread may still be reading frames from the bus
+	delete disparity;
+	disparity = 0;
+	frameBusClose();
+	delete zoom;
+	zoom = 0;
+	delete left;
+	delete right;
+	delete compositor;
+}
+
+/* Handler for window re-size event: keeps the whole window as viewport (as freeglut's default does)
+and caches the size so it does not have to be queried every frame */
+void reshape(int w, int h)
+{
+	windowWidth = w;
+	windowHeight = h;
+	glViewport(0, 0, w, h);
 }
 
 /* Initialize OpenGL Graphics */
@@ -213,10 +960,12 @@ void initGL(int w, int h, int argc, char **argv)
 	glutInitWindowSize(DEFAULT_WIDTH, DEFAULT_HEIGHT);   // Set the window's initial width & height
 	glutCreateWindow("Raven Stereoscopic 3D");      // Create window 
 	glutDisplayFunc(display);       // Register callback handler for window re-paint event
-	//glutReshapeFunc(reshape);       // Register callback handler for window re-size event// here is the idle func registration
+	glutReshapeFunc(reshape);       // Register callback handler for window re-size event
 	glutIdleFunc(display);			//just update display when idle
 
 	/* OpenGL 2D generic init */
+	windowWidth = w;
+	windowHeight = h;
 	glViewport(0, 0, w, h); // use a screen size of WIDTH x HEIGHT
 	glEnable(GL_TEXTURE_2D);     // Enable 2D texturing
 
@@ -235,6 +984,46 @@ void initGL(int w, int h, int argc, char **argv)
 	glBindTexture(GL_TEXTURE_2D, texid); /* Binding of texture name */
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); /* We will use linear interpolation for magnification filter */
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); /* We will use linear interpolation for minifying filter */
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); /* edge pixels are not blended with the opposite edge */
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); /* camera buffer rows are not padded, which matters for 1-byte luma rows */
+
+	/* Asynchronous readback for recording, if the driver has pixel pack buffers and fences */
+	loadGLExtensions();
+	if (glReadbackSupported())
+		readback = new AsyncReadback(READBACK_SLOTS_DEF, displayChannels, saveFrame, 0);
+
+	/* GPU demosaic of RAW8 colour frames; falls back to CPU conversion without shaders */
+	if (shader_on && capturePixelFormat == PIXEL_FORMAT_RAW8 && displayChannels == 3)
+	{
+		shaderDemosaic = new ShaderDemosaic();
+		if (!shaderDemosaic->init())
+		{
+			delete shaderDemosaic;
+			shaderDemosaic = 0;
+		}
+	}
+
+	/* Both eyes in one draw from persistent textures; falls back to immediate mode quads without GL 2.0 */
+	if (shaderDemosaic == 0 && !immediate_on)
+	{
+		glCompositor = new GLCompositor();
+		if (!glCompositor->init(displayChannels))
+		{
+			delete glCompositor;
+			glCompositor = 0;
+		}
+	}
+	printf("Rendering with %s\n", (shaderDemosaic != 0) ? "the shader demosaic"
+		: (glCompositor != 0) ? "the single draw compositor" : "immediate mode quads");
+
+	/* GPU time of each frame, read back a few frames later */
+	glTimer = new GLTimer();
+	if (!glTimer->init())
+	{
+		delete glTimer;
+		glTimer = 0;
+	}
 }
 
 //adapted from pointgrey code
@@ -267,6 +1056,176 @@ int main(int argc, char **argv)
 	char buffer[100];
     PrintBuildInfo();
 
+	//command line options:
+	// -headless [frames] [fps]: render offscreen with simulated cameras and report throughput
+	// -record: start with recording turned on
+	// -monitor: print the live metrics of a running instance once a second
+	// -raw12, -raw16: capture 12/16-bit raw data and tone map it for display
+	// -bench [frames]: benchmark the image processing on synthetic frames
+	// -threads n: threads for image processing, 0 (default) for one per core
+	// -profile name: capture profile (e.g. 720p120, 1080p60), or auto (default) for the best that fits the bus
+	// -quality level: hold full, bilinear, binned or essential processing instead of adapting to the load
+	// -depth: compute disparity maps from the stereo pair (saved with recorded frames)
+	// -mono: grey display and recording, carried as 1 byte of luma per pixel from the Bayer data on
+	// -shader: upload the RAW8 mosaics and demosaic them in a fragment shader instead of on the CPU
+	// -verify: check the shader demosaic against the CPU path and the single draw compositor against immediate mode, and exit
+	// -render name: single (default) draws both eyes at once from persistent textures, immediate uses the original quads
+	// -framebus: publish every frame to other local processes through a shared memory ring
+	// -busread: read the frames a running instance publishes and print rates, latency and torn reads
+	// -stall [ms]: with -headless, stall the right camera every 300 frames, for ms or until the watchdog restarts it
+	// -denoise [sigma]: filter sensor noise of about sigma grey levels (default 4) out of each eye over time
+	// -zoom [factor]: start magnified by factor (default 2, up to 8); + and - change it, the number pad pans
+	// -preroll [seconds] [after]: keep the last seconds (default 10) of raw frames; 'P' saves them and the next after seconds (default 5)
+	// -direct: record into one file, <base>_record.bmps, with unbuffered overlapped writes instead of a bmp per frame
+	// -transcode dir: code the bitmaps and timestamps of a recorded session into dir\dir_session.rvs, using -threads, and exit
+	// -export file: convert the raw frames of a saved pre-roll file to bitmaps next to it, and exit
+	// -script file: post the operator commands in file (lines of "<frame> <command> [arg]") as the frames go by
+	// -trace [ms]: write a timeline of the pipeline threads around every frame slower than ms (default 50), at most every 10 s
+	unsigned int headlessFrames = HEADLESS_FRAMES_DEF;
+	double headlessFps = 0;
+	int processingThreads = 0;
+	const char* transcodeSession = 0;
+	const char* exportPreroll = 0;
+	bool bench_on = false;
+	unsigned int benchFrames = BENCH_FRAMES_DEF;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-headless") == 0)
+		{
+			headless_on = true;
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				headlessFrames = atoi(argv[++i]);
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				headlessFps = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-record") == 0)
+		{
+			saving_on = true;
+		}
+		else if (strcmp(argv[i], "-monitor") == 0)
+		{
+			return runMetricsMonitor();
+		}
+		else if (strcmp(argv[i], "-raw12") == 0)
+		{
+			capturePixelFormat = PIXEL_FORMAT_RAW12;
+		}
+		else if (strcmp(argv[i], "-raw16") == 0)
+		{
+			capturePixelFormat = PIXEL_FORMAT_RAW16;
+		}
+		else if (strcmp(argv[i], "-bench") == 0)
+		{
+			bench_on = true;
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				benchFrames = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+		{
+			processingThreads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+		{
+			captureProfileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "-quality") == 0 && i + 1 < argc)
+		{
+			fixedQuality = findQualityLevel(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-depth") == 0)
+		{
+			depth_on = true;
+		}
+		else if (strcmp(argv[i], "-mono") == 0)
+		{
+			displayChannels = 1;
+		}
+		else if (strcmp(argv[i], "-shader") == 0)
+		{
+			shader_on = true;
+		}
+		else if (strcmp(argv[i], "-verify") == 0)
+		{
+			return runShaderVerify(argc, argv);
+		}
+		else if (strcmp(argv[i], "-render") == 0 && i + 1 < argc)
+		{
+			immediate_on = strcmp(argv[++i], "immediate") == 0;
+		}
+		else if (strcmp(argv[i], "-framebus") == 0)
+		{
+			framebus_on = true;
+		}
+		else if (strcmp(argv[i], "-busread") == 0)
+		{
+			return runFrameBusReader();
+		}
+		else if (strcmp(argv[i], "-stall") == 0)
+		{
+			stall_on = true;
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				stallMs = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-denoise") == 0)
+		{
+			denoiseSigma = DENOISE_SIGMA_DEF;
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				denoiseSigma = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-zoom") == 0)
+		{
+			zoomInitial = ZOOM_DEF;
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				zoomInitial = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-preroll") == 0)
+		{
+			preroll_on = true;
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				prerollSeconds = atof(argv[++i]);
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				prerollAfter = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-direct") == 0)
+		{
+			direct_on = true;
+		}
+		else if (strcmp(argv[i], "-transcode") == 0 && i + 1 < argc)
+		{
+			transcodeSession = argv[++i];
+		}
+		else if (strcmp(argv[i], "-export") == 0 && i + 1 < argc)
+		{
+			exportPreroll = argv[++i];
+		}
+		else if (strcmp(argv[i], "-script") == 0 && i + 1 < argc)
+		{
+			scriptPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "-trace") == 0)
+		{
+			trace_on = true;
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				traceLateMs = atof(argv[++i]);
+		}
+	}
+
+	//offline: nothing is captured or displayed
+	if (bench_on)
+		return runBenchmark(benchFrames, processingThreads, captureProfileName);
+	if (transcodeSession != 0)
+	{
+		initTaskPool(processingThreads);
+		int result = runTranscode(transcodeSession);
+		closeTaskPool();
+		return result;
+	}
+	if (exportPreroll != 0)
+		return runPrerollExport(exportPreroll);
+
+	//live metrics for external monitoring
+	metricsOpen();
+
 	//get time for counting from beginning of program
 	startTime = timeGetTime();
 
@@ -285,15 +1244,6 @@ int main(int argc, char **argv)
 
     Error error;
 
-	//Uses the bus manager to find attached cameras
-    BusManager busMgr;
-    error = busMgr.GetNumOfCameras(&numCameras);
-    if (error != PGRERROR_OK)
-    {
-        PrintError( error );
-        return -1;
-    }
-
 	//turn logging on/off using define
 	if (LOGGING)
 	{
@@ -306,6 +1256,39 @@ int main(int argc, char **argv)
 		logFile = (FILE*)0;
 	}
 
+	//spans are always recorded; trace files go next to the log
+	CreateDirectoryA(baseFilename, NULL);
+	traceOpen(baseFilename, logFile);
+	commandsOpen(&displayFrameNum, logFile);
+
+	//worker threads shared by the conversion and compositing of both eyes; started after traceOpen so they are named
+	initTaskPool(processingThreads);
+
+	//no cameras, window or GPU needed: run the render path offscreen and exit
+	if (headless_on)
+	{
+		CreateDirectoryA(baseFilename, NULL);
+		dataFile = fopen(dataFilename, "w+");
+		runHeadless(headlessFrames, headlessFps);
+		traceClose();
+		fclose(dataFile);
+		if (LOGGING)
+			fclose(logFile);
+		closeQualityGovernor();
+		closeTaskPool();
+		metricsClose();
+		return 0;
+	}
+
+	//Uses the bus manager to find attached cameras
+    BusManager busMgr;
+    error = busMgr.GetNumOfCameras(&numCameras);
+    if (error != PGRERROR_OK)
+    {
+        PrintError( error );
+        return -1;
+    }
+
 	sprintf(buffer,"Number of cameras detected: %u\n", numCameras);
 	printf(buffer);
 	if (LOGGING)
@@ -362,6 +1345,10 @@ int main(int argc, char **argv)
 		{
 			//connect left
 			left = new FL3Camera(CAMERA_NAME_LEFT, startTime, logFile);
+			left->setPixelFormat(capturePixelFormat);
+			left->setMonochrome(displayChannels == 1);
+			left->setDenoise(denoiseSigma);
+			left->setRawOutput(shaderDemosaic != 0);
 			left->connect(guid);
 
 			//connect right camera
@@ -379,12 +1366,20 @@ int main(int argc, char **argv)
 			}
 
 			right = new FL3Camera(CAMERA_NAME_RIGHT, startTime, logFile);
+			right->setPixelFormat(capturePixelFormat);
+			right->setMonochrome(displayChannels == 1);
+			right->setDenoise(denoiseSigma);
+			right->setRawOutput(shaderDemosaic != 0);
 			right->connect(guid);
 		}
 		else
 		{
 			//connect right camera
 			right = new FL3Camera(CAMERA_NAME_RIGHT, startTime, logFile);
+			right->setPixelFormat(capturePixelFormat);
+			right->setMonochrome(displayChannels == 1);
+			right->setDenoise(denoiseSigma);
+			right->setRawOutput(shaderDemosaic != 0);
 			right->connect(guid);
 
 			//left camera
@@ -397,12 +1392,54 @@ int main(int argc, char **argv)
 			}
 
 			left = new FL3Camera(CAMERA_NAME_LEFT, startTime, logFile);
+			left->setPixelFormat(capturePixelFormat);
+			left->setMonochrome(displayChannels == 1);
+			left->setDenoise(denoiseSigma);
+			left->setRawOutput(shaderDemosaic != 0);
 			left->connect(guid);
 		}
 
+		//****choose resolution, frame rate and packet size****
+		const CAPTURE_PROFILE* profile = configureCameras(left, right, captureProfileName);
+		if (profile == 0)
+		{
+			sprintf(buffer,"No capture profile fits\n");
+			printf(buffer);
+			if (LOGGING)
+			{
+				fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+			}
+			return -1;
+		}
+		//a profile asked for by name may not leave room for the usual spacing of the eyes
+		if (profileSeparation(profile) < STEREO_SEPARATION)
+		{
+			sprintf(buffer,"Capture profile %s puts the eyes %u sensor pixels apart instead of %u\n", profile->name, profileSeparation(profile), STEREO_SEPARATION);
+			printf(buffer);
+			if (LOGGING)
+			{
+				fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+			}
+		}
+		startQualityGovernor(profile->fps);
+		//slots big enough for an RGB frame of the profile
+		if (framebus_on)
+			frameBusOpen(3 * profile->width * profile->height);
+		//the disparity search needs converted frames, which the shader path does not make
+		if (depth_on && shaderDemosaic == 0)
+			disparity = new DisparityEstimator(baseFilename, logFile);
+		//the zoom works on converted frames too
+		if (shaderDemosaic == 0)
+			startZoom(profile);
+		if (preroll_on)
+			startPreroll(profile, profile->fps);
+
 		//****start capture****
 		left->start();
 		right->start();
+		watchdog = new CaptureWatchdog(left, right, profile->fps, logFile);
+		if (scriptPath != 0)
+			startCommandScript(scriptPath);
 
 
 		//***run OpenGL***
@@ -414,6 +1451,19 @@ int main(int argc, char **argv)
 
 		//runs continuously until Esc is pressed (in keyboard hook)
 		glutMainLoop();
+
+		//the window (and its context) outlives the main loop: finish saving frames still being read back
+		delete readback;
+		readback = 0;
+		delete recordWriter;
+		recordWriter = 0;
+		delete shaderDemosaic;
+		shaderDemosaic = 0;
+		delete glCompositor;
+		glCompositor = 0;
+		delete glTimer;
+		glTimer = 0;
+
 		sprintf(buffer,"Exited main loop\n");
 		printf(buffer);
 		if (LOGGING)
@@ -422,14 +1472,26 @@ int main(int argc, char **argv)
 		}
 
 		//****disconnect cameras when glut ceases ****
+		commandsClose();
+		finishOffsetChange();
+		delete watchdog;
+		watchdog = 0;
 		left->disconnectCamera();
 		right->disconnectCamera();
+		prerollClose();
+		//the depth thread may still be reading frames from the bus
+		delete disparity;
+		disparity = 0;
+		frameBusClose();
+		delete zoom;
+		zoom = 0;
 
 		//remove keyboard hook
 		UnhookWindowsHookEx(hhkLowLevelKybd);
 
 		//close data file
 		fclose(dataFile);
+		traceClose();
 	}
 	else
 	{
@@ -442,6 +1504,9 @@ int main(int argc, char **argv)
 	}
 	if (LOGGING)
 		fclose(logFile);
+	closeQualityGovernor();
+	closeTaskPool();
+	metricsClose();
    
 	printf( "Done! Press Enter to exit...\n" );
     getchar();
@@ -450,10 +1515,25 @@ int main(int argc, char **argv)
     return 0;
 }
 
-//callback for key press hook
+/* Logs a key press and queues its command for the display thread; never waits, so the hook returns at once */
+static LRESULT postKey(const char* message, int type, LONG arg)
+{
+	char buffer[80];
+	if (postCommand(type, arg, CMD_SOURCE_KEY) != 0)
+		sprintf(buffer, "%s", message);
+	else
+		sprintf(buffer, "Command queue full, key ignored: %s", message);
+	printf(buffer);
+	if (LOGGING)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+	}
+	return 1;
+}
+
+//callback for key press hook; runs on the hook thread, so it only posts commands
 LRESULT CALLBACK LowLevelKeyboardProc(int nCode, WPARAM wParam, LPARAM lParam)
 {
-	char buffer[50];
 	if (nCode == HC_ACTION)
 	{
 		switch (wParam)
@@ -462,65 +1542,27 @@ LRESULT CALLBACK LowLevelKeyboardProc(int nCode, WPARAM wParam, LPARAM lParam)
 			PKBDLLHOOKSTRUCT p = (PKBDLLHOOKSTRUCT)lParam;
 			//leave main loop (end program, disconnect from cameras) if Esc was pressed
 			if (p->vkCode == VK_ESCAPE)
-			{
-				sprintf(buffer,"Esc pressed --> leave main loop\n");
-				printf(buffer);
-				if (LOGGING)
-				{
-					fwrite(buffer, sizeof(char), strlen(buffer), logFile);
-				}
-				glutLeaveMainLoop();
-				return 1;
-			}
-			//toggle between full screen and windowed on spacebar
+				return postKey("Esc pressed --> leave main loop\n", CMD_QUIT, 0);
+			//toggle between full screen and windowed
 			if (p->vkCode == 'F')
-			{
-				sprintf(buffer,"F --> toggle fullscreen\n");
-				printf(buffer);
-				if (LOGGING)
-				{
-					fwrite(buffer, sizeof(char), strlen(buffer), logFile);
-				}
-				glutFullScreenToggle();
-				return 1;
-			}
+				return postKey("F --> toggle fullscreen\n", CMD_FULLSCREEN, 0);
 			//toggles recording on/off
 			if (p->vkCode == 'R')
-			{
-				sprintf(buffer,"R --> toggle recording\n");
-				printf(buffer);
-				if (LOGGING)
-				{
-					fwrite(buffer, sizeof(char), strlen(buffer), logFile);
-				}
-				saving_on = !saving_on;
-				return 1;
-			}
+				return postKey("R --> toggle recording\n", CMD_RECORD, 0);
 			//use up/down arrows to adjust the stereo spacing between left and right frames
 			if (p->vkCode == VK_UP)
-			{
-				sprintf(buffer, "Up pressed --> increase stereo spacing\n");
-				printf(buffer);
-				if (LOGGING)
-				{
-					fwrite(buffer, sizeof(char), strlen(buffer), logFile);
-				}
-				left->increaseOffset();
-				right->increaseOffset();
-				return 1;
-			}
+				return postKey("Up pressed --> increase stereo spacing\n", CMD_OFFSET_UP, 0);
 			if (p->vkCode == VK_DOWN)
-			{
-				sprintf(buffer, "DOWN pressed --> decrease stereo spacing\n");
-				printf(buffer);
-				if (LOGGING)
-				{
-					fwrite(buffer, sizeof(char), strlen(buffer), logFile);
-				}
-				left->decreaseOffset();
-				right->decreaseOffset();
-				return 1;
-			}
+				return postKey("DOWN pressed --> decrease stereo spacing\n", CMD_OFFSET_DOWN, 0);
+			//writes the timeline of the last few seconds
+			if (p->vkCode == 'T')
+				return postKey("T --> write trace\n", CMD_TRACE, 0);
+			//saves the pre-roll and the frames that follow
+			if (p->vkCode == 'P')
+				return postKey("P --> save pre-roll\n", CMD_PREROLL, 0);
+			//zoom in, out and pan
+			if (zoom != 0 && isZoomKey(p->vkCode))
+				return postKey("Zoom key\n", CMD_ZOOM, p->vkCode);
 			break;
 		}
 	}
@@ -538,50 +1580,41 @@ DWORD WINAPI SaveImageFile(LPVOID lpThreadParameter)//char* szPathName, void* lp
 {
 	IMAGE_DATA* data = (IMAGE_DATA*) lpThreadParameter;
 	//printf("Saving to %s\n", szPathName);
+	LONGLONG saveStart = perfCounter();
+	traceThreadName("save");
 
 	//Create a new file for writing
 	FILE *pFile = fopen(data->szPathName, "wb");
 	if (pFile == NULL)
 	{
 		printf("Failed\n");
+		metricAdd(METRIC_SAVE_BACKLOG, -1);
+		InterlockedExchange(data->release, 1);
+		traceThreadExit();
 		return false;
 	}
-	BITMAPINFOHEADER BMIH;
-	BMIH.biSize = sizeof(BITMAPINFOHEADER);
-	BMIH.biSizeImage = data->w * data->h * 3;
-
-	// Create the bitmap for this OpenGL context
-	BMIH.biSize = sizeof(BITMAPINFOHEADER);
-	BMIH.biWidth = data->w;
-	BMIH.biHeight = data->h;
-	BMIH.biPlanes = 1;
-	BMIH.biBitCount = 24;
-	BMIH.biCompression = BI_RGB;
-	BMIH.biSizeImage = data->w * data->h * 3;
-
-	BITMAPFILEHEADER bmfh;
-
-	int nBitsOffset = sizeof(BITMAPFILEHEADER) + BMIH.biSize;
-
-	LONG lImageSize = BMIH.biSizeImage;
-	LONG lFileSize = nBitsOffset + lImageSize;
-
-	bmfh.bfType = 'B' + ('M' << 8);
-	bmfh.bfOffBits = nBitsOffset;
-	bmfh.bfSize = lFileSize;
-	bmfh.bfReserved1 = bmfh.bfReserved2 = 0;
-
-	//Write the bitmap file header
-	fwrite(&bmfh, 1, sizeof(BITMAPFILEHEADER), pFile);
-
-	//And then the bitmap info header
-	fwrite(&BMIH,1, sizeof(BITMAPINFOHEADER), pFile);
+	//the file header, info header and (for grey) palette, in one write
+	unsigned char* headers = (unsigned char*)malloc(bitmapHeaders(0, data->w, data->h, data->channels));
+	unsigned int headerSize = bitmapHeaders(headers, data->w, data->h, data->channels);
+	fwrite(headers, 1, headerSize, pFile);
+	free(headers);
 
 	//Finally, write the image data itself 
 	//-- the data represents our drawing
+	LONG lImageSize = ((data->w * data->channels + 3) & ~3) * data->h; //rows are padded to 4 bytes
 	fwrite(data->lpBits, 1, lImageSize, pFile);
+	//the frame goes back to its owner: a pack buffer, a compositor framebuffer or a read buffer
+	InterlockedExchange(data->release, 1);
 
 	fclose(pFile);
 
+	LONGLONG saveEnd = perfCounter();
+	traceSpan("save", saveStart, saveEnd);
+	//save threads come and go: the next one records into this buffer
+	traceThreadExit();
+	metricObserve(METRIC_SAVE_US, (LONGLONG)(perfMs(saveEnd - saveStart) * 1000));
+	metricAdd(METRIC_SAVE_FRAMES, 1);
+	metricAdd(METRIC_SAVE_BACKLOG, -1);
+
 	return 0;
 }
@@ -0,0 +1,447 @@
+
+//Recording into one large file with unbuffered, overlapped writes
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "RecordWriter.h"
+#include "Metrics.h"
+#include "PerfTimer.h"
+#include "Trace.h"
+#include <mmsystem.h>
+
+#define		CHUNK_COUNT			(RECORD_QUEUE_DEPTH + 1)
+#define		BITMAP_HEADERS_MAX	(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + 256 * sizeof(RGBQUAD))
+
+unsigned int bitmapHeaders(unsigned char* dst, int w, int h, int channels)
+{
+	BITMAPINFOHEADER BMIH;
+	BMIH.biSize = sizeof(BITMAPINFOHEADER);
+	BMIH.biWidth = w;
+	BMIH.biHeight = h;
+	BMIH.biPlanes = 1;
+	BMIH.biBitCount = 8 * channels;
+	BMIH.biCompression = BI_RGB;
+	BMIH.biSizeImage = ((w * channels + 3) & ~3) * h; //rows are padded to 4 bytes
+	BMIH.biXPelsPerMeter = BMIH.biYPelsPerMeter = 0;
+	//8-bit bitmaps index a grey palette
+	BMIH.biClrUsed = (channels == 1) ? 256 : 0;
+	BMIH.biClrImportant = 0;
+
+	unsigned int size = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + sizeof(RGBQUAD) * BMIH.biClrUsed;
+	if (dst == 0)
+		return size;
+
+	BITMAPFILEHEADER bmfh;
+	bmfh.bfType = 'B' + ('M' << 8);
+	bmfh.bfOffBits = size;
+	bmfh.bfSize = size + BMIH.biSizeImage;
+	bmfh.bfReserved1 = bmfh.bfReserved2 = 0;
+
+	memcpy(dst, &bmfh, sizeof(BITMAPFILEHEADER));
+	memcpy(dst + sizeof(BITMAPFILEHEADER), &BMIH, sizeof(BITMAPINFOHEADER));
+	RGBQUAD* palette = (RGBQUAD*)(dst + sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER));
+	for (unsigned int i = 0; i < BMIH.biClrUsed; i++)
+	{
+		RGBQUAD grey = { (BYTE)i, (BYTE)i, (BYTE)i, 0 };
+		palette[i] = grey;
+	}
+	return size;
+}
+// ----------------------------------------------------------------------------
+
+//enables the privilege SetFileValidData needs; administrators hold it, but it is off until asked for
+static bool enableVolumePrivilege()
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return false;
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	//succeeds without the privilege too, only setting ERROR_NOT_ALL_ASSIGNED
+	bool enabled = LookupPrivilegeValue(NULL, SE_MANAGE_VOLUME_NAME, &privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) && GetLastError() != ERROR_NOT_ALL_ASSIGNED;
+	CloseHandle(token);
+	return enabled;
+}
+
+// ============================================================================
+//public functions
+
+RecordWriter::RecordWriter(const char* baseFilename, FILE* log)
+{
+	char buffer[200];
+	logFile = log;
+	filling = 0;
+	streamLength = 0;
+	allocated = 0;
+	bytesWritten = 0;
+	failed = false;
+	validData = false;
+	writes = syncWrites = 0;
+	startTime = timeGetTime();
+	thread = sealed = stop = 0;
+	framesHead = framesTail = 0;
+	framesQueued = framesFree = copyThread = copyStop = 0;
+
+	path = (char*)malloc(strlen(baseFilename) * 2 + 20);
+	sprintf(path, "%s\\%s_record.bmps", baseFilename, baseFilename);
+	//straight from our chunks to the disk; the chunks meet the alignment unbuffered writes need
+	file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+	direct = (file != INVALID_HANDLE_VALUE);
+	if (!direct)
+		file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		sprintf(buffer, "Could not create recording file %s\n", path);
+		this->log(buffer);
+		for (int i = 0; i < CHUNK_COUNT; i++)
+		{
+			chunks[i].data = 0;
+			chunks[i].free = 0;
+			chunks[i].overlapped.hEvent = 0;
+		}
+		return;
+	}
+
+	validData = enableVolumePrivilege();
+	for (int i = 0; i < CHUNK_COUNT; i++)
+	{
+		chunks[i].data = (unsigned char*)VirtualAlloc(NULL, RECORD_CHUNK_BYTES, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		chunks[i].used = 0;
+		chunks[i].offset = 0;
+		memset(&chunks[i].overlapped, 0, sizeof(OVERLAPPED));
+		chunks[i].overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		chunks[i].free = CreateEvent(NULL, TRUE, TRUE, NULL);
+	}
+
+	sealed = CreateSemaphore(NULL, 0, CHUNK_COUNT, NULL);
+	stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	thread = CreateThread(NULL, 0, writerThread, this, 0, NULL);
+	framesQueued = CreateSemaphore(NULL, 0, RECORD_FRAMES_MAX, NULL);
+	framesFree = CreateSemaphore(NULL, RECORD_FRAMES_MAX, RECORD_FRAMES_MAX, NULL);
+	copyStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	copyThread = CreateThread(NULL, 0, copyThreadProc, this, 0, NULL);
+
+	sprintf(buffer, "Recording to %s: %s, %d chunks of %d MB, %d in flight, %s\n", path,
+		direct ? "unbuffered overlapped writes" : "buffered writes (unbuffered open failed)",
+		CHUNK_COUNT, RECORD_CHUNK_BYTES >> 20, direct ? RECORD_QUEUE_DEPTH : 1,
+		validData ? "volume privilege held, new space not zeroed" : "no volume privilege, new space zeroed on first write");
+	this->log(buffer);
+}
+// ----------------------------------------------------------------------------
+
+RecordWriter::~RecordWriter()
+{
+	char buffer[300];
+	if (copyThread != 0)
+	{
+		//the frames already posted are copied first
+		SetEvent(copyStop);
+		WaitForSingleObject(copyThread, INFINITE);
+		CloseHandle(copyThread);
+		CloseHandle(copyStop);
+		CloseHandle(framesQueued);
+		CloseHandle(framesFree);
+	}
+	if (thread != 0)
+	{
+		//the last chunk goes out padded to a whole sector, then the thread finishes what is in flight
+		CHUNK* chunk = &chunks[filling];
+		if (chunk->used > 0)
+		{
+			unsigned int padded = (chunk->used + RECORD_SECTOR - 1) & ~(RECORD_SECTOR - 1);
+			memset(chunk->data + chunk->used, 0, padded - chunk->used);
+			chunk->used = padded;
+			seal();
+		}
+		SetEvent(stop);
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+		CloseHandle(sealed);
+		CloseHandle(stop);
+
+		//the preallocation and the padding are cut off
+		LARGE_INTEGER length;
+		length.QuadPart = streamLength;
+		if (!SetFilePointerEx(file, length, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+			log("Could not set the length of the recording file\n");
+	}
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+
+	for (int i = 0; i < CHUNK_COUNT; i++)
+	{
+		if (chunks[i].data != 0)
+			VirtualFree(chunks[i].data, 0, MEM_RELEASE);
+		if (chunks[i].free != 0)
+			CloseHandle(chunks[i].free);
+		if (chunks[i].overlapped.hEvent != 0)
+			CloseHandle(chunks[i].overlapped.hEvent);
+	}
+
+	//where each bitmap is in the file
+	if (!index.empty())
+	{
+		char* indexPath = _strdup(path);
+		strcpy(indexPath + strlen(indexPath) - strlen(".bmps"), ".idx");
+		FILE* indexFile = fopen(indexPath, "w");
+		if (indexFile != NULL)
+		{
+			fprintf(indexFile, "frame\toffset\tbytes\n");
+			for (size_t i = 0; i < index.size(); i++)
+				fprintf(indexFile, "%u\t%lld\t%u\n", index[i].frameNum, (long long)index[i].offset, index[i].bytes);
+			fclose(indexFile);
+		}
+		free(indexPath);
+	}
+
+	DWORD elapsed = timeGetTime() - startTime;
+	sprintf(buffer, "Recorded %u frames, %.1f MB in %.1f s (%.1f MB/s written, %s, %u of %u writes synchronous)%s\n",
+		(unsigned int)index.size(), streamLength / 1048576.0, elapsed / 1000.0, (elapsed > 0) ? bytesWritten / 1048.576 / elapsed : 0.0,
+		direct ? "unbuffered" : "buffered", direct ? syncWrites : writes, writes, failed ? "; some writes FAILED" : "");
+	log(buffer);
+	free(path);
+}
+// ----------------------------------------------------------------------------
+
+bool RecordWriter::isOpen()
+{
+	return file != INVALID_HANDLE_VALUE;
+}
+// ----------------------------------------------------------------------------
+
+bool RecordWriter::isDirect()
+{
+	return direct;
+}
+// ----------------------------------------------------------------------------
+
+bool RecordWriter::post(unsigned int frameNum, const unsigned char* pixels, int w, int h, int channels, volatile LONG* release)
+{
+	if (copyThread == 0 || WaitForSingleObject(framesFree, 0) != WAIT_OBJECT_0)
+		return false;
+	FRAME* frame = &frames[framesTail];
+	frame->frameNum = frameNum;
+	frame->pixels = pixels;
+	frame->w = w;
+	frame->h = h;
+	frame->channels = channels;
+	frame->release = release;
+	framesTail = (framesTail + 1) % RECORD_FRAMES_MAX;
+	ReleaseSemaphore(framesQueued, 1, NULL);
+	return true;
+}
+
+// ============================================================================
+//private functions
+
+//appends a frame as a bitmap; waits only when all chunks are still being written
+void RecordWriter::write(const FRAME* frame)
+{
+	LONGLONG start = perfCounter();
+
+	unsigned char headers[BITMAP_HEADERS_MAX];
+	unsigned int headerBytes = bitmapHeaders(headers, frame->w, frame->h, frame->channels);
+	unsigned int dataBytes = ((frame->w * frame->channels + 3) & ~3) * frame->h;
+	INDEX_ENTRY entry = { frame->frameNum, streamLength, headerBytes + dataBytes };
+	index.push_back(entry);
+	append(headers, headerBytes);
+	append(frame->pixels, dataBytes);
+
+	LONGLONG end = perfCounter();
+	traceSpan("save", start, end, frame->frameNum);
+	metricObserve(METRIC_SAVE_US, (LONGLONG)(perfMs(end - start) * 1000));
+	metricAdd(METRIC_SAVE_FRAMES, 1);
+}
+// ----------------------------------------------------------------------------
+
+//copies bytes into the stream, sealing each chunk as it fills
+void RecordWriter::append(const void* bytes, unsigned int count)
+{
+	const unsigned char* src = (const unsigned char*)bytes;
+	while (count > 0)
+	{
+		CHUNK* chunk = &chunks[filling];
+		unsigned int n = RECORD_CHUNK_BYTES - chunk->used;
+		if (n > count)
+			n = count;
+		memcpy(chunk->data + chunk->used, src, n);
+		chunk->used += n;
+		streamLength += n;
+		src += n;
+		count -= n;
+		if (chunk->used == RECORD_CHUNK_BYTES)
+			seal();
+	}
+}
+// ----------------------------------------------------------------------------
+
+//hands the chunk being filled to the writer and moves on to the next, waiting if it is still being written
+void RecordWriter::seal()
+{
+	CHUNK* chunk = &chunks[filling];
+	LONGLONG offset = chunk->offset;
+	ResetEvent(chunk->free);
+	ReleaseSemaphore(sealed, 1, NULL);
+
+	filling = (filling + 1) % CHUNK_COUNT;
+	chunk = &chunks[filling];
+	if (WaitForSingleObject(chunk->free, 0) != WAIT_OBJECT_0)
+	{
+		//the disk is behind by a whole queue
+		metricAdd(METRIC_RECORD_STALLS, 1);
+		LONGLONG start = perfCounter();
+		WaitForSingleObject(chunk->free, INFINITE);
+		traceSpan("record stall", start, perfCounter());
+	}
+	chunk->used = 0;
+	chunk->offset = offset + RECORD_CHUNK_BYTES;
+}
+// ----------------------------------------------------------------------------
+
+//starts writing a chunk; without the unbuffered handle the write happens here
+void RecordWriter::submit(CHUNK* chunk)
+{
+	//keep the file ahead of the writes, so they do not have to extend it
+	if (chunk->offset + chunk->used > allocated)
+	{
+		LARGE_INTEGER size;
+		size.QuadPart = allocated + RECORD_PREALLOC_BYTES;
+		if (SetFilePointerEx(file, size, NULL, FILE_BEGIN) && SetEndOfFile(file))
+		{
+			allocated = size.QuadPart;
+			//without the volume privilege the space is still zeroed on first write, but is at least reserved
+			if (validData && !SetFileValidData(file, allocated))
+			{
+				validData = false;
+				log("SetFileValidData failed; new space in the recording file is zeroed on first write\n");
+			}
+		}
+	}
+
+	chunk->overlapped.Offset = (DWORD)chunk->offset;
+	chunk->overlapped.OffsetHigh = (DWORD)(chunk->offset >> 32);
+	chunk->overlapped.Internal = chunk->overlapped.InternalHigh = 0;
+	ResetEvent(chunk->overlapped.hEvent);
+	chunk->submitted = perfCounter();
+	DWORD written = 0;
+	writes++;
+	if (direct)
+	{
+		//TRUE means the write finished before returning, with this thread waiting on it
+		if (WriteFile(file, chunk->data, chunk->used, NULL, &chunk->overlapped))
+		{
+			syncWrites++;
+			metricAdd(METRIC_RECORD_SYNC_WRITES, 1);
+			chunk->error = false;
+		}
+		else
+		{
+			chunk->error = (GetLastError() != ERROR_IO_PENDING);
+		}
+	}
+	else
+	{
+		//a synchronous handle still writes at the offset given
+		chunk->error = !WriteFile(file, chunk->data, chunk->used, &written, &chunk->overlapped) || written != chunk->used;
+	}
+}
+// ----------------------------------------------------------------------------
+
+//waits for a chunk's write to finish and frees it for filling
+void RecordWriter::complete(CHUNK* chunk)
+{
+	DWORD written = chunk->used;
+	if (direct && !chunk->error)
+		chunk->error = !GetOverlappedResult(file, &chunk->overlapped, &written, TRUE) || written != chunk->used;
+	if (chunk->error)
+	{
+		if (!failed)
+			log("Writing the recording file failed; frames are being lost\n");
+		failed = true;
+	}
+	else
+	{
+		bytesWritten += written;
+		metricAdd(METRIC_RECORD_BYTES, written);
+	}
+	LONGLONG end = perfCounter();
+	traceSpan("record write", chunk->submitted, end, (unsigned int)(chunk->offset / RECORD_CHUNK_BYTES));
+	metricObserve(METRIC_RECORD_WRITE_US, (LONGLONG)(perfMs(end - chunk->submitted) * 1000));
+	SetEvent(chunk->free);
+}
+// ----------------------------------------------------------------------------
+
+//prints a line and adds it to the log
+void RecordWriter::log(const char* buffer)
+{
+	printf(buffer);
+	if (logFile != 0)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+	}
+}
+// ----------------------------------------------------------------------------
+
+//submits every sealed chunk there is room for in one go, then waits for the oldest write.
+//Sealed chunks take priority over stopping, so all of them are written before the thread exits
+DWORD WINAPI RecordWriter::writerThread(LPVOID param)
+{
+	RecordWriter* writer = (RecordWriter*)param;
+	traceThreadName("record");
+	int next = 0;			//next chunk to be sealed
+	int oldest = 0;			//oldest chunk in flight
+	int inFlight = 0;
+	int depth = writer->direct ? RECORD_QUEUE_DEPTH : 1;
+	HANDLE events[2] = { writer->sealed, writer->stop };
+	for (;;)
+	{
+		DWORD result = WAIT_TIMEOUT;
+		if (inFlight < depth)
+			result = WaitForMultipleObjects(2, events, FALSE, (inFlight == 0) ? INFINITE : 0);
+		if (result == WAIT_OBJECT_0)
+		{
+			writer->submit(&writer->chunks[next]);
+			next = (next + 1) % CHUNK_COUNT;
+			inFlight++;
+			metricSet(METRIC_RECORD_QUEUE, inFlight);
+		}
+		else if (inFlight > 0)
+		{
+			writer->complete(&writer->chunks[oldest]);
+			oldest = (oldest + 1) % CHUNK_COUNT;
+			inFlight--;
+			metricSet(METRIC_RECORD_QUEUE, inFlight);
+		}
+		else
+		{
+			break;
+		}
+	}
+	traceThreadExit();
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+//copies posted frames into the chunks in order and gives their pixels back; posted frames take
+//priority over stopping, so all of them are in the file before the thread exits
+DWORD WINAPI RecordWriter::copyThreadProc(LPVOID param)
+{
+	RecordWriter* writer = (RecordWriter*)param;
+	traceThreadName("record copy");
+	HANDLE events[2] = { writer->framesQueued, writer->copyStop };
+	while (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0)
+	{
+		FRAME* frame = &writer->frames[writer->framesHead];
+		writer->write(frame);
+		InterlockedExchange(frame->release, 1);
+		writer->framesHead = (writer->framesHead + 1) % RECORD_FRAMES_MAX;
+		ReleaseSemaphore(writer->framesFree, 1, NULL);
+	}
+	traceThreadExit();
+	return 0;
+}
@@ -0,0 +1,130 @@
+#ifndef RECORD_WRITER
+#define RECORD_WRITER
+// ============================================================================
+
+//Recording into one large file with unbuffered, overlapped writes
+//Recorded frames are appended as bitmaps, headers included, to a stream of fixed size
+//chunks. Chunks are page aligned and written whole by a writer thread with
+//FILE_FLAG_NO_BUFFERING, so the frames bypass the page cache, and with overlapped I/O, so
+//up to RECORD_QUEUE_DEPTH chunks are on their way to the disk at once; every chunk that is
+//ready when the thread wakes is submitted together. The file is extended ahead of the
+//writes in large steps and cut to its real length when closed, with an index of where
+//each frame is. If the file cannot be opened unbuffered, the same thread writes each chunk
+//synchronously at its offset instead.
+//Extending a file only reserves the space: Windows zeroes it when it is first written,
+//which makes those writes complete synchronously, holding up the writer thread with the
+//queue drained. The writer enables SE_MANAGE_VOLUME_NAME (held by administrators, off until
+//asked for) and marks the new space valid with SetFileValidData, so it is not zeroed; without
+//the privilege the zeroing stays. Either way is logged when the file opens, and overlapped
+//writes that still completed synchronously are counted (record.sync) and reported at the end.
+//Frames are handed over by pointer and copied into the chunks on a thread of their own, so
+//the render thread neither copies nor waits; a frame that finds the hand-over queue full is refused
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+#include <stdio.h>
+#include <vector>
+
+#define		RECORD_CHUNK_BYTES		(8 << 20)	//bytes gathered into one write
+#define		RECORD_QUEUE_DEPTH		4			//chunks being written at once
+#define		RECORD_PREALLOC_BYTES	(1 << 30)	//the file is extended by this much at a time
+#define		RECORD_SECTOR			4096		//unbuffered writes are a multiple of this (any sector size up to 4K)
+#define		RECORD_FRAMES_MAX		4			//frames handed over but not yet copied into the chunks
+
+//the headers of a bottom-up bitmap of w x h pixels of channels bytes (3 BGR, or 1 with a grey palette);
+//writes them to dst if it is given and returns their size
+unsigned int bitmapHeaders(unsigned char* dst, int w, int h, int channels);
+
+// ============================================================================
+
+class RecordWriter
+{
+public:
+	//creates <base>\<base>_record.bmps and starts the writer thread
+	RecordWriter(const char* baseFilename, FILE* log);
+	//writes what is left, cuts the file to length, writes <base>\<base>_record.idx and reports the throughput
+	~RecordWriter();
+
+	//false if the file could not be created at all
+	bool isOpen();
+	//true when writing unbuffered and overlapped, false for the synchronous fallback
+	bool isDirect();
+
+	//queues a frame (bottom-up, rows padded to 4 bytes) to be appended as a bitmap, and sets *release to 1
+	//once the pixels are copied. Returns false, without touching release, if the queue is full or the file
+	//could not be created
+	bool post(unsigned int frameNum, const unsigned char* pixels, int w, int h, int channels, volatile LONG* release);
+
+private:
+	struct CHUNK
+	{
+		unsigned char* data;		//RECORD_CHUNK_BYTES, page aligned
+		unsigned int used;			//bytes filled
+		LONGLONG offset;			//position in the file
+		OVERLAPPED overlapped;
+		HANDLE free;				//set while the chunk can be filled
+		LONGLONG submitted;			//perfCounter() when the write started
+		bool error;					//the write failed
+	};
+	struct FRAME
+	{
+		unsigned int frameNum;
+		const unsigned char* pixels;
+		int w, h, channels;
+		volatile LONG* release;
+	};
+	struct INDEX_ENTRY
+	{
+		unsigned int frameNum;
+		LONGLONG offset;
+		unsigned int bytes;
+	};
+
+	//data
+	HANDLE file;
+	bool direct;
+	char* path;
+	FILE* logFile;
+	CHUNK chunks[RECORD_QUEUE_DEPTH + 1];	//one being filled while the others are written
+	int filling;					//chunk being filled
+	LONGLONG streamLength;			//bytes appended so far
+	LONGLONG allocated;				//current file size, ahead of the writes
+	std::vector<INDEX_ENTRY> index;
+	DWORD startTime;
+
+	//kept by the writer thread
+	LONGLONG bytesWritten;
+	bool failed;					//a write failed, so frames are missing
+	bool validData;					//SetFileValidData works, so writes skip the zeroing of new space
+	unsigned int writes;			//chunk writes submitted
+	unsigned int syncWrites;		//overlapped writes that completed before WriteFile returned
+
+	//writer thread
+	HANDLE thread;
+	HANDLE sealed;					//semaphore: chunks ready to be written, in order
+	HANDLE stop;
+
+	//copy thread
+	FRAME frames[RECORD_FRAMES_MAX];
+	int framesHead;					//next frame to copy, kept by the copy thread
+	int framesTail;					//next free entry, kept by post
+	HANDLE framesQueued;			//semaphore: frames posted and not yet copied
+	HANDLE framesFree;				//semaphore: free entries
+	HANDLE copyThread;
+	HANDLE copyStop;
+
+	//private prototypes
+	void write(const FRAME* frame);
+	void append(const void* bytes, unsigned int count);
+	void seal();
+	void submit(CHUNK* chunk);
+	void complete(CHUNK* chunk);
+	void log(const char*);
+	static DWORD WINAPI writerThread(LPVOID);
+	static DWORD WINAPI copyThreadProc(LPVOID);
+};
+
+// ============================================================================
+#endif
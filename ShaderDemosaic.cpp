@@ -0,0 +1,341 @@
+
+//Demosaics RAW8 frames on the GPU
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "ShaderDemosaic.h"
+#include "ImageKernels.h"
+#include "Compositor.h"
+#include <stdlib.h>
+
+#define		VERIFY_COLS		1280	//size of the test mosaics
+#define		VERIFY_ROWS		720
+
+static const char* vertexSource =
+	"#version 120\n"
+	"void main()\n"
+	"{\n"
+	"	gl_Position = ftransform();\n"
+	"}\n";
+
+//values are handled as integers 0-255 in floats, which hold every intermediate exactly
+static const char* fragmentSource =
+	"#version 120\n"
+	"uniform sampler2D raw;\n"
+	"uniform vec2 rawSize;\n"			//texture size in texels
+	"uniform vec4 crop;\n"				//x, y, width, height of the source rectangle in texels
+	"uniform vec2 firstRed;\n"			//position of red in the 2x2 tile at the texture origin
+	"uniform vec4 quad;\n"				//x, y (from the top left), width, height of the quad in window pixels
+	"uniform float viewHeight;\n"
+	"\n"
+	//reflects an index back into [0, size) like mirror() in ImageKernels.cpp
+	"float mirror(float i, float size)\n"
+	"{\n"
+	"	if (i < 0.0) return -i;\n"
+	"	if (i >= size) return 2.0 * (size - 1.0) - i;\n"
+	"	return i;\n"
+	"}\n"
+	"\n"
+	"float fetch(float x, float y)\n"
+	"{\n"
+	"	return floor(texture2D(raw, (crop.xy + vec2(x, y) + 0.5) / rawSize).r * 255.0 + 0.5);\n"
+	"}\n"
+	"\n"
+	//crop pixel p as demosaicBilinear8 computes it
+	"vec3 demosaic(vec2 p)\n"
+	"{\n"
+	"	float xl = mirror(p.x - 1.0, crop.z);\n"
+	"	float xr = mirror(p.x + 1.0, crop.z);\n"
+	"	float yu = mirror(p.y - 1.0, crop.w);\n"
+	"	float yd = mirror(p.y + 1.0, crop.w);\n"
+	"	vec2 phase = mod(crop.xy + p, 2.0);\n"
+	"	bool redRow = phase.y == firstRed.y;\n"
+	"	bool redColumn = phase.x == firstRed.x;\n"
+	"	float mid = fetch(p.x, p.y);\n"
+	"	if (redRow != redColumn)\n"
+	"	{\n"
+	"		float across = floor((fetch(xl, p.y) + fetch(xr, p.y) + 1.0) / 2.0);\n"
+	"		float vertical = floor((fetch(p.x, yu) + fetch(p.x, yd) + 1.0) / 2.0);\n"
+	"		return redRow ? vec3(across, mid, vertical) : vec3(vertical, mid, across);\n"
+	"	}\n"
+	"	float green = floor((fetch(p.x, yu) + fetch(p.x, yd) + fetch(xl, p.y) + fetch(xr, p.y) + 2.0) / 4.0);\n"
+	"	float diagonal = floor((fetch(xl, yu) + fetch(xr, yu) + fetch(xl, yd) + fetch(xr, yd) + 2.0) / 4.0);\n"
+	"	return redRow ? vec3(mid, green, diagonal) : vec3(diagonal, green, mid);\n"
+	"}\n"
+	"\n"
+	//GL_LINEAR sampling of the demosaiced crop with 8-bit weights, as CpuCompositor::drawRows does it
+	"void main()\n"
+	"{\n"
+	"	vec2 screen = vec2(gl_FragCoord.x - 0.5 - quad.x, viewHeight - gl_FragCoord.y - 0.5 - quad.y);\n"
+	"	vec2 t = max((screen + 0.5) * crop.zw / quad.zw - 0.5, 0.0);\n"
+	"	vec2 t0 = min(floor(t), crop.zw - 1.0);\n"
+	"	vec2 w = min(floor((t - t0) * 256.0 + 0.5), 256.0);\n"
+	"	vec2 t1 = min(t0 + 1.0, crop.zw - 1.0);\n"
+	"	vec3 top = demosaic(t0) * (256.0 - w.x) + demosaic(vec2(t1.x, t0.y)) * w.x;\n"
+	"	vec3 bottom = demosaic(vec2(t0.x, t1.y)) * (256.0 - w.x) + demosaic(t1) * w.x;\n"
+	"	vec3 value = floor((top * (256.0 - w.y) + bottom * w.y + 32768.0) / 65536.0);\n"
+	"	gl_FragColor = vec4(value / 255.0, 1.0);\n"
+	"}\n";
+
+// ============================================================================
+//public functions
+ShaderDemosaic::ShaderDemosaic()
+{
+	program = 0;
+	textures[0] = textures[1] = 0;
+	texCols[0] = texCols[1] = 0;
+	texRows[0] = texRows[1] = 0;
+	rawLocation = rawSizeLocation = cropLocation = firstRedLocation = quadLocation = viewHeightLocation = -1;
+}
+// ----------------------------------------------------------------------------
+
+ShaderDemosaic::~ShaderDemosaic()
+{
+	if (program != 0)
+		glDeleteProgram(program);
+	if (textures[0] != 0)
+		glDeleteTextures(2, textures);
+}
+// ----------------------------------------------------------------------------
+
+bool ShaderDemosaic::init()
+{
+	if (!glShadersSupported())
+	{
+		printf("Shader demosaic needs OpenGL 2.0\n");
+		return false;
+	}
+
+	GLuint vertex = compile(GL_VERTEX_SHADER, vertexSource);
+	GLuint fragment = compile(GL_FRAGMENT_SHADER, fragmentSource);
+	if (vertex == 0 || fragment == 0)
+		return false;
+
+	program = glCreateProgram();
+	glAttachShader(program, vertex);
+	glAttachShader(program, fragment);
+	glLinkProgram(program);
+	//the program keeps them
+	glDeleteShader(vertex);
+	glDeleteShader(fragment);
+
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		char log[1000];
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		printf("Shader demosaic failed to link:\n%s\n", log);
+		glDeleteProgram(program);
+		program = 0;
+		return false;
+	}
+
+	rawLocation = glGetUniformLocation(program, "raw");
+	rawSizeLocation = glGetUniformLocation(program, "rawSize");
+	cropLocation = glGetUniformLocation(program, "crop");
+	firstRedLocation = glGetUniformLocation(program, "firstRed");
+	quadLocation = glGetUniformLocation(program, "quad");
+	viewHeightLocation = glGetUniformLocation(program, "viewHeight");
+
+	//every texel is fetched individually, so no filtering
+	GLint previous;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+	glGenTextures(2, textures);
+	for (int i = 0; i < 2; i++)
+	{
+		glBindTexture(GL_TEXTURE_2D, textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	}
+	glBindTexture(GL_TEXTURE_2D, previous);
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+void ShaderDemosaic::upload(int eye, const unsigned char* raw, unsigned int stride, unsigned int cols, unsigned int rows)
+{
+	GLint previous;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+	glBindTexture(GL_TEXTURE_2D, textures[eye]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, stride);
+
+	//the texture is only reallocated when the capture size changes
+	if (cols != texCols[eye] || rows != texRows[eye])
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE8, cols, rows, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, raw);
+		texCols[eye] = cols;
+		texRows[eye] = rows;
+	}
+	else
+	{
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, cols, rows, GL_LUMINANCE, GL_UNSIGNED_BYTE, raw);
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindTexture(GL_TEXTURE_2D, previous);
+}
+// ----------------------------------------------------------------------------
+
+void ShaderDemosaic::draw(int eye, BayerTileFormat format, int cropX, int cropY, int cropW, int cropH,
+	int x0, int x1, int viewWidth, int viewHeight)
+{
+	if (texCols[eye] == 0 || x0 >= x1)
+		return;
+
+	//red of the 2x2 tile at the texture origin
+	float redX = (format == GRBG || format == BGGR) ? 1.0f : 0.0f;
+	float redY = (format == GBRG || format == BGGR) ? 1.0f : 0.0f;
+
+	GLint previous;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+	glBindTexture(GL_TEXTURE_2D, textures[eye]);
+	glUseProgram(program);
+	glUniform1i(rawLocation, 0);
+	glUniform2f(rawSizeLocation, (GLfloat)texCols[eye], (GLfloat)texRows[eye]);
+	glUniform4f(cropLocation, (GLfloat)cropX, (GLfloat)cropY, (GLfloat)cropW, (GLfloat)cropH);
+	glUniform2f(firstRedLocation, redX, redY);
+	glUniform4f(quadLocation, (GLfloat)x0, 0.0f, (GLfloat)(x1 - x0), (GLfloat)viewHeight);
+	glUniform1f(viewHeightLocation, (GLfloat)viewHeight);
+
+	//window pixel coordinates whatever projection the caller uses
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho(0.0, viewWidth, viewHeight, 0.0, -1.0, 1.0);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+
+	glBegin(GL_QUADS);
+	glVertex2i(x0, 0);
+	glVertex2i(x0, viewHeight);
+	glVertex2i(x1, viewHeight);
+	glVertex2i(x1, 0);
+	glEnd();
+
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+
+	glUseProgram(0);
+	glBindTexture(GL_TEXTURE_2D, previous);
+}
+
+// ============================================================================
+//private functions
+
+//returns the compiled shader, or 0 after printing the compiler's log
+GLuint ShaderDemosaic::compile(GLenum type, const char* source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	GLint compiled = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (!compiled)
+	{
+		char log[1000];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		printf("Shader demosaic failed to compile:\n%s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+// ============================================================================
+//verification against the CPU path
+
+//pattern at (dx, dy) of a mosaic whose top left corner has the given pattern
+static BayerTileFormat shiftBayer(BayerTileFormat format, int dx, int dy)
+{
+	//red position in the 2x2 tile: RGGB (0, 0), GRBG (1, 0), GBRG (0, 1), BGGR (1, 1)
+	int redX = (format == GRBG || format == BGGR) ? 1 : 0;
+	int redY = (format == GBRG || format == BGGR) ? 1 : 0;
+	redX ^= dx & 1;
+	redY ^= dy & 1;
+	BayerTileFormat formats[4] = { RGGB, GRBG, GBRG, BGGR };
+	return formats[redY * 2 + redX];
+}
+// ----------------------------------------------------------------------------
+
+bool verifyShaderDemosaic(int viewWidth, int viewHeight)
+{
+	ShaderDemosaic shader;
+	if (!shader.init())
+		return false;
+	printf("Verifying shader demosaic on %s\n", glGetString(GL_RENDERER));
+
+	//noise makes every neighbour of every pixel matter
+	unsigned char* raw = new unsigned char[VERIFY_COLS * VERIFY_ROWS];
+	srand(1);
+	for (int i = 0; i < VERIFY_COLS * VERIFY_ROWS; i++)
+		raw[i] = (unsigned char)(rand() >> 4);
+	shader.upload(0, raw, VERIFY_COLS, VERIFY_COLS, VERIFY_ROWS);
+	shader.upload(1, raw, VERIFY_COLS, VERIFY_COLS, VERIFY_ROWS);
+
+	//whole frame, odd offsets in each direction (which change the pattern), and a small crop that is magnified
+	const int crops[5][4] = {
+		{ 0, 0, VERIFY_COLS, VERIFY_ROWS },
+		{ 1, 0, VERIFY_COLS - 2, VERIFY_ROWS },
+		{ 0, 1, VERIFY_COLS, VERIFY_ROWS - 2 },
+		{ 3, 5, VERIFY_COLS - 80, VERIFY_ROWS - 40 },
+		{ 101, 37, 200, 150 } };
+	const BayerTileFormat formats[4] = { RGGB, GRBG, GBRG, BGGR };
+	const char* formatNames[4] = { "RGGB", "GRBG", "GBRG", "BGGR" };
+
+	unsigned char* rgb = new unsigned char[3 * VERIFY_COLS * VERIFY_ROWS];
+	CpuCompositor reference(viewWidth, viewHeight, 3);
+	int size = ((3 * viewWidth + 3) & ~3) * viewHeight;
+	unsigned char* pixels = new unsigned char[size];
+	bool passed = true;
+
+	for (int f = 0; f < 4; f++)
+	{
+		for (int c = 0; c < 5; c++)
+		{
+			const int* crop = crops[c];
+			demosaicBilinear8(raw + crop[1] * VERIFY_COLS + crop[0], VERIFY_COLS, crop[2], crop[3],
+				shiftBayer(formats[f], crop[0], crop[1]), rgb, 0, crop[3]);
+			reference.clear();
+			reference.drawQuad(0, viewWidth / 2, rgb, crop[2], crop[3]);
+			reference.drawQuad(viewWidth / 2, viewWidth, rgb, crop[2], crop[3]);
+
+			glClear(GL_COLOR_BUFFER_BIT);
+			shader.draw(0, formats[f], crop[0], crop[1], crop[2], crop[3], 0, viewWidth / 2, viewWidth, viewHeight);
+			shader.draw(1, formats[f], crop[0], crop[1], crop[2], crop[3], viewWidth / 2, viewWidth, viewWidth, viewHeight);
+			glFinish();
+			glPixelStorei(GL_PACK_ALIGNMENT, 4);
+			glReadPixels(0, 0, viewWidth, viewHeight, GL_BGR_EXT, GL_UNSIGNED_BYTE, pixels);
+
+			int differing = 0, maxDiff = 0;
+			const unsigned char* expected = reference.getPixels();
+			for (int i = 0; i < size; i++)
+			{
+				int diff = abs((int)pixels[i] - (int)expected[i]);
+				if (diff > 0)
+					differing++;
+				if (diff > maxDiff)
+					maxDiff = diff;
+			}
+			printf("%s crop %4d,%3d %4dx%3d: %s (%d bytes differ, max difference %d)\n", formatNames[f],
+				crop[0], crop[1], crop[2], crop[3], (differing == 0) ? "match" : "MISMATCH", differing, maxDiff);
+			if (differing > 0)
+				passed = false;
+		}
+	}
+
+	printf("Shader demosaic %s the CPU path at the bilinear level\n", passed ? "matches" : "DOES NOT match");
+	delete[] raw;
+	delete[] rgb;
+	delete[] pixels;
+	return passed;
+}
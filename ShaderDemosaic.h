@@ -0,0 +1,59 @@
+#ifndef SHADER_DEMOSAIC
+#define SHADER_DEMOSAIC
+// ============================================================================
+
+//Demosaics RAW8 frames on the GPU
+//The 1-byte Bayer mosaic of each eye is uploaded as a single channel texture, and a
+//fragment shader does the bilinear demosaic, the crop and the side-by-side placement.
+//The shader repeats the integer arithmetic of demosaicBilinear8 and of the GL_LINEAR
+//sampling CpuCompositor emulates, so its output matches the CPU path at the bilinear
+//quality level pixel for pixel. It has no equivalent of the SDK's edge sensing demosaic
+//of the full level, so sessions that use it are held at the bilinear level
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "GLExt.h"
+#include "FlyCapture2.h"
+
+using namespace FlyCapture2;
+
+// ============================================================================
+
+class ShaderDemosaic
+{
+public:
+	ShaderDemosaic();
+	~ShaderDemosaic();
+
+	//builds the program and the textures; needs a current context with GL 2.0. Returns false if that fails
+	bool init();
+
+	//uploads an eye's mosaic; stride is in bytes
+	void upload(int eye, const unsigned char* raw, unsigned int stride, unsigned int cols, unsigned int rows);
+	//draws the crop (cropX, cropY, cropW, cropH) of an eye's mosaic over the window columns [x0, x1) and all rows.
+	//format is the Bayer pattern at the mosaic's top left corner; the window is viewWidth x viewHeight
+	void draw(int eye, BayerTileFormat format, int cropX, int cropY, int cropW, int cropH,
+		int x0, int x1, int viewWidth, int viewHeight);
+
+private:
+	//data
+	GLuint program;
+	GLuint textures[2];
+	unsigned int texCols[2], texRows[2];	//size of each texture, 0 before the first upload
+
+	//uniform locations
+	GLint rawLocation, rawSizeLocation, cropLocation, firstRedLocation, quadLocation, viewHeightLocation;
+
+	//private prototypes
+	GLuint compile(GLenum type, const char* source);
+};
+
+//renders random mosaics in every Bayer pattern, whole and cropped, down and up scaled, with the shader and with
+//the CPU path at the bilinear level (demosaicBilinear8 on the cropped mosaic, then CpuCompositor) and compares
+//them byte for byte.
+//Needs a current context drawing to a viewWidth x viewHeight back buffer; returns true if they all match
+bool verifyShaderDemosaic(int viewWidth, int viewHeight);
+
+// ============================================================================
+#endif
@@ -0,0 +1,339 @@
+
+//Stand-in for a Flea3 camera used for headless runs and testing without hardware
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "SimCamera.h"
+#include "CaptureProfile.h"
+
+#define		SIM_SCROLL_STEP		2	//pixels the scene scrolls per frame; even to keep the Bayer phase
+#define		SIM_STALL_POLL_MS	5	//how often a stalled capture thread checks for StopCapture
+
+volatile LONG SimCamera::busReserved = 0;
+
+// ============================================================================
+//public functions
+SimCamera::SimCamera(std::string name, unsigned int c, unsigned int r, double rate, PixelFormat pixelFormat)
+{
+	cameraName = name;
+	cols = c;
+	rows = r;
+	fps = rate;
+	packetSize = 0;
+	bitsPerPixel = 0;
+	offsetX = 0;
+	frameNum = 0;
+	thread = 0;
+	capturing = false;
+	callback = 0;
+	callbackData = 0;
+	stallMs = 0;
+
+	sensor = 0;
+	frame = 0;
+	setFormat(pixelFormat);
+}
+// ----------------------------------------------------------------------------
+
+SimCamera::~SimCamera()
+{
+	StopCapture();
+	InterlockedExchangeAdd(&busReserved, -(LONG)packetSize);
+	delete[] sensor;
+	delete[] frame;
+}
+// ----------------------------------------------------------------------------
+
+int SimCamera::StartCapture(ImageEventCallback cb, const void* data)
+{
+	if (capturing)
+		return -1;
+
+	callback = cb;
+	callbackData = data;
+	//a restarted camera comes back delivering
+	stallMs = 0;
+	capturing = true;
+	thread = CreateThread(NULL, 0, captureThread, this, 0, NULL);
+	if (thread == 0)
+	{
+		capturing = false;
+		return -1;
+	}
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+int SimCamera::StopCapture()
+{
+	if (!capturing)
+		return 0;
+
+	capturing = false;
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	thread = 0;
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+//grabs a single frame synchronously; pImage points at internal storage until the next frame
+int SimCamera::RetrieveBuffer(Image* pImage)
+{
+	readFrame();
+	wrapFrame(pImage);
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+//same checks as the camera: ROI on the sensor (half size when binned) with even sizes and offsets
+int SimCamera::ValidateFormat7Settings(const Format7ImageSettings* settings, bool* valid, Format7PacketInfo* packetInfo)
+{
+	unsigned int binning = (settings->mode == MODE_1) ? 2 : 1;
+	*valid = settings->width > 0 && settings->height > 0
+		&& settings->offsetX + settings->width <= SIM_SENSOR_WIDTH / binning
+		&& settings->offsetY + settings->height <= SIM_SENSOR_HEIGHT / binning
+		&& ((settings->width | settings->height | settings->offsetX | settings->offsetY) & 1) == 0
+		&& (settings->pixelFormat == PIXEL_FORMAT_RAW8 || settings->pixelFormat == PIXEL_FORMAT_RAW12 || settings->pixelFormat == PIXEL_FORMAT_RAW16);
+
+	packetInfo->unitBytesPerPacket = SIM_PACKET_UNIT;
+	packetInfo->maxBytesPerPacket = SIM_PACKET_MAX;
+	packetInfo->recommendedBytesPerPacket = SIM_PACKET_MAX;
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+int SimCamera::SetFormat7Configuration(const Format7ImageSettings* settings, unsigned int packet)
+{
+	bool valid;
+	Format7PacketInfo packetInfo;
+	ValidateFormat7Settings(settings, &valid, &packetInfo);
+	if (!valid || capturing || packet == 0 || packet > SIM_PACKET_MAX)
+		return -1;
+
+	//swap this camera's reservation for the new one, backing out if the bus is over-subscribed
+	LONG change = (LONG)packet - (LONG)packetSize;
+	LONG reserved = InterlockedExchangeAdd(&busReserved, change) + change;
+	if (reserved * (double)USB3_PACKETS_PER_SEC > USB3_BUS_BYTES_PER_SEC)
+	{
+		InterlockedExchangeAdd(&busReserved, -change);
+		printf("%s: bus bandwidth exceeded (%u byte packets, %ld reserved)\n", cameraName.c_str(), packet, reserved);
+		return -1;
+	}
+	packetSize = packet;
+
+	//binning is not modelled in the image: the ROI is cut from the sensor at full scale
+	cols = settings->width;
+	rows = settings->height;
+	delete[] frame;
+	frame = 0;
+	setFormat(settings->pixelFormat);
+	setOffset(settings->offsetX);
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+void SimCamera::SetFrameRate(double rate)
+{
+	fps = rate;
+}
+// ----------------------------------------------------------------------------
+
+void SimCamera::setOffset(unsigned int x)
+{
+	//keep the ROI on the sensor and on an even column so the Bayer phase does not change
+	if (x + cols > SIM_SENSOR_WIDTH)
+		x = SIM_SENSOR_WIDTH - cols;
+	offsetX = x & ~1u;
+}
+// ----------------------------------------------------------------------------
+
+unsigned int SimCamera::getFrameCount()
+{
+	return frameNum;
+}
+// ----------------------------------------------------------------------------
+
+void SimCamera::injectStall(DWORD ms)
+{
+	InterlockedExchange(&stallMs, (LONG)ms);
+}
+
+// ============================================================================
+//private functions
+
+//reallocates the frame and redraws the sensor when the output format changes
+void SimCamera::setFormat(PixelFormat pixelFormat)
+{
+	unsigned int bits = 8;
+	if (pixelFormat == PIXEL_FORMAT_RAW12)
+		bits = 12;
+	else if (pixelFormat == PIXEL_FORMAT_RAW16)
+		bits = 16;
+
+	if (sensor == 0 || bits != bitsPerPixel)
+	{
+		format = pixelFormat;
+		bitsPerPixel = bits;
+		delete[] sensor;
+		sensor = new unsigned char[SIM_SENSOR_WIDTH * bitsPerPixel / 8 * SIM_SENSOR_HEIGHT];
+		renderSensor();
+		delete[] frame;
+		frame = 0;
+	}
+	if (frame == 0)
+		frame = new unsigned char[cols * bitsPerPixel / 8 * rows];
+}
+// ----------------------------------------------------------------------------
+
+//12-bit scene: colour gradients with vertical bars so that stereo offset and scaling
+//artifacts are visible, plus a dark cavity and a specular highlight to exercise dynamic range
+unsigned int SimCamera::sceneValue(unsigned int x, unsigned int y)
+{
+	unsigned int r = x * 4095 / SIM_SENSOR_WIDTH;
+	unsigned int g = y * 4095 / SIM_SENSOR_HEIGHT;
+	unsigned int b = ((x / 64) % 2 == 0) ? 3200 : 640;
+
+	//colour of this site of the RGGB mosaic
+	unsigned int value;
+	if ((y & 1) == 0)
+		value = ((x & 1) == 0) ? r : g;
+	else
+		value = ((x & 1) == 0) ? g : b;
+
+	int dx = (int)x - SIM_SENSOR_WIDTH / 3;
+	int dy = (int)y - SIM_SENSOR_HEIGHT / 2;
+	if (dx * dx + dy * dy < 300 * 300)
+		value /= 32;
+
+	dx = (int)x - 2 * SIM_SENSOR_WIDTH / 3;
+	dy = (int)y - SIM_SENSOR_HEIGHT / 3;
+	if (dx * dx + dy * dy < 60 * 60)
+		value = 4095;
+
+	return value;
+}
+// ----------------------------------------------------------------------------
+
+//draws the scene once in the output format
+void SimCamera::renderSensor()
+{
+	unsigned int rowBytes = SIM_SENSOR_WIDTH * bitsPerPixel / 8;
+	for (unsigned int y = 0; y < SIM_SENSOR_HEIGHT; y++)
+	{
+		unsigned char* row = sensor + y * rowBytes;
+		for (unsigned int x = 0; x < SIM_SENSOR_WIDTH; x += 2)
+		{
+			unsigned int v0 = sceneValue(x, y);
+			unsigned int v1 = sceneValue(x + 1, y);
+			switch (bitsPerPixel)
+			{
+			case 12:
+				//Point Grey 12-bit packing, see unpackRaw12
+				row[x / 2 * 3] = (unsigned char)(v0 >> 4);
+				row[x / 2 * 3 + 1] = (unsigned char)((v0 & 0x0F) | ((v1 & 0x0F) << 4));
+				row[x / 2 * 3 + 2] = (unsigned char)(v1 >> 4);
+				break;
+			case 16:
+				//12 significant bits, left aligned
+				((unsigned short*)row)[x] = (unsigned short)(v0 << 4);
+				((unsigned short*)row)[x + 1] = (unsigned short)(v1 << 4);
+				break;
+			default:
+				row[x] = (unsigned char)(v0 >> 4);
+				row[x + 1] = (unsigned char)(v1 >> 4);
+				break;
+			}
+		}
+	}
+}
+// ----------------------------------------------------------------------------
+
+//copies the current ROI out of the sensor, scrolling the scene a little every frame
+void SimCamera::readFrame()
+{
+	unsigned int span = SIM_SENSOR_WIDTH - cols;
+	unsigned int scroll = (frameNum * SIM_SCROLL_STEP) % (span + 1);
+	unsigned int x0 = (offsetX + scroll) % (span + 1);
+	x0 &= ~1u;
+
+	unsigned int rowBytes = cols * bitsPerPixel / 8;
+	unsigned int sensorRowBytes = SIM_SENSOR_WIDTH * bitsPerPixel / 8;
+	for (unsigned int y = 0; y < rows && y < SIM_SENSOR_HEIGHT; y++)
+	{
+		memcpy(frame + y * rowBytes, sensor + y * sensorRowBytes + x0 * bitsPerPixel / 8, rowBytes);
+	}
+}
+// ----------------------------------------------------------------------------
+
+void SimCamera::wrapFrame(Image* pImage)
+{
+	unsigned int rowBytes = cols * bitsPerPixel / 8;
+	pImage->SetDimensions(rows, cols, rowBytes, format, RGGB);
+	pImage->SetData(frame, rowBytes * rows);
+}
+// ----------------------------------------------------------------------------
+
+//holds the capture thread for an injected stall; returns early on StopCapture
+void SimCamera::stall()
+{
+	DWORD ms = (DWORD)InterlockedExchange(&stallMs, 0);
+	char buffer[100];
+	if (ms == SIM_STALL_HANG)
+		sprintf(buffer, "%s: simulated stall until restarted\n", cameraName.c_str());
+	else
+		sprintf(buffer, "%s: simulated stall of %lu ms\n", cameraName.c_str(), ms);
+	printf(buffer);
+
+	DWORD start = timeGetTime();
+	while (capturing && (ms == SIM_STALL_HANG || timeGetTime() - start < ms))
+		Sleep(SIM_STALL_POLL_MS);
+}
+// ----------------------------------------------------------------------------
+
+//delivers frames to the callback at the configured rate until StopCapture
+DWORD WINAPI SimCamera::captureThread(LPVOID lpThreadParameter)
+{
+	SimCamera* sim = (SimCamera*)lpThreadParameter;
+	double interval = (sim->fps > 0) ? 1000.0 / sim->fps : 0;
+
+	//a frame takes at least as long as its packets do to cross the bus; unthrottled runs skip this
+	if (interval > 0 && sim->packetSize > 0)
+	{
+		double busInterval = 1000.0 * sim->cols * sim->rows * sim->bitsPerPixel / 8 / ((double)sim->packetSize * USB3_PACKETS_PER_SEC);
+		if (busInterval > interval)
+			interval = busInterval;
+	}
+	double nextDue = (double)timeGetTime();
+
+	while (sim->capturing)
+	{
+		if (sim->stallMs != 0)
+		{
+			sim->stall();
+			nextDue = (double)timeGetTime();
+			if (!sim->capturing)
+				break;
+		}
+
+		sim->readFrame();
+		Image image;
+		sim->wrapFrame(&image);
+		sim->callback(&image, sim->callbackData);
+		sim->frameNum++;
+
+		//hold a fixed cadence if a frame rate was given
+		if (interval > 0)
+		{
+			nextDue += interval;
+			double now = (double)timeGetTime();
+			if (nextDue > now)
+				Sleep((DWORD)(nextDue - now));
+			else
+				nextDue = now;
+		}
+	}
+	return 0;
+}
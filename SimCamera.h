@@ -0,0 +1,91 @@
+#ifndef SIM_CAMERA
+#define SIM_CAMERA
+// ============================================================================
+
+//Stand-in for a Flea3 camera: generates RAW8/12/16 Bayer frames of a synthetic scene
+//on its own thread and delivers them through the same callback signature as
+//FlyCapture2::Camera::StartCapture, so the rest of the pipeline (conversion,
+//display, recording) runs unchanged without hardware attached
+//Format7 configuration is checked against a USB3 bus shared by all SimCameras:
+//a configuration whose packet size does not fit in the remaining bandwidth fails,
+//and frames are never delivered faster than the packet size allows
+//Stalls can be injected to stand in for a camera that stops delivering (e.g. after a USB hiccup)
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "FlyCapture2.h"
+#include <string>
+#include <mmsystem.h>
+
+#define		SIM_SENSOR_WIDTH	2080	//sensor size of the FL3-U3-32S2C
+#define		SIM_SENSOR_HEIGHT	1552
+#define		SIM_PACKET_UNIT		16		//Format7PacketInfo reported by ValidateFormat7Settings
+#define		SIM_PACKET_MAX		49152
+#define		SIM_STALL_HANG		INFINITE	//stall length that lasts until capture is restarted
+
+using namespace FlyCapture2;
+
+// ============================================================================
+
+class SimCamera
+{
+public:
+	//fps of 0 delivers frames as fast as the consumer can take them
+	SimCamera(std::string, unsigned int cols, unsigned int rows, double fps, PixelFormat = PIXEL_FORMAT_RAW8);
+	~SimCamera();
+
+	//mirror the subset of FlyCapture2::Camera used by FL3Camera; return 0 on success
+	int StartCapture(ImageEventCallback, const void*);
+	int StopCapture();
+	int RetrieveBuffer(Image*);
+	int ValidateFormat7Settings(const Format7ImageSettings*, bool* valid, Format7PacketInfo*);
+	//reserves packetSize bytes per bus interval on the shared bus; fails while capturing or if the bus is full
+	int SetFormat7Configuration(const Format7ImageSettings*, unsigned int packetSize);
+	//equivalent of setting the FRAME_RATE property; 0 is unthrottled
+	void SetFrameRate(double);
+
+	//moves the ROI horizontally on the synthetic sensor, like fmt7ImageSettings.offsetX
+	void setOffset(unsigned int);
+
+	//returns number of frames delivered so far
+	unsigned int getFrameCount();
+	//withholds frames for ms, or with SIM_STALL_HANG until StopCapture; safe from any thread
+	void injectStall(DWORD ms);
+
+private:
+	//data
+	std::string cameraName;
+	unsigned int cols, rows;
+	double fps;
+	unsigned int offsetX;
+	PixelFormat format;
+	unsigned int bitsPerPixel;	//8, 12 (packed) or 16
+	unsigned int packetSize;	//bytes per bus interval reserved on the shared bus; 0 if not configured
+
+	unsigned char* sensor;		//full synthetic sensor image in the output format, RGGB
+	unsigned char* frame;		//ROI of the current frame
+	unsigned int frameNum;
+
+	//capture thread
+	HANDLE thread;
+	volatile bool capturing;
+	ImageEventCallback callback;
+	const void* callbackData;
+	volatile LONG stallMs;		//stall requested by injectStall, 0 if none
+
+	//bandwidth reserved by all SimCameras, in bytes per bus interval
+	static volatile LONG busReserved;
+
+	//private prototypes
+	void setFormat(PixelFormat);
+	void renderSensor();
+	unsigned int sceneValue(unsigned int x, unsigned int y);
+	void readFrame();
+	void wrapFrame(Image*);
+	void stall();
+	static DWORD WINAPI captureThread(LPVOID);
+};
+
+// ============================================================================
+#endif
@@ -0,0 +1,295 @@
+
+//Shared work-stealing thread pool for per-frame image kernels
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "TaskPool.h"
+#include "Trace.h"
+
+#define		WORKER_IDLE_WAIT	50		//ms a worker sleeps before rechecking the queues without a wake up
+
+//queue of the current thread, registered the first time it submits to a pool
+//a pool is recognised by its generation, not its address, which a later pool may reuse
+static __declspec(thread) LONG tlsGeneration = 0;
+static __declspec(thread) int tlsQueue = -1;
+static volatile LONG poolGenerations = 0;
+
+//worker start up parameters
+struct WORKER_START
+{
+	TaskPool* pool;
+	int queue;
+};
+
+static TaskPool* sharedPool = 0;
+
+// ============================================================================
+//public functions
+TaskPool::TaskPool(int threads)
+{
+	if (threads <= 0)
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		threads = info.dwNumberOfProcessors;
+	}
+	if (threads > TASK_POOL_MAX_QUEUES / 2)
+		threads = TASK_POOL_MAX_QUEUES / 2;
+
+	//the submitting thread runs bands too, so one thread fewer is started
+	generation = InterlockedIncrement(&poolGenerations);
+	numWorkers = threads - 1;
+	numQueues = numWorkers;
+	stopping = false;
+
+	queues = new TASK_QUEUE[TASK_POOL_MAX_QUEUES];
+	for (int i = 0; i < TASK_POOL_MAX_QUEUES; i++)
+	{
+		InitializeCriticalSection(&queues[i].lock);
+		queues[i].head = queues[i].tail = 0;
+		owners[i] = 0;
+	}
+
+	wake = CreateSemaphore(NULL, 0, TASK_POOL_MAX_QUEUES * TASK_QUEUE_SIZE, NULL);
+	workers = new HANDLE[numWorkers > 0 ? numWorkers : 1];
+	for (int i = 0; i < numWorkers; i++)
+	{
+		WORKER_START* start = new WORKER_START;
+		start->pool = this;
+		start->queue = i;
+		workers[i] = CreateThread(NULL, 0, workerThread, start, 0, NULL);
+	}
+}
+// ----------------------------------------------------------------------------
+
+TaskPool::~TaskPool()
+{
+	stopping = true;
+	ReleaseSemaphore(wake, numWorkers > 0 ? numWorkers : 1, NULL);
+	for (int i = 0; i < numWorkers; i++)
+	{
+		WaitForSingleObject(workers[i], INFINITE);
+		CloseHandle(workers[i]);
+	}
+	CloseHandle(wake);
+	for (int i = 0; i < TASK_POOL_MAX_QUEUES; i++)
+		DeleteCriticalSection(&queues[i].lock);
+	delete[] queues;
+	delete[] workers;
+}
+// ----------------------------------------------------------------------------
+
+void TaskPool::parallelFor(TaskFunction fn, void* context, unsigned int count, unsigned int grain)
+{
+	if (grain == 0)
+		grain = 1;
+	int queue = callerQueue();
+	if (numWorkers == 0 || count <= grain || queue < 0)
+	{
+		fn(context, 0, count);
+		return;
+	}
+
+	unsigned int bands = (count + grain - 1) / grain;
+	volatile LONG remaining = bands;
+
+	//push the bands in reverse so the owner (popping from the tail) works top down
+	unsigned int pushed = 0;
+	for (unsigned int b = bands; b-- > 0; )
+	{
+		POOL_TASK task;
+		task.fn = fn;
+		task.context = context;
+		task.begin = b * grain;
+		task.end = (b + 1) * grain < count ? (b + 1) * grain : count;
+		task.remaining = &remaining;
+		if (push(queue, task))
+			pushed++;
+		else
+			run(task);		//queue full: do it now
+	}
+	if (pushed > 1)
+		ReleaseSemaphore(wake, (LONG)(pushed - 1 < (unsigned int)numWorkers ? pushed - 1 : numWorkers), NULL);
+
+	//help until every band is done; may run bands of other submitters (e.g. the other eye) meanwhile
+	while (remaining > 0)
+	{
+		POOL_TASK task;
+		if (pop(queue, &task) || steal(queue, &task))
+			run(task);
+		else
+			Sleep(0);
+	}
+}
+// ----------------------------------------------------------------------------
+
+int TaskPool::getThreads()
+{
+	return numWorkers + 1;
+}
+// ----------------------------------------------------------------------------
+
+void TaskPool::releaseQueue(DWORD threadId)
+{
+	//its bands all finished before its last parallelFor returned, so the queue is empty
+	for (int i = numWorkers; i < TASK_POOL_MAX_QUEUES; i++)
+		InterlockedCompareExchange(&owners[i], 0, (LONG)threadId);
+}
+
+// ============================================================================
+//private functions
+
+//queue owned by the calling thread; workers own theirs, other threads get a free one on first use,
+//and again if theirs was released. Capture restarts start new callback threads, so queues are reused
+int TaskPool::callerQueue()
+{
+	LONG thread = (LONG)GetCurrentThreadId();
+	if (tlsGeneration != generation || tlsQueue < 0 || (tlsQueue >= numWorkers && owners[tlsQueue] != thread))
+	{
+		int index = -1;
+		for (int i = numWorkers; i < TASK_POOL_MAX_QUEUES && index < 0; i++)
+		{
+			if (InterlockedCompareExchange(&owners[i], thread, 0) == 0)
+				index = i;
+		}
+		//thieves look at the queues below numQueues
+		LONG n;
+		while (index >= 0 && (n = numQueues) <= index)
+			InterlockedCompareExchange(&numQueues, index + 1, n);
+		//out of queues: this thread runs its kernels by itself until one is released
+		tlsGeneration = generation;
+		tlsQueue = index;
+	}
+	return tlsQueue;
+}
+// ----------------------------------------------------------------------------
+
+bool TaskPool::push(int queue, const POOL_TASK& task)
+{
+	TASK_QUEUE* q = &queues[queue];
+	bool ok = false;
+	EnterCriticalSection(&q->lock);
+	if (q->tail - q->head < TASK_QUEUE_SIZE)
+	{
+		q->tasks[q->tail % TASK_QUEUE_SIZE] = task;
+		q->tail++;
+		ok = true;
+	}
+	LeaveCriticalSection(&q->lock);
+	return ok;
+}
+// ----------------------------------------------------------------------------
+
+bool TaskPool::pop(int queue, POOL_TASK* task)
+{
+	TASK_QUEUE* q = &queues[queue];
+	bool ok = false;
+	EnterCriticalSection(&q->lock);
+	if (q->tail != q->head)
+	{
+		q->tail--;
+		*task = q->tasks[q->tail % TASK_QUEUE_SIZE];
+		ok = true;
+	}
+	LeaveCriticalSection(&q->lock);
+	return ok;
+}
+// ----------------------------------------------------------------------------
+
+bool TaskPool::steal(int thief, POOL_TASK* task)
+{
+	int n = numQueues;
+	for (int i = 1; i < n; i++)
+	{
+		TASK_QUEUE* q = &queues[(thief + i) % n];
+		//cheap check first so idle threads do not contend on empty queues
+		if (q->tail == q->head)
+			continue;
+		if (!TryEnterCriticalSection(&q->lock))
+			continue;
+		bool ok = false;
+		if (q->tail != q->head)
+		{
+			*task = q->tasks[q->head % TASK_QUEUE_SIZE];
+			q->head++;
+			ok = true;
+		}
+		LeaveCriticalSection(&q->lock);
+		if (ok)
+			return true;
+	}
+	return false;
+}
+// ----------------------------------------------------------------------------
+
+void TaskPool::run(const POOL_TASK& task)
+{
+	TraceScope span("task");
+	task.fn(task.context, task.begin, task.end);
+	InterlockedDecrement(task.remaining);
+}
+// ----------------------------------------------------------------------------
+
+DWORD WINAPI TaskPool::workerThread(LPVOID lpThreadParameter)
+{
+	WORKER_START* start = (WORKER_START*)lpThreadParameter;
+	TaskPool* pool = start->pool;
+	int queue = start->queue;
+	delete start;
+
+	tlsGeneration = pool->generation;
+	tlsQueue = queue;
+	traceThreadName("worker");
+
+	while (!pool->stopping)
+	{
+		POOL_TASK task;
+		if (pool->pop(queue, &task) || pool->steal(queue, &task))
+			pool->run(task);
+		else
+			WaitForSingleObject(pool->wake, WORKER_IDLE_WAIT);
+	}
+	return 0;
+}
+
+// ============================================================================
+//shared pool
+
+void initTaskPool(int threads)
+{
+	closeTaskPool();
+	sharedPool = new TaskPool(threads);
+	if (sharedPool->getThreads() <= 1)
+	{
+		delete sharedPool;
+		sharedPool = 0;
+	}
+	printf("Image processing on %d thread(s)\n", sharedPool != 0 ? sharedPool->getThreads() : 1);
+}
+
+void closeTaskPool()
+{
+	delete sharedPool;
+	sharedPool = 0;
+}
+
+TaskPool* getTaskPool()
+{
+	return sharedPool;
+}
+
+void parallelRows(TaskFunction fn, void* context, unsigned int count)
+{
+	if (sharedPool != 0)
+		sharedPool->parallelFor(fn, context, count, TASK_BAND_ROWS);
+	else
+		fn(context, 0, count);
+}
+
+void releaseTaskQueue(DWORD threadId)
+{
+	if (sharedPool != 0)
+		sharedPool->releaseQueue(threadId);
+}
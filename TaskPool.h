@@ -0,0 +1,87 @@
+#ifndef TASK_POOL
+#define TASK_POOL
+// ============================================================================
+
+//Shared work-stealing thread pool for per-frame image kernels
+//Kernels are split into row bands; each submitting thread (camera callbacks,
+//display) pushes its bands onto its own queue and helps run them, idle threads
+//steal from the other queues. Both eyes and all stages share the one set of
+//worker threads, so running several stages at once does not oversubscribe the cores
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+
+#define		TASK_POOL_MAX_QUEUES	32		//worker threads plus submitting threads
+#define		TASK_QUEUE_SIZE			256		//bands that can wait in one queue
+#define		TASK_BAND_ROWS			32		//default band height for image kernels
+
+//runs a kernel over the rows [begin, end)
+typedef void (*TaskFunction)(void* context, unsigned int begin, unsigned int end);
+
+// ============================================================================
+
+class TaskPool
+{
+public:
+	//threads counts the submitting thread too; 0 uses one thread per core
+	TaskPool(int threads);
+	~TaskPool();
+
+	//runs fn over [0, count) in bands of grain rows and returns when all bands are done
+	void parallelFor(TaskFunction fn, void* context, unsigned int count, unsigned int grain);
+
+	//returns number of threads that run kernels (workers plus the submitting thread)
+	int getThreads();
+	//frees the queue of a thread that has stopped submitting, e.g. a capture callback thread after StopCapture
+	void releaseQueue(DWORD threadId);
+
+private:
+	struct POOL_TASK
+	{
+		TaskFunction fn;
+		void* context;
+		unsigned int begin, end;
+		volatile LONG* remaining;	//bands of the parallelFor still to finish
+	};
+
+	//owner pushes and pops at the tail, thieves take from the head
+	struct TASK_QUEUE
+	{
+		CRITICAL_SECTION lock;
+		POOL_TASK tasks[TASK_QUEUE_SIZE];
+		unsigned int head, tail;
+	};
+
+	//data
+	LONG generation;				//identifies this pool to the threads that have used it
+	int numWorkers;
+	HANDLE* workers;
+	TASK_QUEUE* queues;
+	volatile LONG numQueues;		//worker queues followed by queues of submitting threads
+	volatile LONG owners[TASK_POOL_MAX_QUEUES];	//thread id of each submitting thread's queue, 0 when free
+	HANDLE wake;					//semaphore released when bands are pushed
+	volatile bool stopping;
+
+	//private prototypes
+	int callerQueue();
+	bool push(int queue, const POOL_TASK&);
+	bool pop(int queue, POOL_TASK*);
+	bool steal(int thief, POOL_TASK*);
+	void run(const POOL_TASK&);
+	static DWORD WINAPI workerThread(LPVOID);
+};
+
+//pool shared by all stages; null until initTaskPool, and when running single threaded
+void initTaskPool(int threads);
+void closeTaskPool();
+TaskPool* getTaskPool();
+
+//runs fn over [0, count) on the shared pool, or directly if there is none
+void parallelRows(TaskFunction fn, void* context, unsigned int count);
+//gives the shared pool's queue of a finished thread to the next thread that submits
+void releaseTaskQueue(DWORD threadId);
+
+// ============================================================================
+#endif
@@ -0,0 +1,309 @@
+
+//Timeline tracing of the pipeline stages
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "Trace.h"
+#include <mmsystem.h>
+#include <intrin.h>
+#include <string.h>
+
+#define		TRACE_TIDS_MAX		256		//distinct threads named in one trace file
+
+//one thread's spans; only the owning thread writes
+struct TRACE_BUFFER
+{
+	TRACE_EVENT events[TRACE_EVENTS];
+	volatile LONG head;			//spans recorded; the next one goes to events[head % TRACE_EVENTS]
+	DWORD threadId;				//current owner
+	const char* name;			//given by traceThreadName, or null
+	volatile LONG inUse;
+};
+
+//a trace waiting for its window to close, for the export thread
+struct TRACE_REQUEST
+{
+	LONGLONG from, trigger, to;
+	DWORD afterMs;
+	char path[200];
+	char reason[64];
+};
+
+static DWORD traceTls = TLS_OUT_OF_INDEXES;
+static TRACE_BUFFER* buffers[TRACE_THREADS_MAX];
+static volatile LONG numBuffers = 0;
+static CRITICAL_SECTION registryLock;
+
+static LONGLONG traceStart;			//time 0 of the timeline
+static char* traceBase;
+static FILE* traceLog;
+static volatile LONG exporting = 0;
+static HANDLE exportThread = 0;
+static int exportCount = 0;
+static DWORD lastTrigger = 0;
+static bool triggeredBefore = false;
+
+// ============================================================================
+//recording
+
+//gives the calling thread a buffer, reusing one released by traceThreadExit if possible
+static TRACE_BUFFER* attach()
+{
+	TRACE_BUFFER* buffer = 0;
+	EnterCriticalSection(&registryLock);
+	for (int i = 0; i < numBuffers && buffer == 0; i++)
+	{
+		if (buffers[i]->inUse == 0)
+			buffer = buffers[i];
+	}
+	if (buffer == 0 && numBuffers < TRACE_THREADS_MAX)
+	{
+		buffer = new TRACE_BUFFER;
+		buffer->head = 0;
+		buffers[numBuffers] = buffer;
+		//the export thread only looks at buffers below numBuffers
+		InterlockedIncrement(&numBuffers);
+	}
+	if (buffer != 0)
+	{
+		buffer->inUse = 1;
+		buffer->threadId = GetCurrentThreadId();
+		buffer->name = 0;
+		TlsSetValue(traceTls, buffer);
+	}
+	LeaveCriticalSection(&registryLock);
+	return buffer;
+}
+// ----------------------------------------------------------------------------
+
+void traceOpen(const char* baseFilename, FILE* log)
+{
+	if (traceTls != TLS_OUT_OF_INDEXES)
+		return;
+	InitializeCriticalSection(&registryLock);
+	traceBase = _strdup(baseFilename);
+	traceLog = log;
+	traceStart = perfCounter();
+	traceTls = TlsAlloc();
+}
+// ----------------------------------------------------------------------------
+
+void traceClose()
+{
+	if (exportThread != 0)
+	{
+		WaitForSingleObject(exportThread, INFINITE);
+		CloseHandle(exportThread);
+		exportThread = 0;
+	}
+	//the buffers stay allocated: threads may still be finishing a span until the process exits
+}
+// ----------------------------------------------------------------------------
+
+void traceThreadName(const char* name)
+{
+	if (traceTls == TLS_OUT_OF_INDEXES)
+		return;
+	TRACE_BUFFER* buffer = (TRACE_BUFFER*)TlsGetValue(traceTls);
+	//a buffer released by traceReleaseThread may have gone to another thread since
+	if (buffer == 0 || buffer->inUse == 0 || buffer->threadId != GetCurrentThreadId())
+		buffer = attach();
+	if (buffer != 0)
+		buffer->name = name;
+}
+// ----------------------------------------------------------------------------
+
+void traceThreadExit()
+{
+	if (traceTls == TLS_OUT_OF_INDEXES)
+		return;
+	TRACE_BUFFER* buffer = (TRACE_BUFFER*)TlsGetValue(traceTls);
+	if (buffer != 0)
+	{
+		TlsSetValue(traceTls, 0);
+		InterlockedExchange(&buffer->inUse, 0);
+	}
+}
+// ----------------------------------------------------------------------------
+
+void traceReleaseThread(DWORD threadId)
+{
+	if (traceTls == TLS_OUT_OF_INDEXES)
+		return;
+	EnterCriticalSection(&registryLock);
+	for (int i = 0; i < numBuffers; i++)
+	{
+		if (buffers[i]->inUse != 0 && buffers[i]->threadId == threadId)
+			InterlockedExchange(&buffers[i]->inUse, 0);
+	}
+	LeaveCriticalSection(&registryLock);
+}
+// ----------------------------------------------------------------------------
+
+void traceSpan(const char* name, LONGLONG start, LONGLONG end, LONG arg)
+{
+	if (traceTls == TLS_OUT_OF_INDEXES)
+		return;
+	TRACE_BUFFER* buffer = (TRACE_BUFFER*)TlsGetValue(traceTls);
+	if (buffer == 0 && (buffer = attach()) == 0)
+		return;
+
+	TRACE_EVENT* event = &buffer->events[buffer->head & (TRACE_EVENTS - 1)];
+	event->name = name;
+	event->start = start;
+	event->end = end;
+	event->threadId = buffer->threadId;
+	event->arg = arg;
+	//x86 keeps stores in order, so the span is complete before it is counted as long as the compiler keeps them
+	_ReadWriteBarrier();
+	buffer->head = buffer->head + 1;
+}
+
+// ============================================================================
+//export
+
+//microseconds on the timeline
+static double traceUs(LONGLONG ticks)
+{
+	return perfMs(ticks - traceStart) * 1000;
+}
+// ----------------------------------------------------------------------------
+
+//writes the spans overlapping [from, to] of every buffer as Chrome trace JSON; returns the number written
+static int writeTrace(FILE* file, const TRACE_REQUEST* request)
+{
+	DWORD pid = GetCurrentProcessId();
+	TRACE_EVENT* copy = new TRACE_EVENT[TRACE_EVENTS];
+	DWORD named[TRACE_TIDS_MAX];
+	int numNamed = 0;
+	int written = 0;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"reason\":\"%s\"},\"traceEvents\":[\n", request->reason);
+	fprintf(file, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":%lu,\"tid\":0,\"ts\":%.3f}", request->reason, pid, traceUs(request->trigger));
+
+	int count = numBuffers;
+	for (int b = 0; b < count; b++)
+	{
+		TRACE_BUFFER* buffer = buffers[b];
+		const char* name = buffer->name;
+
+		//copy the ring while its thread keeps recording, then drop what it may have overwritten meanwhile
+		LONG head = buffer->head;
+		_ReadWriteBarrier();
+		LONG first = (head > TRACE_EVENTS) ? head - TRACE_EVENTS : 0;
+		for (LONG i = first; i < head; i++)
+			copy[i - first] = buffer->events[i & (TRACE_EVENTS - 1)];
+		_ReadWriteBarrier();
+		LONG after = buffer->head;
+		//the span being recorded at index after overwrites index after - TRACE_EVENTS
+		LONG valid = after - TRACE_EVENTS + 1;
+		if (valid < first)
+			valid = first;
+
+		for (LONG i = valid; i < head; i++)
+		{
+			const TRACE_EVENT* event = &copy[i - first];
+			if (event->end < request->from || event->start > request->to)
+				continue;
+
+			//name each thread once, with the name of the buffer it recorded into; spans of an earlier owner of
+			//a reused buffer keep their own thread id and are left unnamed
+			bool known = event->threadId != buffer->threadId;
+			for (int n = 0; n < numNamed && !known; n++)
+				known = named[n] == event->threadId;
+			if (!known && numNamed < TRACE_TIDS_MAX)
+			{
+				named[numNamed++] = event->threadId;
+				if (name != 0)
+					fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}", pid, event->threadId, name);
+			}
+
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f", event->name, pid, event->threadId,
+				traceUs(event->start), perfMs(event->end - event->start) * 1000);
+			if (event->arg >= 0)
+				fprintf(file, ",\"args\":{\"frame\":%ld}", event->arg);
+			fprintf(file, "}");
+			written++;
+		}
+	}
+
+	fprintf(file, "\n]}\n");
+	delete[] copy;
+	return written;
+}
+// ----------------------------------------------------------------------------
+
+//waits for the end of the window, then writes the trace file
+static DWORD WINAPI exportTrace(LPVOID lpThreadParameter)
+{
+	TRACE_REQUEST* request = (TRACE_REQUEST*)lpThreadParameter;
+	traceThreadName("trace export");
+	Sleep(request->afterMs);
+
+	char buffer[300];
+	FILE* file = fopen(request->path, "w");
+	if (file != 0)
+	{
+		LONGLONG start = perfCounter();
+		int spans = writeTrace(file, request);
+		fclose(file);
+		sprintf(buffer, "Trace (%s): %d spans written to %s in %.0f ms\n", request->reason, spans, request->path, perfMs(perfCounter() - start));
+	}
+	else
+	{
+		sprintf(buffer, "Could not write trace %s\n", request->path);
+	}
+	printf(buffer);
+	if (traceLog != 0)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), traceLog);
+	}
+
+	delete request;
+	InterlockedExchange(&exporting, 0);
+	traceThreadExit();
+	return 0;
+}
+// ----------------------------------------------------------------------------
+
+bool traceExport(DWORD beforeMs, DWORD afterMs, const char* reason, bool triggered)
+{
+	if (traceTls == TLS_OUT_OF_INDEXES)
+		return false;
+
+	DWORD now = timeGetTime();
+	if (triggered && triggeredBefore && now - lastTrigger < TRACE_TRIGGER_GAP)
+		return false;
+	if (InterlockedCompareExchange(&exporting, 1, 0) != 0)
+		return false;
+	if (triggered)
+	{
+		lastTrigger = now;
+		triggeredBefore = true;
+	}
+
+	//the previous export has finished
+	if (exportThread != 0)
+		CloseHandle(exportThread);
+
+	double ticksPerMs = 1.0 / perfMs(1);
+	TRACE_REQUEST* request = new TRACE_REQUEST;
+	request->trigger = perfCounter();
+	request->from = request->trigger - (LONGLONG)(beforeMs * ticksPerMs);
+	request->to = request->trigger + (LONGLONG)(afterMs * ticksPerMs);
+	request->afterMs = afterMs;
+	sprintf(request->path, "%s\\%s_trace-%d.json", traceBase, traceBase, exportCount++);
+	strncpy(request->reason, reason, sizeof(request->reason) - 1);
+	request->reason[sizeof(request->reason) - 1] = 0;
+
+	exportThread = CreateThread(NULL, 0, exportTrace, request, 0, NULL);
+	if (exportThread == 0)
+	{
+		delete request;
+		InterlockedExchange(&exporting, 0);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,76 @@
+#ifndef PIPELINE_TRACE
+#define PIPELINE_TRACE
+// ============================================================================
+
+//Timeline tracing of the pipeline stages
+//Every thread records the spans it runs (conversion, upload, swap, save, ...) into its
+//own ring buffer, so recording takes no lock and costs two counter reads and a few
+//stores. The newest spans of all threads can be written out as Chrome trace JSON
+//(chrome://tracing or ui.perfetto.dev) on demand, or for a window around a trigger
+//such as a late frame, to see how the threads interacted on that frame
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+#include <stdio.h>
+#include "PerfTimer.h"
+
+#define		TRACE_EVENTS		16384	//spans kept per thread, oldest overwritten first; a power of 2
+#define		TRACE_THREADS_MAX	64		//threads that can record at the same time
+#define		TRACE_BEFORE_DEF	2000	//ms before a trigger written to the trace
+#define		TRACE_AFTER_DEF		500		//ms after a trigger written to the trace
+#define		TRACE_TRIGGER_GAP	10000	//ms between automatically triggered traces
+
+//one finished span
+struct TRACE_EVENT
+{
+	const char* name;		//string literal
+	LONGLONG start, end;	//perfCounter() values
+	DWORD threadId;
+	LONG arg;				//frame number, or -1
+};
+
+//starts recording; trace files are written as <base>\<base>_trace-n.json
+void traceOpen(const char* baseFilename, FILE* log);
+//waits for a trace being written and stops recording
+void traceClose();
+
+//names the calling thread in the timeline
+void traceThreadName(const char* name);
+//gives the calling thread's buffer to the next thread that records; for short lived threads
+void traceThreadExit();
+//the same for a thread that has stopped recording but cannot call traceThreadExit itself, such as a capture
+//callback thread after StopCapture. If it records again it should call traceThreadName first
+void traceReleaseThread(DWORD threadId);
+
+//records a span of the calling thread; does nothing before traceOpen
+void traceSpan(const char* name, LONGLONG start, LONGLONG end, LONG arg = -1);
+
+//writes the spans from beforeMs ago to afterMs from now on a background thread; returns false if a trace
+//is still being written. Triggered traces (e.g. late frames) are also dropped within TRACE_TRIGGER_GAP of the last
+bool traceExport(DWORD beforeMs, DWORD afterMs, const char* reason, bool triggered = false);
+
+//records the enclosing scope as a span
+class TraceScope
+{
+public:
+	TraceScope(const char* spanName, LONG spanArg = -1)
+	{
+		name = spanName;
+		arg = spanArg;
+		start = perfCounter();
+	}
+	~TraceScope()
+	{
+		traceSpan(name, start, perfCounter(), arg);
+	}
+
+private:
+	const char* name;
+	LONG arg;
+	LONGLONG start;
+};
+
+// ============================================================================
+#endif
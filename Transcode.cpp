@@ -0,0 +1,820 @@
+
+//Offline transcoding of a recorded session into one indexed, seekable file
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "Transcode.h"
+#include "TaskPool.h"
+#include "PerfTimer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define		RICE_CONTEXTS		8		//activity classes per channel, each with its own Rice parameter
+#define		RICE_LIMIT			24		//unary length at which a residual is sent as 8 raw bits instead
+#define		RICE_RESET			64		//samples after which a context's statistics are halved
+#define		ADLER_BASE			65521
+#define		ADLER_BLOCK			5552	//bytes that can be summed before the sums are reduced
+#define		TRANSCODE_MAX_BAD	5		//files named when they cannot be read
+
+// ============================================================================
+//coding
+
+//running statistics of a context: mean of the mapped residuals is about sum / count
+struct RICE_CONTEXT
+{
+	int count;
+	int sum;
+};
+
+static void initContexts(RICE_CONTEXT* contexts, int channels)
+{
+	for (int i = 0; i < channels * RICE_CONTEXTS; i++)
+	{
+		contexts[i].count = 1;
+		contexts[i].sum = 2;
+	}
+}
+// ----------------------------------------------------------------------------
+
+//smallest k for which the context's residuals average under 2^k
+static inline int riceParameter(const RICE_CONTEXT* context)
+{
+	int k = 0;
+	while ((context->count << k) < context->sum)
+		k++;
+	return k;
+}
+// ----------------------------------------------------------------------------
+
+static inline void riceUpdate(RICE_CONTEXT* context, int mapped)
+{
+	context->sum += mapped;
+	if (++context->count == RICE_RESET)
+	{
+		context->count >>= 1;
+		context->sum >>= 1;
+	}
+}
+// ----------------------------------------------------------------------------
+
+//octave of each neighbourhood activity, and leading zeros of each byte for the decoder
+static unsigned char activityClass[512];
+static unsigned char leadingZeros[256];
+
+static bool initTables()
+{
+	for (int i = 0; i < 512; i++)
+	{
+		int activity = i, q = 0;
+		while (activity > 0 && q < RICE_CONTEXTS - 1)
+		{
+			activity >>= 1;
+			q++;
+		}
+		activityClass[i] = q;
+	}
+	for (int i = 0; i < 256; i++)
+	{
+		int zeros = 0;
+		while (zeros < 8 && (i & (0x80 >> zeros)) == 0)
+			zeros++;
+		leadingZeros[i] = zeros;
+	}
+	return true;
+}
+//filled before main, so no thread sees them empty
+static bool tablesReady = initTables();
+// ----------------------------------------------------------------------------
+
+//the context of a sample: channel, and how busy its neighbourhood is, in octaves
+static inline int contextOf(int channel, int a, int b, int c)
+{
+	return channel * RICE_CONTEXTS + activityClass[abs(a - c) + abs(b - c)];
+}
+// ----------------------------------------------------------------------------
+
+//LOCO-I median edge detector: left a, above b, above left c
+static inline int predictMed(int a, int b, int c)
+{
+	int lo = (a < b) ? a : b;
+	int hi = (a < b) ? b : a;
+	if (c >= hi)
+		return lo;
+	if (c <= lo)
+		return hi;
+	return a + b - c;
+}
+// ----------------------------------------------------------------------------
+
+//the planes coded: green, then blue and red less green as signed bytes, so that grey is near zero in both
+static inline void toPlanes(const unsigned char* p, int channels, int* out)
+{
+	if (channels == 1)
+	{
+		out[0] = p[0];
+		return;
+	}
+	out[0] = p[1];
+	out[1] = (signed char)(p[0] - p[1]);
+	out[2] = (signed char)(p[2] - p[1]);
+}
+// ----------------------------------------------------------------------------
+
+//msb first into out
+struct BIT_WRITER
+{
+	unsigned char* out;
+	unsigned int pos;
+	ULONGLONG bits;
+	int count;
+};
+
+static inline void putBits(BIT_WRITER* writer, unsigned int value, int n)
+{
+	writer->bits = (writer->bits << n) | value;
+	writer->count += n;
+	while (writer->count >= 8)
+	{
+		writer->count -= 8;
+		writer->out[writer->pos++] = (unsigned char)(writer->bits >> writer->count);
+	}
+}
+// ----------------------------------------------------------------------------
+
+struct BIT_READER
+{
+	const unsigned char* in;
+	unsigned int pos, size;
+	ULONGLONG bits;		//left aligned
+	int count;
+};
+
+static inline void refill(BIT_READER* reader)
+{
+	while (reader->count <= 56)
+	{
+		//zeros past the end; decoding checks afterwards that it did not use them
+		ULONGLONG byte = 0;
+		if (reader->pos < reader->size)
+			byte = reader->in[reader->pos];
+		reader->pos++;
+		reader->bits |= byte << (56 - reader->count);
+		reader->count += 8;
+	}
+}
+// ----------------------------------------------------------------------------
+
+static inline unsigned int getBits(BIT_READER* reader, int n)
+{
+	if (n == 0)
+		return 0;
+	unsigned int value = (unsigned int)(reader->bits >> (64 - n));
+	reader->bits <<= n;
+	reader->count -= n;
+	return value;
+}
+// ----------------------------------------------------------------------------
+
+//residual of a sample as an 8-bit signed value, folded onto 0, -1, 1, -2, ...
+static inline int mapResidual(int value, int predicted)
+{
+	int e = (signed char)(value - predicted);
+	return (e >= 0) ? 2 * e : -2 * e - 1;
+}
+// ----------------------------------------------------------------------------
+
+static inline void putResidual(BIT_WRITER* writer, int mapped, int k)
+{
+	int q = mapped >> k;
+	if (q < RICE_LIMIT)
+	{
+		//q zeros, a one, and the low k bits
+		putBits(writer, (1 << k) | (mapped & ((1 << k) - 1)), q + 1 + k);
+	}
+	else
+	{
+		putBits(writer, 1, RICE_LIMIT + 1);
+		putBits(writer, mapped, 8);
+	}
+}
+// ----------------------------------------------------------------------------
+
+static inline int getResidual(BIT_READER* reader, int k)
+{
+	refill(reader);
+	int zeros = 0;
+	int n;
+	//whole bytes of zeros first; valid data has at most RICE_LIMIT
+	while ((n = leadingZeros[reader->bits >> 56]) == 8 && zeros <= RICE_LIMIT)
+	{
+		reader->bits <<= 8;
+		reader->count -= 8;
+		zeros += 8;
+	}
+	zeros += n;
+	getBits(reader, n + 1);
+	if (zeros < RICE_LIMIT)
+		return (zeros << k) | getBits(reader, k);
+	return getBits(reader, 8);
+}
+// ----------------------------------------------------------------------------
+
+unsigned int sessionCodedBound(int w, int h, int channels)
+{
+	//the longest code is RICE_LIMIT + 9 bits
+	return (unsigned int)(((ULONGLONG)w * h * channels * (RICE_LIMIT + 9) + 7) / 8) + 8;
+}
+// ----------------------------------------------------------------------------
+
+unsigned int sessionEncode(const unsigned char* pixels, int w, int h, int channels, unsigned char* out)
+{
+	int stride = (w * channels + 3) & ~3;
+	int planeWidth = (w + 1) * channels;
+	//plane values of the row above and this row, with a pixel on the left for the first column
+	int* above = (int*)malloc(2 * planeWidth * sizeof(int));
+	int* row = above + planeWidth;
+	memset(above, 0, planeWidth * sizeof(int));
+	RICE_CONTEXT contexts[3 * RICE_CONTEXTS];
+	initContexts(contexts, channels);
+
+	BIT_WRITER writer = { out, 0, 0, 0 };
+	for (int y = 0; y < h; y++)
+	{
+		const unsigned char* src = pixels + (size_t)y * stride;
+		//the first pixel is predicted from the one above it
+		for (int c = 0; c < channels; c++)
+			row[c] = above[c] = above[channels + c];
+		for (int x = 0; x < w; x++)
+		{
+			int* current = row + (x + 1) * channels;
+			toPlanes(src + x * channels, channels, current);
+			for (int c = 0; c < channels; c++)
+			{
+				int a = current[c - channels];
+				int b = above[(x + 1) * channels + c];
+				int d = above[x * channels + c];
+				RICE_CONTEXT* context = &contexts[contextOf(c, a, b, d)];
+				int mapped = mapResidual(current[c], predictMed(a, b, d));
+				putResidual(&writer, mapped, riceParameter(context));
+				riceUpdate(context, mapped);
+			}
+		}
+		int* swap = above;
+		above = row;
+		row = swap;
+	}
+	if (writer.count > 0)
+		putBits(&writer, 0, 8 - writer.count);
+
+	free(above < row ? above : row);
+	return writer.pos;
+}
+// ----------------------------------------------------------------------------
+
+bool sessionDecode(const unsigned char* coded, unsigned int bytes, int w, int h, int channels, unsigned char* pixels)
+{
+	int stride = (w * channels + 3) & ~3;
+	int planeWidth = (w + 1) * channels;
+	int* above = (int*)malloc(2 * planeWidth * sizeof(int));
+	int* row = above + planeWidth;
+	memset(above, 0, planeWidth * sizeof(int));
+	RICE_CONTEXT contexts[3 * RICE_CONTEXTS];
+	initContexts(contexts, channels);
+
+	BIT_READER reader = { coded, 0, bytes, 0, 0 };
+	for (int y = 0; y < h; y++)
+	{
+		unsigned char* dst = pixels + (size_t)y * stride;
+		for (int c = 0; c < channels; c++)
+			row[c] = above[c] = above[channels + c];
+		for (int x = 0; x < w; x++)
+		{
+			int* current = row + (x + 1) * channels;
+			for (int c = 0; c < channels; c++)
+			{
+				int a = current[c - channels];
+				int b = above[(x + 1) * channels + c];
+				int d = above[x * channels + c];
+				RICE_CONTEXT* context = &contexts[contextOf(c, a, b, d)];
+				int mapped = getResidual(&reader, riceParameter(context));
+				riceUpdate(context, mapped);
+				int e = (mapped & 1) ? -((mapped + 1) >> 1) : (mapped >> 1);
+				int value = predictMed(a, b, d) + e;
+				//green is unsigned, the differences signed
+				current[c] = (c == 0) ? (unsigned char)value : (signed char)value;
+			}
+			unsigned char* p = dst + x * channels;
+			if (channels == 1)
+			{
+				p[0] = (unsigned char)current[0];
+			}
+			else
+			{
+				p[1] = (unsigned char)current[0];
+				p[0] = (unsigned char)(current[1] + current[0]);
+				p[2] = (unsigned char)(current[2] + current[0]);
+			}
+		}
+		memset(dst + w * channels, 0, stride - w * channels);
+		int* swap = above;
+		above = row;
+		row = swap;
+	}
+
+	free(above < row ? above : row);
+	return (ULONGLONG)reader.pos * 8 - reader.count <= (ULONGLONG)bytes * 8;
+}
+// ----------------------------------------------------------------------------
+
+DWORD sessionChecksum(const unsigned char* pixels, int w, int h, int channels)
+{
+	int stride = (w * channels + 3) & ~3;
+	DWORD a = 1, b = 0;
+	for (int y = 0; y < h; y++)
+	{
+		const unsigned char* data = pixels + (size_t)y * stride;
+		int bytes = w * channels;
+		while (bytes > 0)
+		{
+			int n = (bytes < ADLER_BLOCK) ? bytes : ADLER_BLOCK;
+			bytes -= n;
+			while (n-- > 0)
+			{
+				a += *data++;
+				b += a;
+			}
+			a %= ADLER_BASE;
+			b %= ADLER_BASE;
+		}
+	}
+	return (b << 16) | a;
+}
+
+// ============================================================================
+//reader
+
+SessionReader::SessionReader()
+{
+	file = INVALID_HANDLE_VALUE;
+	index = 0;
+	memset(&header, 0, sizeof(header));
+}
+// ----------------------------------------------------------------------------
+
+SessionReader::~SessionReader()
+{
+	close();
+}
+// ----------------------------------------------------------------------------
+
+//reads at an offset without moving a shared file pointer, so several threads can read at once
+static bool readAt(HANDLE file, LONGLONG offset, void* buffer, DWORD bytes)
+{
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD read = 0;
+	return ReadFile(file, buffer, bytes, &read, &overlapped) && read == bytes;
+}
+// ----------------------------------------------------------------------------
+
+bool SessionReader::open(const char* path)
+{
+	close();
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	if (!readAt(file, 0, &header, sizeof(header)) || header.magic != SESSION_MAGIC || header.version != SESSION_VERSION
+		|| header.entrySize != sizeof(SESSION_FRAME) || header.frames < 0)
+	{
+		close();
+		return false;
+	}
+	index = new SESSION_FRAME[header.frames + 1];
+	if (!readAt(file, header.indexOffset, index, header.frames * sizeof(SESSION_FRAME)))
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+void SessionReader::close()
+{
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	delete[] index;
+	file = INVALID_HANDLE_VALUE;
+	index = 0;
+	header.frames = 0;
+}
+// ----------------------------------------------------------------------------
+
+int SessionReader::getFrames()
+{
+	return header.frames;
+}
+// ----------------------------------------------------------------------------
+
+const SESSION_FRAME* SessionReader::getFrame(int i)
+{
+	return &index[i];
+}
+// ----------------------------------------------------------------------------
+
+int SessionReader::find(unsigned int frameNum)
+{
+	int lo = 0, hi = header.frames - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if ((unsigned int)index[mid].frameNum == frameNum)
+			return mid;
+		if ((unsigned int)index[mid].frameNum < frameNum)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+// ----------------------------------------------------------------------------
+
+bool SessionReader::decode(int i, unsigned char* pixels)
+{
+	const SESSION_FRAME* frame = &index[i];
+	unsigned int bytes = ((frame->width * frame->channels + 3) & ~3) * frame->height;
+	bool ok;
+	if (frame->method == SESSION_STORED)
+	{
+		ok = (unsigned int)frame->codedBytes == bytes && readAt(file, frame->offset, pixels, bytes);
+	}
+	else
+	{
+		unsigned char* coded = (unsigned char*)malloc(frame->codedBytes);
+		ok = readAt(file, frame->offset, coded, frame->codedBytes)
+			&& sessionDecode(coded, frame->codedBytes, frame->width, frame->height, frame->channels, pixels);
+		free(coded);
+	}
+	return ok && sessionChecksum(pixels, frame->width, frame->height, frame->channels) == frame->checksum;
+}
+
+// ============================================================================
+//transcoder
+
+//one frame of a batch
+struct TRANSCODE_JOB
+{
+	char* path;
+	SESSION_FRAME frame;
+	unsigned char* coded;		//coded data, or the pixels if stored
+	unsigned int capacity;
+	ULONGLONG fileBytes;	//size of the bitmap
+	bool ok;
+};
+
+struct TRANSCODE_BATCH_CONTEXT
+{
+	TRANSCODE_JOB* jobs;
+	SessionReader* reader;		//for verification
+	volatile LONG failures;
+};
+
+//maps a bitmap, checks it is one the recorder wrote, and codes its pixels
+static void transcodeFrame(TRANSCODE_JOB* job)
+{
+	job->ok = false;
+	HANDLE file = CreateFileA(job->path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER size;
+	HANDLE mapping = 0;
+	const unsigned char* view = 0;
+	if (GetFileSizeEx(file, &size) && size.QuadPart >= (LONGLONG)(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)))
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping != 0)
+		view = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+	if (view != 0)
+	{
+		BITMAPFILEHEADER bmfh;
+		BITMAPINFOHEADER bmih;
+		memcpy(&bmfh, view, sizeof(BITMAPFILEHEADER));
+		memcpy(&bmih, view + sizeof(BITMAPFILEHEADER), sizeof(BITMAPINFOHEADER));
+		int channels = bmih.biBitCount / 8;
+		ULONGLONG stride = (bmih.biWidth * channels + 3) & ~3;
+		//bottom-up 24-bit BGR or 8-bit grey, as SaveImageFile and RecordWriter write them
+		if (bmfh.bfType == 'B' + ('M' << 8) && bmih.biCompression == BI_RGB && bmih.biWidth > 0 && bmih.biHeight > 0
+			&& (channels == 3 || channels == 1) && bmfh.bfOffBits + stride * bmih.biHeight <= (ULONGLONG)size.QuadPart)
+		{
+			const unsigned char* pixels = view + bmfh.bfOffBits;
+			unsigned int bytes = (unsigned int)(stride * bmih.biHeight);
+			unsigned int bound = sessionCodedBound(bmih.biWidth, bmih.biHeight, channels);
+			if (job->capacity < bound)
+			{
+				free(job->coded);
+				job->coded = (unsigned char*)malloc(bound);
+				job->capacity = bound;
+			}
+			job->frame.width = bmih.biWidth;
+			job->frame.height = bmih.biHeight;
+			job->frame.channels = channels;
+			job->frame.checksum = sessionChecksum(pixels, bmih.biWidth, bmih.biHeight, channels);
+			job->frame.method = SESSION_MED_RICE;
+			job->frame.codedBytes = sessionEncode(pixels, bmih.biWidth, bmih.biHeight, channels, job->coded);
+			//noise can beat the predictor; such frames are kept as they are
+			if ((unsigned int)job->frame.codedBytes >= bytes)
+			{
+				job->frame.method = SESSION_STORED;
+				job->frame.codedBytes = bytes;
+				memcpy(job->coded, pixels, bytes);
+			}
+			job->fileBytes = size.QuadPart;
+			job->ok = true;
+		}
+		UnmapViewOfFile(view);
+	}
+	if (mapping != 0)
+		CloseHandle(mapping);
+	CloseHandle(file);
+}
+// ----------------------------------------------------------------------------
+
+static void transcodeTask(void* context, unsigned int begin, unsigned int end)
+{
+	TRANSCODE_BATCH_CONTEXT* batch = (TRANSCODE_BATCH_CONTEXT*)context;
+	for (unsigned int i = begin; i < end; i++)
+		transcodeFrame(&batch->jobs[i]);
+}
+// ----------------------------------------------------------------------------
+
+//decodes frames [begin, end) of the written file and counts those that do not match
+static void verifyTask(void* context, unsigned int begin, unsigned int end)
+{
+	TRANSCODE_BATCH_CONTEXT* batch = (TRANSCODE_BATCH_CONTEXT*)context;
+	for (unsigned int i = begin; i < end; i++)
+	{
+		const SESSION_FRAME* frame = batch->reader->getFrame(i);
+		unsigned char* pixels = (unsigned char*)malloc(((frame->width * frame->channels + 3) & ~3) * frame->height);
+		if (!batch->reader->decode(i, pixels))
+			InterlockedIncrement(&batch->failures);
+		free(pixels);
+	}
+}
+// ----------------------------------------------------------------------------
+
+//runs fn over [0, count) a frame at a time, on the pool if there is one
+static void parallelFrames(TaskFunction fn, void* context, unsigned int count)
+{
+	if (getTaskPool() != 0)
+		getTaskPool()->parallelFor(fn, context, count, 1);
+	else
+		fn(context, 0, count);
+}
+// ----------------------------------------------------------------------------
+
+static int compareFrameNums(const void* a, const void* b)
+{
+	unsigned int x = *(const unsigned int*)a;
+	unsigned int y = *(const unsigned int*)b;
+	return (x < y) ? -1 : (x > y);
+}
+// ----------------------------------------------------------------------------
+
+//frame numbers of the session's bitmaps, sorted; returns how many. Only <name>-<frame>.bmp counts: the depth maps
+//of -depth (<name>-<frame>_disparity.bmp) match the same wildcard and are counted in depthMaps instead
+static unsigned int findFrames(const char* base, const char* name, unsigned int** frameNums, unsigned int* depthMaps)
+{
+	char* pattern = (char*)malloc(strlen(base) + strlen(name) + 20);
+	sprintf(pattern, "%s\\%s-*.bmp", base, name);
+	size_t prefix = strlen(name) + 1;
+
+	unsigned int count = 0, capacity = 1024;
+	*frameNums = (unsigned int*)malloc(capacity * sizeof(unsigned int));
+	*depthMaps = 0;
+	WIN32_FIND_DATAA found;
+	HANDLE find = FindFirstFileA(pattern, &found);
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			const char* number = found.cFileName + prefix;
+			if (!isdigit((unsigned char)number[0]))
+				continue;
+			char* end;
+			unsigned long frameNum = strtoul(number, &end, 10);
+			if (strcmp(end, "_disparity.bmp") == 0)
+				(*depthMaps)++;
+			if (strcmp(end, ".bmp") != 0)
+				continue;
+			if (count == capacity)
+			{
+				capacity *= 2;
+				*frameNums = (unsigned int*)realloc(*frameNums, capacity * sizeof(unsigned int));
+			}
+			(*frameNums)[count++] = frameNum;
+		} while (FindNextFileA(find, &found));
+		FindClose(find);
+	}
+	free(pattern);
+	qsort(*frameNums, count, sizeof(unsigned int), compareFrameNums);
+	return count;
+}
+// ----------------------------------------------------------------------------
+
+//display and capture times of each displayed frame from _data.txt, by frame number; returns the number of frames
+//covered (entries without a line are SESSION_NO_TIME)
+static unsigned int readTimes(const char* base, const char* name, LONG** times)
+{
+	char* path = (char*)malloc(strlen(base) + strlen(name) + 20);
+	sprintf(path, "%s\\%s_data.txt", base, name);
+	FILE* dataFile = fopen(path, "r");
+	free(path);
+	*times = 0;
+	if (dataFile == NULL)
+		return 0;
+
+	unsigned int count = 0, capacity = 0;
+	char line[200];
+	while (fgets(line, sizeof(line), dataFile) != NULL)
+	{
+		unsigned int frameNum;
+		LONG displayTime, leftTime, rightTime;
+		//frame number - timestamp (displayed) - timestamp (left) - timestamp (right), as display() writes them
+		if (sscanf(line, "%u, %ld, %ld, %ld", &frameNum, &displayTime, &leftTime, &rightTime) != 4)
+			continue;
+		if (frameNum >= capacity)
+		{
+			unsigned int grown = (capacity == 0) ? 4096 : capacity;
+			while (grown <= frameNum)
+				grown *= 2;
+			*times = (LONG*)realloc(*times, grown * 3 * sizeof(LONG));
+			for (unsigned int i = 3 * capacity; i < 3 * grown; i++)
+				(*times)[i] = SESSION_NO_TIME;
+			capacity = grown;
+		}
+		(*times)[3 * frameNum] = displayTime;
+		(*times)[3 * frameNum + 1] = leftTime;
+		(*times)[3 * frameNum + 2] = rightTime;
+		if (frameNum + 1 > count)
+			count = frameNum + 1;
+	}
+	fclose(dataFile);
+	return count;
+}
+// ----------------------------------------------------------------------------
+
+int runTranscode(const char* base)
+{
+	//the bitmaps are named after the directory, which may be given as a path
+	char* dir = _strdup(base);
+	size_t length = strlen(dir);
+	while (length > 1 && (dir[length - 1] == '\\' || dir[length - 1] == '/'))
+		dir[--length] = 0;
+	const char* name = dir + length;
+	while (name > dir && name[-1] != '\\' && name[-1] != '/')
+		name--;
+
+	unsigned int* frameNums;
+	unsigned int depthMaps;
+	unsigned int numFrames = findFrames(dir, name, &frameNums, &depthMaps);
+	LONG* times;
+	unsigned int timed = readTimes(dir, name, &times);
+	if (numFrames == 0)
+	{
+		printf("No recorded frames (%s\\%s-<frame>.bmp) to transcode\n", dir, name);
+		free(frameNums);
+		free(times);
+		free(dir);
+		return -1;
+	}
+	if (timed == 0)
+		printf("No %s_data.txt; frames will have no timestamps\n", name);
+	if (depthMaps > 0)
+		printf("%u depth maps (%s-<frame>_disparity.bmp) are not part of the session file and stay in %s\n", depthMaps, name, dir);
+
+	char* outPath = (char*)malloc(length + strlen(name) + 20);
+	sprintf(outPath, "%s\\%s_session.rvs", dir, name);
+	FILE* out = fopen(outPath, "wb");
+	if (out == NULL)
+	{
+		printf("Could not create %s\n", outPath);
+		free(outPath);
+		free(frameNums);
+		free(times);
+		free(dir);
+		return -1;
+	}
+	int threads = (getTaskPool() != 0) ? getTaskPool()->getThreads() : 1;
+	printf("Transcoding %u frames of %s to %s on %d threads\n", numFrames, dir, outPath, threads);
+
+	SESSION_FILE_HEADER header;
+	memset(&header, 0, sizeof(header));
+	header.magic = SESSION_MAGIC;
+	header.version = SESSION_VERSION;
+	header.entrySize = sizeof(SESSION_FRAME);
+	fwrite(&header, sizeof(header), 1, out);
+	LONGLONG position = sizeof(header);
+
+	//a few frames per thread at a time bounds the memory, and the pool balances frames that code slower
+	unsigned int batchSize = threads * TRANSCODE_BATCH;
+	TRANSCODE_JOB* jobs = (TRANSCODE_JOB*)calloc(batchSize, sizeof(TRANSCODE_JOB));
+	for (unsigned int j = 0; j < batchSize; j++)
+		jobs[j].path = (char*)malloc(length + strlen(name) + 30);
+	SESSION_FRAME* index = (SESSION_FRAME*)malloc(numFrames * sizeof(SESSION_FRAME));
+	TRANSCODE_BATCH_CONTEXT batch;
+	batch.jobs = jobs;
+	batch.reader = 0;
+	batch.failures = 0;
+
+	unsigned int written = 0, unreadable = 0;
+	ULONGLONG inBytes = 0, pixelBytes = 0;
+	LONGLONG start = perfCounter();
+	for (unsigned int first = 0; first < numFrames; first += batchSize)
+	{
+		unsigned int count = (numFrames - first < batchSize) ? numFrames - first : batchSize;
+		for (unsigned int j = 0; j < count; j++)
+		{
+			unsigned int frameNum = frameNums[first + j];
+			sprintf(jobs[j].path, "%s\\%s-%u.bmp", dir, name, frameNum);
+			memset(&jobs[j].frame, 0, sizeof(SESSION_FRAME));
+			jobs[j].frame.frameNum = frameNum;
+			bool hasTime = frameNum < timed;
+			jobs[j].frame.displayTime = hasTime ? times[3 * frameNum] : SESSION_NO_TIME;
+			jobs[j].frame.leftTime = hasTime ? times[3 * frameNum + 1] : SESSION_NO_TIME;
+			jobs[j].frame.rightTime = hasTime ? times[3 * frameNum + 2] : SESSION_NO_TIME;
+		}
+		parallelFrames(transcodeTask, &batch, count);
+
+		//appended in frame order, so the index is sorted
+		for (unsigned int j = 0; j < count; j++)
+		{
+			if (!jobs[j].ok)
+			{
+				if (unreadable++ < TRANSCODE_MAX_BAD)
+					printf("\rSkipped %s: not a bitmap the recorder wrote\n", jobs[j].path);
+				continue;
+			}
+			SESSION_FRAME* frame = &jobs[j].frame;
+			frame->offset = position + sizeof(SESSION_FRAME);
+			fwrite(frame, sizeof(SESSION_FRAME), 1, out);
+			fwrite(jobs[j].coded, 1, frame->codedBytes, out);
+			position = frame->offset + frame->codedBytes;
+			index[written++] = *frame;
+			inBytes += jobs[j].fileBytes;
+			pixelBytes += ((frame->width * frame->channels + 3) & ~3) * frame->height;
+		}
+		printf("\r%u / %u frames", first + count, numFrames);
+	}
+	printf("\n");
+
+	//the index, then the header that points to it
+	header.frames = written;
+	header.indexOffset = position;
+	fwrite(index, sizeof(SESSION_FRAME), written, out);
+	position += (LONGLONG)written * sizeof(SESSION_FRAME);
+	bool ok = fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+	ok = (fclose(out) == 0) && ok;
+	double seconds = perfMs(perfCounter() - start) / 1000;
+
+	printf("Transcoded %u frames (%u skipped) in %.2f s: %.1f files/s, %.1f MB/s read\n", written, unreadable, seconds,
+		written / seconds, inBytes / 1048576.0 / seconds);
+	printf("%.1f MB of bitmaps into %.1f MB: %.2f:1 (%.2f bits per pixel value)\n", inBytes / 1048576.0,
+		position / 1048576.0, (double)inBytes / position, (pixelBytes > 0) ? 8.0 * position / pixelBytes : 0.0);
+
+	//read the whole file back through the index before anyone deletes the bitmaps
+	SessionReader reader;
+	if (ok && reader.open(outPath) && reader.getFrames() == (int)written)
+	{
+		LONGLONG verifyStart = perfCounter();
+		batch.reader = &reader;
+		parallelFrames(verifyTask, &batch, written);
+		printf("Verified %u frames in %.2f s: %s\n", written, perfMs(perfCounter() - verifyStart) / 1000,
+			(batch.failures == 0) ? "all match" : "MISMATCHES");
+		ok = batch.failures == 0;
+		if (!ok)
+			printf("%ld frames do not decode to their bitmaps\n", batch.failures);
+	}
+	else
+	{
+		printf("Could not read back %s\n", outPath);
+		ok = false;
+	}
+
+	for (unsigned int j = 0; j < batchSize; j++)
+	{
+		free(jobs[j].path);
+		free(jobs[j].coded);
+	}
+	free(jobs);
+	free(index);
+	free(outPath);
+	free(frameNums);
+	free(times);
+	free(dir);
+	return ok ? 0 : -1;
+}
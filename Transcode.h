@@ -0,0 +1,100 @@
+#ifndef TRANSCODE
+#define TRANSCODE
+// ============================================================================
+
+//Offline transcoding of a recorded session into one indexed, seekable file
+//A session is the directory a run leaves behind: a <base>-<frame>.bmp for every recorded
+//frame and <base>_data.txt with the display and capture times of every displayed frame.
+//The transcoder maps each bitmap into memory and codes it losslessly on the task pool, a
+//batch of frames at a time, and appends the frames in frame order to <base>_session.rvs
+//with their timestamps. Frames are coded with the LOCO-I median predictor on green and the
+//differences of blue and red from green, and adaptive Rice codes for the residuals.
+//An index at the end of the file allows seeking to any frame; SessionReader reads it back
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+#include <stdio.h>
+
+#define		SESSION_MAGIC			0x53535652	//"RVSS"
+#define		SESSION_VERSION			1			//bump when the file layout or the coding changes
+#define		SESSION_NO_TIME			-1			//timestamp of a frame missing from _data.txt
+#define		TRANSCODE_BATCH			4			//frames in flight per thread
+
+//how a frame's pixels are stored
+enum SessionMethod
+{
+	SESSION_STORED,			//as they were, when coding would not make them smaller
+	SESSION_MED_RICE		//median prediction and adaptive Rice codes
+};
+
+//start of a session file; the frames follow, each an SESSION_FRAME and its coded data, then the index
+struct SESSION_FILE_HEADER
+{
+	LONG magic;
+	LONG version;
+	LONG frames;				//written when the file is complete
+	LONG entrySize;				//sizeof(SESSION_FRAME), so readers can check the layout
+	LONGLONG indexOffset;		//frames entries, sorted by frame number
+	LONG pad[2];
+};
+
+//one frame, before its data and in the index
+struct SESSION_FRAME
+{
+	LONG frameNum;
+	LONG displayTime;			//ms since the start of the run, from _data.txt, or SESSION_NO_TIME
+	LONG leftTime, rightTime;	//capture timestamps of the eyes, from _data.txt
+	LONG width, height;
+	LONG channels;				//3 for BGR, 1 for grey
+	LONG method;				//SessionMethod
+	LONG codedBytes;			//data after this header
+	DWORD checksum;				//Adler-32 of the bitmap's pixels, without the padding of the rows
+	LONGLONG offset;			//position of the data in the file
+};
+
+// ============================================================================
+
+//lossless coding of bottom-up pixels with rows padded to 4 bytes; out needs sessionCodedBound bytes.
+//Returns the size of the coded data. The padding is not coded and decodes as zeros
+unsigned int sessionEncode(const unsigned char* pixels, int w, int h, int channels, unsigned char* out);
+unsigned int sessionCodedBound(int w, int h, int channels);
+//returns false if the data ends early
+bool sessionDecode(const unsigned char* coded, unsigned int bytes, int w, int h, int channels, unsigned char* pixels);
+DWORD sessionChecksum(const unsigned char* pixels, int w, int h, int channels);
+
+// ============================================================================
+
+//random access to the frames of a session file; safe to decode from several threads at once
+class SessionReader
+{
+public:
+	SessionReader();
+	~SessionReader();
+
+	bool open(const char* path);
+	void close();
+
+	int getFrames();
+	const SESSION_FRAME* getFrame(int i);
+	//index of a frame number, or -1 if the session does not have it
+	int find(unsigned int frameNum);
+	//decodes frame i into pixels (((width * channels + 3) & ~3) * height bytes); false if it cannot be read or
+	//does not match its checksum
+	bool decode(int i, unsigned char* pixels);
+
+private:
+	HANDLE file;
+	SESSION_FILE_HEADER header;
+	SESSION_FRAME* index;
+};
+
+// ============================================================================
+
+//transcodes the session in directory base to <base>\<base>_session.rvs, verifies it, and reports the
+//rates and the compression; uses the shared task pool. Returns 0 on success
+int runTranscode(const char* base);
+
+// ============================================================================
+#endif
@@ -0,0 +1,149 @@
+
+//Capture stall watchdog
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "Watchdog.h"
+#include "FL3Camera.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include <string.h>
+
+#define		WATCHDOG_POLLS		5		//checks per stall timeout
+#define		WATCHDOG_POLL_MIN_MS	10
+
+static const char* eyeNames[2] = { CAMERA_NAME_LEFT, CAMERA_NAME_RIGHT };
+
+// ============================================================================
+//public functions
+CaptureWatchdog::CaptureWatchdog(FL3Camera* left, FL3Camera* right, double fps, FILE* log)
+{
+	cameras[0] = left;
+	cameras[1] = right;
+	logFile = log;
+
+	timeout = (DWORD)(WATCHDOG_STALL_FRAMES * 1000.0 / ((fps > 0) ? fps : 60));
+	if (timeout < WATCHDOG_STALL_MIN_MS)
+		timeout = WATCHDOG_STALL_MIN_MS;
+
+	for (int eye = 0; eye < 2; eye++)
+	{
+		stalled[eye] = 0;
+		stallFrameTime[eye] = 0;
+		nextRestart[eye] = 0;
+		retryWait[eye] = timeout;
+		restarts[eye] = 0;
+		recoveries[eye] = 0;
+	}
+
+	stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	thread = CreateThread(NULL, 0, watchThread, this, 0, NULL);
+}
+// ----------------------------------------------------------------------------
+
+CaptureWatchdog::~CaptureWatchdog()
+{
+	SetEvent(stop);
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	CloseHandle(stop);
+}
+// ----------------------------------------------------------------------------
+
+bool CaptureWatchdog::isStalled(int eye)
+{
+	return stalled[eye] != 0;
+}
+// ----------------------------------------------------------------------------
+
+unsigned int CaptureWatchdog::getRecoveries(int eye)
+{
+	return recoveries[eye];
+}
+
+// ============================================================================
+//private functions
+
+//detects a stall of one camera, retries its restart, and notices when frames come back
+void CaptureWatchdog::check(int eye, DWORD now)
+{
+	char buffer[150];
+	DWORD last = cameras[eye]->getLastFrameTime();
+	//signed, since a frame may have arrived after now was taken
+	LONG age = (LONG)(now - last);
+
+	if (!stalled[eye])
+	{
+		if (age > (LONG)timeout)
+		{
+			sprintf(buffer, "%s camera stalled: no frame for %ld ms\n", eyeNames[eye], age);
+			log(buffer);
+			metricAdd(METRIC_WATCHDOG_STALLS + eye, 1);
+			stallFrameTime[eye] = last;
+			restarts[eye] = 0;
+			retryWait[eye] = timeout;
+			InterlockedExchange(&stalled[eye], 1);
+			restartCamera(eye);
+		}
+	}
+	else if (last != stallFrameTime[eye])
+	{
+		DWORD downtime = last - stallFrameTime[eye];
+		sprintf(buffer, "%s camera recovered: %lu ms without frames, %u restarts\n", eyeNames[eye], downtime, restarts[eye]);
+		log(buffer);
+		metricObserve(METRIC_WATCHDOG_DOWNTIME_MS + eye, downtime);
+		InterlockedIncrement(&recoveries[eye]);
+		InterlockedExchange(&stalled[eye], 0);
+	}
+	else if ((LONG)(now - nextRestart[eye]) >= 0)
+	{
+		//the last restart did not bring it back
+		restartCamera(eye);
+	}
+}
+// ----------------------------------------------------------------------------
+
+//restarts a stalled camera and schedules the next attempt, waiting twice as long each time
+void CaptureWatchdog::restartCamera(int eye)
+{
+	restarts[eye]++;
+	metricAdd(METRIC_WATCHDOG_RESTARTS + eye, 1);
+	TraceScope span(eye == 0 ? "restart left" : "restart right");
+	cameras[eye]->restart();
+
+	//reconnecting can take a while; the wait counts from when it finished
+	nextRestart[eye] = timeGetTime() + retryWait[eye];
+	retryWait[eye] *= 2;
+	if (retryWait[eye] > WATCHDOG_RETRY_MAX_MS)
+		retryWait[eye] = WATCHDOG_RETRY_MAX_MS;
+}
+// ----------------------------------------------------------------------------
+
+void CaptureWatchdog::log(const char* buffer)
+{
+	printf(buffer);
+	if (logFile != 0)
+	{
+		fwrite(buffer, sizeof(char), strlen(buffer), logFile);
+	}
+}
+// ----------------------------------------------------------------------------
+
+DWORD WINAPI CaptureWatchdog::watchThread(LPVOID lpThreadParameter)
+{
+	CaptureWatchdog* watchdog = (CaptureWatchdog*)lpThreadParameter;
+	DWORD poll = watchdog->timeout / WATCHDOG_POLLS;
+	if (poll < WATCHDOG_POLL_MIN_MS)
+		poll = WATCHDOG_POLL_MIN_MS;
+	traceThreadName("watchdog");
+
+	while (WaitForSingleObject(watchdog->stop, poll) == WAIT_TIMEOUT)
+	{
+		DWORD now = timeGetTime();
+		watchdog->check(0, now);
+		watchdog->check(1, now);
+	}
+	return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef CAPTURE_WATCHDOG
+#define CAPTURE_WATCHDOG
+// ============================================================================
+
+//Capture stall watchdog
+//Watches the time since each camera last delivered a frame against the expected frame
+//interval. A camera that falls silent is marked stalled, so the display carries on with
+//the other eye and the stalled eye's last frame, and is restarted on its own (reconnected
+//for real cameras) with a growing wait between attempts until frames arrive again.
+//Each stall and recovery is logged with its downtime
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+#include <stdio.h>
+
+#define		WATCHDOG_STALL_FRAMES		10		//frame intervals without a frame before a camera counts as stalled
+#define		WATCHDOG_STALL_MIN_MS		250		//shortest stall timeout, for high frame rates
+#define		WATCHDOG_RETRY_MAX_MS		8000	//longest wait between restarts of a camera that stays silent
+
+class FL3Camera;
+
+// ============================================================================
+
+class CaptureWatchdog
+{
+public:
+	//fps is the expected frame rate of both cameras; starts watching straight away
+	CaptureWatchdog(FL3Camera* left, FL3Camera* right, double fps, FILE* log);
+	~CaptureWatchdog();
+
+	//true while the eye (0 left, 1 right) is stalled and being recovered
+	bool isStalled(int eye);
+	//returns the number of stalls the eye has recovered from
+	unsigned int getRecoveries(int eye);
+
+private:
+	//data
+	FL3Camera* cameras[2];
+	DWORD timeout;				//ms without a frame before a camera counts as stalled
+	volatile LONG stalled[2];
+	DWORD stallFrameTime[2];	//time of the last frame before the stall
+	DWORD nextRestart[2];		//time of the next restart attempt while stalled
+	DWORD retryWait[2];			//current wait between restart attempts
+	unsigned int restarts[2];	//restarts during the current stall
+	volatile LONG recoveries[2];
+	FILE* logFile;
+
+	HANDLE thread;
+	HANDLE stop;
+
+	//private prototypes
+	void check(int eye, DWORD now);
+	void restartCamera(int eye);
+	void log(const char*);
+	static DWORD WINAPI watchThread(LPVOID);
+};
+
+// ============================================================================
+#endif
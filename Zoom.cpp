@@ -0,0 +1,436 @@
+
+//Digital zoom and pan of both eyes
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include "stdafx.h"
+#include "Zoom.h"
+#include "TaskPool.h"
+#include <emmintrin.h>
+#include <math.h>
+
+#define		ZOOM_CUBIC_A		-0.5	//Catmull-Rom
+#define		ZOOM_MID_BITS		6		//the vertical pass keeps 1/64 grey levels for the horizontal one
+
+//weights of the vertical pass are shifted down to the middle precision, those of the horizontal pass to bytes
+#define		ZOOM_V_SHIFT		(ZOOM_WEIGHT_BITS - ZOOM_MID_BITS)
+#define		ZOOM_H_SHIFT		(ZOOM_WEIGHT_BITS + ZOOM_MID_BITS)
+
+// ============================================================================
+//helpers
+
+//cubic convolution kernel
+static double cubic(double x)
+{
+	double a = ZOOM_CUBIC_A;
+	x = fabs(x);
+	if (x <= 1)
+		return ((a + 2) * x - (a + 3)) * x * x + 1;
+	if (x < 2)
+		return ((a * x - 5 * a) * x + 8 * a) * x - 4 * a;
+	return 0;
+}
+
+static inline int clampIndex(int i, int size)
+{
+	return (i < 0) ? 0 : ((i >= size) ? size - 1 : i);
+}
+
+static inline unsigned char clampByte(int v)
+{
+	return (unsigned char)((v < 0) ? 0 : ((v > 255) ? 255 : v));
+}
+
+// ============================================================================
+//public functions
+
+ZoomResampler::ZoomResampler(unsigned int cols, unsigned int rows, unsigned int bytesPerPixel)
+{
+	maxCols = cols;
+	maxRows = rows;
+	channels = bytesPerPixel;
+	output[0] = new unsigned char[channels * maxCols * maxRows];
+	output[1] = new unsigned char[channels * maxCols * maxRows];
+
+	colFirst = new int[maxCols];
+	colWeights = new short[ZOOM_TAPS * maxCols];
+	colPairWeights = new short[2 * 8 * maxCols];
+	rowFirst = new int[maxRows];
+	rowWeights = new const short*[maxRows];
+
+	//a row of source samples, the taps past both edges included, with room for the last 8-sample load,
+	//then the row in pairs of pixels (8 samples per pixel) for colour
+	unsigned int span = maxCols + 2 * ZOOM_PAD + ZOOM_TAPS;
+	scratchSamples = channels * span + 8 + ((channels > 1) ? 8 * span : 0);
+	unsigned int bands = (2 * maxRows + TASK_BAND_ROWS - 1) / TASK_BAND_ROWS;
+	scratch = new short[bands * scratchSamples];
+
+	//taps at -1, 0, 1 and 2 pixels from the sample before the position; each phase sums to exactly 1
+	for (int p = 0; p < ZOOM_PHASES; p++)
+	{
+		double t = (double)p / ZOOM_PHASES;
+		int sum = 0, largest = 0;
+		for (int k = 0; k < ZOOM_TAPS; k++)
+		{
+			phaseWeights[p][k] = (short)floor(cubic(t - (k - 1)) * (1 << ZOOM_WEIGHT_BITS) + 0.5);
+			sum += phaseWeights[p][k];
+			if (phaseWeights[p][k] > phaseWeights[p][largest])
+				largest = k;
+		}
+		phaseWeights[p][largest] += (short)((1 << ZOOM_WEIGHT_BITS) - sum);
+
+		//bilinear taps at 0 and 1 pixels; the other two are zero so the tails can run either filter
+		linearWeights[p][1] = (short)((p << ZOOM_WEIGHT_BITS) / ZOOM_PHASES);
+		linearWeights[p][0] = (short)((1 << ZOOM_WEIGHT_BITS) - linearWeights[p][1]);
+		linearWeights[p][2] = linearWeights[p][3] = 0;
+	}
+
+	InitializeCriticalSection(&settingsLock);
+	zoom = 1;
+	centreX = centreY = 0.5;
+	taps = ZOOM_TAPS;
+	tableZoom = 0;
+	tableCentreX = tableCentreY = 0;
+	tableCols = tableRows = tableTaps = 0;
+	spanBegin = spanEnd = 0;
+	source[0] = source[1] = 0;
+}
+// ----------------------------------------------------------------------------
+
+ZoomResampler::~ZoomResampler()
+{
+	DeleteCriticalSection(&settingsLock);
+	delete[] output[0];
+	delete[] output[1];
+	delete[] colFirst;
+	delete[] colWeights;
+	delete[] colPairWeights;
+	delete[] rowFirst;
+	delete[] rowWeights;
+	delete[] scratch;
+}
+// ----------------------------------------------------------------------------
+
+void ZoomResampler::setZoom(double newZoom, double x, double y)
+{
+	if (newZoom < 1)
+		newZoom = 1;
+	if (newZoom > ZOOM_MAX)
+		newZoom = ZOOM_MAX;
+
+	//the view is 1 / zoom of the frame; its centre can go no closer to an edge than half of that
+	double margin = 0.5 / newZoom;
+	x = (x < margin) ? margin : ((x > 1 - margin) ? 1 - margin : x);
+	y = (y < margin) ? margin : ((y > 1 - margin) ? 1 - margin : y);
+
+	EnterCriticalSection(&settingsLock);
+	zoom = newZoom;
+	centreX = x;
+	centreY = y;
+	LeaveCriticalSection(&settingsLock);
+}
+// ----------------------------------------------------------------------------
+
+void ZoomResampler::zoomIn()
+{
+	EnterCriticalSection(&settingsLock);
+	double z = zoom * ZOOM_STEP, x = centreX, y = centreY;
+	LeaveCriticalSection(&settingsLock);
+	setZoom(z, x, y);
+}
+// ----------------------------------------------------------------------------
+
+void ZoomResampler::zoomOut()
+{
+	EnterCriticalSection(&settingsLock);
+	double z = zoom / ZOOM_STEP, x = centreX, y = centreY;
+	LeaveCriticalSection(&settingsLock);
+	//snap back to exactly 1 so the resampling stops
+	if (z < 1 + 1e-6)
+		z = 1;
+	setZoom(z, x, y);
+}
+// ----------------------------------------------------------------------------
+
+void ZoomResampler::pan(int stepsX, int stepsY)
+{
+	EnterCriticalSection(&settingsLock);
+	double z = zoom;
+	double x = centreX + stepsX * ZOOM_PAN_STEP / zoom;
+	double y = centreY + stepsY * ZOOM_PAN_STEP / zoom;
+	LeaveCriticalSection(&settingsLock);
+	setZoom(z, x, y);
+}
+// ----------------------------------------------------------------------------
+
+double ZoomResampler::getZoom()
+{
+	EnterCriticalSection(&settingsLock);
+	double z = zoom;
+	LeaveCriticalSection(&settingsLock);
+	return z;
+}
+// ----------------------------------------------------------------------------
+
+bool ZoomResampler::isActive()
+{
+	return getZoom() > 1;
+}
+// ----------------------------------------------------------------------------
+
+void ZoomResampler::setTaps(unsigned int newTaps)
+{
+	taps = (newTaps == ZOOM_FAST_TAPS) ? ZOOM_FAST_TAPS : ZOOM_TAPS;
+}
+// ----------------------------------------------------------------------------
+
+unsigned int ZoomResampler::getTaps()
+{
+	return taps;
+}
+// ----------------------------------------------------------------------------
+
+bool ZoomResampler::resample(const unsigned char* left, const unsigned char* right, unsigned int cols, unsigned int rows)
+{
+	if (cols > maxCols || rows > maxRows || cols < ZOOM_TAPS || rows < ZOOM_TAPS)
+		return false;
+
+	//one snapshot for both eyes
+	EnterCriticalSection(&settingsLock);
+	double z = zoom, x = centreX, y = centreY;
+	LeaveCriticalSection(&settingsLock);
+	if (z <= 1)
+		return false;
+
+	if (z != tableZoom || x != tableCentreX || y != tableCentreY || cols != tableCols || rows != tableRows || taps != tableTaps)
+		buildTables(cols, rows, taps, z, x, y);
+
+	source[0] = left;
+	source[1] = right;
+	parallelRows(resampleTask, this, 2 * rows);
+	source[0] = source[1] = 0;
+	return true;
+}
+// ----------------------------------------------------------------------------
+
+const unsigned char* ZoomResampler::getOutput(int eye)
+{
+	return output[eye];
+}
+
+// ============================================================================
+//private functions
+
+//works out the taps of every output column and row for a zoom setting; the bicubic taps start one pixel
+//before the position, the bilinear ones at it
+void ZoomResampler::buildTables(unsigned int cols, unsigned int rows, unsigned int newTaps, double z, double x, double y)
+{
+	short (*weights)[ZOOM_TAPS] = (newTaps == ZOOM_FAST_TAPS) ? linearWeights : phaseWeights;
+	int before = (newTaps == ZOOM_FAST_TAPS) ? 0 : 1;
+	for (int axis = 0; axis < 2; axis++)
+	{
+		unsigned int size = (axis == 0) ? cols : rows;
+		double centre = (axis == 0) ? x : y;
+		//source position of output pixel i, in pixels with pixel centres on integers
+		double first = centre * size - 0.5 * size / z;
+
+		for (unsigned int i = 0; i < size; i++)
+		{
+			double position = first + (i + 0.5) / z - 0.5;
+			int whole = (int)floor(position);
+			int phase = (int)floor((position - whole) * ZOOM_PHASES + 0.5);
+			if (phase == ZOOM_PHASES)
+			{
+				whole++;
+				phase = 0;
+			}
+			if (axis == 0)
+			{
+				colFirst[i] = whole - before;
+				memcpy(colWeights + ZOOM_TAPS * i, weights[phase], sizeof(weights[phase]));
+				//taps 0 and 1, then 2 and 3, for the red, green and blue lanes of a pixel pair; the last two lanes are unused
+				short* pair = colPairWeights + 16 * i;
+				for (int half = 0; half < 2; half++)
+				{
+					for (int c = 0; c < 3; c++)
+					{
+						pair[8 * half + 2 * c] = weights[phase][2 * half];
+						pair[8 * half + 2 * c + 1] = weights[phase][2 * half + 1];
+					}
+					pair[8 * half + 6] = pair[8 * half + 7] = 0;
+				}
+			}
+			else
+			{
+				rowFirst[i] = whole - before;
+				rowWeights[i] = weights[phase];
+			}
+		}
+	}
+
+	spanBegin = colFirst[0];
+	spanEnd = colFirst[cols - 1] + ZOOM_TAPS;
+	tableZoom = z;
+	tableCentreX = x;
+	tableCentreY = y;
+	tableCols = cols;
+	tableRows = rows;
+	tableTaps = newTaps;
+}
+// ----------------------------------------------------------------------------
+
+//one output row of an eye: the four (bilinear: two) source rows are filtered into a row of 1/64 grey levels over the
+//columns the view needs, which the horizontal taps then read
+void ZoomResampler::resampleRow(int eye, unsigned int y, short* rowScratch)
+{
+	unsigned int cols = tableCols, rows = tableRows;
+	unsigned int stride = channels * cols;
+	unsigned int spanLength = spanEnd - spanBegin;
+	short* mid = rowScratch;
+
+	// --- vertical pass over the source columns inside the frame ---
+	const unsigned char* src[ZOOM_TAPS];
+	for (int k = 0; k < ZOOM_TAPS; k++)
+		src[k] = source[eye] + clampIndex(rowFirst[y] + k, rows) * stride;
+	const short* w = rowWeights[y];
+
+	int inBegin = (spanBegin < 0) ? 0 : spanBegin;
+	int inEnd = (spanEnd > (int)cols) ? cols : spanEnd;
+	unsigned int sampleBegin = channels * inBegin, sampleEnd = channels * inEnd;
+	short* out = mid + channels * (inBegin - spanBegin) - sampleBegin;
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w01 = _mm_set_epi16(w[1], w[0], w[1], w[0], w[1], w[0], w[1], w[0]);
+	const __m128i w23 = _mm_set_epi16(w[3], w[2], w[3], w[2], w[3], w[2], w[3], w[2]);
+	const __m128i roundV = _mm_set1_epi32(1 << (ZOOM_V_SHIFT - 1));
+	unsigned int s = sampleBegin;
+	if (tableTaps == ZOOM_FAST_TAPS)
+	{
+		//bilinear: one madd per half, and the 4-tap loop below is left nothing to do
+		for (; s + 8 <= sampleEnd; s += 8)
+		{
+			__m128i r0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src[0] + s)), zero);
+			__m128i r1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src[1] + s)), zero);
+			__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), w01);
+			__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), w01);
+			lo = _mm_srai_epi32(_mm_add_epi32(lo, roundV), ZOOM_V_SHIFT);
+			hi = _mm_srai_epi32(_mm_add_epi32(hi, roundV), ZOOM_V_SHIFT);
+			_mm_storeu_si128((__m128i*)(out + s), _mm_packs_epi32(lo, hi));
+		}
+	}
+	for (; s + 8 <= sampleEnd; s += 8)
+	{
+		__m128i r0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src[0] + s)), zero);
+		__m128i r1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src[1] + s)), zero);
+		__m128i r2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src[2] + s)), zero);
+		__m128i r3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src[3] + s)), zero);
+		//rows interleaved in pairs, so each madd applies two taps
+		__m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), w01), _mm_madd_epi16(_mm_unpacklo_epi16(r2, r3), w23));
+		__m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), w01), _mm_madd_epi16(_mm_unpackhi_epi16(r2, r3), w23));
+		lo = _mm_srai_epi32(_mm_add_epi32(lo, roundV), ZOOM_V_SHIFT);
+		hi = _mm_srai_epi32(_mm_add_epi32(hi, roundV), ZOOM_V_SHIFT);
+		_mm_storeu_si128((__m128i*)(out + s), _mm_packs_epi32(lo, hi));
+	}
+	for (; s < sampleEnd; s++)
+	{
+		int sum = w[0] * src[0][s] + w[1] * src[1][s] + w[2] * src[2][s] + w[3] * src[3][s];
+		out[s] = (short)((sum + (1 << (ZOOM_V_SHIFT - 1))) >> ZOOM_V_SHIFT);
+	}
+
+	//taps past the edges of the frame repeat the edge column
+	for (int x = spanBegin; x < inBegin; x++)
+		memcpy(mid + channels * (x - spanBegin), mid + channels * (inBegin - spanBegin), channels * sizeof(short));
+	for (int x = inEnd; x < spanEnd; x++)
+		memcpy(mid + channels * (x - spanBegin), mid + channels * (inEnd - 1 - spanBegin), channels * sizeof(short));
+
+	unsigned char* dst = output[eye] + y * stride;
+	const __m128i roundH = _mm_set1_epi32(1 << (ZOOM_H_SHIFT - 1));
+	if (channels == 1)
+	{
+		// --- horizontal pass for grey, four output pixels per iteration ---
+		const short* plane = mid - spanBegin;
+		unsigned int x = 0;
+		for (; x + 4 <= cols; x += 4)
+		{
+			__m128i a = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(plane + colFirst[x])),
+				_mm_loadl_epi64((const __m128i*)(plane + colFirst[x + 1])));
+			__m128i b = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(plane + colFirst[x + 2])),
+				_mm_loadl_epi64((const __m128i*)(plane + colFirst[x + 3])));
+			//pairs of taps per 32-bit lane, then the two pairs of each pixel added
+			__m128i ma = _mm_madd_epi16(a, _mm_loadu_si128((const __m128i*)(colWeights + ZOOM_TAPS * x)));
+			__m128i mb = _mm_madd_epi16(b, _mm_loadu_si128((const __m128i*)(colWeights + ZOOM_TAPS * (x + 2))));
+			__m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(ma), _mm_castsi128_ps(mb), _MM_SHUFFLE(2, 0, 2, 0)));
+			__m128i odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(ma), _mm_castsi128_ps(mb), _MM_SHUFFLE(3, 1, 3, 1)));
+			__m128i sum = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(even, odd), roundH), ZOOM_H_SHIFT);
+			__m128i words = _mm_packs_epi32(sum, sum);
+			*(int*)(dst + x) = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+		}
+		for (; x < cols; x++)
+		{
+			const short* taps = plane + colFirst[x];
+			const short* wx = colWeights + ZOOM_TAPS * x;
+			int sum = taps[0] * wx[0] + taps[1] * wx[1] + taps[2] * wx[2] + taps[3] * wx[3];
+			dst[x] = clampByte((sum + (1 << (ZOOM_H_SHIFT - 1))) >> ZOOM_H_SHIFT);
+		}
+		return;
+	}
+
+	//colour: pixel i and i + 1 side by side per channel, r r g g b b, so one madd applies two taps to all channels
+	__m128i* pairs = (__m128i*)(mid + channels * spanLength + 8);
+	for (unsigned int i = 0; i + 1 < spanLength; i++)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(mid + 3 * i));
+		_mm_storeu_si128(pairs + i, _mm_unpacklo_epi16(v, _mm_srli_si128(v, 6)));
+	}
+	const __m128i* pair = pairs - spanBegin;
+
+	// --- horizontal pass for colour, one pixel per madd pair (one madd for bilinear), four pixels per store ---
+	//each pixel is written as 4 bytes, the fourth overwritten by the next pixel, so the row's last pixel is left to the scalar loop
+	bool bicubic = (tableTaps == ZOOM_TAPS);
+	unsigned int x = 0;
+	for (; x + 4 < cols; x += 4)
+	{
+		__m128i sum[4];
+		for (int i = 0; i < 4; i++)
+		{
+			const __m128i* taps = pair + colFirst[x + i];
+			const __m128i* w = (const __m128i*)(colPairWeights + 16 * (x + i));
+			__m128i s = _mm_madd_epi16(_mm_loadu_si128(taps), _mm_loadu_si128(w));
+			if (bicubic)
+				s = _mm_add_epi32(s, _mm_madd_epi16(_mm_loadu_si128(taps + 2), _mm_loadu_si128(w + 1)));
+			sum[i] = _mm_srai_epi32(_mm_add_epi32(s, roundH), ZOOM_H_SHIFT);
+		}
+		__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(sum[0], sum[1]), _mm_packs_epi32(sum[2], sum[3]));
+		unsigned char* out = dst + 3 * x;
+		*(int*)out = _mm_cvtsi128_si32(bytes);
+		*(int*)(out + 3) = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 4));
+		*(int*)(out + 6) = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+		*(int*)(out + 9) = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 12));
+	}
+	const short* interleaved = mid - 3 * spanBegin;
+	for (; x < cols; x++)
+	{
+		const short* wx = colWeights + ZOOM_TAPS * x;
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			const short* taps = interleaved + 3 * colFirst[x] + c;
+			int sum = taps[0] * wx[0] + taps[3] * wx[1] + taps[6] * wx[2] + taps[9] * wx[3];
+			dst[3 * x + c] = clampByte((sum + (1 << (ZOOM_H_SHIFT - 1))) >> ZOOM_H_SHIFT);
+		}
+	}
+}
+// ----------------------------------------------------------------------------
+
+//task pool kernel; context is the ZoomResampler. Rows [0, rows) are the left eye, [rows, 2 rows) the right,
+//and each band has its own scratch row
+void ZoomResampler::resampleTask(void* context, unsigned int begin, unsigned int end)
+{
+	ZoomResampler* zoom = (ZoomResampler*)context;
+	short* rowScratch = zoom->scratch + (begin / TASK_BAND_ROWS) * zoom->scratchSamples;
+	for (unsigned int r = begin; r < end; r++)
+	{
+		int eye = (r >= zoom->tableRows) ? 1 : 0;
+		zoom->resampleRow(eye, r - eye * zoom->tableRows, rowScratch);
+	}
+}
@@ -0,0 +1,100 @@
+#ifndef DIGITAL_ZOOM
+#define DIGITAL_ZOOM
+// ============================================================================
+
+//Digital zoom and pan of both eyes
+//Crops the same region out of the left and right frames and scales it back up to the
+//frame size with a separable bicubic (Catmull-Rom) filter. Filter weights come from a
+//table of sub-pixel phases, and the per-column and per-row taps are worked out once per
+//zoom setting. The vertical pass runs across whole rows with SSE2, the horizontal pass
+//with pmaddwd: four grey pixels at a time, or for colour one pixel's three channels and
+//two taps at a time from a row laid out in pairs of neighbouring pixels. Both eyes are resampled together, on the task
+//pool, with one snapshot of the zoom and pan, so the two views never disagree and the
+//stereo geometry is kept: equal magnification, no vertical offset. When the host falls
+//behind, setTaps(2) swaps the bicubic for a bilinear filter, which halves the vertical
+//multiplies and the colour horizontal ones at the cost of some softness. All buffers are sized
+//for the largest frame up front, so changing the zoom never allocates
+//Stanford CHARM Lab, NRI project
+
+// ============================================================================
+
+#include <windows.h>
+
+#define		ZOOM_DEF			2.0		//magnification of -zoom unless given
+#define		ZOOM_MAX			8.0		//largest magnification
+#define		ZOOM_STEP			1.25	//factor per zoom key press
+#define		ZOOM_PAN_STEP		0.1		//fraction of the visible width or height per pan key press
+#define		ZOOM_TAPS			4		//filter taps per direction
+#define		ZOOM_FAST_TAPS		2		//taps of the bilinear filter used when the host cannot keep up
+#define		ZOOM_PHASES			256		//sub-pixel positions in the filter table
+#define		ZOOM_WEIGHT_BITS	14		//filter weights are in 1/2^14
+#define		ZOOM_PAD			2		//samples replicated past the edges of a row for the horizontal taps
+
+// ============================================================================
+
+class ZoomResampler
+{
+public:
+	//sizes everything for frames of up to maxCols x maxRows with the given bytes per pixel (3 or 1)
+	ZoomResampler(unsigned int maxCols, unsigned int maxRows, unsigned int channels);
+	~ZoomResampler();
+
+	//sets the magnification (1 to ZOOM_MAX) and the centre of the view as a fraction of the frame;
+	//the centre is moved in as far as needed to keep the view inside the frame. Safe from any thread
+	void setZoom(double zoom, double centreX, double centreY);
+	//zoom keys: multiply the magnification by ZOOM_STEP or divide by it, keeping the centre
+	void zoomIn();
+	void zoomOut();
+	//pan keys: moves the centre by steps of ZOOM_PAN_STEP of the visible area
+	void pan(int stepsX, int stepsY);
+	double getZoom();
+	//true while magnifying, i.e. resample has something to do
+	bool isActive();
+	//ZOOM_TAPS for bicubic, ZOOM_FAST_TAPS for bilinear; takes effect at the next resample. Call from the
+	//thread that resamples
+	void setTaps(unsigned int taps);
+	unsigned int getTaps();
+
+	//resamples both eyes (same size) with the current zoom into the buffers returned by getOutput; returns
+	//false, leaving them alone, when not magnifying or when the frames do not fit
+	bool resample(const unsigned char* left, const unsigned char* right, unsigned int cols, unsigned int rows);
+	//resampled frame of an eye (0 left, 1 right), the size of the frames given to resample
+	const unsigned char* getOutput(int eye);
+
+private:
+	//data
+	unsigned int maxCols, maxRows, channels;
+	unsigned char* output[2];
+	short phaseWeights[ZOOM_PHASES][ZOOM_TAPS];
+	short linearWeights[ZOOM_PHASES][ZOOM_TAPS];	//bilinear, in the first two taps
+	unsigned int taps;
+
+	//zoom and pan as set, and the snapshot the tables were last built for
+	CRITICAL_SECTION settingsLock;
+	double zoom, centreX, centreY;
+	double tableZoom, tableCentreX, tableCentreY;
+	unsigned int tableCols, tableRows, tableTaps;
+
+	//taps of the current setting: first source column or row of each output one and the phase's weights
+	int* colFirst;
+	short* colWeights;			//ZOOM_TAPS per output column
+	short* colPairWeights;		//the same for colour rows in pairs: 8 weights (w0 w1 for each channel) per tap pair
+	int* rowFirst;
+	const short** rowWeights;	//per output row; point into phaseWeights or linearWeights
+	int spanBegin, spanEnd;		//source columns the horizontal taps read, past the edges included
+
+	//per band scratch: one vertically filtered row, then the same in pairs of neighbouring pixels for colour
+	short* scratch;
+	unsigned int scratchSamples;
+
+	//frames being resampled, for the task pool kernel
+	const unsigned char* source[2];
+
+	//private prototypes
+	void buildTables(unsigned int cols, unsigned int rows, unsigned int taps, double zoom, double centreX, double centreY);
+	void resampleRow(int eye, unsigned int y, short* rowScratch);
+	static void resampleTask(void*, unsigned int, unsigned int);
+};
+
+// ============================================================================
+#endif